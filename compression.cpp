@@ -0,0 +1,724 @@
+/*
+*   compression.cpp
+*   @Author Sophie Kirkham STFC, 2018
+*   Implementation of the compression helpers, decompress_source and compress_sink
+*   Decompresses gzip, zstd and lz4 images for the program engine and ..
+*   compresses dumps written by the read engine.
+*/
+
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <algorithm>
+#include <sstream>
+
+#include "compression.h"
+
+/*
+*   Detects the compression format of an image from its first bytes.
+*   @param data : the first bytes of the image
+*   @param num_bytes : the number of bytes available
+*   @returns the codec, CODEC_NONE if the magic number is not recognised.
+*/
+compression_codec detect_codec(const uint8_t* data, unsigned long num_bytes){
+
+    if(num_bytes >= 2 && data[0] == 0x1F && data[1] == 0x8B){
+        return CODEC_GZIP;
+    }
+    if(num_bytes >= 4 && data[0] == 0x28 && data[1] == 0xB5 && data[2] == 0x2F && data[3] == 0xFD){
+        return CODEC_ZSTD;
+    }
+    if(num_bytes >= 4 && data[0] == 0x04 && data[1] == 0x22 && data[2] == 0x4D && data[3] == 0x18){
+        return CODEC_LZ4;
+    }
+    return CODEC_NONE;
+}
+
+/*
+*   Gets a codec from its name or file extension (gz, zst, lz4, none).
+*   @param name : the codec name
+*   @throws mem_exception : if the name is not a known codec
+*/
+compression_codec codec_from_name(const std::string& name){
+
+    if(name == "none" || name == "bin"){
+        return CODEC_NONE;
+    }
+    if(name == "gz" || name == "gzip"){
+        return CODEC_GZIP;
+    }
+    if(name == "zst" || name == "zstd"){
+        return CODEC_ZSTD;
+    }
+    if(name == "lz4"){
+        return CODEC_LZ4;
+    }
+    throw mem_exception("Unknown Compression Format : " + name);
+}
+
+/*
+*   @returns the name of a codec.
+*/
+std::string codec_name(compression_codec codec){
+
+    switch(codec){
+        case CODEC_GZIP:
+            return "gzip";
+        case CODEC_ZSTD:
+            return "zstd";
+        case CODEC_LZ4:
+            return "lz4";
+        default:
+            return "none";
+    }
+}
+
+/*
+*   @returns true if this build of the driver supports the codec.
+*/
+bool codec_supported(compression_codec codec){
+
+    switch(codec){
+        case CODEC_ZSTD:
+#ifdef QSPI_WITH_ZSTD
+            return true;
+#else
+            return false;
+#endif
+        case CODEC_LZ4:
+#ifdef QSPI_WITH_LZ4
+            return true;
+#else
+            return false;
+#endif
+        default:
+            return true;
+    }
+}
+
+/*
+*   @returns the default compression level for a codec.
+*/
+int default_level(compression_codec codec){
+
+    switch(codec){
+        case CODEC_GZIP:
+            return 6;
+        case CODEC_ZSTD:
+            return 3;
+        default:
+            return 0;
+    }
+}
+
+/*
+*   Checks a compression level is one the codec accepts, including the ..
+*   fast levels compress_sink drops to when it falls behind.
+*   @param codec : the codec the level is for
+*   @param level : the level to check
+*   @throws mem_exception : if the codec does not accept the level
+*/
+void check_level(compression_codec codec, int level){
+
+    int lowest = 0;
+    int highest = 0;
+    switch(codec){
+        case CODEC_GZIP:
+            lowest = 0;
+            highest = 9;
+            break;
+        case CODEC_ZSTD:
+            lowest = -5;
+            highest = 22;
+            break;
+        case CODEC_LZ4:
+            lowest = -8;
+            highest = 12;
+            break;
+        default:
+            return;
+    }
+    if(level < lowest || level > highest){
+        std::ostringstream error;
+        error << "Invalid " << codec_name(codec) << " Compression Level " << level
+        << ", must be " << lowest << " to " << highest;
+        throw mem_exception(error.str(), QSPI_ERROR_INVALID_ARGUMENT);
+    }
+}
+
+/*
+*   Constructor for decompress_source objects reading a mapped image.
+*   @param data : the compressed image bytes
+*   @param num_bytes : the size of the compressed image
+*/
+decompress_source::decompress_source(const uint8_t* data, unsigned long num_bytes) :
+    stream_source(-1),
+    input(data),
+    input_size(num_bytes),
+    input_mapped(true),
+    input_ended(true),
+    detected(false),
+    frame_open(false),
+    input_codec(CODEC_NONE)
+{
+    memset(&this->gzip_stream, 0, sizeof(this->gzip_stream));
+#ifdef QSPI_WITH_ZSTD
+    this->zstd_stream = NULL;
+#endif
+#ifdef QSPI_WITH_LZ4
+    this->lz4_context = NULL;
+#endif
+    this->start();
+}
+
+/*
+*   Constructor for decompress_source objects reading a file descriptor.
+*   @param file_descriptor : the descriptor to read the compressed image from
+*/
+decompress_source::decompress_source(int file_descriptor) :
+    stream_source(file_descriptor),
+    input(NULL),
+    input_size(0),
+    input_buffer(CODEC_INPUT_SIZE),
+    input_mapped(false),
+    input_ended(false),
+    detected(false),
+    frame_open(false),
+    input_codec(CODEC_NONE)
+{
+    memset(&this->gzip_stream, 0, sizeof(this->gzip_stream));
+#ifdef QSPI_WITH_ZSTD
+    this->zstd_stream = NULL;
+#endif
+#ifdef QSPI_WITH_LZ4
+    this->lz4_context = NULL;
+#endif
+    this->start();
+}
+
+/*
+*   Destructor for decompress_source objects.
+*   Stops the reader thread before releasing the codec state it uses.
+*/
+decompress_source::~decompress_source(){
+
+    this->stop();
+    if(this->input_codec == CODEC_GZIP){
+        inflateEnd(&this->gzip_stream);
+    }
+#ifdef QSPI_WITH_ZSTD
+    if(this->zstd_stream != NULL){
+        ZSTD_freeDCtx(this->zstd_stream);
+    }
+#endif
+#ifdef QSPI_WITH_LZ4
+    if(this->lz4_context != NULL){
+        LZ4F_freeDecompressionContext(this->lz4_context);
+    }
+#endif
+}
+
+/*
+*   @returns the codec detected from the image, valid once bytes are read.
+*/
+compression_codec decompress_source::codec(){
+    return this->input_codec;
+}
+
+/*
+*   Initialises the decompression state for the detected codec.
+*   @throws mem_exception : if the codec is not supported by this build
+*/
+void decompress_source::init_codec(){
+
+    if(!codec_supported(this->input_codec)){
+        throw mem_exception("Image Is " + codec_name(this->input_codec) +
+                            " Compressed, Driver Built Without " + codec_name(this->input_codec));
+    }
+    switch(this->input_codec){
+        case CODEC_GZIP:
+            // window bits 15 + 32 accepts gzip and zlib headers
+            if(inflateInit2(&this->gzip_stream, 15 + 32) != Z_OK){
+                throw mem_exception("Failed to Initialise gzip Decompression");
+            }
+            break;
+#ifdef QSPI_WITH_ZSTD
+        case CODEC_ZSTD:
+            this->zstd_stream = ZSTD_createDCtx();
+            if(this->zstd_stream == NULL){
+                throw mem_exception("Failed to Initialise zstd Decompression");
+            }
+            break;
+#endif
+#ifdef QSPI_WITH_LZ4
+        case CODEC_LZ4:
+            if(LZ4F_isError(LZ4F_createDecompressionContext(&this->lz4_context, LZ4F_VERSION))){
+                throw mem_exception("Failed to Initialise lz4 Decompression");
+            }
+            break;
+#endif
+        default:
+            break;
+    }
+}
+
+/*
+*   Reads the next buffer of compressed bytes from the descriptor.
+*   @throws mem_exception : if reading the descriptor fails
+*/
+void decompress_source::refill_input(){
+
+    unsigned long filled = 0;
+    while(filled < CODEC_INPUT_SIZE){
+        ssize_t count = read(this->file_descriptor, &this->input_buffer[filled], CODEC_INPUT_SIZE - filled);
+        if(count == 0){
+            this->input_ended = true;
+            break;
+        }
+        if(count < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            throw mem_exception("Failed to Read Bytes from Stream.", QSPI_ERROR_IO);
+        }
+        filled += count;
+    }
+    this->input = &this->input_buffer[0];
+    this->input_size = filled;
+}
+
+/*
+*   Decompresses input bytes into a buffer with the detected codec.
+*   Consumes input and advances input / input_size.
+*   @param buffer : the buffer to decompress into
+*   @param capacity : the space left in the buffer
+*   @throws mem_exception : if the compressed data is corrupt
+*   @returns the number of bytes produced.
+*/
+unsigned long decompress_source::decompress(uint8_t* buffer, unsigned long capacity){
+
+    unsigned long consumed = 0;
+    unsigned long produced = 0;
+
+    switch(this->input_codec){
+        case CODEC_GZIP: {
+            z_stream& stream = this->gzip_stream;
+            stream.next_in = (Bytef*)this->input;
+            stream.avail_in = std::min(this->input_size, (unsigned long)UINT_MAX);
+            stream.next_out = buffer;
+            stream.avail_out = std::min(capacity, (unsigned long)UINT_MAX);
+            unsigned long avail_in = stream.avail_in;
+            unsigned long avail_out = stream.avail_out;
+            int result = inflate(&stream, Z_NO_FLUSH);
+            consumed = avail_in - stream.avail_in;
+            produced = avail_out - stream.avail_out;
+            if(result == Z_STREAM_END){
+                // concatenated gzip members are decompressed in turn
+                inflateReset(&stream);
+                this->frame_open = false;
+            }
+            else if(result == Z_OK || result == Z_BUF_ERROR){
+                this->frame_open = true;
+            }
+            else{
+                throw mem_exception("Failed to Decompress gzip Image");
+            }
+            break;
+        }
+#ifdef QSPI_WITH_ZSTD
+        case CODEC_ZSTD: {
+            ZSTD_inBuffer in = {this->input, this->input_size, 0};
+            ZSTD_outBuffer out = {buffer, capacity, 0};
+            size_t result = ZSTD_decompressStream(this->zstd_stream, &out, &in);
+            if(ZSTD_isError(result)){
+                throw mem_exception(std::string("Failed to Decompress zstd Image : ") + ZSTD_getErrorName(result));
+            }
+            consumed = in.pos;
+            produced = out.pos;
+            this->frame_open = (result != 0);
+            break;
+        }
+#endif
+#ifdef QSPI_WITH_LZ4
+        case CODEC_LZ4: {
+            size_t out_size = capacity;
+            size_t in_size = this->input_size;
+            size_t result = LZ4F_decompress(this->lz4_context, buffer, &out_size, this->input, &in_size, NULL);
+            if(LZ4F_isError(result)){
+                throw mem_exception(std::string("Failed to Decompress lz4 Image : ") + LZ4F_getErrorName(result));
+            }
+            consumed = in_size;
+            produced = out_size;
+            this->frame_open = (result != 0);
+            break;
+        }
+#endif
+        default:
+            // uncompressed input passes straight through
+            produced = std::min(capacity, this->input_size);
+            memcpy(buffer, this->input, produced);
+            consumed = produced;
+            break;
+    }
+
+    if(consumed == 0 && produced == 0){
+        throw mem_exception("Failed to Decompress Image, No Progress");
+    }
+    this->input += consumed;
+    this->input_size -= consumed;
+    return produced;
+}
+
+/*
+*   Fills a block with decompressed image bytes, runs on the reader thread.
+*   Detects the codec from the first input bytes on the first call.
+*   @param buffer : the block to fill
+*   @param capacity : the size of the block
+*   @throws mem_exception : if the image is corrupt or truncated
+*   @returns the number of bytes produced, 0 at the end of the image.
+*/
+unsigned long decompress_source::fill(uint8_t* buffer, unsigned long capacity){
+
+    if(!this->detected){
+        if(!this->input_mapped){
+            refill_input();
+        }
+        this->input_codec = detect_codec(this->input, this->input_size);
+        init_codec();
+        this->detected = true;
+    }
+
+    unsigned long produced = 0;
+    while(produced < capacity){
+
+        if(this->input_size == 0 && !this->input_ended){
+            refill_input();
+        }
+        if(this->input_size == 0){
+            // all input consumed, the last frame must be complete
+            if(this->frame_open && this->input_codec != CODEC_NONE){
+                throw mem_exception("Compressed Image Is Truncated", QSPI_ERROR_IO);
+            }
+            break;
+        }
+        produced += decompress(buffer + produced, capacity - produced);
+    }
+    return produced;
+}
+
+/*
+*   Constructor for compress_sink objects.
+*   @param file_descriptor : the file descriptor to write the compressed dump to
+*   @param owns_descriptor : true if the descriptor is closed by close()
+*   @param codec : the codec to compress with
+*   @param level : the compression level to start at
+*   @throws mem_exception : if the codec is not supported or fails to initialise
+*/
+compress_sink::compress_sink(int file_descriptor, bool owns_descriptor, compression_codec codec, int level) :
+    stream_sink(file_descriptor, owns_descriptor),
+    output_codec(codec),
+    current_level(level),
+    frame_started(false),
+    bytes_in(0),
+    bytes_out(0),
+    output(SINK_BLOCK_SIZE)
+{
+    memset(&this->gzip_stream, 0, sizeof(this->gzip_stream));
+#ifdef QSPI_WITH_ZSTD
+    this->zstd_context = NULL;
+#endif
+#ifdef QSPI_WITH_LZ4
+    this->lz4_context = NULL;
+#endif
+
+    if(!codec_supported(codec)){
+        throw mem_exception("Driver Built Without " + codec_name(codec) + " Support");
+    }
+    switch(codec){
+        case CODEC_GZIP:
+            // window bits 15 + 16 writes a gzip header
+            if(deflateInit2(&this->gzip_stream, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK){
+                throw mem_exception("Failed to Initialise gzip Compression");
+            }
+            break;
+#ifdef QSPI_WITH_ZSTD
+        case CODEC_ZSTD:
+            this->zstd_context = ZSTD_createCCtx();
+            if(this->zstd_context == NULL){
+                throw mem_exception("Failed to Initialise zstd Compression");
+            }
+            this->output.resize(std::max((size_t)SINK_BLOCK_SIZE, ZSTD_CStreamOutSize()));
+            break;
+#endif
+#ifdef QSPI_WITH_LZ4
+        case CODEC_LZ4:
+            if(LZ4F_isError(LZ4F_createCompressionContext(&this->lz4_context, LZ4F_VERSION))){
+                throw mem_exception("Failed to Initialise lz4 Compression");
+            }
+            memset(&this->lz4_preferences, 0, sizeof(this->lz4_preferences));
+            this->output.resize(LZ4F_compressBound(SINK_BLOCK_SIZE, NULL) + LZ4F_HEADER_SIZE_MAX);
+            break;
+#endif
+        default:
+            break;
+    }
+}
+
+/*
+*   Destructor for compress_sink objects.
+*   Closes the sink so the final frame is written before the codec is freed.
+*/
+compress_sink::~compress_sink(){
+
+    try{
+        this->close();
+    }
+    catch(mem_exception& err){
+    }
+    if(this->output_codec == CODEC_GZIP){
+        deflateEnd(&this->gzip_stream);
+    }
+#ifdef QSPI_WITH_ZSTD
+    if(this->zstd_context != NULL){
+        ZSTD_freeCCtx(this->zstd_context);
+    }
+#endif
+#ifdef QSPI_WITH_LZ4
+    if(this->lz4_context != NULL){
+        LZ4F_freeCompressionContext(this->lz4_context);
+    }
+#endif
+}
+
+/*
+*   @returns the compression level in use, lower if the sink fell behind.
+*/
+int compress_sink::level(){
+    return this->current_level;
+}
+
+/*
+*   @returns the number of compressed bytes written.
+*/
+unsigned long long compress_sink::compressed_bytes(){
+    return this->bytes_out;
+}
+
+/*
+*   @returns the number of uncompressed bytes compressed.
+*/
+unsigned long long compress_sink::uncompressed_bytes(){
+    return this->bytes_in;
+}
+
+/*
+*   Writes compressed bytes from the output buffer.
+*   @param num_bytes : the number of bytes in the output buffer
+*/
+void compress_sink::emit(unsigned long num_bytes){
+
+    if(num_bytes > 0){
+        write_out(&this->output[0], num_bytes);
+        this->bytes_out += num_bytes;
+    }
+}
+
+/*
+*   Starts a new compressed frame at the current level.
+*   @throws mem_exception : if the codec fails to start the frame
+*/
+void compress_sink::begin_frame(){
+
+    switch(this->output_codec){
+        case CODEC_GZIP:
+            if(deflateParams(&this->gzip_stream, this->current_level, Z_DEFAULT_STRATEGY) != Z_OK){
+                throw mem_exception("Failed to Set gzip Compression Level");
+            }
+            break;
+#ifdef QSPI_WITH_ZSTD
+        case CODEC_ZSTD:
+            if(ZSTD_isError(ZSTD_CCtx_setParameter(this->zstd_context, ZSTD_c_compressionLevel, this->current_level))){
+                throw mem_exception("Failed to Set zstd Compression Level");
+            }
+            break;
+#endif
+#ifdef QSPI_WITH_LZ4
+        case CODEC_LZ4: {
+            this->lz4_preferences.compressionLevel = this->current_level;
+            size_t result = LZ4F_compressBegin(this->lz4_context, &this->output[0], this->output.size(), &this->lz4_preferences);
+            if(LZ4F_isError(result)){
+                throw mem_exception("Failed to Begin lz4 Frame");
+            }
+            emit(result);
+            break;
+        }
+#endif
+        default:
+            break;
+    }
+    this->frame_started = true;
+}
+
+/*
+*   Ends the current compressed frame, flushing all of its bytes.
+*   Concatenated frames (gzip members) decompress as one stream.
+*   @throws mem_exception : if the codec fails to end the frame
+*/
+void compress_sink::end_frame(){
+
+    if(!this->frame_started){
+        return;
+    }
+    switch(this->output_codec){
+        case CODEC_GZIP: {
+            z_stream& stream = this->gzip_stream;
+            stream.next_in = NULL;
+            stream.avail_in = 0;
+            int result = Z_OK;
+            while(result != Z_STREAM_END){
+                stream.next_out = &this->output[0];
+                stream.avail_out = this->output.size();
+                result = deflate(&stream, Z_FINISH);
+                if(result != Z_OK && result != Z_STREAM_END){
+                    throw mem_exception("Failed to End gzip Member");
+                }
+                emit(this->output.size() - stream.avail_out);
+            }
+            deflateReset(&stream);
+            break;
+        }
+#ifdef QSPI_WITH_ZSTD
+        case CODEC_ZSTD: {
+            ZSTD_inBuffer in = {NULL, 0, 0};
+            size_t remaining = 1;
+            while(remaining != 0){
+                ZSTD_outBuffer out = {&this->output[0], this->output.size(), 0};
+                remaining = ZSTD_compressStream2(this->zstd_context, &out, &in, ZSTD_e_end);
+                if(ZSTD_isError(remaining)){
+                    throw mem_exception("Failed to End zstd Frame");
+                }
+                emit(out.pos);
+            }
+            break;
+        }
+#endif
+#ifdef QSPI_WITH_LZ4
+        case CODEC_LZ4: {
+            size_t result = LZ4F_compressEnd(this->lz4_context, &this->output[0], this->output.size(), NULL);
+            if(LZ4F_isError(result)){
+                throw mem_exception("Failed to End lz4 Frame");
+            }
+            emit(result);
+            break;
+        }
+#endif
+        default:
+            break;
+    }
+    this->frame_started = false;
+}
+
+/*
+*   Drops to a faster compression level when the writer is falling behind.
+*   If three quarters of the blocks are waiting, the current frame is ..
+*   ended so the next one starts at a faster level. Levels never go back up.
+*/
+void compress_sink::adapt_level(){
+
+    if(queued_blocks() < (SINK_BLOCK_COUNT * 3) / 4){
+        return;
+    }
+    int faster = this->current_level;
+    switch(this->output_codec){
+        case CODEC_GZIP:
+            faster = std::max(1, this->current_level / 2);
+            break;
+        case CODEC_ZSTD:
+            // halve positive levels, then use the negative fast levels
+            faster = (this->current_level > 1) ? this->current_level / 2 : std::max(-5, this->current_level - 2);
+            break;
+        case CODEC_LZ4:
+            // leave high compression mode, then raise the acceleration
+            faster = (this->current_level >= 3) ? 0 : std::max(-8, this->current_level - 4);
+            break;
+        default:
+            break;
+    }
+    if(faster != this->current_level){
+        end_frame();
+        this->current_level = faster;
+    }
+}
+
+/*
+*   Compresses one queued block and writes the output, on the writer thread.
+*   @param data : the bytes of the block
+*   @param num_bytes : the number of bytes in the block
+*   @throws mem_exception : if compression or the write fails
+*/
+void compress_sink::drain(const uint8_t* data, unsigned long num_bytes){
+
+    adapt_level();
+    if(!this->frame_started){
+        begin_frame();
+    }
+
+    switch(this->output_codec){
+        case CODEC_GZIP: {
+            z_stream& stream = this->gzip_stream;
+            stream.next_in = (Bytef*)data;
+            stream.avail_in = num_bytes;
+            do{
+                stream.next_out = &this->output[0];
+                stream.avail_out = this->output.size();
+                if(deflate(&stream, Z_NO_FLUSH) == Z_STREAM_ERROR){
+                    throw mem_exception("Failed to Compress gzip Output");
+                }
+                emit(this->output.size() - stream.avail_out);
+            } while(stream.avail_in > 0 || stream.avail_out == 0);
+            break;
+        }
+#ifdef QSPI_WITH_ZSTD
+        case CODEC_ZSTD: {
+            ZSTD_inBuffer in = {data, num_bytes, 0};
+            while(in.pos < in.size){
+                ZSTD_outBuffer out = {&this->output[0], this->output.size(), 0};
+                size_t result = ZSTD_compressStream2(this->zstd_context, &out, &in, ZSTD_e_continue);
+                if(ZSTD_isError(result)){
+                    throw mem_exception("Failed to Compress zstd Output");
+                }
+                emit(out.pos);
+            }
+            break;
+        }
+#endif
+#ifdef QSPI_WITH_LZ4
+        case CODEC_LZ4: {
+            size_t result = LZ4F_compressUpdate(this->lz4_context, &this->output[0], this->output.size(), data, num_bytes, NULL);
+            if(LZ4F_isError(result)){
+                throw mem_exception("Failed to Compress lz4 Output");
+            }
+            emit(result);
+            break;
+        }
+#endif
+        default:
+            write_out(data, num_bytes);
+            this->bytes_out += num_bytes;
+            break;
+    }
+    this->bytes_in += num_bytes;
+}
+
+/*
+*   Ends the final frame once every block has been drained.
+*/
+void compress_sink::finish(){
+
+    if(!this->frame_started && this->bytes_in == 0){
+        // an empty dump is still a valid compressed stream
+        begin_frame();
+    }
+    end_frame();
+}
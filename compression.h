@@ -0,0 +1,135 @@
+/*
+*   compression.h
+*   @Author Sophie Kirkham STFC, 2018
+*   Header file for the compression helpers, decompress_source and compress_sink
+*   Detects compressed images and decompresses them on the image source ..
+*   reader thread straight into the blocks consumed by the program engine.
+*   Compresses dumps on the image sink writer thread.
+*   gzip is always available, zstd and lz4 are enabled with QSPI_WITH_ZSTD ..
+*   and QSPI_WITH_LZ4 at build time.
+*/
+
+#ifndef COMPRESSION_H_
+#define COMPRESSION_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <zlib.h>
+
+#ifdef QSPI_WITH_ZSTD
+#include <zstd.h>
+#endif
+#ifdef QSPI_WITH_LZ4
+#include <lz4frame.h>
+#endif
+
+#include "image_source.h"
+#include "image_sink.h"
+#include "mem_exception.h"
+
+#define CODEC_INPUT_SIZE 65536  // Size of the compressed input buffer
+
+// Compression formats understood for images and dumps
+enum compression_codec{
+    CODEC_NONE,
+    CODEC_GZIP,
+    CODEC_ZSTD,
+    CODEC_LZ4
+};
+
+compression_codec detect_codec(const uint8_t* data, unsigned long num_bytes);
+compression_codec codec_from_name(const std::string& name);
+std::string codec_name(compression_codec codec);
+bool codec_supported(compression_codec codec);
+int default_level(compression_codec codec);
+void check_level(compression_codec codec, int level);
+
+/*
+*   Image source decompressing a gzip, zstd or lz4 image on the reader thread
+*   The compressed bytes come from a mapped file or a file descriptor, the ..
+*   codec is detected from the first bytes, uncompressed input passes through.
+*/
+class decompress_source : public stream_source{
+
+    public:
+
+        decompress_source(const uint8_t* data, unsigned long num_bytes);
+        decompress_source(int file_descriptor);
+        ~decompress_source();
+        compression_codec codec();
+
+    protected:
+
+        unsigned long fill(uint8_t* buffer, unsigned long capacity);
+
+    private:
+
+        const uint8_t* input;           // the next compressed input bytes
+        unsigned long input_size;       // number of compressed input bytes left
+        std::vector<uint8_t> input_buffer;  // buffer for input read from the descriptor
+        bool input_mapped;              // true if the input is a mapping
+        bool input_ended;               // true once all input has been read
+        bool detected;                  // true once the codec has been detected
+        bool frame_open;                // true while a compressed frame is incomplete
+        compression_codec input_codec;  // the detected codec
+
+        z_stream gzip_stream;           // zlib inflate state
+#ifdef QSPI_WITH_ZSTD
+        ZSTD_DStream* zstd_stream;      // zstd decompression state
+#endif
+#ifdef QSPI_WITH_LZ4
+        LZ4F_dctx* lz4_context;         // lz4 frame decompression state
+#endif
+
+        void init_codec();
+        void refill_input();
+        unsigned long decompress(uint8_t* buffer, unsigned long capacity);
+};
+
+/*
+*   Image sink compressing a dump on the writer thread before writing it.
+*   Each frame is compressed at the selected level; when the queue of ..
+*   blocks waiting to be compressed backs up, the current frame is ended ..
+*   and the next begins at a faster level so the SPI reads never stall.
+*/
+class compress_sink : public stream_sink{
+
+    public:
+
+        compress_sink(int file_descriptor, bool owns_descriptor, compression_codec codec, int level);
+        ~compress_sink();
+        int level();
+        unsigned long long compressed_bytes();
+        unsigned long long uncompressed_bytes();
+
+    protected:
+
+        void drain(const uint8_t* data, unsigned long num_bytes);
+        void finish();
+
+    private:
+
+        compression_codec output_codec; // the codec to compress with
+        int current_level;      // the level the current frame is compressed at
+        bool frame_started;     // true once the current frame has begun
+        unsigned long long bytes_in;    // uncompressed bytes drained
+        unsigned long long bytes_out;   // compressed bytes written
+        std::vector<uint8_t> output;    // compressed output buffer
+
+        z_stream gzip_stream;           // zlib deflate state
+#ifdef QSPI_WITH_ZSTD
+        ZSTD_CCtx* zstd_context;        // zstd compression state
+#endif
+#ifdef QSPI_WITH_LZ4
+        LZ4F_cctx* lz4_context;         // lz4 frame compression state
+        LZ4F_preferences_t lz4_preferences; // lz4 frame preferences
+#endif
+
+        void begin_frame();
+        void end_frame();
+        void emit(unsigned long num_bytes);
+        void adapt_level();
+};
+
+#endif
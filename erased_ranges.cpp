@@ -0,0 +1,205 @@
+/*
+*   erased_ranges.cpp
+*   @Author Sophie Kirkham STFC, 2018
+*   Implementation of the erased_ranges class and the erased block scan
+*/
+
+#include <string.h>
+#include <algorithm>
+#include <fstream>
+
+#include "erased_ranges.h"
+
+/*
+*   Checks whether every byte of a buffer is erased (0xFF).
+*   Strides of sixteen words are copied out with memcpy and AND-ed ..
+*   together, a loop the compiler turns into vector loads whatever the ..
+*   alignment of the image, stopping at the first stride with data.
+*   @param data : the bytes to check
+*   @param num_bytes : the number of bytes to check
+*   @returns true if every byte is 0xFF.
+*/
+bool is_erased(const uint8_t* data, unsigned long num_bytes){
+
+    const unsigned long stride_bytes = 16 * sizeof(unsigned long);
+    unsigned long i = 0;
+    // AND together strides of words, an erased word is all ones
+    for(; i + stride_bytes <= num_bytes; i += stride_bytes){
+        unsigned long words[16];
+        memcpy(words, data + i, stride_bytes);
+        unsigned long stride = ~0UL;
+        for(int k = 0; k < 16; k++){
+            stride &= words[k];
+        }
+        if(stride != ~0UL){
+            return false;
+        }
+    }
+
+    // check the remaining tail bytes
+    for(; i < num_bytes; i++){
+        if(data[i] != 0xFF){
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+*   Adds an erased range, merging it with any range it touches.
+*   @param offset : the image offset the range starts at
+*   @param length : the number of erased bytes
+*/
+void erased_ranges::add(unsigned long long offset, unsigned long long length){
+
+    if(length == 0){
+        return;
+    }
+    unsigned long long end = offset + length;
+
+    // the common case, ranges are added in order as a dump is written
+    if(this->ranges.empty() || offset > this->ranges.back().second){
+        this->ranges.push_back(std::make_pair(offset, end));
+        return;
+    }
+    if(offset >= this->ranges.back().first){
+        this->ranges.back().second = std::max(this->ranges.back().second, end);
+        return;
+    }
+
+    // out of order, re-sort and merge the overlapping ranges
+    this->ranges.push_back(std::make_pair(offset, end));
+    std::sort(this->ranges.begin(), this->ranges.end());
+    unsigned long merged = 0;
+    for(unsigned long i = 1; i < this->ranges.size(); i++){
+        if(this->ranges[i].first <= this->ranges[merged].second){
+            this->ranges[merged].second = std::max(this->ranges[merged].second, this->ranges[i].second);
+        }
+        else{
+            this->ranges[++merged] = this->ranges[i];
+        }
+    }
+    this->ranges.resize(merged + 1);
+}
+
+/*
+*   Finds the last range starting at or before an offset.
+*   @param offset : the image offset
+*   @returns the index of the range, -1 if no range starts at or before offset.
+*/
+long erased_ranges::find(unsigned long long offset) const{
+
+    std::vector< std::pair<unsigned long long, unsigned long long> >::const_iterator next =
+        std::upper_bound(this->ranges.begin(), this->ranges.end(), std::make_pair(offset, ~0ULL));
+    return (long)(next - this->ranges.begin()) - 1;
+}
+
+/*
+*   @returns true if every byte of [offset, offset + length) is erased.
+*/
+bool erased_ranges::covers(unsigned long long offset, unsigned long length) const{
+
+    long i = find(offset);
+    return i >= 0 && offset + length <= this->ranges[i].second;
+}
+
+/*
+*   @returns true if any byte of [offset, offset + length) is erased.
+*/
+bool erased_ranges::intersects(unsigned long long offset, unsigned long length) const{
+
+    long i = find(offset);
+    if(i >= 0 && this->ranges[i].second > offset){
+        return true;
+    }
+    return (unsigned long)(i + 1) < this->ranges.size() && this->ranges[i + 1].first < offset + length;
+}
+
+/*
+*   Sets the erased bytes of a buffer holding image bytes to 0xFF.
+*   @param offset : the image offset of the buffer
+*   @param buffer : the buffer to fill
+*   @param length : the number of bytes in the buffer
+*/
+void erased_ranges::fill(unsigned long long offset, uint8_t* buffer, unsigned long length) const{
+
+    unsigned long long end = offset + length;
+    for(long i = std::max(find(offset), 0L); i < (long)this->ranges.size() && this->ranges[i].first < end; i++){
+        unsigned long long start = std::max(this->ranges[i].first, offset);
+        unsigned long long stop = std::min(this->ranges[i].second, end);
+        if(start < stop){
+            memset(buffer + (start - offset), 0xFF, stop - start);
+        }
+    }
+}
+
+/*
+*   @returns the total number of erased bytes.
+*/
+unsigned long long erased_ranges::erased_bytes() const{
+
+    unsigned long long total = 0;
+    for(unsigned long i = 0; i < this->ranges.size(); i++){
+        total += this->ranges[i].second - this->ranges[i].first;
+    }
+    return total;
+}
+
+/*
+*   @returns true if there are no erased ranges.
+*/
+bool erased_ranges::empty() const{
+    return this->ranges.empty();
+}
+
+/*
+*   Removes every range.
+*/
+void erased_ranges::clear(){
+    this->ranges.clear();
+}
+
+/*
+*   Writes the ranges to a sidecar file.
+*   @param filename : the name of the sidecar file
+*   @throws mem_exception : if the file fails to be written
+*/
+void erased_ranges::save(const std::string& filename) const{
+
+    std::ofstream out_file(filename.c_str());
+    if(!out_file.is_open()){
+        throw mem_exception("Failed to Open Erased Ranges File", QSPI_ERROR_IO);
+    }
+    out_file << std::hex;
+    for(unsigned long i = 0; i < this->ranges.size(); i++){
+        out_file << "0x" << this->ranges[i].first << " 0x"
+        << (this->ranges[i].second - this->ranges[i].first) << "\n";
+    }
+    out_file.close();
+    if(out_file.fail()){
+        throw mem_exception("Failed to Write Erased Ranges File", QSPI_ERROR_IO);
+    }
+}
+
+/*
+*   Reads the ranges from a sidecar file, replacing any held.
+*   @param filename : the name of the sidecar file
+*   @throws mem_exception : if the file fails to open or is not a range list
+*/
+void erased_ranges::load(const std::string& filename){
+
+    std::ifstream in_file(filename.c_str());
+    if(!in_file.is_open()){
+        throw mem_exception("Failed to Open Erased Ranges File", QSPI_ERROR_IO);
+    }
+    this->ranges.clear();
+    unsigned long long offset;
+    unsigned long long length;
+    in_file >> std::hex;
+    while(in_file >> offset >> length){
+        add(offset, length);
+    }
+    if(!in_file.eof()){
+        throw mem_exception("Erased Ranges File Is Corrupt", QSPI_ERROR_IO);
+    }
+}
@@ -0,0 +1,50 @@
+/*
+*   erased_ranges.h
+*   @Author Sophie Kirkham STFC, 2018
+*   Header file for the erased_ranges class and the erased block scan
+*   Records the erased (0xFF) regions of a sparse dump in a sidecar file ..
+*   so they are never written out and never programmed back.
+*/
+
+#ifndef ERASED_RANGES_H_
+#define ERASED_RANGES_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <utility>
+
+#include "mem_exception.h"
+
+#define ERASED_BLOCK_SIZE 4096  // Size of the blocks scanned for erased bytes
+
+bool is_erased(const uint8_t* data, unsigned long num_bytes);
+
+/*
+*   Sorted list of erased byte ranges within an image.
+*   Adjacent ranges are merged, so a mostly erased chip is a few lines.
+*   The sidecar file holds one "<hex offset> <hex length>" pair per line.
+*/
+class erased_ranges{
+
+    public:
+
+        void add(unsigned long long offset, unsigned long long length);
+        bool covers(unsigned long long offset, unsigned long length) const;
+        bool intersects(unsigned long long offset, unsigned long length) const;
+        void fill(unsigned long long offset, uint8_t* buffer, unsigned long length) const;
+        unsigned long long erased_bytes() const;
+        bool empty() const;
+        void clear();
+        void save(const std::string& filename) const;
+        void load(const std::string& filename);
+
+    private:
+
+        // the [start, end) byte offsets of each range, sorted and disjoint
+        std::vector< std::pair<unsigned long long, unsigned long long> > ranges;
+
+        long find(unsigned long long offset) const;
+};
+
+#endif
@@ -0,0 +1,433 @@
+/*
+*   event_log.cpp
+*   @Author Sophie Kirkham STFC, 2018
+*   Implementation of the event_log class
+*   Events are queued on a bounded lock-free ring (each slot carries a ..
+*   sequence number saying whether it is free or full), drained by the ..
+*   flusher thread to the console as text and to the binary log as records.
+*/
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sstream>
+#include <fstream>
+#include <iomanip>
+
+#include "event_log.h"
+#include "realtime.h"
+#include "compression.h"
+#include "qspi_flash_defines.h"
+
+std::atomic<event_log*> event_log::active_log(NULL);
+
+namespace{
+
+const char* const EVENT_NAMES[EVENT_COUNT] = {
+    "device_id", "read_crc", "read_done", "sparse_holes", "compressed", "level_lowered",
+    "erase_done", "image_erased", "decompressing", "image_crc", "write_crc", "write_done",
+    "verify_ok", "verify_mismatch", "page_program", "fifo_read", "sector_erase",
+    "flash_geometry", "fifo_depth", "image_segments", "segment"
+};
+
+const uint16_t EVENT_NUM_ARGS[EVENT_COUNT] = {
+    1, 1, 1, 1, 4, 1, 1, 1, 1, 1, 1, 1, 0, 1, 3, 3, 1, 4, 1, 4, 4
+};
+
+/*
+*   @returns the kernel thread id of the calling thread, looked up once per thread.
+*/
+uint32_t thread_id(){
+    static thread_local uint32_t id = syscall(SYS_gettid);
+    return id;
+}
+
+}
+
+/*
+*   Opens the binary log if given and starts the flusher thread.
+*   @param console : the stream to render events to as text, NULL for none
+*   @param filename : the binary log to write, empty for none
+*   @param capacity : the events the ring holds, rounded up to a power of 2
+*   @throws mem_exception : if the binary log fails to open or its header to write
+*/
+event_log::event_log(FILE* console, const std::string& filename, unsigned long capacity) :
+    console(console),
+    filename(filename),
+    fd(-1),
+    head(0),
+    tail(0),
+    dropped(0),
+    detailed(false),
+    start(std::chrono::steady_clock::now()),
+    stopping(false),
+    failed(false)
+{
+    unsigned long long size = 1;
+    while(size < capacity){
+        size <<= 1;
+    }
+    this->ring.reset(new slot[size]);
+    this->mask = size - 1;
+    for(unsigned long long i = 0; i < size; i++){
+        this->ring[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    if(!filename.empty()){
+        this->fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(this->fd == -1){
+            throw mem_exception("Failed to Open Event Log " + filename, QSPI_ERROR_IO);
+        }
+        event_log_header header;
+        memcpy(header.magic, EVENT_LOG_MAGIC, sizeof(header.magic));
+        header.version = EVENT_LOG_VERSION;
+        header.record_size = sizeof(event_record);
+        if(::write(this->fd, &header, sizeof(header)) != sizeof(header)){
+            ::close(this->fd);
+            throw mem_exception("Failed to Write Event Log " + filename, QSPI_ERROR_IO);
+        }
+    }
+    this->flusher = std::thread(&event_log::run, this);
+}
+
+/*
+*   Flushes the events left in the ring and stops the flusher.
+*/
+event_log::~event_log(){
+    try{
+        close();
+    }
+    catch(mem_exception& err){
+    }
+}
+
+/*
+*   Logs an event without waiting, dropping it if the ring is full.
+*   @param id : the event
+*   @param a0 - a3 : the arguments of the event
+*   @returns false if the event was dropped.
+*/
+bool event_log::log(event_id id, uint64_t a0, uint64_t a1, uint64_t a2, uint64_t a3){
+
+    // claim the slot at head, free while its sequence equals the position
+    unsigned long long position = this->head.load(std::memory_order_relaxed);
+    slot* entry;
+    while(true){
+        entry = &this->ring[position & this->mask];
+        long long behind = (long long)(entry->sequence.load(std::memory_order_acquire) - position);
+        if(behind == 0){
+            if(this->head.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)){
+                break;
+            }
+        }
+        else if(behind < 0){
+            // the slot still holds an event a lap behind, the ring is full
+            this->dropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        else{
+            position = this->head.load(std::memory_order_relaxed);
+        }
+    }
+    event_record& record = entry->record;
+    record.time_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - this->start).count();
+    record.id = id;
+    record.num_args = EVENT_NUM_ARGS[id];
+    record.thread = thread_id();
+    record.args[0] = a0;
+    record.args[1] = a1;
+    record.args[2] = a2;
+    record.args[3] = a3;
+    // publish the event to the flusher
+    entry->sequence.store(position + 1, std::memory_order_release);
+    return true;
+}
+
+/*
+*   Writes out every event logged before the call, on the calling thread.
+*   Used before printing outside the log, so the console stays in order.
+*/
+void event_log::flush(){
+    drain();
+}
+
+/*
+*   Stops the flusher thread once it has written every event logged.
+*   @throws mem_exception : if a write to the binary log failed
+*/
+void event_log::close(){
+
+    {
+        std::lock_guard<std::mutex> guard(this->lock);
+        if(this->stopping){
+            return;
+        }
+        this->stopping = true;
+    }
+    this->wake.notify_one();
+    this->flusher.join();
+    if(this->fd != -1){
+        ::close(this->fd);
+        this->fd = -1;
+    }
+    if(this->failed){
+        throw mem_exception("Failed to Write Event Log " + this->filename, QSPI_ERROR_IO);
+    }
+}
+
+/*
+*   Enables or disables the detail events, one per page, FIFO or sector.
+*/
+void event_log::set_detail(bool detail){
+    this->detailed.store(detail, std::memory_order_relaxed);
+}
+
+/*
+*   @returns true if detail events are logged.
+*/
+bool event_log::detail() const{
+    return this->detailed.load(std::memory_order_relaxed);
+}
+
+/*
+*   @returns the number of events dropped with the ring full.
+*/
+unsigned long long event_log::events_dropped() const{
+    return this->dropped.load();
+}
+
+/*
+*   Sets the log events are sent to. Clear it before the log is destroyed, ..
+*   while no operation is running.
+*   @param log : the log, NULL to stop logging
+*/
+void event_log::set_active(event_log* log){
+    active_log.store(log, std::memory_order_release);
+}
+
+/*
+*   Drains the ring every EVENT_FLUSH_MS until stopped, on the flusher thread.
+*/
+void event_log::run(){
+
+    enter_background();
+    std::unique_lock<std::mutex> guard(this->lock);
+    while(!this->wake.wait_for(guard, std::chrono::milliseconds(EVENT_FLUSH_MS), [this]{ return this->stopping; })){
+        guard.unlock();
+        drain();
+        guard.lock();
+    }
+    guard.unlock();
+    drain();
+}
+
+/*
+*   Takes the published events off the ring, in the order their slots ..
+*   were claimed, then renders them to the console and writes them to the ..
+*   binary log. Stops at a slot claimed but not yet published.
+*/
+void event_log::drain(){
+
+    std::lock_guard<std::mutex> guard(this->drain_lock);
+    std::vector<event_record> batch;
+    while(true){
+        slot& entry = this->ring[this->tail & this->mask];
+        if(entry.sequence.load(std::memory_order_acquire) != this->tail + 1){
+            break;
+        }
+        batch.push_back(entry.record);
+        // free the slot for the claim one lap on
+        entry.sequence.store(this->tail + this->mask + 1, std::memory_order_release);
+        this->tail++;
+    }
+    if(batch.empty()){
+        return;
+    }
+    if(this->console != NULL){
+        for(unsigned long i = 0; i < batch.size(); i++){
+            fputs((event_text(batch[i]) + "\n").c_str(), this->console);
+        }
+        fflush(this->console);
+    }
+    if(this->fd != -1 && !this->failed){
+        const char* data = (const char*)batch.data();
+        unsigned long num_bytes = batch.size() * sizeof(event_record);
+        unsigned long written = 0;
+        while(written < num_bytes){
+            ssize_t count = ::write(this->fd, data + written, num_bytes - written);
+            if(count < 0){
+                if(errno == EINTR){
+                    continue;
+                }
+                this->failed = true;
+                break;
+            }
+            written += count;
+        }
+    }
+}
+
+/*
+*   @returns the name of an event, for JSON.
+*/
+std::string event_name(uint16_t id){
+    if(id >= EVENT_COUNT){
+        std::ostringstream name;
+        name << "event_" << id;
+        return name.str();
+    }
+    return EVENT_NAMES[id];
+}
+
+/*
+*   Renders an event as the message the driver prints for it.
+*   @param record : the event
+*   @returns the message, without a trailing newline.
+*/
+std::string event_text(const event_record& record){
+
+    std::ostringstream text;
+    const uint64_t* args = record.args;
+    switch(record.id){
+        case EVENT_DEVICE_ID:
+            text << "Device ID : 0x" << std::hex << args[0];
+            break;
+        case EVENT_READ_CRC:
+            text << "CRC code for read : 0x" << std::hex << args[0];
+            break;
+        case EVENT_READ_DONE:
+            text << args[0] << " ms to read";
+            break;
+        case EVENT_SPARSE_HOLES:
+            text << args[0] << " erased bytes left as holes, listed in the .erased file";
+            break;
+        case EVENT_COMPRESSED:
+            text << "Compressed " << args[0] << " bytes to " << args[1] << " bytes with "
+            << codec_name((compression_codec)args[2]) << " level " << args[3];
+            break;
+        case EVENT_LEVEL_LOWERED:
+            text << "Compression fell behind the read, level lowered from " << args[0];
+            break;
+        case EVENT_ERASE_DONE:
+            text << args[0] << " ms to erase." << std::endl << "Erase Operation Complete";
+            break;
+        case EVENT_IMAGE_ERASED:
+            text << "Treating " << args[0] << " bytes listed in the .erased file as blank";
+            break;
+        case EVENT_DECOMPRESSING:
+            text << "Decompressing " << codec_name((compression_codec)args[0]) << " image";
+            break;
+        case EVENT_IMAGE_CRC:
+            text << "CRC code for image : 0x" << std::hex << args[0];
+            break;
+        case EVENT_WRITE_CRC:
+            text << "CRC code for write : 0x" << std::hex << args[0];
+            break;
+        case EVENT_WRITE_DONE:
+            text << args[0] << " ms to write." << std::endl << "Write Successfull";
+            break;
+        case EVENT_VERIFY_OK:
+            text << "Flash Program Verified Successfully";
+            break;
+        case EVENT_VERIFY_MISMATCH:
+            text << "First mismatch at flash address 0x" << std::hex << args[0];
+            break;
+        case EVENT_PAGE_PROGRAM:
+            text << "Page programmed at 0x" << std::hex << args[0] << std::dec << ", " << args[1]
+            << " bytes in " << args[2] / 1000.0 << " us";
+            break;
+        case EVENT_FIFO_READ:
+            text << "FIFO read at 0x" << std::hex << args[0] << std::dec << ", " << args[1]
+            << " bytes in " << args[2] / 1000.0 << " us";
+            break;
+        case EVENT_SECTOR_ERASE:
+            text << "Sector erased at 0x" << std::hex << args[0];
+            break;
+        case EVENT_FLASH_GEOMETRY:
+            text << "Flash chip " << (args[0] >> 24) << " JEDEC ID 0x" << std::hex << std::setfill('0') << std::setw(6)
+            << (args[0] & 0xFFFFFF) << std::dec << " : " << args[1] << " bytes, " << args[2] << " byte pages, "
+            << args[3] << " byte sectors";
+            break;
+        case EVENT_FIFO_DEPTH:
+            if(args[0] == 0){
+                text << "Controller FIFO depth not detected, using " << FIFO_DEPTH << " byte transfers";
+                break;
+            }
+            text << "Controller FIFO depth : " << args[0] << " bytes";
+            break;
+        case EVENT_IMAGE_SEGMENTS:
+            text << "Image container of " << args[0] << " segments holding " << args[1] << " of " << args[2]
+            << " bytes, gaps filled with 0x" << std::hex << args[3];
+            break;
+        case EVENT_SEGMENT:
+            text << "Segment " << args[0] << " : " << args[2] << " bytes at address 0x" << std::hex << args[1]
+            << std::dec << (args[3] == CODEC_NONE ? ", stored" : ", " + codec_name((compression_codec)args[3]) + " compressed");
+            break;
+        default:
+            text << "Unknown event " << record.id;
+    }
+    return text.str();
+}
+
+/*
+*   Renders an event as a single line JSON object.
+*   @param record : the event
+*   @returns the object, without a trailing newline.
+*/
+std::string event_json(const event_record& record){
+
+    std::ostringstream json;
+    json << "{\"time_ns\": " << record.time_ns << ", \"thread\": " << record.thread
+    << ", \"event\": \"" << event_name(record.id) << "\", \"args\": [";
+    for(unsigned i = 0; i < record.num_args && i < EVENT_ARGS; i++){
+        json << (i > 0 ? ", " : "") << record.args[i];
+    }
+    // the messages hold no quotes or backslashes, only the line breaks need escaping
+    std::string text = event_text(record);
+    std::string::size_type line;
+    while((line = text.find('\n')) != std::string::npos){
+        text.replace(line, 1, "\\n");
+    }
+    json << "], \"text\": \"" << text << "\"}";
+    return json.str();
+}
+
+/*
+*   Reads every event of a binary event log.
+*   @param filename : the log to read
+*   @throws mem_exception : if the file fails to open or is not a log of this version
+*   @returns the events, in the order they were logged.
+*/
+std::vector<event_record> read_event_log(const std::string& filename){
+
+    std::ifstream file(filename.c_str(), std::ios::binary);
+    if(!file){
+        throw mem_exception("Failed to Open Event Log " + filename, QSPI_ERROR_IO);
+    }
+    event_log_header header;
+    if(!file.read((char*)&header, sizeof(header)) || memcmp(header.magic, EVENT_LOG_MAGIC, sizeof(header.magic)) != 0){
+        throw mem_exception(filename + " Is Not An Event Log", QSPI_ERROR_INVALID_ARGUMENT);
+    }
+    if(header.version != EVENT_LOG_VERSION || header.record_size != sizeof(event_record)){
+        throw mem_exception(filename + " Is An Event Log Of An Unsupported Version", QSPI_ERROR_INVALID_ARGUMENT);
+    }
+    std::vector<event_record> records;
+    event_record record;
+    while(file.read((char*)&record, sizeof(record))){
+        records.push_back(record);
+    }
+    return records;
+}
+
+/*
+*   Writes out the events logged so far to the active log, if there is one.
+*/
+void flush_events(){
+    event_log* log = event_log::active();
+    if(log != NULL){
+        log->flush();
+    }
+}
@@ -0,0 +1,157 @@
+/*
+*   event_log.h
+*   @Author Sophie Kirkham STFC, 2018
+*   Header file for the event_log class and the event log file format
+*   The driver core reports what it did (CRCs, timings, the device ID) as ..
+*   fixed size binary events instead of printing. Logging an event claims ..
+*   a slot of a lock-free ring and stores its id, timestamp and arguments, ..
+*   any thread may log and none waits on another, or on stdio. A flusher ..
+*   thread drains the ring, rendering each event as a line of text to the ..
+*   console, if one is given, and appending the records to a binary log, ..
+*   if one is given, for qspi_logdump to decode into text or JSON.
+*   With no event_log active, logging an event costs a load and a branch, ..
+*   so the library and the benchmark stay silent.
+*   Detail events, one per page or FIFO transfer, are only logged once ..
+*   enabled with set_detail().
+*/
+
+#ifndef EVENT_LOG_H_
+#define EVENT_LOG_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+
+#include "mem_exception.h"
+
+#define EVENT_LOG_MAGIC "QSPILOG1"  // First 8 bytes of a binary event log
+#define EVENT_LOG_VERSION 1         // Incremented when the record layout or event ids change
+#define EVENT_RING_RECORDS 65536    // Events the ring holds, a power of 2
+#define EVENT_FLUSH_MS 20           // Longest the flusher thread sleeps between drains
+#define EVENT_ARGS 4                // Arguments carried by each event
+
+enum event_id{
+    EVENT_DEVICE_ID,        // a flash device ID byte : id
+    EVENT_READ_CRC,         // the CRC of a read : crc
+    EVENT_READ_DONE,        // a read finished : ms
+    EVENT_SPARSE_HOLES,     // erased blocks of a read left as holes : bytes
+    EVENT_COMPRESSED,       // a read was compressed : bytes in, bytes out, codec, level
+    EVENT_LEVEL_LOWERED,    // compression fell behind the read : level started at
+    EVENT_ERASE_DONE,       // a bulk erase finished : ms
+    EVENT_IMAGE_ERASED,     // ranges of a sparse image treated as blank : bytes
+    EVENT_DECOMPRESSING,    // a compressed image is being decompressed : codec
+    EVENT_IMAGE_CRC,        // the CRC of an image : crc
+    EVENT_WRITE_CRC,        // the CRC of the bytes programmed : crc
+    EVENT_WRITE_DONE,       // a program finished : ms
+    EVENT_VERIFY_OK,        // the flash matched the image
+    EVENT_VERIFY_MISMATCH,  // the first byte that did not match : flash address
+    EVENT_PAGE_PROGRAM,     // detail, a page programmed : address, bytes, ns
+    EVENT_FIFO_READ,        // detail, a FIFO read : address, bytes, ns
+    EVENT_SECTOR_ERASE,     // detail, a sector erased : address
+    EVENT_FLASH_GEOMETRY,   // a flash chip was probed : chip and JEDEC ID, size, page size, sector size
+    EVENT_FIFO_DEPTH,       // the controller's FIFO depth was probed : depth, 0 if not detected
+    EVENT_IMAGE_SEGMENTS,   // an image container was opened : segments, bytes held, layout size, fill value
+    EVENT_SEGMENT,          // a container segment is starting : index, flash address, bytes, codec
+    EVENT_COUNT
+};
+
+struct event_log_header{
+    char magic[8];          // EVENT_LOG_MAGIC
+    uint32_t version;       // EVENT_LOG_VERSION
+    uint32_t record_size;   // sizeof(event_record)
+};
+
+struct event_record{
+    uint64_t time_ns;       // time since the log started
+    uint16_t id;            // an event_id
+    uint16_t num_args;      // the arguments the event carries
+    uint32_t thread;        // the kernel thread id of the logging thread
+    uint64_t args[EVENT_ARGS];  // the arguments, unused ones are 0
+};
+
+class event_log{
+
+    public:
+
+        event_log(FILE* console, const std::string& filename = "", unsigned long capacity = EVENT_RING_RECORDS);
+        ~event_log();
+
+        bool log(event_id id, uint64_t a0, uint64_t a1, uint64_t a2, uint64_t a3);
+        void flush();
+        void close();
+        void set_detail(bool detail);
+        bool detail() const;
+        unsigned long long events_dropped() const;
+
+        static void set_active(event_log* log);
+
+        /*  @returns the log events are sent to, NULL if none.
+        */
+        static event_log* active(){
+            return active_log.load(std::memory_order_acquire);
+        };
+
+    private:
+
+        // a ring slot, its sequence says whether it is free or holds an event
+        struct slot{
+            std::atomic<unsigned long long> sequence;
+            event_record record;
+        };
+
+        FILE* console;              // rendered as text to, NULL if not
+        std::string filename;       // the binary log, empty if none
+        int fd;                     // the open binary log, -1 if none
+        std::unique_ptr<slot[]> ring;   // events waiting to be flushed
+        unsigned long long mask;    // the ring size - 1
+        std::atomic<unsigned long long> head;   // the next slot to claim
+        unsigned long long tail;    // the next slot to flush, guarded by drain_lock
+        std::atomic<unsigned long long> dropped;    // events dropped with the ring full
+        std::atomic<bool> detailed; // true to log detail events
+        std::chrono::steady_clock::time_point start;    // time 0 of the log
+        std::mutex drain_lock;      // one drain at a time
+        std::mutex lock;            // guards stopping
+        std::condition_variable wake;   // wakes the flusher to stop
+        bool stopping;              // set to drain the ring and stop the flusher
+        bool failed;                // set if a write to the binary log failed
+        std::thread flusher;        // drains the ring
+
+        static std::atomic<event_log*> active_log;  // the log events are sent to
+
+        void run();
+        void drain();
+};
+
+std::string event_name(uint16_t id);
+std::string event_text(const event_record& record);
+std::string event_json(const event_record& record);
+std::vector<event_record> read_event_log(const std::string& filename);
+
+/*  Logs an event to the active event_log, if there is one.
+*   @param id : the event
+*   @param a0 - a3 : the arguments of the event
+*/
+inline void log_event(event_id id, uint64_t a0 = 0, uint64_t a1 = 0, uint64_t a2 = 0, uint64_t a3 = 0){
+    event_log* log = event_log::active();
+    if(log != NULL){
+        log->log(id, a0, a1, a2, a3);
+    }
+}
+
+/*  @returns true if detail events are being logged, check before timing one.
+*/
+inline bool log_detail(){
+    event_log* log = event_log::active();
+    return log != NULL && log->detail();
+}
+
+void flush_events();
+
+#endif
@@ -0,0 +1,231 @@
+/*
+*   fifo_dma.cpp
+*   @Author Sophie Kirkham STFC, 2018
+*   Implementation of the axi_cdma and emulated_dma classes
+*/
+
+#include <fstream>
+
+#include "fifo_dma.h"
+
+/*
+*   Constructor for axi_cdma objects
+*   Maps the CDMA registers and the udmabuf buffer, opens the UIO device ..
+*   and resets the engine.
+*   @param uio_device : the UIO device delivering the CDMA interrupt e.g. /dev/uio0
+*   @param buffer_device : the udmabuf device holding the buffer e.g. udmabuf0
+*   @throws mem_exception : if a device fails to open or map
+*/
+axi_cdma::axi_cdma(const std::string& uio_device, const std::string& buffer_device) :
+    uio_descriptor(-1)
+{
+    // the udmabuf driver publishes the buffer's size and address in sysfs
+    std::string sysfs = "/sys/class/u-dma-buf/" + buffer_device + "/";
+    unsigned long buffer_bytes = read_sysfs(sysfs + "size");
+    this->buffer_physical = read_sysfs(sysfs + "phys_addr");
+
+    // the udmabuf is opened O_SYNC by its manager, mapping the buffer uncached ..
+    // so the CPU and engine see the same bytes
+    this->buffer_region = mapping_manager::open("/dev/" + buffer_device, true)->map(0, buffer_bytes);
+    this->buffer = (uint32_t*)this->buffer_region->base();
+    this->buffer_words = buffer_bytes / sizeof(uint32_t);
+    this->cdma = mapping_manager::open(MEM_DEVICE, true)->registers(CDMA_BASE, CDMA_SIZE);
+
+    if((this->uio_descriptor = open(uio_device.c_str(), O_RDWR)) == -1){
+        throw mem_exception("Failed to Open DMA Interrupt " + uio_device, QSPI_ERROR_MAP);
+    }
+    this->cdma.write<uint32_t>(CDMA_CR, CDMA_RESET);
+    while(this->cdma.read<uint32_t>(CDMA_CR) & CDMA_RESET){
+    }
+}
+
+/*
+*   Destructor for axi_cdma objects, the registers and buffer un-map themselves.
+*/
+axi_cdma::~axi_cdma(){
+    close(this->uio_descriptor);
+}
+
+/*
+*   Reads a number from a sysfs attribute.
+*   @throws mem_exception : if the attribute fails to read
+*/
+unsigned long long axi_cdma::read_sysfs(const std::string& filename){
+
+    std::ifstream attribute(filename.c_str());
+    std::string value;
+    if(!(attribute >> value)){
+        throw mem_exception("Failed to Read " + filename, QSPI_ERROR_MAP);
+    }
+    return strtoull(value.c_str(), NULL, 0);
+}
+
+/*
+*   @returns the name of the engine for messages.
+*/
+std::string axi_cdma::name() const{
+    return "AXI CDMA";
+}
+
+/*
+*   Programs a simple mode transfer, writing the length starts it.
+*   The interrupt is unmasked in UIO first so its completion is not missed.
+*/
+void axi_cdma::start(uint32_t control, uint32_t source, uint32_t destination, unsigned long num_words){
+
+    uint32_t unmask = 1;
+    if(write(this->uio_descriptor, &unmask, sizeof(unmask)) != sizeof(unmask)){
+        throw mem_exception("Failed to Enable The DMA Interrupt", QSPI_ERROR_IO);
+    }
+    this->cdma.write<uint32_t>(CDMA_CR, control | CDMA_IOC_IRQ);
+    this->cdma.write<uint32_t>(CDMA_SA, source);
+    this->cdma.write<uint32_t>(CDMA_DA, destination);
+    this->cdma.write<uint32_t>(CDMA_BTT, num_words * sizeof(uint32_t));
+}
+
+/*
+*   Starts moving words from the buffer to the fixed QSPI_DTR address.
+*/
+void axi_cdma::start_to_fifo(unsigned long num_words){
+    start(CDMA_KEYHOLE_WRITE, this->buffer_physical, QSPI_BASE + QSPI_DTR, num_words);
+}
+
+/*
+*   Starts moving words from the fixed QSPI_DRR address to the buffer.
+*/
+void axi_cdma::start_from_fifo(unsigned long num_words){
+    start(CDMA_KEYHOLE_READ, QSPI_BASE + QSPI_DRR, this->buffer_physical, num_words);
+}
+
+/*
+*   Sleeps in poll on the UIO device until the transfer complete interrupt, ..
+*   then acknowledges it. A transfer that never completes, the engine hung ..
+*   on the bus, resets the engine after DMA_TIMEOUT_MS.
+*   @throws mem_exception : if the interrupt did not arrive in time
+*   @throws mem_exception : if the engine reported an error
+*/
+void axi_cdma::wait(){
+
+    struct pollfd interrupt = {this->uio_descriptor, POLLIN, 0};
+    int ready;
+    while((ready = poll(&interrupt, 1, DMA_TIMEOUT_MS)) == -1 && errno == EINTR){
+    }
+    if(ready == -1){
+        throw mem_exception("Failed to Wait For The DMA Interrupt", QSPI_ERROR_IO);
+    }
+    if(ready == 0){
+        this->cdma.write<uint32_t>(CDMA_CR, CDMA_RESET);
+        throw mem_exception("DMA Transfer Timed Out", QSPI_ERROR_IO);
+    }
+    uint32_t interrupts;
+    if(read(this->uio_descriptor, &interrupts, sizeof(interrupts)) != sizeof(interrupts)){
+        throw mem_exception("Failed to Wait For The DMA Interrupt", QSPI_ERROR_IO);
+    }
+    uint32_t status = this->cdma.read<uint32_t>(CDMA_SR);
+    // writing the interrupt bit back clears it
+    this->cdma.write<uint32_t>(CDMA_SR, CDMA_IOC_IRQ);
+    if(status & CDMA_ERRORS){
+        this->cdma.write<uint32_t>(CDMA_CR, CDMA_RESET);
+        throw mem_exception("DMA Transfer Error", QSPI_ERROR_IO);
+    }
+}
+
+/*
+*   Constructor for emulated_dma objects, starts the engine thread.
+*   @param qspi : the mapped QSPI controller
+*/
+emulated_dma::emulated_dma(memory_mapped_device& qspi) :
+    qspi(qspi),
+    storage(DMA_BUFFER_WORDS),
+    pending_words(0),
+    pending_to_fifo(false),
+    stopping(false)
+{
+    this->buffer = this->storage.data();
+    this->buffer_words = this->storage.size();
+    this->engine = std::thread(&emulated_dma::run, this);
+}
+
+/*
+*   Destructor for emulated_dma objects, stops the engine thread.
+*/
+emulated_dma::~emulated_dma(){
+    {
+        std::lock_guard<std::mutex> guard(this->lock);
+        this->stopping = true;
+    }
+    this->changed.notify_all();
+    this->engine.join();
+}
+
+/*
+*   @returns the name of the engine for messages.
+*/
+std::string emulated_dma::name() const{
+    return "emulated DMA";
+}
+
+/*
+*   The engine thread, copies each transfer started then signals completion.
+*/
+void emulated_dma::run(){
+
+    std::unique_lock<std::mutex> guard(this->lock);
+    while(true){
+        while(this->pending_words == 0 && !this->stopping){
+            this->changed.wait(guard);
+        }
+        if(this->stopping){
+            return;
+        }
+        for(unsigned long i = 0; i < this->pending_words; i++){
+            if(this->pending_to_fifo){
+                this->qspi.write_mem(QSPI_DTR, this->buffer[i] & 0xFF, QSPI_STD_WIDTH);
+            }
+            else{
+                this->buffer[i] = this->qspi.read_mem(QSPI_DRR, QSPI_STD_WIDTH);
+            }
+        }
+        this->pending_words = 0;
+        this->changed.notify_all();
+    }
+}
+
+/*
+*   Hands a transfer to the engine thread.
+*/
+void emulated_dma::start(unsigned long num_words, bool to_fifo){
+
+    if(num_words == 0){
+        return;
+    }
+    std::lock_guard<std::mutex> guard(this->lock);
+    this->pending_words = num_words;
+    this->pending_to_fifo = to_fifo;
+    this->changed.notify_all();
+}
+
+/*
+*   Starts copying words from the buffer to QSPI_DTR.
+*/
+void emulated_dma::start_to_fifo(unsigned long num_words){
+    start(num_words, true);
+}
+
+/*
+*   Starts copying words from QSPI_DRR to the buffer.
+*/
+void emulated_dma::start_from_fifo(unsigned long num_words){
+    start(num_words, false);
+}
+
+/*
+*   Waits for the engine thread to signal completion.
+*/
+void emulated_dma::wait(){
+
+    std::unique_lock<std::mutex> guard(this->lock);
+    while(this->pending_words != 0){
+        this->changed.wait(guard);
+    }
+}
@@ -0,0 +1,158 @@
+/*
+*   fifo_dma.h
+*   @Author Sophie Kirkham STFC, 2018
+*   Header file for the fifo_dma classes
+*   DMA engines moving page and read buffers between a physically ..
+*   contiguous buffer and the QSPI controller's FIFOs, so the CPU does not ..
+*   make one AXI access per byte through QSPI_DTR and QSPI_DRR.
+*/
+
+#ifndef FIFO_DMA_H_
+#define FIFO_DMA_H_
+
+#include <stdint.h>
+#include <poll.h>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "memory_mapped_device.h"
+#include "mapping_manager.h"
+#include "qspi_flash_defines.h"
+
+#define DMA_MIN_BYTES 16        // Transfers shorter than this are left to the CPU
+#define DMA_BUFFER_WORDS 4096   // Words in the emulated engine's buffer
+#define DMA_TIMEOUT_MS 1000     // Milliseconds a transfer may take before the engine is reset
+
+// AXI CDMA Definitions
+#define CDMA_BASE 0x7E200000    // The base address of the AXI CDMA engine
+#define CDMA_CR 0x00            // The offset address of the CDMA control reg
+#define CDMA_SR 0x04            // The offset address of the CDMA status reg
+#define CDMA_SA 0x18            // The offset address of the CDMA source address reg
+#define CDMA_DA 0x20            // The offset address of the CDMA destination address reg
+#define CDMA_BTT 0x28           // The offset address of the CDMA bytes to transfer reg, writing starts the transfer
+#define CDMA_RESET 0x00000004   // Control value to soft reset the engine
+#define CDMA_KEYHOLE_READ 0x00000010    // Control bit reading the source address without incrementing
+#define CDMA_KEYHOLE_WRITE 0x00000020   // Control bit writing the destination address without incrementing
+#define CDMA_IOC_IRQ 0x00001000 // Control bit enabling, status bit flagging, the transfer complete interrupt
+#define CDMA_IDLE 0x00000002    // Status bit set when the engine is idle
+#define CDMA_ERRORS 0x00000070  // Status bits set on an internal, slave or decode error
+#define CDMA_SIZE 0x40          // The size of the CDMA register space
+#define DMA_UIO_DEVICE "/dev/uio0"  // UIO device delivering the CDMA interrupt
+#define DMA_BUFFER_DEVICE "udmabuf0"    // udmabuf device holding the DMA buffer
+const std::string DMA_CDMA = "cdma";            // Engine name of the AXI CDMA
+const std::string DMA_EMULATED = "emulated";    // Engine name of the stand-in engine
+
+/*
+*   Interface for a DMA engine between its buffer and the QSPI FIFOs
+*   The FIFO registers take one byte per 32 bit access, so the buffer holds ..
+*   one FIFO byte in the low byte of each word. Start a transfer, then ..
+*   wait() for it to complete before touching the buffer or the controller.
+*/
+class fifo_dma{
+
+    public:
+
+        virtual ~fifo_dma(){};
+
+        /*  @returns the name of the engine for messages.
+        */
+        virtual std::string name() const = 0;
+
+        /*  Starts moving words from the start of the buffer to QSPI_DTR.
+        *   @param num_words : the number of words, at most capacity()
+        */
+        virtual void start_to_fifo(unsigned long num_words) = 0;
+
+        /*  Starts moving words from QSPI_DRR to the start of the buffer.
+        *   @param num_words : the number of words, at most capacity()
+        */
+        virtual void start_from_fifo(unsigned long num_words) = 0;
+
+        /*  Waits for the transfer to complete.
+        *   @throws mem_exception : if the engine reported an error
+        */
+        virtual void wait() = 0;
+
+        /*  @returns the buffer, as seen by the CPU.
+        */
+        uint32_t* words(){
+            return this->buffer;
+        };
+
+        /*  @returns the number of words in the buffer.
+        */
+        unsigned long capacity() const{
+            return this->buffer_words;
+        };
+
+    protected:
+
+        uint32_t* buffer;               // the DMA buffer
+        unsigned long buffer_words;     // the number of words in the buffer
+};
+
+/*
+*   Xilinx AXI CDMA in simple mode with keyhole access to the FIFO registers
+*   The buffer is a udmabuf, physically contiguous and mapped uncached, and ..
+*   the transfer complete interrupt is delivered through a UIO device.
+*/
+class axi_cdma : public fifo_dma{
+
+    public:
+
+        axi_cdma(const std::string& uio_device, const std::string& buffer_device);
+        ~axi_cdma();
+
+        std::string name() const;
+        void start_to_fifo(unsigned long num_words);
+        void start_from_fifo(unsigned long num_words);
+        void wait();
+
+    private:
+
+        register_window cdma;       // the CDMA registers
+        region_handle buffer_region;    // the udmabuf mapping
+        int uio_descriptor;         // the UIO device, read to wait for the interrupt
+        uint32_t buffer_physical;   // the physical address of the buffer
+
+        void start(uint32_t control, uint32_t source, uint32_t destination, unsigned long num_words);
+        static unsigned long long read_sysfs(const std::string& filename);
+};
+
+/*
+*   Stand-in DMA engine for testing without the CDMA
+*   An engine thread copies between an ordinary buffer and the FIFO ..
+*   registers a word at a time, as the CDMA's keyhole accesses do, and ..
+*   signals completion as the interrupt would.
+*/
+class emulated_dma : public fifo_dma{
+
+    public:
+
+        emulated_dma(memory_mapped_device& qspi);
+        ~emulated_dma();
+
+        std::string name() const;
+        void start_to_fifo(unsigned long num_words);
+        void start_from_fifo(unsigned long num_words);
+        void wait();
+
+    private:
+
+        memory_mapped_device& qspi;     // the QSPI controller the engine moves words to and from
+        std::vector<uint32_t> storage;  // the buffer
+        std::mutex lock;                // guards the transfer state
+        std::condition_variable changed;    // signals a transfer starting or completing
+        unsigned long pending_words;    // words of the transfer started, 0 when idle
+        bool pending_to_fifo;           // direction of the transfer started
+        bool stopping;                  // set to stop the engine thread
+        std::thread engine;             // the engine thread
+
+        void run();
+        void start(unsigned long num_words, bool to_fifo);
+};
+
+#endif
@@ -0,0 +1,67 @@
+/*
+*   flash_backend.h
+*   @Author Sophie Kirkham STFC, 2018
+*   Interface for the backends qspi_device can move flash data through ..
+*   instead of driving the QSPI controller's registers itself.
+*   qspi_device keeps the chip selection (the multiplexer), the CRCs, ..
+*   verification, sinks, progress and cancellation, a backend only reads, ..
+*   programs and erases the selected chip.
+*/
+
+#ifndef FLASH_BACKEND_H_
+#define FLASH_BACKEND_H_
+
+#include <stdint.h>
+#include <string>
+
+#include "mem_exception.h"
+
+class flash_backend{
+
+    public:
+
+        virtual ~flash_backend(){};
+
+        /*  @returns the name of the backend for messages.
+        */
+        virtual std::string name() const = 0;
+
+        /*  Reads bytes from the selected flash.
+        *   @param address : the flash address to read from
+        *   @param buffer : the buffer to read into, at least num_bytes long
+        *   @param num_bytes : the number of bytes to read
+        *   @throws mem_exception : if the read fails
+        */
+        virtual void read(uint32_t address, uint8_t* buffer, unsigned long num_bytes) = 0;
+
+        /*  Programs bytes within one page of the erased selected flash.
+        *   @param address : the flash address to program from
+        *   @param data : the bytes to program
+        *   @param num_bytes : the number of bytes, not crossing a page boundary
+        *   @throws mem_exception : if the program fails
+        */
+        virtual void program(uint32_t address, const uint8_t* data, unsigned long num_bytes) = 0;
+
+        /*  Starts erasing whole erase blocks of the selected flash.
+        *   A backend may finish the erase before returning.
+        *   @param address : the first address to erase, a multiple of erase_size()
+        *   @param num_bytes : the number of bytes, a multiple of erase_size()
+        *   @throws mem_exception : if the erase fails
+        */
+        virtual void start_erase(uint32_t address, unsigned long num_bytes) = 0;
+
+        /*  @returns true once the erase started by start_erase() has finished.
+        *   @throws mem_exception : if the erase failed
+        */
+        virtual bool erase_complete() = 0;
+
+        /*  @returns the size of an erase block.
+        */
+        virtual unsigned long erase_size() const = 0;
+
+        /*  @returns the size of the flash.
+        */
+        virtual unsigned long long flash_size() const = 0;
+};
+
+#endif
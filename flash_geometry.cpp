@@ -0,0 +1,192 @@
+/*
+*   flash_geometry.cpp
+*   @Author Sophie Kirkham STFC, 2018
+*   Implementation of the flash_geometry defaults and the SFDP parser
+*   Field positions follow the JEDEC basic flash parameter table, JESD216B ..
+*   DWORDs 1 to 11 are used, later revisions only append DWORDs.
+*/
+
+#include <string.h>
+#include <sstream>
+#include <iomanip>
+
+#include "flash_geometry.h"
+#include "qspi_flash_defines.h"
+
+/*
+*   @returns the geometry of the S25FL512S the driver was written for, ..
+*   used when a device has no usable SFDP or is driven through a backend.
+*/
+flash_geometry default_geometry(){
+
+    flash_geometry geometry;
+    memset(geometry.jedec_id, 0xFF, sizeof(geometry.jedec_id));
+    geometry.from_sfdp = false;
+    geometry.size = SIXTY_FOUR_MB;
+    geometry.page_size = PAGE_SIZE;
+    geometry.sector_size = SECTOR_SIZE;
+    geometry.read_opcode = FL_READ_QUAD_OUT;
+    geometry.read_dummy_bytes = PREAMBLE_SIZE - 5;
+    geometry.program_opcode = FL_QUAD_PP;
+    geometry.sector_erase_opcode = FL_SECTOR_ERASE;
+    geometry.bulk_erase_opcode = FL_BULK_ERASE;
+    geometry.page_program_ns = 0;
+    geometry.sector_erase_ns = 0;
+    geometry.bulk_erase_ns = 0;
+    return geometry;
+}
+
+/*
+*   Converts a three byte address opcode to its four byte address form.
+*   @param opcode : the opcode given in the SFDP
+*   @returns the four byte address opcode, the opcode itself if it has none.
+*/
+uint8_t four_byte_opcode(uint8_t opcode){
+
+    switch(opcode){
+        case 0x03: return 0x13;     // read
+        case 0x0B: return 0x0C;     // fast read
+        case 0x3B: return 0x3C;     // dual output read
+        case 0xBB: return 0xBC;     // dual I/O read
+        case 0x6B: return 0x6C;     // quad output read
+        case 0xEB: return 0xEC;     // quad I/O read
+        case 0x02: return 0x12;     // page program
+        case 0x32: return 0x34;     // quad page program
+        case 0x20: return 0x21;     // 4KB erase
+        case 0xD8: return 0xDC;     // sector erase
+        default: return opcode;
+    }
+}
+
+/*
+*   Checks the SFDP signature and counts the parameter headers after it.
+*   @param header : the first SFDP_HEADER_SIZE bytes of the SFDP
+*   @throws mem_exception : if the signature is missing, the device has no SFDP
+*   @returns the number of parameter headers, at most SFDP_MAX_HEADERS.
+*/
+unsigned sfdp_parameter_headers(const uint8_t* header){
+
+    if(memcmp(header, "SFDP", 4) != 0){
+        throw mem_exception("Flash Device Has No SFDP Signature", QSPI_ERROR_INVALID_ARGUMENT);
+    }
+    // the header holds the count less one
+    unsigned count = header[6] + 1;
+    return (count > SFDP_MAX_HEADERS) ? SFDP_MAX_HEADERS : count;
+}
+
+/*
+*   Finds the JEDEC basic flash parameter table among the parameter headers.
+*   The newest revision is used if a device lists more than one.
+*   @param headers : the parameter headers, SFDP_HEADER_SIZE bytes each
+*   @param count : the number of parameter headers
+*   @param address : set to the SFDP address of the table
+*   @param dwords : set to the length of the table in DWORDs, at most SFDP_MAX_DWORDS
+*   @returns true if the table was found.
+*/
+bool find_basic_table(const uint8_t* headers, unsigned count, uint32_t& address, unsigned& dwords){
+
+    int best_revision = -1;
+    for(unsigned i = 0; i < count; i++){
+        const uint8_t* header = headers + i * SFDP_HEADER_SIZE;
+        // the basic table has ID 0xFF00, split across the first and last bytes
+        if(header[0] != 0x00 || header[7] != 0xFF){
+            continue;
+        }
+        int revision = (header[2] << 8) | header[1];
+        if(revision <= best_revision || header[3] < SFDP_MIN_DWORDS){
+            continue;
+        }
+        best_revision = revision;
+        address = header[4] | (header[5] << 8) | (header[6] << 16);
+        dwords = (header[3] > SFDP_MAX_DWORDS) ? SFDP_MAX_DWORDS : header[3];
+    }
+    return best_revision >= 0;
+}
+
+/*
+*   Fills a geometry from the basic flash parameter table.
+*   Fields the table leaves out keep the values already in the geometry. ..
+*   The quad output read is used, the FIFO engine shifts the address out ..
+*   on one line so a quad I/O read gains nothing.
+*   @param dwords : the table, DWORD 1 first
+*   @param geometry : the geometry to fill
+*   @throws mem_exception : if the table is too short or describes a device the engines can not drive
+*/
+void parse_basic_table(const std::vector<uint32_t>& dwords, flash_geometry& geometry){
+
+    if(dwords.size() < SFDP_MIN_DWORDS){
+        throw mem_exception("SFDP Basic Flash Parameter Table Too Short", QSPI_ERROR_INVALID_ARGUMENT);
+    }
+    // DWORD 2 : density in bits, 2^N bits if the top bit is set
+    uint32_t density = dwords[1];
+    unsigned long long size = ((unsigned long long)density + 1) / 8;
+    if(density & 0x80000000){
+        uint32_t exponent = density & 0x7FFFFFFF;
+        size = (exponent >= 3 && exponent < 64 + 3) ? (1ULL << (exponent - 3)) : 0;
+    }
+    if(size == 0){
+        throw mem_exception("SFDP Gives A Flash Size Of 0", QSPI_ERROR_INVALID_ARGUMENT);
+    }
+    geometry.size = size;
+
+    // DWORD 1 bit 22 and DWORD 3 high half : the 1-1-4 fast read
+    if(dwords[0] & (1 << 22)){
+        unsigned cycles = ((dwords[2] >> 16) & 0x1F) + ((dwords[2] >> 21) & 0x07);
+        geometry.read_opcode = four_byte_opcode((dwords[2] >> 24) & 0xFF);
+        // the wait cycles are clocked on four lines, two to a byte
+        geometry.read_dummy_bytes = (cycles + 1) / 2;
+    }
+
+    // DWORDs 8 and 9 : up to four erase types, the largest is the sector erase
+    unsigned largest = 0;
+    for(int i = 0; i < 4; i++){
+        uint32_t type = (dwords[7 + i / 2] >> (16 * (i % 2))) & 0xFFFF;
+        unsigned exponent = type & 0xFF;
+        if(exponent == 0 || exponent >= 32 || exponent <= largest){
+            continue;
+        }
+        largest = exponent;
+        geometry.sector_size = 1UL << exponent;
+        geometry.sector_erase_opcode = four_byte_opcode(type >> 8);
+        // DWORD 10 : typical time of each erase type
+        if(dwords.size() > 9){
+            static const uint64_t erase_units[4] = {1000000ULL, 16000000ULL, 128000000ULL, 1000000000ULL};
+            uint32_t time = (dwords[9] >> (4 + 7 * i)) & 0x7F;
+            geometry.sector_erase_ns = ((time & 0x1F) + 1) * erase_units[time >> 5];
+        }
+    }
+
+    // DWORD 11 : page size, typical page program and chip erase times
+    if(dwords.size() > 10){
+        unsigned long page_size = 1UL << ((dwords[10] >> 4) & 0x0F);
+        if(page_size > MAX_PAGE_SIZE){
+            throw mem_exception("SFDP Gives A Page Size The Engines Can Not Program", QSPI_ERROR_INVALID_ARGUMENT);
+        }
+        geometry.page_size = page_size;
+        uint64_t program_unit = (dwords[10] & (1 << 13)) ? 64000ULL : 8000ULL;
+        geometry.page_program_ns = (((dwords[10] >> 8) & 0x1F) + 1) * program_unit;
+        static const uint64_t chip_units[4] = {16000000ULL, 256000000ULL, 4000000000ULL, 64000000000ULL};
+        geometry.bulk_erase_ns = (((dwords[10] >> 24) & 0x1F) + 1) * chip_units[(dwords[10] >> 29) & 0x03];
+    }
+    geometry.from_sfdp = true;
+}
+
+/*
+*   @returns the geometry as lines of text, for the status operation.
+*/
+std::string describe_geometry(const flash_geometry& geometry){
+
+    std::ostringstream text;
+    text << "JEDEC ID : " << std::hex << std::setfill('0');
+    for(int i = 0; i < JEDEC_ID_SIZE; i++){
+        text << std::setw(2) << (int)geometry.jedec_id[i] << (i + 1 < JEDEC_ID_SIZE ? " " : "");
+    }
+    text << std::dec << std::setfill(' ') << (geometry.from_sfdp ? ", geometry from SFDP" : ", no SFDP, geometry from defaults")
+    << std::endl << "Size : " << geometry.size << " bytes, page : " << geometry.page_size << " bytes, sector : "
+    << geometry.sector_size << " bytes" << std::endl << std::hex << "Read : 0x" << (int)geometry.read_opcode << std::dec
+    << " with " << geometry.read_dummy_bytes << " dummy bytes, program : 0x" << std::hex << (int)geometry.program_opcode
+    << ", sector erase : 0x" << (int)geometry.sector_erase_opcode << ", bulk erase : 0x" << (int)geometry.bulk_erase_opcode
+    << std::dec << std::endl << "Typical times : page program " << geometry.page_program_ns / 1000.0 << " us, sector erase "
+    << geometry.sector_erase_ns / 1000000.0 << " ms, bulk erase " << geometry.bulk_erase_ns / 1000000000.0 << " s";
+    return text.str();
+}
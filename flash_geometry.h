@@ -0,0 +1,62 @@
+/*
+*   flash_geometry.h
+*   @Author Sophie Kirkham STFC, 2018
+*   Header file for the flash_geometry table and the SFDP parser
+*   The geometry and command set of a flash device: its size, page and ..
+*   sector sizes, the opcodes the read, program and erase engines issue ..
+*   and the typical time of each operation. Parsed from the JEDEC basic ..
+*   flash parameter table (JESD216) a device returns to the Read SFDP ..
+*   instruction, the defines in qspi_flash_defines.h otherwise.
+*   The driver addresses the flash with four bytes, opcodes the table ..
+*   gives for three byte addressing are swapped for their four byte forms.
+*/
+
+#ifndef FLASH_GEOMETRY_H_
+#define FLASH_GEOMETRY_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "mem_exception.h"
+
+#define FL_READ_JEDEC_ID 0x9F   // Instruction code to read the JEDEC manufacturer and device ID
+#define FL_READ_SFDP 0x5A       // Instruction code to read the serial flash discoverable parameters
+#define JEDEC_ID_SIZE 6         // Bytes of JEDEC ID read, manufacturer, type, capacity and extended ID
+#define SFDP_HEADER_SIZE 8      // Size of the SFDP header and of each parameter header
+#define SFDP_MAX_HEADERS 8      // Most parameter headers searched for the basic flash parameter table
+#define SFDP_MAX_DWORDS 23      // Most DWORDs of the basic flash parameter table read (JESD216D)
+#define SFDP_MIN_DWORDS 9       // Fewest DWORDs of a usable basic flash parameter table (JESD216)
+#define MAX_PAGE_SIZE 4096      // Largest program page the engines accept
+
+struct flash_geometry{
+    uint8_t jedec_id[JEDEC_ID_SIZE];    // manufacturer, type, capacity, extended ID, 0xFF if unread
+    bool from_sfdp;             // true if parsed from the device's SFDP, false for the defaults
+    unsigned long long size;    // size of the flash array in bytes
+    unsigned long page_size;    // bytes programmed in one page program
+    unsigned long sector_size;  // bytes cleared by one sector erase
+    uint8_t read_opcode;        // four byte address quad output read
+    unsigned read_dummy_bytes;  // dummy bytes clocked between the address and the data
+    uint8_t program_opcode;     // four byte address quad page program
+    uint8_t sector_erase_opcode;    // four byte address sector erase
+    uint8_t bulk_erase_opcode;  // whole chip erase
+    uint64_t page_program_ns;   // typical page program time, 0 if unknown
+    uint64_t sector_erase_ns;   // typical sector erase time, 0 if unknown
+    uint64_t bulk_erase_ns;     // typical whole chip erase time, 0 if unknown
+
+    /*  @returns the bytes received before the data of a read, the ..
+    *   opcode, four address bytes and the dummy bytes.
+    */
+    unsigned read_preamble() const{
+        return 5 + this->read_dummy_bytes;
+    };
+};
+
+flash_geometry default_geometry();
+uint8_t four_byte_opcode(uint8_t opcode);
+unsigned sfdp_parameter_headers(const uint8_t* header);
+bool find_basic_table(const uint8_t* headers, unsigned count, uint32_t& address, unsigned& dwords);
+void parse_basic_table(const std::vector<uint32_t>& dwords, flash_geometry& geometry);
+std::string describe_geometry(const flash_geometry& geometry);
+
+#endif
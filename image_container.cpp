@@ -0,0 +1,391 @@
+/*
+*   image_container.cpp
+*   @Author Sophie Kirkham STFC, 2018
+*   Implementation of the image_container class and the image packer
+*   The packer splits each raw image on aligned blocks holding only the ..
+*   fill value, so the gaps of a sparse layout are left out of the container.
+*/
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <fstream>
+#include <memory>
+#include <algorithm>
+
+#include "image_container.h"
+#include "qspi_flash_defines.h"
+
+namespace{
+
+// a run of an input image to store as one segment
+struct pending_segment{
+    uint64_t offset;        // flash offset of the run
+    const uint8_t* data;    // the bytes of the run, in the mapped input
+    uint64_t length;        // bytes in the run
+};
+
+/*
+*   @returns the CRC-32 of a buffer, continuing from crc.
+*/
+uint32_t crc32_bytes(uint32_t crc, const uint8_t* data, uint64_t num_bytes){
+    while(num_bytes > 0){
+        uInt chunk = (uInt)std::min(num_bytes, (uint64_t)STREAM_BLOCK_SIZE);
+        crc = crc32(crc, data, chunk);
+        data += chunk;
+        num_bytes -= chunk;
+    }
+    return crc;
+}
+
+/*
+*   Writes a whole buffer to a file at an offset.
+*   @throws mem_exception : if the write fails
+*/
+void write_at(int fd, const void* data, uint64_t num_bytes, off_t offset){
+    const char* bytes = (const char*)data;
+    while(num_bytes > 0){
+        ssize_t count = pwrite(fd, bytes, num_bytes, offset);
+        if(count < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            throw mem_exception("Failed to Write Image Container", QSPI_ERROR_IO);
+        }
+        bytes += count;
+        offset += count;
+        num_bytes -= count;
+    }
+}
+
+/*
+*   @returns true if every byte of a buffer is the fill value.
+*/
+bool is_fill(const uint8_t* data, unsigned long num_bytes, uint8_t fill){
+    for(unsigned long i = 0; i < num_bytes; i++){
+        if(data[i] != fill){
+            return false;
+        }
+    }
+    return true;
+}
+
+}
+
+/*
+*   Constructor for image_container objects, no container is open until open().
+*/
+image_container::image_container(){
+    memset(&this->header, 0, sizeof(this->header));
+}
+
+/*
+*   Maps a container and checks its header and segment table
+*   The CRC-32 of each segment is checked by check_segment().
+*   @param filename : the container to open
+*   @throws mem_exception : if the file fails to open
+*   @throws mem_exception : if the file is not a container of this version, ..
+*   or a segment overlaps another, lies outside the layout or the file
+*   @throws mem_exception : if a segment is stored with a codec not built in
+*/
+void image_container::open(const std::string& filename){
+
+    this->close();
+    this->file.open(filename);
+    const uint8_t* data = this->file.data();
+    unsigned long size = this->file.size();
+
+    if(!is_image_container(data, size) || size < sizeof(this->header)){
+        this->close();
+        throw mem_exception(filename + " Is Not An Image Container", QSPI_ERROR_INVALID_ARGUMENT);
+    }
+    memcpy(&this->header, data, sizeof(this->header));
+    if(this->header.version != IMAGE_CONTAINER_VERSION){
+        this->close();
+        throw mem_exception(filename + " Is An Image Container Of An Unsupported Version", QSPI_ERROR_INVALID_ARGUMENT);
+    }
+    if(this->header.num_segments > IMAGE_MAX_SEGMENTS ||
+        size < sizeof(this->header) + (uint64_t)this->header.num_segments * sizeof(image_segment)){
+        this->close();
+        throw mem_exception("Image Container Segment Table Is Truncated", QSPI_ERROR_INVALID_ARGUMENT);
+    }
+    this->table.resize(this->header.num_segments);
+    if(!this->table.empty()){
+        memcpy(&this->table[0], data + sizeof(this->header), this->table.size() * sizeof(image_segment));
+    }
+
+    uint64_t previous_end = 0;
+    for(unsigned long i = 0; i < this->table.size(); i++){
+        const image_segment& segment = this->table[i];
+        std::string error;
+        if(segment.length == 0 || segment.offset < previous_end){
+            error = "Image Container Segments Are Empty, Unsorted Or Overlap";
+        }
+        else if(segment.offset + segment.length > this->header.image_size || segment.offset + segment.length < segment.offset){
+            error = "Image Container Segment Lies Outside The Image";
+        }
+        else if(segment.data_offset > size || segment.stored_size > size - segment.data_offset){
+            error = "Image Container Segment Data Is Truncated";
+        }
+        else if(segment.codec > CODEC_LZ4 || (segment.codec == CODEC_NONE && segment.stored_size != segment.length)){
+            error = "Image Container Segment Has An Unknown Codec";
+        }
+        if(!error.empty()){
+            this->close();
+            throw mem_exception(error, QSPI_ERROR_INVALID_ARGUMENT);
+        }
+        if(!codec_supported((compression_codec)segment.codec)){
+            this->close();
+            throw mem_exception("Driver Built Without " + codec_name((compression_codec)segment.codec) + " Support",
+                                QSPI_ERROR_INVALID_ARGUMENT);
+        }
+        previous_end = segment.offset + segment.length;
+    }
+}
+
+/*
+*   Un-maps the container, safe to call when not open.
+*/
+void image_container::close(){
+    this->table.clear();
+    memset(&this->header, 0, sizeof(this->header));
+    this->file.close();
+}
+
+/*
+*   @returns the value of the bytes between segments.
+*/
+uint8_t image_container::fill(){
+    return this->header.fill;
+}
+
+/*
+*   @returns the bytes of flash the layout spans, from offset 0.
+*/
+unsigned long long image_container::image_size(){
+    return this->header.image_size;
+}
+
+/*
+*   @returns the bytes held by the segments.
+*/
+unsigned long long image_container::populated_bytes(){
+    unsigned long long total = 0;
+    for(unsigned long i = 0; i < this->table.size(); i++){
+        total += this->table[i].length;
+    }
+    return total;
+}
+
+/*
+*   @returns the segments, sorted by flash offset.
+*/
+const std::vector<image_segment>& image_container::segments(){
+    return this->table;
+}
+
+/*
+*   @returns the runs of the layout not covered by a segment, sorted by ..
+*   flash offset, including any before the first and after the last.
+*/
+std::vector<image_gap> image_container::gaps(){
+    std::vector<image_gap> runs;
+    uint64_t position = 0;
+    for(unsigned long i = 0; i <= this->table.size(); i++){
+        uint64_t end = (i < this->table.size()) ? this->table[i].offset : this->header.image_size;
+        if(end > position){
+            image_gap gap = {position, end - position};
+            runs.push_back(gap);
+        }
+        if(i < this->table.size()){
+            position = this->table[i].offset + this->table[i].length;
+        }
+    }
+    return runs;
+}
+
+/*
+*   Opens the uncompressed bytes of a segment
+*   A stored segment is read straight from the mapping and can be byte ..
+*   compared, a compressed one is decompressed on a reader thread.
+*   @param index : the segment
+*   @returns the image source, owned by the caller.
+*/
+image_source* image_container::segment_source(unsigned long index){
+
+    const image_segment& segment = this->table.at(index);
+    const uint8_t* data = this->file.data() + segment.data_offset;
+    if(segment.codec == CODEC_NONE){
+        return new memory_source(data, segment.length);
+    }
+    return new decompress_source(data, segment.stored_size);
+}
+
+/*
+*   Checks the bytes of a segment against its CRC-32, before any are programmed.
+*   @param index : the segment
+*   @throws mem_exception : if the bytes do not match, or a compressed segment ends early
+*/
+void image_container::check_segment(unsigned long index){
+
+    const image_segment& segment = this->table.at(index);
+    uint32_t crc = crc32(0L, Z_NULL, 0);
+    if(segment.codec == CODEC_NONE){
+        crc = crc32_bytes(crc, this->file.data() + segment.data_offset, segment.length);
+    }
+    else{
+        std::unique_ptr<image_source> source(segment_source(index));
+        uint64_t checked = 0;
+        while(checked < segment.length){
+            unsigned long chunk = std::min(segment.length - checked, (uint64_t)STREAM_BLOCK_SIZE);
+            crc = crc32_bytes(crc, source->next(chunk), chunk);
+            checked += chunk;
+        }
+    }
+    if(crc != segment.crc){
+        throw mem_exception("Image Container Segment Fails Its CRC-32", QSPI_ERROR_IO);
+    }
+}
+
+/*
+*   @returns true if the bytes start with the container magic.
+*/
+bool is_image_container(const uint8_t* data, unsigned long num_bytes){
+    return data != NULL && num_bytes >= 8 && memcmp(data, IMAGE_CONTAINER_MAGIC, 8) == 0;
+}
+
+/*
+*   @returns true if the file is an image container, false for stdin or a raw image.
+*/
+bool is_image_container(const std::string& filename){
+
+    if(filename.compare(STREAM_NAME) == 0){
+        return false;
+    }
+    std::ifstream file(filename.c_str(), std::ios::binary);
+    uint8_t magic[8];
+    if(!file.read((char*)magic, sizeof(magic))){
+        return false;
+    }
+    return is_image_container(magic, sizeof(magic));
+}
+
+/*
+*   Packs raw images into a container
+*   Each image is split on PACK_BLOCK_SIZE blocks, aligned to the flash, ..
+*   that hold only the fill value, the rest become segments. The layout ..
+*   spans the flash up to the end of the last image.
+*   @param filename : the container to write
+*   @param inputs : the raw images and the flash offsets they are packed at
+*   @param fill : the value of the bytes left out
+*   @param codec : the codec to store the segments with, CODEC_NONE to store them as is
+*   @param level : the compression level
+*   @throws mem_exception : if an image fails to open, or images overlap
+*   @throws mem_exception : if the layout is larger than the 4 byte flash address space
+*   @throws mem_exception : if the container fails to write
+*/
+void pack_image(const std::string& filename, const std::vector<pack_input>& inputs, uint8_t fill,
+                compression_codec codec, int level){
+
+    // map every image, kept open until its bytes are written
+    std::vector<std::unique_ptr<mapped_file> > files;
+    std::vector<std::pair<uint64_t, uint64_t> > extents;
+    std::vector<pending_segment> pending;
+    uint64_t image_size = 0;
+    for(unsigned long i = 0; i < inputs.size(); i++){
+        files.push_back(std::unique_ptr<mapped_file>(new mapped_file()));
+        files.back()->open(inputs[i].filename);
+        const uint8_t* data = files.back()->data();
+        uint64_t size = files.back()->size();
+        uint64_t offset = inputs[i].offset;
+        extents.push_back(std::make_pair(offset, offset + size));
+        image_size = std::max(image_size, offset + size);
+
+        // runs of blocks holding data become segments
+        uint64_t position = 0;
+        bool open_run = false;
+        while(position < size){
+            uint64_t block = std::min(size - position, PACK_BLOCK_SIZE - (offset + position) % PACK_BLOCK_SIZE);
+            if(is_fill(data + position, block, fill)){
+                open_run = false;
+            }
+            else if(open_run){
+                pending.back().length += block;
+            }
+            else{
+                pending_segment segment = {offset + position, data + position, block};
+                pending.push_back(segment);
+                open_run = true;
+            }
+            position += block;
+        }
+    }
+    if(image_size > 0x100000000ULL){
+        throw mem_exception("Packed Images Extend Past The 4 Byte Address Space", QSPI_ERROR_INVALID_ARGUMENT);
+    }
+    std::sort(extents.begin(), extents.end());
+    for(unsigned long i = 1; i < extents.size(); i++){
+        if(extents[i].first < extents[i - 1].second){
+            throw mem_exception("Packed Images Overlap", QSPI_ERROR_INVALID_ARGUMENT);
+        }
+    }
+    std::sort(pending.begin(), pending.end(),
+            [](const pending_segment& a, const pending_segment& b){ return a.offset < b.offset; });
+    if(pending.size() > IMAGE_MAX_SEGMENTS){
+        throw mem_exception("Packed Images Split Into Too Many Segments", QSPI_ERROR_INVALID_ARGUMENT);
+    }
+
+    int fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd == -1){
+        throw mem_exception("Failed to Open Image Container " + filename, QSPI_ERROR_IO);
+    }
+    try{
+        // the segment data follows the header and table, written once the sizes are known
+        image_container_header header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, IMAGE_CONTAINER_MAGIC, sizeof(header.magic));
+        header.version = IMAGE_CONTAINER_VERSION;
+        header.num_segments = pending.size();
+        header.image_size = image_size;
+        header.fill = fill;
+        std::vector<image_segment> table(pending.size());
+        off_t position = sizeof(header) + table.size() * sizeof(image_segment);
+
+        for(unsigned long i = 0; i < pending.size(); i++){
+            image_segment& segment = table[i];
+            segment.offset = pending[i].offset;
+            segment.length = pending[i].length;
+            segment.data_offset = position;
+            segment.codec = codec;
+            segment.crc = crc32_bytes(crc32(0L, Z_NULL, 0), pending[i].data, pending[i].length);
+            if(codec == CODEC_NONE){
+                write_at(fd, pending[i].data, pending[i].length, position);
+                segment.stored_size = pending[i].length;
+            }
+            else{
+                // each segment is its own compressed stream, appended at the file offset
+                if(lseek(fd, position, SEEK_SET) == (off_t)-1){
+                    throw mem_exception("Failed to Write Image Container", QSPI_ERROR_IO);
+                }
+                compress_sink sink(fd, false, codec, level);
+                sink.write(pending[i].data, pending[i].length);
+                sink.close();
+                segment.stored_size = sink.compressed_bytes();
+            }
+            position += segment.stored_size;
+        }
+        write_at(fd, &header, sizeof(header), 0);
+        if(!table.empty()){
+            write_at(fd, &table[0], table.size() * sizeof(image_segment), sizeof(header));
+        }
+    }
+    catch(mem_exception& err){
+        ::close(fd);
+        unlink(filename.c_str());
+        throw;
+    }
+    if(::close(fd) != 0){
+        throw mem_exception("Failed to Write Image Container", QSPI_ERROR_IO);
+    }
+}
@@ -0,0 +1,99 @@
+/*
+*   image_container.h
+*   @Author Sophie Kirkham STFC, 2018
+*   Header file for the image_container class and the image packer
+*   An image container describes a sparse flash layout as a list of ..
+*   segments, each a flash offset, a length, the codec its bytes are ..
+*   stored with and a CRC-32 of its uncompressed bytes, followed by the ..
+*   stored bytes of every segment. The flash between segments holds the ..
+*   fill value, it is erased with the rest of the layout and only ..
+*   programmed when the fill is not the erased value 0xFF, so a chip ..
+*   holding a few small partitions programs in the time of its data.
+*   The file starts with the header, then the segment table, then the ..
+*   segment data. Fields are little endian, as written by the host.
+*/
+
+#ifndef IMAGE_CONTAINER_H_
+#define IMAGE_CONTAINER_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "mapped_file.h"
+#include "image_source.h"
+#include "compression.h"
+#include "mem_exception.h"
+
+#define IMAGE_CONTAINER_MAGIC "QSPIIMG1"    // First 8 bytes of an image container
+#define IMAGE_CONTAINER_VERSION 1           // Incremented when the header or segment layout changes
+#define IMAGE_MAX_SEGMENTS 65536            // Most segments a container may list
+#define PACK_BLOCK_SIZE 4096    // Aligned blocks of this size holding only the fill value are left out
+#define PACK_DEFAULT_FILL 0xFF  // Fill value of the gaps, the erased value of the flash
+
+struct image_container_header{
+    char magic[8];          // IMAGE_CONTAINER_MAGIC
+    uint32_t version;       // IMAGE_CONTAINER_VERSION
+    uint32_t num_segments;  // entries in the segment table
+    uint64_t image_size;    // bytes of flash the layout spans, from offset 0
+    uint8_t fill;           // value of the bytes between segments
+    uint8_t reserved[7];    // 0
+};
+
+struct image_segment{
+    uint64_t offset;        // flash offset of the segment
+    uint64_t length;        // uncompressed bytes of the segment
+    uint64_t data_offset;   // file offset of the stored bytes
+    uint64_t stored_size;   // stored bytes of the segment
+    uint32_t codec;         // compression_codec the bytes are stored with
+    uint32_t crc;           // CRC-32 of the uncompressed bytes
+};
+
+/*
+*   A run of the layout between segments, holding the fill value.
+*/
+struct image_gap{
+    uint64_t offset;        // flash offset of the gap
+    uint64_t length;        // bytes in the gap
+};
+
+/*
+*   A raw .bin file and the flash offset it is packed at.
+*/
+struct pack_input{
+    std::string filename;   // the raw image
+    uint64_t offset;        // flash offset of its first byte
+};
+
+/*
+*   A mapped image container, opened to program or verify its segments.
+*/
+class image_container{
+
+    public:
+
+        image_container();
+        ~image_container(){};
+        void open(const std::string& filename);
+        void close();
+        uint8_t fill();
+        unsigned long long image_size();
+        unsigned long long populated_bytes();
+        const std::vector<image_segment>& segments();
+        std::vector<image_gap> gaps();
+        image_source* segment_source(unsigned long index);
+        void check_segment(unsigned long index);
+
+    private:
+
+        mapped_file file;       // the mapped container
+        image_container_header header;  // the header of the container
+        std::vector<image_segment> table;   // the segments, sorted by offset
+};
+
+bool is_image_container(const uint8_t* data, unsigned long num_bytes);
+bool is_image_container(const std::string& filename);
+void pack_image(const std::string& filename, const std::vector<pack_input>& inputs, uint8_t fill,
+                compression_codec codec, int level);
+
+#endif
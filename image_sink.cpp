@@ -0,0 +1,360 @@
+/*
+*   image_sink.cpp
+*   @Author Sophie Kirkham STFC, 2018
+*   Implementation of the image_sink classes
+*   Writes bytes read from the flash memory to a file or stdout, ..
+*   optionally as a sparse file with the erased blocks left as holes.
+*/
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+
+#include "image_sink.h"
+#include "realtime.h"
+#include "qspi_flash_defines.h"
+
+/*
+*   Constructor for buffer_sink objects.
+*   @param buffer : the buffer to write to, owned by the caller
+*   @param capacity : the size of the buffer
+*/
+buffer_sink::buffer_sink(uint8_t* buffer, unsigned long capacity) :
+    buffer(buffer),
+    capacity(capacity),
+    offset(0)
+{}
+
+/*
+*   Copies bytes to the buffer.
+*   @param data : the bytes to append
+*   @param num_bytes : the number of bytes to append
+*   @throws mem_exception : if the buffer is full
+*/
+void buffer_sink::write(const uint8_t* data, unsigned long num_bytes){
+
+    if(this->offset + num_bytes > this->capacity){
+        throw mem_exception("Read Overflows the Buffer.", QSPI_ERROR_INVALID_ARGUMENT);
+    }
+    memcpy(this->buffer + this->offset, data, num_bytes);
+    this->offset += num_bytes;
+}
+
+/*
+*   Nothing to flush, the bytes are already in the buffer.
+*/
+void buffer_sink::close(){
+}
+
+/*
+*   Constructor for stream_sink objects, starts the writer thread.
+*   @param file_descriptor : the file descriptor to write the bytes to
+*   @param owns_descriptor : true if the descriptor is closed by close()
+*/
+stream_sink::stream_sink(int file_descriptor, bool owns_descriptor) :
+    file_descriptor(file_descriptor),
+    owns_descriptor(owns_descriptor),
+    blocks(SINK_BLOCK_COUNT),
+    closing(false),
+    closed(false),
+    error_code(QSPI_OK),
+    current(-1)
+{
+    for(int i = 0; i < SINK_BLOCK_COUNT; i++){
+        this->blocks[i].data.resize(SINK_BLOCK_SIZE);
+        this->blocks[i].size = 0;
+        this->free_blocks.push_back(i);
+    }
+    this->start();
+}
+
+/*
+*   Destructor for stream_sink objects.
+*   Stops the writer thread, errors are only reported through close().
+*/
+stream_sink::~stream_sink(){
+
+    try{
+        this->close();
+    }
+    catch(mem_exception& err){
+    }
+}
+
+/*
+*   Opens an output file for writing, "-" selects stdout.
+*   @param filename : the name of the file to write to
+*   @throws mem_exception : if the file fails to open
+*   @returns the file descriptor.
+*/
+int stream_sink::open_output(const std::string& filename){
+
+    if(filename.compare(STREAM_NAME) == 0){
+        return STDOUT_FILENO;
+    }
+    int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd == -1){
+        throw mem_exception("Failed to Open .bin File", QSPI_ERROR_IO);
+    }
+    return fd;
+}
+
+/*
+*   Starts the writer thread.
+*/
+void stream_sink::start(){
+    this->writer = std::thread(&stream_sink::write_loop, this);
+}
+
+/*
+*   @returns the number of blocks waiting for the writer thread.
+*/
+unsigned long stream_sink::queued_blocks(){
+    std::lock_guard<std::mutex> guard(this->lock);
+    return this->full_blocks.size();
+}
+
+/*
+*   Writes bytes to the file descriptor, retrying short writes.
+*   @param data : the bytes to write
+*   @param num_bytes : the number of bytes to write
+*   @throws mem_exception : if the write fails
+*/
+void stream_sink::write_out(const uint8_t* data, unsigned long num_bytes){
+
+    unsigned long written = 0;
+    while(written < num_bytes){
+        ssize_t count = ::write(this->file_descriptor, data + written, num_bytes - written);
+        if(count < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            throw mem_exception("Failed to Write Bytes to Output.", QSPI_ERROR_IO);
+        }
+        written += count;
+    }
+}
+
+/*
+*   Writes one queued block, called on the writer thread.
+*   @param data : the bytes of the block
+*   @param num_bytes : the number of bytes in the block
+*/
+void stream_sink::drain(const uint8_t* data, unsigned long num_bytes){
+    write_out(data, num_bytes);
+}
+
+/*
+*   Called on the writer thread once every block has been drained.
+*/
+void stream_sink::finish(){
+}
+
+/*
+*   Writer thread body, drains full blocks until the sink is closed.
+*/
+void stream_sink::write_loop(){
+
+    enter_background();
+    while(true){
+
+        int index;
+        {
+            // wait for a block to write
+            std::unique_lock<std::mutex> guard(this->lock);
+            while(this->full_blocks.empty() && !this->closing){
+                this->changed.wait(guard);
+            }
+            if(this->full_blocks.empty()){
+                break;
+            }
+            index = this->full_blocks.front();
+        }
+
+        try{
+            // after an error blocks are discarded so the producer never stalls
+            if(this->error.empty()){
+                drain(&this->blocks[index].data[0], this->blocks[index].size);
+            }
+        }
+        catch(mem_exception& err){
+            std::lock_guard<std::mutex> guard(this->lock);
+            this->error = err.what();
+            this->error_code = err.code();
+        }
+
+        std::lock_guard<std::mutex> guard(this->lock);
+        this->full_blocks.pop_front();
+        this->free_blocks.push_back(index);
+        this->changed.notify_all();
+    }
+
+    try{
+        if(this->error.empty()){
+            finish();
+        }
+    }
+    catch(mem_exception& err){
+        std::lock_guard<std::mutex> guard(this->lock);
+        this->error = err.what();
+        this->error_code = err.code();
+    }
+}
+
+/*
+*   Queues the block being filled for the writer thread.
+*/
+void stream_sink::queue_current(){
+
+    if(this->current == -1){
+        return;
+    }
+    std::lock_guard<std::mutex> guard(this->lock);
+    this->full_blocks.push_back(this->current);
+    this->current = -1;
+    this->changed.notify_all();
+}
+
+/*
+*   Appends bytes to the current block, queueing blocks as they fill.
+*   Waits for the writer when every block is queued, bounding memory.
+*   @param data : the bytes to append
+*   @param num_bytes : the number of bytes to append
+*   @throws mem_exception : if the writer thread has failed
+*/
+void stream_sink::write(const uint8_t* data, unsigned long num_bytes){
+
+    unsigned long copied = 0;
+    while(copied < num_bytes){
+
+        if(this->current == -1){
+            std::unique_lock<std::mutex> guard(this->lock);
+            while(this->free_blocks.empty()){
+                this->changed.wait(guard);
+            }
+            if(!this->error.empty()){
+                throw mem_exception(this->error, this->error_code);
+            }
+            this->current = this->free_blocks.front();
+            this->free_blocks.pop_front();
+            this->blocks[this->current].size = 0;
+        }
+
+        block& current_block = this->blocks[this->current];
+        unsigned long chunk = std::min(num_bytes - copied, SINK_BLOCK_SIZE - current_block.size);
+        memcpy(&current_block.data[current_block.size], data + copied, chunk);
+        current_block.size += chunk;
+        copied += chunk;
+
+        if(current_block.size == SINK_BLOCK_SIZE){
+            queue_current();
+        }
+    }
+}
+
+/*
+*   Queues the last partial block, waits for the writer to drain every ..
+*   block and closes the descriptor if owned.
+*   @throws mem_exception : if any bytes failed to be written
+*/
+void stream_sink::close(){
+
+    if(this->closed){
+        return;
+    }
+    this->closed = true;
+
+    if(this->current != -1 && this->blocks[this->current].size > 0){
+        queue_current();
+    }
+    {
+        std::lock_guard<std::mutex> guard(this->lock);
+        this->closing = true;
+    }
+    this->changed.notify_all();
+    if(this->writer.joinable()){
+        this->writer.join();
+    }
+    if(this->owns_descriptor){
+        if(::close(this->file_descriptor) == -1 && this->error.empty()){
+            this->error = "Failed to Write Bytes to Output.";
+            this->error_code = QSPI_ERROR_IO;
+        }
+    }
+    if(!this->error.empty()){
+        throw mem_exception(this->error, this->error_code);
+    }
+}
+
+/*
+*   Constructor for sparse_sink objects, the sink owns the descriptor.
+*   @param file_descriptor : the file descriptor of the dump file, must be seekable
+*   @param ranges_filename : the name of the sidecar file to list the erased ranges in
+*/
+sparse_sink::sparse_sink(int file_descriptor, const std::string& ranges_filename) :
+    stream_sink(file_descriptor, true),
+    ranges_filename(ranges_filename),
+    offset(0)
+{}
+
+/*
+*   Destructor for sparse_sink objects.
+*   Closes the sink so the file size and sidecar are written.
+*/
+sparse_sink::~sparse_sink(){
+
+    try{
+        this->close();
+    }
+    catch(mem_exception& err){
+    }
+}
+
+/*
+*   @returns the erased ranges of the dump, complete once closed.
+*/
+const erased_ranges& sparse_sink::ranges(){
+    return this->erased;
+}
+
+/*
+*   Writes the data blocks of a queued block and seeks over the erased ones.
+*   @param data : the bytes of the block
+*   @param num_bytes : the number of bytes in the block
+*   @throws mem_exception : if the write or seek fails
+*/
+void sparse_sink::drain(const uint8_t* data, unsigned long num_bytes){
+
+    unsigned long position = 0;
+    unsigned long data_start = 0;
+    while(position < num_bytes){
+
+        unsigned long chunk = std::min((unsigned long)ERASED_BLOCK_SIZE, num_bytes - position);
+        if(is_erased(data + position, chunk)){
+            // write out the data before the erased block, then leave a hole
+            write_out(data + data_start, position - data_start);
+            if(lseek(this->file_descriptor, chunk, SEEK_CUR) == (off_t)-1){
+                throw mem_exception("Failed to Seek Over Erased Bytes In Output.", QSPI_ERROR_IO);
+            }
+            this->erased.add(this->offset + position, chunk);
+            data_start = position + chunk;
+        }
+        position += chunk;
+    }
+    write_out(data + data_start, num_bytes - data_start);
+    this->offset += num_bytes;
+}
+
+/*
+*   Sets the file size, a trailing hole is not written, and saves the sidecar.
+*   @throws mem_exception : if the size or sidecar fails to be written
+*/
+void sparse_sink::finish(){
+
+    if(ftruncate(this->file_descriptor, this->offset) == -1){
+        throw mem_exception("Failed to Set the Size of the Output.", QSPI_ERROR_IO);
+    }
+    this->erased.save(this->ranges_filename);
+}
@@ -0,0 +1,139 @@
+/*
+*   image_sink.h
+*   @Author Sophie Kirkham STFC, 2018
+*   Header file for the image_sink classes
+*   Destinations for bytes read from the flash memory, written out with ..
+*   bounded memory on a writer thread so output overlaps with SPI reads.
+*/
+
+#ifndef IMAGE_SINK_H_
+#define IMAGE_SINK_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "mem_exception.h"
+#include "erased_ranges.h"
+
+#define SINK_BLOCK_SIZE 65536   // Size of each block queued for the writer
+#define SINK_BLOCK_COUNT 16     // Number of blocks queued for the writer
+
+/*
+*   Interface for a sequential destination of flash memory bytes.
+*/
+class image_sink{
+
+    public:
+
+        virtual ~image_sink(){};
+
+        /*  Appends bytes to the output
+        *   @param data : the bytes to append
+        *   @param num_bytes : the number of bytes to append
+        */
+        virtual void write(const uint8_t* data, unsigned long num_bytes) = 0;
+
+        /*  Flushes all bytes to the output and closes it
+        *   @throws mem_exception : if any bytes failed to be written
+        */
+        virtual void close() = 0;
+};
+
+/*
+*   Image sink copying bytes straight into a caller's buffer.
+*/
+class buffer_sink : public image_sink{
+
+    public:
+
+        buffer_sink(uint8_t* buffer, unsigned long capacity);
+        void write(const uint8_t* data, unsigned long num_bytes);
+        void close();
+
+    private:
+
+        uint8_t* buffer;        // the caller's buffer
+        unsigned long capacity; // the size of the buffer
+        unsigned long offset;   // offset of the next byte to write
+};
+
+/*
+*   Image sink writing to a file descriptor (a file or stdout) on a writer ..
+*   thread. Memory is bounded to SINK_BLOCK_COUNT blocks of SINK_BLOCK_SIZE.
+*   Subclasses override drain() and finish() to transform the output.
+*/
+class stream_sink : public image_sink{
+
+    public:
+
+        stream_sink(int file_descriptor, bool owns_descriptor);
+        virtual ~stream_sink();
+        void write(const uint8_t* data, unsigned long num_bytes);
+        void close();
+        static int open_output(const std::string& filename);
+
+    protected:
+
+        int file_descriptor;    // the file descriptor to write to
+        bool owns_descriptor;   // true if close() should close the descriptor
+        void start();
+        unsigned long queued_blocks();
+        void write_out(const uint8_t* data, unsigned long num_bytes);
+        virtual void drain(const uint8_t* data, unsigned long num_bytes);
+        virtual void finish();
+
+    private:
+
+        struct block{
+            std::vector<uint8_t> data;  // the bytes held by the block
+            unsigned long size;         // number of valid bytes in the block
+        };
+
+        std::vector<block> blocks;      // the ring of queued blocks
+        std::deque<int> free_blocks;    // blocks waiting to be filled
+        std::deque<int> full_blocks;    // blocks waiting to be written
+        std::mutex lock;                // protects the block queues
+        std::condition_variable changed;// signals a change to the queues
+        std::thread writer;             // the writer thread
+        bool closing;                   // true once no more blocks will be queued
+        bool closed;                    // true once close() has completed
+        std::string error;              // error raised on the writer thread
+        int error_code;                 // qspi_error code of the error
+        int current;                    // block being filled, or -1
+
+        void write_loop();
+        void queue_current();
+};
+
+/*
+*   Image sink writing a sparse dump to a file.
+*   Erased blocks are seeked over rather than written, leaving holes in ..
+*   the file, and are listed in a sidecar range file so the program ..
+*   engine can treat them as blank.
+*/
+class sparse_sink : public stream_sink{
+
+    public:
+
+        sparse_sink(int file_descriptor, const std::string& ranges_filename);
+        ~sparse_sink();
+        const erased_ranges& ranges();
+
+    protected:
+
+        void drain(const uint8_t* data, unsigned long num_bytes);
+        void finish();
+
+    private:
+
+        std::string ranges_filename;    // the sidecar file to list the ranges in
+        erased_ranges erased;           // the erased ranges of the dump
+        unsigned long long offset;      // the dump offset of the next byte
+};
+
+#endif
@@ -0,0 +1,299 @@
+/*
+*   image_source.cpp
+*   @Author Sophie Kirkham STFC, 2018
+*   Implementation of the image_source classes
+*   Provides image bytes to the program engine from a mapping or a stream
+*/
+
+#include <string.h>
+#include <errno.h>
+#include <algorithm>
+#include <unistd.h>
+
+#include "image_source.h"
+#include "realtime.h"
+
+/*
+*   Constructor for mapped_source objects.
+*   @param file : the open, memory mapped image file
+*/
+mapped_source::mapped_source(mapped_file& file) :
+    file(file),
+    offset(0)
+{}
+
+/*
+*   Gets the next bytes of the image straight from the mapping.
+*   @param num_bytes : the number of bytes to get
+*   @throws mem_exception : if the image ends before num_bytes
+*/
+const uint8_t* mapped_source::next(unsigned long num_bytes){
+
+    if(this->offset + num_bytes > this->file.size()){
+        throw mem_exception("Failed to Read Bytes from File.", QSPI_ERROR_IO);
+    }
+    const uint8_t* bytes = this->file.data() + this->offset;
+    this->offset += num_bytes;
+    return bytes;
+}
+
+/*
+*   @returns the whole mapped image.
+*/
+const uint8_t* mapped_source::image(){
+    return this->file.data();
+}
+
+/*
+*   Constructor for memory_source objects.
+*   @param data : the image bytes, owned by the caller
+*   @param size : the number of image bytes
+*/
+memory_source::memory_source(const uint8_t* data, unsigned long size) :
+    data(data),
+    size(size),
+    offset(0)
+{}
+
+/*
+*   Gets the next bytes of the image straight from the buffer.
+*   @param num_bytes : the number of bytes to get
+*   @throws mem_exception : if the image ends before num_bytes
+*/
+const uint8_t* memory_source::next(unsigned long num_bytes){
+
+    if(this->offset + num_bytes > this->size){
+        throw mem_exception("Failed to Read Bytes from Buffer.", QSPI_ERROR_INVALID_ARGUMENT);
+    }
+    const uint8_t* bytes = this->data + this->offset;
+    this->offset += num_bytes;
+    return bytes;
+}
+
+/*
+*   @returns the whole image buffer.
+*/
+const uint8_t* memory_source::image(){
+    return this->data;
+}
+
+/*
+*   Constructor for fill_source objects.
+*   @param value : the byte every image byte holds
+*   @param size : the number of image bytes
+*/
+fill_source::fill_source(uint8_t value, unsigned long size) :
+    value(value),
+    size(size),
+    offset(0)
+{}
+
+/*
+*   Gets the next bytes of the image, all holding the value.
+*   @param num_bytes : the number of bytes to get
+*   @throws mem_exception : if the image ends before num_bytes
+*/
+const uint8_t* fill_source::next(unsigned long num_bytes){
+
+    if(this->offset + num_bytes > this->size){
+        throw mem_exception("Failed to Read Bytes from Fill.", QSPI_ERROR_INVALID_ARGUMENT);
+    }
+    if(this->bytes.size() < num_bytes){
+        this->bytes.resize(num_bytes, this->value);
+    }
+    this->offset += num_bytes;
+    return this->bytes.data();
+}
+
+/*
+*   Constructor for stream_source objects.
+*   Allocates the blocks up front, the reader starts with start().
+*   @param file_descriptor : the file descriptor to read the image from
+*/
+stream_source::stream_source(int file_descriptor) :
+    file_descriptor(file_descriptor),
+    blocks(STREAM_BLOCK_COUNT),
+    finished(false),
+    stopping(false),
+    error_code(QSPI_OK),
+    current(-1),
+    current_offset(0)
+{
+    for(int i = 0; i < STREAM_BLOCK_COUNT; i++){
+        this->blocks[i].data.resize(STREAM_BLOCK_SIZE);
+        this->blocks[i].size = 0;
+        this->free_blocks.push_back(i);
+    }
+}
+
+/*
+*   Destructor for stream_source objects, stops the reader thread.
+*   Subclasses overriding fill() must call stop() in their own destructor.
+*/
+stream_source::~stream_source(){
+    this->stop();
+}
+
+/*
+*   Starts the reader thread filling blocks from the stream.
+*/
+void stream_source::start(){
+    this->reader = std::thread(&stream_source::read_loop, this);
+}
+
+/*
+*   Stops the reader thread and waits for it to exit.
+*/
+void stream_source::stop(){
+
+    {
+        std::lock_guard<std::mutex> guard(this->lock);
+        this->stopping = true;
+    }
+    this->changed.notify_all();
+    if(this->reader.joinable()){
+        this->reader.join();
+    }
+}
+
+/*
+*   Reads up to capacity bytes from the file descriptor into a block.
+*   Only returns short at the end of the stream.
+*   @param buffer : the block to fill
+*   @param capacity : the size of the block
+*   @throws mem_exception : if reading the stream fails
+*   @returns the number of bytes read, 0 at the end of the stream.
+*/
+unsigned long stream_source::fill(uint8_t* buffer, unsigned long capacity){
+
+    unsigned long filled = 0;
+    while(filled < capacity){
+        ssize_t count = read(this->file_descriptor, buffer + filled, capacity - filled);
+        if(count == 0){
+            break;
+        }
+        if(count < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            throw mem_exception("Failed to Read Bytes from Stream.", QSPI_ERROR_IO);
+        }
+        filled += count;
+    }
+    return filled;
+}
+
+/*
+*   Reader thread body, fills free blocks until the stream ends.
+*/
+void stream_source::read_loop(){
+
+    enter_background();
+    while(true){
+
+        int index;
+        {
+            // wait for a free block to fill
+            std::unique_lock<std::mutex> guard(this->lock);
+            while(this->free_blocks.empty() && !this->stopping){
+                this->changed.wait(guard);
+            }
+            if(this->stopping){
+                return;
+            }
+            index = this->free_blocks.front();
+            this->free_blocks.pop_front();
+        }
+
+        block& current_block = this->blocks[index];
+        try{
+            current_block.size = fill(&current_block.data[0], STREAM_BLOCK_SIZE);
+        }
+        catch(mem_exception& err){
+            std::lock_guard<std::mutex> guard(this->lock);
+            this->error = err.what();
+            this->error_code = err.code();
+            this->finished = true;
+            this->changed.notify_all();
+            return;
+        }
+
+        std::lock_guard<std::mutex> guard(this->lock);
+        if(current_block.size == 0){
+            // the stream has ended, nothing more to queue
+            this->finished = true;
+            this->free_blocks.push_back(index);
+            this->changed.notify_all();
+            return;
+        }
+        this->full_blocks.push_back(index);
+        this->changed.notify_all();
+    }
+}
+
+/*
+*   Waits for the reader to queue the next filled block.
+*   @throws mem_exception : if the reader thread failed
+*   @returns false if the stream has ended.
+*/
+bool stream_source::acquire_block(){
+
+    std::unique_lock<std::mutex> guard(this->lock);
+    while(this->full_blocks.empty() && !this->finished){
+        this->changed.wait(guard);
+    }
+    if(!this->error.empty()){
+        throw mem_exception(this->error, this->error_code);
+    }
+    if(this->full_blocks.empty()){
+        return false;
+    }
+    this->current = this->full_blocks.front();
+    this->full_blocks.pop_front();
+    this->current_offset = 0;
+    return true;
+}
+
+/*
+*   Gets the next bytes of the image from the buffered blocks.
+*   Bytes straddling two blocks are joined in the staging buffer.
+*   @param num_bytes : the number of bytes to get
+*   @throws mem_exception : if the stream ends before num_bytes
+*/
+const uint8_t* stream_source::next(unsigned long num_bytes){
+
+    unsigned long copied = 0;
+    while(true){
+
+        // hand a consumed block back to the reader
+        if(this->current != -1 && this->current_offset == this->blocks[this->current].size){
+            std::lock_guard<std::mutex> guard(this->lock);
+            this->free_blocks.push_back(this->current);
+            this->current = -1;
+            this->changed.notify_all();
+        }
+        if(this->current == -1 && !acquire_block()){
+            throw mem_exception("Input Stream Ended Before All Bytes Were Written", QSPI_ERROR_IO);
+        }
+
+        block& current_block = this->blocks[this->current];
+        unsigned long available = current_block.size - this->current_offset;
+        const uint8_t* bytes = &current_block.data[this->current_offset];
+
+        // the common case, the bytes are held in one block
+        if(copied == 0 && available >= num_bytes){
+            this->current_offset += num_bytes;
+            return bytes;
+        }
+
+        // join the bytes from consecutive blocks
+        this->staging.resize(num_bytes);
+        unsigned long chunk = std::min(available, num_bytes - copied);
+        memcpy(&this->staging[copied], bytes, chunk);
+        this->current_offset += chunk;
+        copied += chunk;
+        if(copied == num_bytes){
+            return &this->staging[0];
+        }
+    }
+}
@@ -0,0 +1,152 @@
+/*
+*   image_source.h
+*   @Author Sophie Kirkham STFC, 2018
+*   Header file for the image_source classes
+*   Sources of image bytes for the program engine, either a memory mapped ..
+*   file or a stream read with bounded memory on a reader thread.
+*/
+
+#ifndef IMAGE_SOURCE_H_
+#define IMAGE_SOURCE_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "mapped_file.h"
+#include "mem_exception.h"
+
+#define STREAM_BLOCK_SIZE 65536 // Size of each block buffered from a stream
+#define STREAM_BLOCK_COUNT 16   // Number of blocks buffered from a stream
+
+/*
+*   Interface for a sequential source of image bytes.
+*/
+class image_source{
+
+    public:
+
+        virtual ~image_source(){};
+
+        /*  Gets the next bytes of the image
+        *   @param num_bytes : the number of bytes to get, at most one page
+        *   @returns a pointer to the bytes, valid until the next call.
+        *   @throws mem_exception : if the image ends before num_bytes
+        */
+        virtual const uint8_t* next(unsigned long num_bytes) = 0;
+
+        /*  @returns the whole image if it is randomly accessible, else NULL
+        *   Used to byte-compare a verify read without re-reading the image.
+        */
+        virtual const uint8_t* image(){ return NULL; };
+};
+
+/*
+*   Image source reading directly from a memory mapped file.
+*/
+class mapped_source : public image_source{
+
+    public:
+
+        mapped_source(mapped_file& file);
+        ~mapped_source(){};
+        const uint8_t* next(unsigned long num_bytes);
+        const uint8_t* image();
+
+    private:
+
+        mapped_file& file;      // the mapped image file
+        unsigned long offset;   // offset of the next byte to return
+};
+
+/*
+*   Image source reading directly from a caller's buffer.
+*/
+class memory_source : public image_source{
+
+    public:
+
+        memory_source(const uint8_t* data, unsigned long size);
+        ~memory_source(){};
+        const uint8_t* next(unsigned long num_bytes);
+        const uint8_t* image();
+
+    private:
+
+        const uint8_t* data;    // the image bytes
+        unsigned long size;     // the number of image bytes
+        unsigned long offset;   // offset of the next byte to return
+};
+
+/*
+*   Image source of one repeated byte, e.g. the fill value between the ..
+*   segments of an image container.
+*/
+class fill_source : public image_source{
+
+    public:
+
+        fill_source(uint8_t value, unsigned long size);
+        ~fill_source(){};
+        const uint8_t* next(unsigned long num_bytes);
+
+    private:
+
+        std::vector<uint8_t> bytes;     // the value, repeated for the largest request so far
+        uint8_t value;          // the repeated byte
+        unsigned long size;     // the number of image bytes
+        unsigned long offset;   // offset of the next byte to return
+};
+
+/*
+*   Image source reading from a file descriptor (e.g. stdin) on a reader ..
+*   thread, so the transfer overlaps with programming.
+*   Memory is bounded to STREAM_BLOCK_COUNT blocks of STREAM_BLOCK_SIZE bytes.
+*   Subclasses override fill() to produce bytes another way.
+*/
+class stream_source : public image_source{
+
+    public:
+
+        stream_source(int file_descriptor);
+        virtual ~stream_source();
+        void start();
+        void stop();
+        const uint8_t* next(unsigned long num_bytes);
+
+    protected:
+
+        int file_descriptor;    // the file descriptor to read from
+        virtual unsigned long fill(uint8_t* buffer, unsigned long capacity);
+
+    private:
+
+        struct block{
+            std::vector<uint8_t> data;  // the bytes held by the block
+            unsigned long size;         // number of valid bytes in the block
+        };
+
+        std::vector<block> blocks;      // the ring of buffered blocks
+        std::deque<int> free_blocks;    // blocks waiting to be filled
+        std::deque<int> full_blocks;    // blocks waiting to be consumed
+        std::mutex lock;                // protects the block queues
+        std::condition_variable changed;// signals a change to the queues
+        std::thread reader;             // the reader thread
+        bool finished;                  // true once the stream has ended
+        bool stopping;                  // true when the reader should exit
+        std::string error;              // error raised on the reader thread
+        int error_code;                 // qspi_error code of the error
+
+        int current;                    // block being consumed, or -1
+        unsigned long current_offset;   // offset of the next byte in current
+        std::vector<uint8_t> staging;   // joins bytes straddling two blocks
+
+        void read_loop();
+        bool acquire_block();
+};
+
+#endif
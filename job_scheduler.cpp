@@ -0,0 +1,380 @@
+/*
+*   job_scheduler.cpp
+*   @Author Sophie Kirkham STFC, 2018
+*   Implementation of the job_scheduler class
+*/
+
+#include <fstream>
+#include <sstream>
+#include <thread>
+
+#include "job_scheduler.h"
+
+/*
+*   Converts a flat JSON job object to the key=value job format.
+*   Values may be strings, numbers or booleans, nesting is not supported.
+*   @param line : the JSON object
+*   @returns the job line.
+*/
+static std::string json_job_line(const std::string& line){
+
+    size_t open = line.find('{');
+    size_t close = line.rfind('}');
+    if(close == std::string::npos || close < open){
+        throw mem_exception("Invalid Job : unterminated JSON object");
+    }
+
+    std::string job_line;
+    std::istringstream members(line.substr(open + 1, close - open - 1));
+    std::string member;
+    while(std::getline(members, member, ',')){
+        size_t colon = member.find(':');
+        if(colon == std::string::npos){
+            throw mem_exception("Invalid Job : expected \"key\": value, got " + member);
+        }
+        std::string key = member.substr(0, colon);
+        std::string value = member.substr(colon + 1);
+        // strip the spaces and quotes around the key and value
+        const char* strip = " \t\r\"";
+        key = key.substr(key.find_first_not_of(strip));
+        key = key.substr(0, key.find_last_not_of(strip) + 1);
+        size_t first = value.find_first_not_of(strip);
+        value = (first == std::string::npos) ? "" : value.substr(first, value.find_last_not_of(strip) - first + 1);
+        if(value == "true"){
+            value = "1";
+        }
+        else if(value == "false"){
+            value = "0";
+        }
+        job_line += key + "=" + value + " ";
+    }
+    return job_line;
+}
+
+/*
+*   @returns true if the job starts with a bulk erase of its chip, a ..
+*   program or an erase without a range.
+*/
+static bool bulk_erase(const daemon_job& job){
+    return job.operation == "program" || (job.operation == "erase" && !range_erase(job));
+}
+
+/*
+*   Constructor for job_scheduler objects.
+*   @param device : the qspi device, already mapped with map_qspi_mux()
+*/
+job_scheduler::job_scheduler(qspi_device& device) :
+    device(device)
+{}
+
+/*
+*   Reads the jobs from a jobs file, blank lines and lines starting # are ignored.
+*   @param filename : the name of the jobs file
+*   @throws mem_exception : if the file fails to open or a job is invalid
+*/
+void job_scheduler::load(const std::string& filename){
+
+    std::ifstream jobs_file(filename.c_str());
+    if(!jobs_file.is_open()){
+        throw mem_exception("Failed to Open Jobs File");
+    }
+    std::string line;
+    int line_number = 0;
+    while(std::getline(jobs_file, line)){
+        line_number++;
+        size_t first = line.find_first_not_of(" \t\r");
+        if(first == std::string::npos || line[first] == '#'){
+            continue;
+        }
+        try{
+            add(parse_job(line[first] == '{' ? json_job_line(line) : line));
+        }
+        catch(mem_exception& err){
+            std::ostringstream message;
+            message << "Line " << line_number << " : " << err.what();
+            throw mem_exception(message.str());
+        }
+    }
+}
+
+/*
+*   Adds a job to the end of the batch.
+*   @param job : the job to add
+*/
+void job_scheduler::add(const daemon_job& job){
+
+    scheduled_job scheduled;
+    scheduled.job = job;
+    scheduled.state = JOB_WAITING;
+    this->jobs.push_back(scheduled);
+}
+
+/*
+*   @returns true if a job in the state has finished, successfully or not.
+*/
+bool job_scheduler::finished(job_state state){
+    return state == JOB_DONE || state == JOB_FAILED || state == JOB_SKIPPED;
+}
+
+/*
+*   Finds the job a chip must run next, jobs on a chip run in file order.
+*   @param flash_chip : the flash chip
+*   @returns the index of the job, -1 if every job on the chip has finished.
+*/
+long job_scheduler::head(int flash_chip){
+
+    for(unsigned long i = 0; i < this->jobs.size(); i++){
+        if(this->jobs[i].job.flash_chip == flash_chip && !finished(this->jobs[i].state)){
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+*   Records the end of a job, skipping the chip's later jobs if it failed.
+*   @param scheduled : the job
+*   @param state : JOB_DONE or JOB_FAILED
+*   @param result : the result or error message
+*/
+void job_scheduler::finish_job(scheduled_job& scheduled, job_state state, const std::string& result){
+
+    scheduled.state = state;
+    scheduled.result = result;
+    scheduled.finish = std::chrono::steady_clock::now();
+    if(state != JOB_FAILED){
+        return;
+    }
+    for(unsigned long i = 0; i < this->jobs.size(); i++){
+        if(this->jobs[i].job.flash_chip == scheduled.job.flash_chip && this->jobs[i].state == JOB_WAITING){
+            this->jobs[i].state = JOB_SKIPPED;
+            this->jobs[i].result = "skipped, an earlier job on the chip failed";
+        }
+    }
+}
+
+/*
+*   Starts the bulk erase of every chip whose next job erases or programs.
+*   @returns true if an erase was started.
+*/
+bool job_scheduler::start_erases(){
+
+    bool started = false;
+    for(int chip = 1; chip <= FLASH_CHIPS; chip++){
+        long next = head(chip);
+        if(next < 0){
+            continue;
+        }
+        scheduled_job& scheduled = this->jobs[next];
+        if(scheduled.state != JOB_WAITING || !bulk_erase(scheduled.job)){
+            continue;
+        }
+        scheduled.start = std::chrono::steady_clock::now();
+        try{
+            this->device.select_flash(chip);
+            this->device.start_erase(chip);
+            scheduled.state = JOB_ERASING;
+            std::cout << "Job " << next + 1 << " : erase started on flash chip " << chip << std::endl;
+        }
+        catch(mem_exception& err){
+            finish_job(scheduled, JOB_FAILED, err.what());
+        }
+        started = true;
+    }
+    return started;
+}
+
+/*
+*   Checks each erasing chip, erase jobs finish with their erase.
+*   @returns true if an erase finished.
+*/
+bool job_scheduler::poll_erases(){
+
+    bool changed = false;
+    for(unsigned long i = 0; i < this->jobs.size(); i++){
+        scheduled_job& scheduled = this->jobs[i];
+        if(scheduled.state != JOB_ERASING){
+            continue;
+        }
+        try{
+            this->device.select_flash(scheduled.job.flash_chip);
+            if(!this->device.erase_complete()){
+                continue;
+            }
+            scheduled.erase_finish = std::chrono::steady_clock::now();
+            if(scheduled.job.operation == "erase"){
+                finish_job(scheduled, JOB_DONE, "erased");
+            }
+            else{
+                scheduled.state = JOB_ERASED;
+            }
+        }
+        catch(mem_exception& err){
+            finish_job(scheduled, JOB_FAILED, err.what());
+        }
+        changed = true;
+    }
+    return changed;
+}
+
+/*
+*   Runs a read, verify, status, range erase or erased program job to completion.
+*   @param scheduled : the job
+*/
+void job_scheduler::run_job(scheduled_job& scheduled){
+
+    daemon_job& job = scheduled.job;
+    std::ostringstream result;
+    if(scheduled.state == JOB_WAITING){
+        scheduled.start = std::chrono::steady_clock::now();
+    }
+    // the previous job's events print before this job starts
+    flush_events();
+    std::cout << "Job " << (&scheduled - &this->jobs[0]) + 1 << " : " << job.operation
+    << " on flash chip " << job.flash_chip << std::endl;
+
+    try{
+        this->device.select_flash(job.flash_chip);
+        clamp_job(job, this->device.get_geometry());
+        this->device.set_sparse_images(job.sparse);
+        if(job.operation == "read"){
+            this->device.set_output_compression(codec_from_name(job.compress), job.level);
+            uint8_t crc = this->device.read_flash_memory(job.address, job.size, job.filename, true);
+            result << "read " << job.size << " bytes, crc 0x" << std::hex << (int)crc;
+        }
+        else if(job.operation == "program"){
+            this->device.program_flash_memory(job.address, job.size, job.filename, job.verify);
+            result << "programmed " << job.size << " bytes" << (job.verify ? ", verified" : "");
+        }
+        else if(job.operation == "verify"){
+            this->device.verify_flash_memory(job.address, job.size, job.filename);
+            result << "verified " << job.size << " bytes";
+        }
+        else if(job.operation == "erase"){
+            this->device.erase_range(job.flash_chip, job.address, job.size);
+            result << "erased " << job.size << " bytes from 0x" << std::hex << job.address;
+        }
+        else{
+            uint8_t status = this->device.read_flash_status_reg();
+            uint8_t config = this->device.read_flash_config_reg();
+            result << "status 0x" << std::hex << (int)status << ", config 0x" << (int)config;
+        }
+        finish_job(scheduled, JOB_DONE, result.str());
+    }
+    catch(mem_exception& err){
+        finish_job(scheduled, JOB_FAILED, err.what());
+    }
+    this->device.set_output_compression(CODEC_NONE, 0);
+    this->device.set_sparse_images(false);
+}
+
+/*
+*   Runs the earliest job that is ready and does not need an erase started.
+*   @returns true if a job ran.
+*/
+bool job_scheduler::run_next(){
+
+    long next = -1;
+    for(int chip = 1; chip <= FLASH_CHIPS; chip++){
+        long candidate = head(chip);
+        if(candidate < 0){
+            continue;
+        }
+        scheduled_job& scheduled = this->jobs[candidate];
+        bool ready = (scheduled.state == JOB_ERASED) ||
+            (scheduled.state == JOB_WAITING && !bulk_erase(scheduled.job));
+        if(ready && (next < 0 || candidate < next)){
+            next = candidate;
+        }
+    }
+    if(next < 0){
+        return false;
+    }
+    run_job(this->jobs[next]);
+    return true;
+}
+
+/*
+*   Runs every job, then deselects the flash.
+*   Erases are started as soon as a chip is ready for one, then other jobs ..
+*   run while the chips erase, polling between jobs. Jobs left that can ..
+*   never start, with no erase running, fail rather than wait forever.
+*   @returns true if every job succeeded.
+*/
+bool job_scheduler::run(){
+
+    this->batch_start = std::chrono::steady_clock::now();
+    while(true){
+
+        bool unfinished = false;
+        for(unsigned long i = 0; i < this->jobs.size(); i++){
+            unfinished |= !finished(this->jobs[i].state);
+        }
+        if(!unfinished){
+            break;
+        }
+
+        bool changed = start_erases();
+        changed |= poll_erases();
+        if(run_next()){
+            continue;
+        }
+        if(!changed){
+            bool erasing = false;
+            for(unsigned long i = 0; i < this->jobs.size(); i++){
+                erasing |= this->jobs[i].state == JOB_ERASING;
+            }
+            if(!erasing){
+                // nothing is running or can start, the jobs left can never be scheduled
+                for(unsigned long i = 0; i < this->jobs.size(); i++){
+                    if(!finished(this->jobs[i].state)){
+                        this->jobs[i].start = std::chrono::steady_clock::now();
+                        finish_job(this->jobs[i], JOB_FAILED, "could not be scheduled");
+                    }
+                }
+                break;
+            }
+            // only erases are left running, wait before polling them again
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+    this->device.deselect_flash();
+
+    for(unsigned long i = 0; i < this->jobs.size(); i++){
+        if(this->jobs[i].state != JOB_DONE){
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+*   Prints the start, erase and total time of each job and the batch.
+*/
+void job_scheduler::print_summary(){
+
+    long long busy_ms = 0;
+    flush_events();
+    std::cout << std::endl << "Job summary :" << std::endl;
+    for(unsigned long i = 0; i < this->jobs.size(); i++){
+        scheduled_job& scheduled = this->jobs[i];
+        std::cout << "Job " << i + 1 << " : " << scheduled.job.operation << " chip "
+        << scheduled.job.flash_chip << " : ";
+        if(scheduled.state == JOB_SKIPPED){
+            std::cout << scheduled.result << std::endl;
+            continue;
+        }
+        long long started = std::chrono::duration_cast<std::chrono::milliseconds>(scheduled.start - this->batch_start).count();
+        long long total = std::chrono::duration_cast<std::chrono::milliseconds>(scheduled.finish - scheduled.start).count();
+        busy_ms += total;
+        std::cout << "started at " << started << " ms, took " << total << " ms";
+        if(scheduled.job.operation == "program" && scheduled.state == JOB_DONE){
+            std::cout << " (erase " << std::chrono::duration_cast<std::chrono::milliseconds>(
+                scheduled.erase_finish - scheduled.start).count() << " ms)";
+        }
+        std::cout << " : " << (scheduled.state == JOB_DONE ? "" : "FAILED, ") << scheduled.result << std::endl;
+    }
+    long long wall_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - this->batch_start).count();
+    std::cout << "Batch took " << wall_ms << " ms, " << busy_ms << " ms of jobs run back to back" << std::endl;
+}
@@ -0,0 +1,73 @@
+/*
+*   job_scheduler.h
+*   @Author Sophie Kirkham STFC, 2018
+*   Header file for the job_scheduler class
+*   Runs a batch of read, erase, program, verify and status jobs across ..
+*   the flash chips in one invocation, overlapping erases with other work.
+*/
+
+#ifndef JOB_SCHEDULER_H_
+#define JOB_SCHEDULER_H_
+
+#include <string>
+#include <vector>
+#include <chrono>
+
+#include "qspi_device.h"
+#include "qspi_daemon.h"
+
+/*
+*   Scheduler for a batch of jobs read from a --jobs file
+*   Each line of the file is a job in the daemon's key=value format, or a ..
+*   flat JSON object with the same keys, e.g.
+*       op=read chip=1 size=64000000 file=chip1.bin
+*       {"op": "program", "chip": 2, "size": 64000000, "file": "fw.bin", "verify": true}
+*   Jobs on the same chip run in file order, jobs on different chips are ..
+*   independent. Erases (and the erase before a program) are started on ..
+*   every chip that is ready, then the chips are deselected and other jobs ..
+*   run while they erase, so the long erase waits overlap.
+*/
+class job_scheduler{
+
+    public:
+
+        job_scheduler(qspi_device& device);
+        void load(const std::string& filename);
+        void add(const daemon_job& job);
+        bool run();
+        void print_summary();
+
+    private:
+
+        enum job_state{
+            JOB_WAITING,    // not started
+            JOB_ERASING,    // bulk erase running in the chip
+            JOB_ERASED,     // erase finished, the program is waiting to run
+            JOB_DONE,       // finished successfully
+            JOB_FAILED,     // finished with an error
+            JOB_SKIPPED     // not run as an earlier job on the chip failed
+        };
+
+        struct scheduled_job{
+            daemon_job job;         // the job to run
+            job_state state;        // where the job has got to
+            std::string result;     // the result or error message
+            std::chrono::steady_clock::time_point start;        // when the job started
+            std::chrono::steady_clock::time_point erase_finish; // when its erase finished
+            std::chrono::steady_clock::time_point finish;       // when the job finished
+        };
+
+        qspi_device& device;                // the mapped qspi device
+        std::vector<scheduled_job> jobs;    // the jobs in file order
+        std::chrono::steady_clock::time_point batch_start;  // when run() started
+
+        long head(int flash_chip);
+        bool finished(job_state state);
+        bool start_erases();
+        bool poll_erases();
+        bool run_next();
+        void run_job(scheduled_job& scheduled);
+        void finish_job(scheduled_job& scheduled, job_state state, const std::string& result);
+};
+
+#endif
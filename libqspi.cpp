@@ -0,0 +1,561 @@
+/*
+*   libqspi.cpp
+*   @Author Sophie Kirkham STFC, 2018
+*   Implementation of the libqspi C API over the qspi_device class
+*/
+
+#include <string.h>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <deque>
+#include <new>
+#include <algorithm>
+
+#include "libqspi.h"
+#include "qspi_device.h"
+#include "qspi_engine.h"
+
+// A progress report waiting to be passed to a C progress callback
+struct progress_report{
+    qspi_progress_fn callback;  // the callback set when the operation started
+    void* user;                 // passed back to the callback
+    unsigned long long done;    // the number of bytes done
+    unsigned long long total;   // the number of bytes in the operation
+};
+
+// State behind a qspi_handle
+struct qspi_handle{
+    qspi_device device;         // the mapped qspi device
+    std::mutex lock;            // serialises calls on the handle and the engine
+    std::mutex error_lock;      // guards last_error, never held while the device runs
+    std::string last_error;     // message of the last error
+    std::mutex state_lock;      // guards the callback and engine, never held while the device runs
+    qspi_progress_fn progress;  // the C progress callback, NULL if none
+    void* progress_user;        // passed back to the progress callback
+    std::unique_ptr<qspi_engine> engine;    // runs the _async calls, started by the first
+    std::mutex relay_lock;      // guards the reports and the relay thread
+    std::condition_variable relay_changed;  // signals a report queued, delivered or the relay stopping
+    std::deque<progress_report> reports;    // reports waiting for the relay thread
+    bool relay_busy;            // true while the relay thread is in a callback
+    bool relay_stopping;        // true once the relay thread should exit
+    std::thread relay;          // calls the C progress callback without the device lock held
+};
+
+// State behind a qspi_op
+struct qspi_op{
+    operation_handle operation; // the queued operation
+    std::string error;          // the error message, once finished
+};
+
+/*
+*   Relay thread body, calls the C progress callback for each report ..
+*   without the device lock held, so the callback may call the API.
+*   @param handle : the handle
+*/
+static void relay_reports(qspi_handle* handle){
+
+    std::unique_lock<std::mutex> guard(handle->relay_lock);
+    while(true){
+        handle->relay_changed.wait(guard, [handle]{ return !handle->reports.empty() || handle->relay_stopping; });
+        if(handle->reports.empty()){
+            return;
+        }
+        progress_report report = handle->reports.front();
+        handle->reports.pop_front();
+        handle->relay_busy = true;
+        guard.unlock();
+        report.callback(report.done, report.total, report.user);
+        guard.lock();
+        handle->relay_busy = false;
+        handle->relay_changed.notify_all();
+    }
+}
+
+/*
+*   Waits for the reports queued so far to be delivered, unless called ..
+*   from a callback on the relay thread, which can not wait for itself.
+*   @param handle : the handle
+*/
+static void drain_reports(qspi_handle* handle){
+
+    std::unique_lock<std::mutex> guard(handle->relay_lock);
+    if(std::this_thread::get_id() == handle->relay.get_id()){
+        return;
+    }
+    handle->relay_changed.wait(guard, [handle]{ return handle->reports.empty() && !handle->relay_busy; });
+}
+
+/*
+*   Stops the relay thread once it has delivered the reports queued.
+*   @param handle : the handle, not from its own progress callback
+*/
+static void stop_relay(qspi_handle* handle){
+
+    {
+        std::lock_guard<std::mutex> guard(handle->relay_lock);
+        handle->relay_stopping = true;
+        handle->relay_changed.notify_all();
+    }
+    if(handle->relay.joinable()){
+        handle->relay.join();
+    }
+}
+
+/*
+*   Wraps the C progress callback of a handle for qspi_device.
+*   Reports are queued for the relay thread rather than called under the ..
+*   device lock, a later report on the same operation replaces one not ..
+*   yet delivered.
+*   @returns the callback, empty if the handle has none.
+*/
+static progress_callback handle_progress(qspi_handle* handle){
+
+    std::unique_lock<std::mutex> state_guard(handle->state_lock);
+    if(handle->progress == NULL){
+        return progress_callback();
+    }
+    qspi_progress_fn callback = handle->progress;
+    void* user = handle->progress_user;
+    state_guard.unlock();
+
+    std::lock_guard<std::mutex> guard(handle->relay_lock);
+    if(!handle->relay.joinable()){
+        handle->relay = std::thread(relay_reports, handle);
+    }
+    return [handle, callback, user](unsigned long long done, unsigned long long total){
+        std::lock_guard<std::mutex> guard(handle->relay_lock);
+        progress_report report = {callback, user, done, total};
+        if(!handle->reports.empty() && handle->reports.back().callback == callback &&
+            handle->reports.back().user == user && handle->reports.back().total == total){
+            handle->reports.back() = report;
+        }
+        else{
+            handle->reports.push_back(report);
+        }
+        handle->relay_changed.notify_all();
+    };
+}
+
+/*
+*   Records the message of the last error on a handle.
+*/
+static void set_last_error(qspi_handle* handle, const std::string& message){
+    std::lock_guard<std::mutex> guard(handle->error_lock);
+    handle->last_error = message;
+}
+
+/*
+*   Runs an operation on a handle, holding its lock, and turns exceptions into error codes.
+*   The flash is deselected once the operation has finished, whether or not it failed, ..
+*   and its progress reports are delivered before returning.
+*   @param handle : the handle
+*   @param flash_num : the flash chip to select, 0 to select none
+*   @param operation : the operation to run
+*   @returns QSPI_OK, or the error code of the exception thrown.
+*/
+template<typename operation_type>
+static int run(qspi_handle* handle, int flash_num, operation_type operation){
+
+    if(handle == NULL){
+        return QSPI_ERROR_INVALID_ARGUMENT;
+    }
+    std::unique_lock<std::mutex> guard(handle->lock);
+    set_last_error(handle, "");
+    int code = QSPI_OK;
+    try{
+        // the engine clears the device's callback after each of its operations
+        handle->device.set_progress_callback(handle_progress(handle));
+        if(flash_num != 0){
+            handle->device.select_flash(flash_num);
+        }
+        operation(handle->device);
+    }
+    catch(mem_exception& err){
+        set_last_error(handle, err.what());
+        code = err.code();
+    }
+    catch(std::exception& err){
+        set_last_error(handle, err.what());
+        code = QSPI_ERROR_FAILED;
+    }
+    if(flash_num != 0){
+        try{
+            handle->device.deselect_flash();
+        }
+        catch(mem_exception& err){
+            if(code == QSPI_OK){
+                set_last_error(handle, err.what());
+                code = err.code();
+            }
+        }
+    }
+    guard.unlock();
+    drain_reports(handle);
+    return code;
+}
+
+/*
+*   Checks a flash chip number is in range.
+*/
+static bool valid_chip(int flash_num){
+    return flash_num >= 1 && flash_num <= FLASH_CHIPS;
+}
+
+int qspi_version(void){
+    return LIBQSPI_VERSION;
+}
+
+int qspi_open(qspi_handle** handle){
+
+    if(handle == NULL){
+        return QSPI_ERROR_INVALID_ARGUMENT;
+    }
+    *handle = NULL;
+    qspi_handle* opened = new(std::nothrow) qspi_handle();
+    if(opened == NULL){
+        return QSPI_ERROR_FAILED;
+    }
+    opened->progress = NULL;
+    opened->progress_user = NULL;
+    opened->relay_busy = false;
+    opened->relay_stopping = false;
+    int code = run(opened, 0, [](qspi_device& device){
+        device.map_qspi_mux();
+        device.deselect_flash();
+    });
+    if(code != QSPI_OK){
+        delete opened;
+        return code;
+    }
+    *handle = opened;
+    return QSPI_OK;
+}
+
+int qspi_use_xip(qspi_handle* handle, const char* file){
+
+    std::string xip_file = (file == NULL) ? MEM_DEVICE : file;
+    return run(handle, 0, [&](qspi_device& device){
+        device.map_xip(xip_file);
+    });
+}
+
+int qspi_use_dma(qspi_handle* handle, const char* engine){
+
+    std::string dma_engine = (engine == NULL) ? DMA_CDMA : engine;
+    return run(handle, 0, [&](qspi_device& device){
+        device.enable_dma(dma_engine);
+    });
+}
+
+int qspi_close(qspi_handle* handle){
+
+    if(handle != NULL){
+        // the relay thread can not join itself
+        if(std::this_thread::get_id() == handle->relay.get_id()){
+            return QSPI_ERROR_INVALID_ARGUMENT;
+        }
+        // cancels the engine's operations and waits for it to stop
+        handle->engine.reset();
+    }
+    int code = run(handle, 0, [](qspi_device& device){
+        device.deselect_flash();
+        device.un_map_qspi_mux();
+    });
+    if(handle != NULL){
+        stop_relay(handle);
+    }
+    delete handle;
+    return code;
+}
+
+int qspi_set_progress(qspi_handle* handle, qspi_progress_fn callback, void* user){
+
+    if(handle == NULL){
+        return QSPI_ERROR_INVALID_ARGUMENT;
+    }
+    std::lock_guard<std::mutex> guard(handle->state_lock);
+    handle->progress = callback;
+    handle->progress_user = user;
+    return QSPI_OK;
+}
+
+int qspi_read(qspi_handle* handle, int chip, uint32_t address, void* buffer,
+                unsigned long num_bytes, uint8_t* crc){
+
+    if(!valid_chip(chip) || (buffer == NULL && num_bytes != 0)){
+        return QSPI_ERROR_INVALID_ARGUMENT;
+    }
+    return run(handle, chip, [&](qspi_device& device){
+        device.check_range(address, num_bytes);
+        uint8_t read_crc = device.read_flash_buffer(address, num_bytes, (uint8_t*)buffer);
+        if(crc != NULL){
+            *crc = read_crc;
+        }
+    });
+}
+
+int qspi_program(qspi_handle* handle, int chip, uint32_t address, const void* data,
+                unsigned long num_bytes, int flags, uint8_t* crc){
+
+    if(!valid_chip(chip) || (data == NULL && num_bytes != 0)){
+        return QSPI_ERROR_INVALID_ARGUMENT;
+    }
+    return run(handle, chip, [&](qspi_device& device){
+        device.check_range(address, num_bytes);
+        if(flags & QSPI_PROGRAM_ERASE){
+            uint32_t erase_address = address;
+            unsigned long erase_bytes = num_bytes;
+            device.erase_range(chip, erase_address, erase_bytes);
+        }
+        bool verify = (flags & QSPI_PROGRAM_VERIFY) != 0;
+        uint8_t program_crc = device.program_flash_buffer(address, (const uint8_t*)data, num_bytes, verify);
+        if(crc != NULL){
+            *crc = program_crc;
+        }
+    });
+}
+
+int qspi_erase(qspi_handle* handle, int chip, uint32_t address, unsigned long num_bytes){
+
+    if(!valid_chip(chip)){
+        return QSPI_ERROR_INVALID_ARGUMENT;
+    }
+    return run(handle, chip, [&](qspi_device& device){
+        device.check_range(address, num_bytes);
+        device.erase_range(chip, address, num_bytes);
+    });
+}
+
+int qspi_read_status(qspi_handle* handle, int chip, uint8_t* status, uint8_t* config){
+
+    if(!valid_chip(chip) || status == NULL || config == NULL){
+        return QSPI_ERROR_INVALID_ARGUMENT;
+    }
+    return run(handle, chip, [&](qspi_device& device){
+        *status = device.read_flash_status_reg();
+        *config = device.read_flash_config_reg();
+    });
+}
+
+int qspi_pread(qspi_handle* handle, int chip, uint32_t address, void* buffer,
+                unsigned long num_bytes, unsigned long* bytes_read){
+
+    if(!valid_chip(chip) || (buffer == NULL && num_bytes != 0) || bytes_read == NULL){
+        return QSPI_ERROR_INVALID_ARGUMENT;
+    }
+    *bytes_read = 0;
+    return run(handle, chip, [&](qspi_device& device){
+        *bytes_read = device.pread((uint8_t*)buffer, num_bytes, address);
+    });
+}
+
+int qspi_set_cache(qspi_handle* handle, unsigned long num_blocks){
+
+    return run(handle, 0, [num_blocks](qspi_device& device){
+        device.read_cache().set_capacity(num_blocks);
+    });
+}
+
+int qspi_cache_stats(qspi_handle* handle, unsigned long long* hits, unsigned long long* misses,
+                unsigned long long* evictions){
+
+    return run(handle, 0, [&](qspi_device& device){
+        sector_cache& cache = device.read_cache();
+        if(hits != NULL){
+            *hits = cache.hits();
+        }
+        if(misses != NULL){
+            *misses = cache.misses();
+        }
+        if(evictions != NULL){
+            *evictions = cache.evictions();
+        }
+    });
+}
+
+/*
+*   Queues an operation on the handle's engine, starting the engine if needed.
+*   @param handle : the handle
+*   @param request : what the operation does
+*   @param op : set to the new operation
+*   @returns QSPI_OK, or QSPI_ERROR_INVALID_ARGUMENT.
+*/
+static int submit(qspi_handle* handle, const operation_request& request, qspi_op** op){
+
+    if(handle == NULL || op == NULL || !valid_chip(request.flash_chip)){
+        return QSPI_ERROR_INVALID_ARGUMENT;
+    }
+    *op = NULL;
+    qspi_op* submitted = new(std::nothrow) qspi_op();
+    if(submitted == NULL){
+        return QSPI_ERROR_FAILED;
+    }
+
+    progress_callback progress = handle_progress(handle);
+    // the device lock is held by the engine while it runs, only take the state lock
+    std::lock_guard<std::mutex> guard(handle->state_lock);
+    if(!handle->engine){
+        handle->engine.reset(new qspi_engine(handle->device, handle->lock));
+    }
+    submitted->operation = handle->engine->submit(request, progress);
+    *op = submitted;
+    return QSPI_OK;
+}
+
+int qspi_read_async(qspi_handle* handle, int chip, uint32_t address, void* buffer,
+                unsigned long num_bytes, qspi_op** op){
+
+    if(buffer == NULL && num_bytes != 0){
+        return QSPI_ERROR_INVALID_ARGUMENT;
+    }
+    operation_request request = {OP_READ, chip, address, num_bytes, "", (uint8_t*)buffer, NULL, false, false};
+    return submit(handle, request, op);
+}
+
+int qspi_program_async(qspi_handle* handle, int chip, uint32_t address, const void* data,
+                unsigned long num_bytes, int flags, qspi_op** op){
+
+    if(data == NULL && num_bytes != 0){
+        return QSPI_ERROR_INVALID_ARGUMENT;
+    }
+    operation_request request = {OP_PROGRAM, chip, address, num_bytes, "", NULL, (const uint8_t*)data,
+                                (flags & QSPI_PROGRAM_ERASE) != 0, (flags & QSPI_PROGRAM_VERIFY) != 0};
+    return submit(handle, request, op);
+}
+
+int qspi_erase_async(qspi_handle* handle, int chip, uint32_t address, unsigned long num_bytes,
+                qspi_op** op){
+
+    operation_request request = {OP_ERASE, chip, address, num_bytes, "", NULL, NULL, false, false};
+    return submit(handle, request, op);
+}
+
+int qspi_verify_async(qspi_handle* handle, int chip, uint32_t address, const void* data,
+                unsigned long num_bytes, qspi_op** op){
+
+    if(data == NULL && num_bytes != 0){
+        return QSPI_ERROR_INVALID_ARGUMENT;
+    }
+    operation_request request = {OP_VERIFY, chip, address, num_bytes, "", NULL, (const uint8_t*)data, false, false};
+    return submit(handle, request, op);
+}
+
+int qspi_op_cancel(qspi_op* op){
+
+    if(op == NULL){
+        return QSPI_ERROR_INVALID_ARGUMENT;
+    }
+    op->operation->cancel();
+    return QSPI_OK;
+}
+
+int qspi_op_wait(qspi_op* op, int timeout_ms){
+
+    if(op == NULL){
+        return QSPI_ERROR_INVALID_ARGUMENT;
+    }
+    if(timeout_ms < 0){
+        op->operation->wait();
+    }
+    else if(!op->operation->wait_for(std::chrono::milliseconds(timeout_ms))){
+        return QSPI_ERROR_TIMEOUT;
+    }
+    return op->operation->error_code();
+}
+
+int qspi_op_wait_any(qspi_op** ops, int num_ops, int timeout_ms){
+
+    if(ops == NULL || num_ops <= 0){
+        return QSPI_ERROR_INVALID_ARGUMENT;
+    }
+    std::vector<operation_handle> operations;
+    for(int i = 0; i < num_ops; i++){
+        if(ops[i] == NULL){
+            return QSPI_ERROR_INVALID_ARGUMENT;
+        }
+        operations.push_back(ops[i]->operation);
+    }
+    try{
+        long first = qspi_engine::wait_any(operations, std::chrono::milliseconds(timeout_ms));
+        return first < 0 ? (int)QSPI_ERROR_TIMEOUT : (int)first;
+    }
+    catch(mem_exception& err){
+        return err.code();
+    }
+}
+
+int qspi_op_state(qspi_op* op, int* state, unsigned long long* done, unsigned long long* total,
+                uint8_t* crc){
+
+    if(op == NULL || state == NULL){
+        return QSPI_ERROR_INVALID_ARGUMENT;
+    }
+    // operation_state follows the order of the QSPI_OP_ defines
+    *state = (int)op->operation->state();
+    if(done != NULL){
+        *done = op->operation->bytes_done();
+    }
+    if(total != NULL){
+        *total = op->operation->bytes_total();
+    }
+    if(crc != NULL){
+        *crc = op->operation->crc();
+    }
+    return QSPI_OK;
+}
+
+const char* qspi_op_error(qspi_op* op){
+
+    if(op == NULL){
+        return "";
+    }
+    op->error = op->operation->error();
+    return op->error.c_str();
+}
+
+void qspi_op_free(qspi_op* op){
+    delete op;
+}
+
+const char* qspi_last_error(qspi_handle* handle){
+
+    if(handle == NULL){
+        return "";
+    }
+    std::lock_guard<std::mutex> guard(handle->error_lock);
+    return handle->last_error.c_str();
+}
+
+int qspi_copy_last_error(qspi_handle* handle, char* buffer, unsigned long size){
+
+    if(handle == NULL || buffer == NULL || size == 0){
+        return QSPI_ERROR_INVALID_ARGUMENT;
+    }
+    std::lock_guard<std::mutex> guard(handle->error_lock);
+    unsigned long length = std::min((unsigned long)handle->last_error.size(), size - 1);
+    memcpy(buffer, handle->last_error.c_str(), length);
+    buffer[length] = '\0';
+    return QSPI_OK;
+}
+
+const char* qspi_error_name(int code){
+
+    switch(code){
+        case QSPI_OK: return "QSPI_OK";
+        case QSPI_ERROR_FAILED: return "QSPI_ERROR_FAILED";
+        case QSPI_ERROR_INVALID_ARGUMENT: return "QSPI_ERROR_INVALID_ARGUMENT";
+        case QSPI_ERROR_MAP: return "QSPI_ERROR_MAP";
+        case QSPI_ERROR_FLASH_SELECT: return "QSPI_ERROR_FLASH_SELECT";
+        case QSPI_ERROR_PROTECTED: return "QSPI_ERROR_PROTECTED";
+        case QSPI_ERROR_WRITE_ENABLE: return "QSPI_ERROR_WRITE_ENABLE";
+        case QSPI_ERROR_QUAD_MODE: return "QSPI_ERROR_QUAD_MODE";
+        case QSPI_ERROR_ERASE: return "QSPI_ERROR_ERASE";
+        case QSPI_ERROR_PROGRAM: return "QSPI_ERROR_PROGRAM";
+        case QSPI_ERROR_VERIFY: return "QSPI_ERROR_VERIFY";
+        case QSPI_ERROR_IO: return "QSPI_ERROR_IO";
+        case QSPI_ERROR_CANCELLED: return "QSPI_ERROR_CANCELLED";
+        case QSPI_ERROR_TIMEOUT: return "QSPI_ERROR_TIMEOUT";
+        default: return "QSPI_ERROR_UNKNOWN";
+    }
+}
@@ -0,0 +1,232 @@
+/*
+*   libqspi.h
+*   @Author Sophie Kirkham STFC, 2018
+*   C API of libqspi, the qspi_device functionality as a shared and static library
+*   Lets other programs (e.g. Python through ctypes) read, program and erase ..
+*   the 4 flash memory devices on the FEM-II in-process.
+*   Every function returns a qspi_error code, QSPI_OK on success, and the ..
+*   message of the last error is available from qspi_last_error().
+*   Calls on one handle are serialised, the flash chip is deselected after every call.
+*   The _async calls queue the operation on the handle's engine thread and ..
+*   return a qspi_op straight away, to be waited on, cancelled and freed.
+*/
+
+#ifndef LIBQSPI_H_
+#define LIBQSPI_H_
+
+#include <stdint.h>
+
+#include "qspi_errors.h"
+
+#define LIBQSPI_VERSION 1   // Incremented when the API changes incompatibly
+
+// Flags for qspi_program
+#define QSPI_PROGRAM_ERASE 0x01     // Erase the sectors being programmed first
+#define QSPI_PROGRAM_VERIFY 0x02    // Read back and compare every byte programmed
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Opaque handle to the mapped qspi controller and multiplexer
+typedef struct qspi_handle qspi_handle;
+
+// Opaque handle to an asynchronous operation
+typedef struct qspi_op qspi_op;
+
+// States of an asynchronous operation
+#define QSPI_OP_QUEUED 0        // waiting for the engine thread
+#define QSPI_OP_RUNNING 1       // running on the engine thread
+#define QSPI_OP_DONE 2          // finished successfully
+#define QSPI_OP_FAILED 3        // finished with an error
+#define QSPI_OP_CANCELLED 4     // cancelled before it finished
+
+/*  Called as reads, programs and erases advance
+*   Called on the handle's progress thread without the handle locked, so ..
+*   it may call the API, a call using the flash waits for the operation ..
+*   in progress. Reports not yet delivered are replaced by newer ones, a ..
+*   synchronous call returns once its reports have been delivered.
+*   @param done : the number of bytes done
+*   @param total : the number of bytes in the operation
+*   @param user : the pointer given to qspi_set_progress
+*/
+typedef void (*qspi_progress_fn)(unsigned long long done, unsigned long long total, void* user);
+
+/*  @returns LIBQSPI_VERSION of the library loaded.
+*/
+int qspi_version(void);
+
+/*  Maps the qspi controller and multiplexer.
+*   @param handle : set to the new handle
+*/
+int qspi_open(qspi_handle** handle);
+
+/*  Maps the QSPI controller's XIP read port, reads and verifies then copy ..
+*   out of it instead of driving the FIFOs.
+*   @param file : NULL or "/dev/mem" for the port, or a flash image file standing in for it
+*/
+int qspi_use_xip(qspi_handle* handle, const char* file);
+
+/*  Moves FIFO transfers with a DMA engine instead of the CPU.
+*   @param engine : NULL or "cdma" for the AXI CDMA, "emulated" for a stand-in engine
+*/
+int qspi_use_dma(qspi_handle* handle, const char* engine);
+
+/*  Deselects the flash, un-maps the controller and multiplexer and frees the handle.
+*   Returns QSPI_ERROR_INVALID_ARGUMENT if called from the progress callback.
+*/
+int qspi_close(qspi_handle* handle);
+
+/*  Sets the progress callback of a handle, NULL disables it.
+*/
+int qspi_set_progress(qspi_handle* handle, qspi_progress_fn callback, void* user);
+
+/*  Reads flash memory into the caller's buffer.
+*   @param chip : the flash chip, 1-4
+*   @param address : the flash address to read from
+*   @param buffer : the buffer to read into, at least num_bytes long
+*   @param num_bytes : the number of bytes to read
+*   @param crc : if not NULL, set to the CRC-8 of the bytes read
+*   Returns QSPI_ERROR_INVALID_ARGUMENT if the range runs past the end of the flash, ..
+*   as do qspi_program, qspi_erase and the _async calls.
+*/
+int qspi_read(qspi_handle* handle, int chip, uint32_t address, void* buffer,
+                unsigned long num_bytes, uint8_t* crc);
+
+/*  Programs flash memory from the caller's buffer.
+*   The bytes must be erased first, or QSPI_PROGRAM_ERASE given in flags.
+*   @param chip : the flash chip, 1-4
+*   @param address : the flash address to program from
+*   @param data : the bytes to program
+*   @param num_bytes : the number of bytes to program
+*   @param flags : QSPI_PROGRAM_ERASE and / or QSPI_PROGRAM_VERIFY
+*   @param crc : if not NULL, set to the CRC-8 of the bytes programmed
+*/
+int qspi_program(qspi_handle* handle, int chip, uint32_t address, const void* data,
+                unsigned long num_bytes, int flags, uint8_t* crc);
+
+/*  Erases the sectors holding a range of flash memory, the whole chip is bulk erased.
+*   @param chip : the flash chip, 2-4, chip 1 is protected
+*   @param address : the first address to erase
+*   @param num_bytes : the number of bytes to erase, rounded out to the chip's erase unit
+*/
+int qspi_erase(qspi_handle* handle, int chip, uint32_t address, unsigned long num_bytes);
+
+/*  Reads flash memory like pread(2), through the handle's read cache.
+*   Small repeated reads (headers, version words) are served from memory, ..
+*   the cache is invalidated by programs and erases through the handle.
+*   @param chip : the flash chip, 1-4
+*   @param address : the flash address to read from
+*   @param buffer : the buffer to read into, at least num_bytes long
+*   @param num_bytes : the number of bytes to read
+*   @param bytes_read : set to the bytes read, short past the end of the flash
+*/
+int qspi_pread(qspi_handle* handle, int chip, uint32_t address, void* buffer,
+                unsigned long num_bytes, unsigned long* bytes_read);
+
+/*  Sizes the read cache, dropping the least recently used blocks if smaller.
+*   @param num_blocks : the most 4KB blocks to hold, 0 disables the cache
+*/
+int qspi_set_cache(qspi_handle* handle, unsigned long num_blocks);
+
+/*  Reads the read cache statistics, each pointer may be NULL.
+*   @param hits : set to the blocks served from the cache
+*   @param misses : set to the blocks read from the flash
+*   @param evictions : set to the blocks dropped to make room
+*/
+int qspi_cache_stats(qspi_handle* handle, unsigned long long* hits, unsigned long long* misses,
+                unsigned long long* evictions);
+
+/*  Reads the flash status and config registers.
+*   @param chip : the flash chip, 1-4
+*   @param status : set to the status register
+*   @param config : set to the config register
+*/
+int qspi_read_status(qspi_handle* handle, int chip, uint8_t* status, uint8_t* config);
+
+/*  Queues a read of flash memory into the caller's buffer.
+*   The buffer must stay valid until the operation has finished.
+*   @param op : set to the new operation, freed with qspi_op_free
+*   The progress callback of the handle is called on its progress thread.
+*/
+int qspi_read_async(qspi_handle* handle, int chip, uint32_t address, void* buffer,
+                unsigned long num_bytes, qspi_op** op);
+
+/*  Queues a program of flash memory from the caller's buffer, see qspi_program.
+*   The data must stay valid until the operation has finished.
+*/
+int qspi_program_async(qspi_handle* handle, int chip, uint32_t address, const void* data,
+                unsigned long num_bytes, int flags, qspi_op** op);
+
+/*  Queues an erase of the sectors holding a range of flash memory, see qspi_erase.
+*/
+int qspi_erase_async(qspi_handle* handle, int chip, uint32_t address, unsigned long num_bytes,
+                qspi_op** op);
+
+/*  Queues a comparison of flash memory against the caller's buffer.
+*   The data must stay valid until the operation has finished.
+*/
+int qspi_verify_async(qspi_handle* handle, int chip, uint32_t address, const void* data,
+                unsigned long num_bytes, qspi_op** op);
+
+/*  Asks an operation to stop, at the next FIFO of a read, page of a program ..
+*   or sector of an erase, leaving the flash deselected. A queued operation ..
+*   never starts, a bulk erase once issued runs to completion.
+*/
+int qspi_op_cancel(qspi_op* op);
+
+/*  Waits for an operation to finish.
+*   @param timeout_ms : the longest to wait, negative to wait forever
+*   @returns the result of the operation (QSPI_ERROR_CANCELLED if cancelled), ..
+*   QSPI_ERROR_TIMEOUT if it has not finished.
+*/
+int qspi_op_wait(qspi_op* op, int timeout_ms);
+
+/*  Waits for any one of several operations, from the same handle, to finish.
+*   @param ops : the operations to wait on
+*   @param num_ops : the number of operations
+*   @param timeout_ms : the longest to wait, negative to wait forever
+*   @returns the index of the first finished operation, QSPI_ERROR_TIMEOUT ..
+*   if none has finished.
+*/
+int qspi_op_wait_any(qspi_op** ops, int num_ops, int timeout_ms);
+
+/*  Reads the state and progress of an operation.
+*   @param state : set to the QSPI_OP_ state
+*   @param done : if not NULL, set to the bytes done
+*   @param total : if not NULL, set to the bytes in the operation
+*   @param crc : if not NULL, set to the CRC of the bytes read or programmed
+*/
+int qspi_op_state(qspi_op* op, int* state, unsigned long long* done, unsigned long long* total,
+                uint8_t* crc);
+
+/*  @returns the error message of a failed or cancelled operation, "" otherwise.
+*   Valid until the operation is freed.
+*/
+const char* qspi_op_error(qspi_op* op);
+
+/*  Frees an operation handle, an unfinished operation carries on running.
+*/
+void qspi_op_free(qspi_op* op);
+
+/*  @returns the message of the last error on the handle, "" if none.
+*   Valid until the next call on the handle, from any thread, as every ..
+*   call clears it. Use qspi_copy_last_error when other threads share the handle.
+*/
+const char* qspi_last_error(qspi_handle* handle);
+
+/*  Copies the message of the last error on the handle, "" if none.
+*   @param buffer : the buffer to copy into, always nul terminated
+*   @param size : the size of the buffer, a longer message is truncated
+*/
+int qspi_copy_last_error(qspi_handle* handle, char* buffer, unsigned long size);
+
+/*  @returns the name of a qspi_error code.
+*/
+const char* qspi_error_name(int code);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
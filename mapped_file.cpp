@@ -0,0 +1,103 @@
+/*
+*   mapped_file.cpp
+*   @Author Sophie Kirkham STFC, 2018
+*   Implementation for the mapped_file class
+*   Maps an image file read-only, providing direct access to its bytes
+*/
+
+#include "mapped_file.h"
+
+/*
+*   Constructor for mapped_file objects, no file is mapped until open().
+*/
+mapped_file::mapped_file() :
+    file_descriptor(-1),
+    map_base(NULL),
+    map_size(0)
+{}
+
+/*
+*   Destructor for mapped_file objects, un-maps any open image.
+*/
+mapped_file::~mapped_file(){
+    this->close();
+}
+
+/*
+*   Opens and maps an image file read-only.
+*   The kernel is advised the mapping will be read sequentially so it ..
+*   reads ahead aggressively and drops pages behind the program engine.
+*   @param filename : the name of the image file to map
+*   @throws mem_exception : if the file fails to open
+*   @throws mem_exception : if the mmap fails to map the file
+*/
+void mapped_file::open(const std::string& filename){
+
+    this->close();
+
+    // open the file read only, setting the file descriptor.
+    if((this->file_descriptor = ::open(filename.c_str(), O_RDONLY)) == -1){
+        throw mem_exception("File Failed to Open", QSPI_ERROR_IO);
+    }
+
+    // find the size of the file to map.
+    struct stat file_info;
+    if(fstat(this->file_descriptor, &file_info) == -1){
+        this->close();
+        throw mem_exception("File Failed to Open", QSPI_ERROR_IO);
+    }
+    this->map_size = file_info.st_size;
+
+    // an empty file has nothing to map.
+    if(this->map_size == 0){
+        return;
+    }
+
+    // map the whole file, private and read only.
+    void* mapped = mmap(0, this->map_size, PROT_READ, MAP_PRIVATE, this->file_descriptor, 0);
+    if(mapped == MAP_FAILED){
+        this->close();
+        throw mem_exception("Memory map failed to map the image file.", QSPI_ERROR_IO);
+    }
+    this->map_base = (uint8_t*)mapped;
+
+    // advise the kernel the image is consumed front to back.
+    madvise(this->map_base, this->map_size, MADV_SEQUENTIAL);
+}
+
+/*
+*   Un-maps the image and closes the file, safe to call when not open.
+*/
+void mapped_file::close(){
+
+    if(this->map_base != NULL){
+        munmap(this->map_base, this->map_size);
+        this->map_base = NULL;
+    }
+    if(this->file_descriptor != -1){
+        ::close(this->file_descriptor);
+        this->file_descriptor = -1;
+    }
+    this->map_size = 0;
+}
+
+/*
+*   @returns true if an image file is currently open.
+*/
+bool mapped_file::is_open(){
+    return this->file_descriptor != -1;
+}
+
+/*
+*   @returns a pointer to the first byte of the mapped image.
+*/
+const uint8_t* mapped_file::data(){
+    return this->map_base;
+}
+
+/*
+*   @returns the size of the mapped image in bytes.
+*/
+unsigned long mapped_file::size(){
+    return this->map_size;
+}
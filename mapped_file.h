@@ -0,0 +1,44 @@
+/*
+*   mapped_file.h
+*   @Author Sophie Kirkham STFC, 2018
+*   Header file for the mapped_file class
+*   Class to memory map a binary image file read-only for programming.
+*/
+
+#ifndef MAPPED_FILE_H_
+#define MAPPED_FILE_H_
+
+#include <stdint.h>
+#include <string>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "mem_exception.h"
+
+/*
+*   Class to map an image file into memory with read-only, sequential access
+*   The mapping is shared by the program, skip-blank and verify passes so ..
+*   the file is only paged in from storage once.
+*/
+class mapped_file{
+
+    public:
+
+        mapped_file();
+        ~mapped_file();
+        void open(const std::string& filename);
+        void close();
+        bool is_open();
+        const uint8_t* data();
+        unsigned long size();
+
+    private:
+
+        int file_descriptor;    // file descriptor of the open image file
+        uint8_t* map_base;      // start of the mapped image
+        unsigned long map_size; // size of the mapped image in bytes
+};
+
+#endif
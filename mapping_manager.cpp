@@ -0,0 +1,139 @@
+/*
+*   mapping_manager.cpp
+*   @Author Sophie Kirkham STFC, 2018
+*   Implementation of the mapping_manager and mapped_region classes
+*/
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "mapping_manager.h"
+
+/*
+*   Constructor for mapped_region objects, only called by mapping_manager::map().
+*/
+mapped_region::mapped_region(std::shared_ptr<mapping_manager> owner, void* map_base, unsigned long map_length, 
+                            uint8_t* start, unsigned long length) :
+    owner(owner),
+    map_base(map_base),
+    map_length(map_length),
+    start(start),
+    length(length)
+{
+}
+
+/*
+*   Destructor for mapped_region objects, un-maps the region.
+*/
+mapped_region::~mapped_region(){
+    munmap(this->map_base, this->map_length);
+}
+
+/*
+*   Constructor for mapping_manager objects, only called by open().
+*/
+mapping_manager::mapping_manager(const std::string& file, bool writable, int file_descriptor) :
+    device_file(file),
+    writable(writable),
+    file_descriptor(file_descriptor)
+{
+}
+
+/*
+*   Destructor for mapping_manager objects, closes the file.
+*/
+mapping_manager::~mapping_manager(){
+    close(this->file_descriptor);
+}
+
+/*
+*   Gets the manager of a device file, opening the file the first time.
+*   The file stays open for the life of the process.
+*   @param file : the file to map regions from, MEM_DEVICE for physical addresses
+*   @param writable : true to map regions read and write, false read only
+*   @throws mem_exception : if the file fails to open
+*/
+std::shared_ptr<mapping_manager> mapping_manager::open(const std::string& file, bool writable){
+
+    static std::mutex registry_lock;
+    static std::map<std::pair<std::string, bool>, std::shared_ptr<mapping_manager> > registry;
+
+    std::lock_guard<std::mutex> guard(registry_lock);
+    std::shared_ptr<mapping_manager>& manager = registry[std::make_pair(file, writable)];
+    if(!manager){
+        int descriptor = ::open(file.c_str(), (writable ? O_RDWR : O_RDONLY) | O_SYNC);
+        if(descriptor == -1){
+            registry.erase(std::make_pair(file, writable));
+            throw mem_exception("Dev mem failed to open.", QSPI_ERROR_MAP);
+        }
+        manager.reset(new mapping_manager(file, writable, descriptor));
+    }
+    return manager;
+}
+
+/*
+*   Maps a region of the file, or hands back the region if already mapped.
+*   @param base : the offset into the file, the physical address for MEM_DEVICE
+*   @param size : the number of bytes to map
+*   @throws mem_exception : if the mmap fails to map the area
+*/
+region_handle mapping_manager::map(off_t base, unsigned long size){
+
+    std::lock_guard<std::mutex> guard(this->lock);
+    std::pair<off_t, unsigned long> key(base, size);
+    std::map<std::pair<off_t, unsigned long>, std::weak_ptr<mapped_region> >::iterator found = this->regions.find(key);
+    if(found != this->regions.end()){
+        region_handle region = found->second.lock();
+        if(region){
+            return region;
+        }
+        this->regions.erase(found);
+    }
+
+    int protection = this->writable ? PROT_READ | PROT_WRITE : PROT_READ;
+    // Target is clipped to the page boundary
+    off_t page_offset = base & (PAGE_MASK_SIZE - 1);
+    unsigned long map_length = size + page_offset;
+    void* map_base = mmap(0, map_length, protection, MAP_SHARED, this->file_descriptor, base - page_offset);
+    if(map_base == MAP_FAILED){
+        throw mem_exception("Memory map failed to map the addressed area.", QSPI_ERROR_MAP);
+    }
+    uint8_t* start = (uint8_t*)map_base + page_offset;
+    region_handle region(new mapped_region(shared_from_this(), map_base, map_length, start, size));
+    this->regions[key] = region;
+    return region;
+}
+
+/*
+*   Maps the registers of an IP block.
+*   @param base : the physical address of the registers
+*   @param size : the number of bytes of registers
+*   @throws mem_exception : if the mmap fails to map the area
+*/
+register_window mapping_manager::registers(off_t base, unsigned long size){
+    return register_window(map(base, size), 0);
+}
+
+/*
+*   @returns the file regions are mapped from.
+*/
+const std::string& mapping_manager::file() const{
+    return this->device_file;
+}
+
+/*
+*   @returns the number of regions currently mapped.
+*/
+unsigned long mapping_manager::regions_mapped(){
+
+    std::lock_guard<std::mutex> guard(this->lock);
+    unsigned long mapped = 0;
+    std::map<std::pair<off_t, unsigned long>, std::weak_ptr<mapped_region> >::iterator it;
+    for(it = this->regions.begin(); it != this->regions.end(); ++it){
+        if(!it->second.expired()){
+            mapped++;
+        }
+    }
+    return mapped;
+}
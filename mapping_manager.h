@@ -0,0 +1,145 @@
+/*
+*   mapping_manager.h
+*   @Author Sophie Kirkham STFC, 2018
+*   Header file for the mapping_manager, mapped_region and register_window classes
+*   One mapping_manager per device file (e.g. /dev/mem) holds the file open ..
+*   for the life of the process and maps regions of any size out of it, so ..
+*   mapping another region costs a single mmap and no open. Regions are ..
+*   shared, mapping a region already mapped hands back the same mapping, and ..
+*   are un-mapped once the last handle to them is released.
+*/
+
+#ifndef MAPPING_MANAGER_H_
+#define MAPPING_MANAGER_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <string>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+#include "mem_exception.h"
+
+#define PAGE_MASK_SIZE 4096UL       // Size of the pages regions are mapped in
+
+class mapping_manager;
+
+/*
+*   A mapped region of a device file, un-mapped when destroyed
+*   Hand out through mapping_manager::map() as a region_handle.
+*/
+class mapped_region{
+
+    public:
+
+        ~mapped_region();
+
+        /*  @returns the mapped address of the region's base.
+        */
+        uint8_t* base() const{
+            return this->start;
+        };
+
+        /*  @returns the number of bytes mapped from the base.
+        */
+        unsigned long size() const{
+            return this->length;
+        };
+
+        /*  Reads a register of the region.
+        *   @param offset : the byte offset of the register from the base
+        */
+        template<typename T> T read(uint32_t offset) const{
+            return *(volatile T*)(this->start + offset);
+        };
+
+        /*  Writes a register of the region.
+        *   @param offset : the byte offset of the register from the base
+        *   @param value : the value to write
+        */
+        template<typename T> void write(uint32_t offset, T value) const{
+            *(volatile T*)(this->start + offset) = value;
+        };
+
+    private:
+
+        friend class mapping_manager;
+
+        std::shared_ptr<mapping_manager> owner; // the manager holding the file open
+        void* map_base;         // the address returned by mmap, page aligned
+        unsigned long map_length;   // the number of bytes passed to mmap
+        uint8_t* start;         // the address of the region's base
+        unsigned long length;   // the number of bytes from start
+
+        mapped_region(std::shared_ptr<mapping_manager> owner, void* map_base, unsigned long map_length, 
+                    uint8_t* start, unsigned long length);
+        mapped_region(const mapped_region&);
+        mapped_region& operator=(const mapped_region&);
+};
+
+typedef std::shared_ptr<mapped_region> region_handle;
+
+/*
+*   Typed access to the registers of one IP block within a mapped region
+*   Keeps the region mapped while the window is held.
+*/
+class register_window{
+
+    public:
+
+        register_window() : offset(0){};
+        register_window(region_handle region, uint32_t offset) : region(region), offset(offset){};
+
+        /*  @returns true if the window has a region to access.
+        */
+        bool valid() const{
+            return (bool)this->region;
+        };
+
+        template<typename T> T read(uint32_t reg) const{
+            return this->region->read<T>(this->offset + reg);
+        };
+
+        template<typename T> void write(uint32_t reg, T value) const{
+            this->region->write<T>(this->offset + reg, value);
+        };
+
+    private:
+
+        region_handle region;   // the region holding the registers
+        uint32_t offset;        // the byte offset of the registers in the region
+};
+
+/*
+*   Maps regions out of one device file opened once
+*   Get the manager of a file with mapping_manager::open().
+*/
+class mapping_manager : public std::enable_shared_from_this<mapping_manager>{
+
+    public:
+
+        ~mapping_manager();
+
+        static std::shared_ptr<mapping_manager> open(const std::string& file, bool writable);
+
+        region_handle map(off_t base, unsigned long size);
+        register_window registers(off_t base, unsigned long size);
+        const std::string& file() const;
+        unsigned long regions_mapped();
+
+    private:
+
+        std::string device_file;    // the file regions are mapped from
+        bool writable;              // true if the file is open read and write
+        int file_descriptor;        // the open file
+        std::mutex lock;            // guards regions
+        std::map<std::pair<off_t, unsigned long>, std::weak_ptr<mapped_region> > regions;  // live regions by base and size
+
+        mapping_manager(const std::string& file, bool writable, int file_descriptor);
+        mapping_manager(const mapping_manager&);
+        mapping_manager& operator=(const mapping_manager&);
+};
+
+#endif
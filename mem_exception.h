@@ -10,6 +10,8 @@
 #include <exception>
 #include <string>
 
+#include "qspi_errors.h"
+
 
 class mem_exception : public std::exception{
     
@@ -17,14 +19,17 @@ class mem_exception : public std::exception{
 
         // Blank mem_exception constructor
         mem_exception(void) throw() :
-            error_msg("")
+            error_msg(""),
+            error_code(QSPI_ERROR_FAILED)
         {};
 
         /*  mem_exception constructor with error message
         *   @param the_error_msg : the error message to throw
+        *   @param the_error_code : the qspi_error code of the error
         */
-        mem_exception(const std::string the_error_msg) throw() :
-            error_msg(the_error_msg)
+        mem_exception(const std::string the_error_msg, int the_error_code = QSPI_ERROR_FAILED) throw() :
+            error_msg(the_error_msg),
+            error_code(the_error_code)
         {};
 
         
@@ -35,12 +40,19 @@ class mem_exception : public std::exception{
             return error_msg.c_str();
         };
 
+        /*  @return : the qspi_error code of the error
+        */
+        int code(void) const throw(){
+            return error_code;
+        };
+
         // Destructor
         ~mem_exception(void) throw() {};
 
     private:
 
         const std::string error_msg;  // The error message
+        const int error_code;         // The qspi_error code
 
 };
 
@@ -7,46 +7,62 @@
 
 #include "memory_mapped_device.h"
 
+register_bus* memory_mapped_device::shared_bus = NULL;
+mmio_trace* memory_mapped_device::shared_trace = NULL;
+
 /*
 *   Constructor for qspi_memory objects.
 *   @Param base : base address for the device.
 */
-memory_mapped_device::memory_mapped_device(uint32_t base) {
+memory_mapped_device::memory_mapped_device(uint32_t base) :
+    bus(NULL),
+    map_size(MAP_SIZE),
+    device_file(MEM_DEVICE),
+    writable(true)
+{
+    this->target = base;
+}
 
+/*
+*   Constructor for memory_mapped_device objects mapping a larger window.
+*   @Param base : base address for the device, the offset into file.
+*   @Param size : the number of bytes to map
+*   @Param file : the file to map, MEM_DEVICE or a file standing in for it
+*   @Param write : true to map read and write, false read only
+*/
+memory_mapped_device::memory_mapped_device(uint32_t base, unsigned long size, const std::string& file, bool write) :
+    bus(NULL),
+    map_size(size),
+    device_file(file),
+    writable(write)
+{
     this->target = base;
 }
 
 /*
 *   Initialises the memory map using the qspi_memory class variables.
-*   Memory map is initialised with read,write and shared mapping.
+*   Memory map is initialised with read,write and shared mapping, through ..
+*   the mapping_manager of device_file.
 *   @throws mem_exception: if dev mem fails to open.
 *   @throws mem_exception: if the mmap fails to map the area.
 */
 void memory_mapped_device::map(){
 
-    // Open dev/mem setting the file descriptor (fd) with the output.
-    if((this->file_descriptor = open("/dev/mem", O_RDWR | O_SYNC)) == -1)
-    {
-        throw mem_exception("Dev mem failed to open.");
+    // registers on the bus are accessed through it, there is no memory to map
+    if(shared_bus != NULL && this->device_file == MEM_DEVICE){
+        if(this->map_size > MAP_SIZE){
+            throw mem_exception("Memory window not available on the " + shared_bus->name(), QSPI_ERROR_MAP);
+        }
+        this->bus = shared_bus;
+        return;
     }
 
-    // Map the address space, setting map_base.
-    this->map_base = mmap(0, 
-                    MAP_SIZE, // Size of the address space
-                    PROT_READ | PROT_WRITE, // Read and write access
-                    MAP_SHARED, // Share the mapping
-                    this->file_descriptor, // File descriptor for dev/mem
-                    this->target & ~MAP_MASK // Target is clipped to the page boundary. 
-    );
-
-    // Check to see if the mapped area has been mapped.
-    if(this->map_base == (void *) -1){
-       throw mem_exception("Memory map failed to map the addressed area.");
-    } 
-
-    // Set the virtual address to be the correct target address.
-    this->virt_addr = this->map_base + (this->target & MAP_MASK); 
+    // Map the address space from the shared file, the manager opens it once
+    this->region = mapping_manager::open(this->device_file, this->writable)->map(
+                    this->target, this->map_size);
 
+    // the registers start at the base of the region
+    this->registers = register_window(this->region, 0);
 }
 
 /*
@@ -58,23 +74,32 @@ void memory_mapped_device::map(){
 */    
 unsigned long memory_mapped_device::read_mem(uint32_t offset, uint8_t width){    
 
-    // get the full address to read from by adding the virtual base + offset
-    this->full_addr = this->virt_addr + offset;
+    count_metric(METRIC_MMIO_READS);
+    if(this->bus != NULL){
+        this->read_result = this->bus->read(this->target, offset, width);
+        if(shared_trace != NULL){
+            shared_trace->record(TRACE_READ, this->target, offset, width, this->read_result);
+        }
+        return this->read_result;
+    }
+    // read the register at offset from the base of the window
     switch(width) 
     {
         case 8:
-            this->read_result = *((unsigned char *) this->full_addr);
+            this->read_result = this->registers.read<uint8_t>(offset);
             break;
         case 16:
-            this->read_result = *((unsigned short *) this->full_addr);
+            this->read_result = this->registers.read<uint16_t>(offset);
             break;
         case 32:
-            this->read_result = *((unsigned short *) this->full_addr);
+            this->read_result = this->registers.read<uint32_t>(offset);
             break;
         default:
-            throw mem_exception("Illegal Data Width");
+            throw mem_exception("Illegal Data Width", QSPI_ERROR_INVALID_ARGUMENT);
+    }
+    if(shared_trace != NULL){
+        shared_trace->record(TRACE_READ, this->target, offset, width, this->read_result);
     }
-    fflush(stdout);
     return this->read_result;
 }
 
@@ -87,38 +112,74 @@ unsigned long memory_mapped_device::read_mem(uint32_t offset, uint8_t width){
 */
 unsigned long memory_mapped_device::write_mem(uint32_t offset, unsigned long the_data, uint8_t width){
 
-        this->full_addr = this->virt_addr + offset;
+        count_metric(METRIC_MMIO_WRITES);
+        if(shared_trace != NULL){
+            shared_trace->record(TRACE_WRITE, this->target, offset, width, the_data);
+        }
+        if(this->bus != NULL){
+            this->bus->write(this->target, offset, the_data, width);
+            return this->writeval = the_data;
+        }
         this->writeval = the_data;
 
         switch(width) 
         {
             case 8:
-                *((unsigned char *) this->full_addr) = this->writeval;
-                this->read_result = *((unsigned char *) this->full_addr);
+                this->registers.write<uint8_t>(offset, this->writeval);
+                this->read_result = this->registers.read<uint8_t>(offset);
                 break;
             case 16:
-                *((unsigned short *) this->full_addr) = this->writeval;
-                this->read_result = *((unsigned short *) this->full_addr);
+                this->registers.write<uint16_t>(offset, this->writeval);
+                this->read_result = this->registers.read<uint16_t>(offset);
                 break;
             case 32:
-                *((unsigned long *) this->full_addr) = this->writeval;
-                this->read_result = *((unsigned long *) this->full_addr);
+                this->registers.write<uint32_t>(offset, this->writeval);
+                this->read_result = this->registers.read<uint32_t>(offset);
                 break;
             default: 
-                throw mem_exception("Illegal Data Width");
+                throw mem_exception("Illegal Data Width", QSPI_ERROR_INVALID_ARGUMENT);
         }
+        return this->writeval;
 }
 
 /*
-*   Un maps the memory map
-*   @throws mem_exception : if it failed to un map the virtual address space.
+*   @returns the start of the mapped area, for windows read as plain memory.
+*/
+const uint8_t* memory_mapped_device::window() const{
+    return this->region ? this->region->base() : NULL;
+}
+
+/*
+*   Un maps the memory map, once no other device shares the region.
 */
 void memory_mapped_device::unmap(){
 
-    if(munmap((void *)this->map_base, MAP_SIZE) == -1) 
-    {
-        throw mem_exception("Memory Map Failed to Un-Map."); ;
-    }
-    close(this->file_descriptor);
+    this->bus = NULL;
+    this->registers = register_window();
+    this->region.reset();
+}
+
+/*
+*   Sets the bus /dev/mem devices access their registers through, from ..
+*   their next map() on. The bus must outlive the devices using it.
+*   @param bus : the bus, NULL to map /dev/mem
+*/
+void memory_mapped_device::set_register_bus(register_bus* bus){
+    shared_bus = bus;
 }
 
+/*
+*   @returns the bus /dev/mem devices access their registers through, NULL if mapped.
+*/
+register_bus* memory_mapped_device::get_register_bus(){
+    return shared_bus;
+}
+
+/*
+*   Sets the trace every register access is recorded to, from the next ..
+*   access on. The trace must outlive the accesses recorded to it.
+*   @param trace : the trace, NULL to stop recording
+*/
+void memory_mapped_device::set_mmio_trace(mmio_trace* trace){
+    shared_trace = trace;
+}
@@ -21,32 +21,59 @@
 #include <sys/types.h>
 #include <sys/mman.h>
 #include <stdint.h>
+#include <string>
 
 #include "mem_exception.h"
+#include "mapping_manager.h"
+#include "register_bus.h"
+#include "qspi_metrics.h"
+#include "mmio_trace.h"
 
 #define MAP_SIZE 4096UL 
 #define MAP_MASK (MAP_SIZE - 1)
 #define MAX_FIFO 128
+#define MEM_DEVICE "/dev/mem"   // The device file physical addresses are mapped from
 
 /*
 *   Class to memory map address space to access hardware resources
 *   Reads and Writes to memory in 8, 16 and 32 bits.
+*   The mapping is taken from the mapping_manager of the device file, so ..
+*   every device shares one open file, and the registers are accessed ..
+*   through a register_window on it. The region is released on unmap() or ..
+*   when the device is destroyed. When a register_bus is set, /dev/mem ..
+*   devices access their registers through it instead of mapping. When an ..
+*   mmio_trace is set, every register access is recorded to it.
 */
 class memory_mapped_device{
 
     public:
 
-        int file_descriptor; 
-        void *map_base, *virt_addr, *full_addr; 
+        region_handle region;   // the mapped region, empty when not mapped
+        register_window registers;  // typed access to the registers of region, invalid when not mapped
+        register_bus* bus;      // the bus the registers are accessed through, NULL if mapped
         unsigned long read_result, writeval;
         off_t target; 
+        unsigned long map_size;     // the number of bytes mapped from target
+        std::string device_file;    // the file mapped, /dev/mem or a file standing in for it
+        bool writable;              // true to map read and write, false read only
         memory_mapped_device();
         memory_mapped_device(uint32_t base);
+        memory_mapped_device(uint32_t base, unsigned long size, const std::string& file, bool write);
         ~memory_mapped_device(){};
         unsigned long read_mem(uint32_t offset, uint8_t width);
         unsigned long write_mem(uint32_t offset, unsigned long the_data, uint8_t width);
+        const uint8_t* window() const;
         void map();
         void unmap();
+
+        static void set_register_bus(register_bus* bus);
+        static register_bus* get_register_bus();
+        static void set_mmio_trace(mmio_trace* trace);
+
+    private:
+
+        static register_bus* shared_bus;    // the bus devices mapped from then on use, NULL for /dev/mem
+        static mmio_trace* shared_trace;    // records every register access, NULL if not tracing
 };
 
 #endif
@@ -0,0 +1,184 @@
+/*
+*   mmio_trace.cpp
+*   @Author Sophie Kirkham STFC, 2018
+*   Implementation of the mmio_trace class
+*   Records register accesses to a ring, drained to the trace file on a ..
+*   writer thread, and reads trace files back for replay.
+*/
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <fstream>
+
+#include "mmio_trace.h"
+#include "realtime.h"
+
+/*
+*   Opens the trace file, writes its header and starts the writer thread.
+*   @param filename : the trace file to write
+*   @param capacity : the records the ring holds, rounded up to a power of 2
+*   @throws mem_exception : if the file fails to open or the header to write
+*/
+mmio_trace::mmio_trace(const std::string& filename, unsigned long capacity) :
+    filename(filename),
+    head(0),
+    tail(0),
+    dropped(0),
+    start(std::chrono::steady_clock::now()),
+    stopping(false),
+    failed(false)
+{
+    unsigned long size = 1;
+    while(size < capacity){
+        size <<= 1;
+    }
+    // fault the ring in now, not on the first accesses
+    this->ring.assign(size, trace_record());
+
+    this->fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(this->fd == -1){
+        throw mem_exception("Failed to Open Trace File " + filename, QSPI_ERROR_IO);
+    }
+    trace_file_header header;
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.record_size = sizeof(trace_record);
+    if(::write(this->fd, &header, sizeof(header)) != sizeof(header)){
+        ::close(this->fd);
+        throw mem_exception("Failed to Write Trace File " + filename, QSPI_ERROR_IO);
+    }
+    this->writer = std::thread(&mmio_trace::run, this);
+}
+
+/*
+*   Writes out the records left in the ring and closes the file.
+*/
+mmio_trace::~mmio_trace(){
+    try{
+        close();
+    }
+    catch(mem_exception& err){
+    }
+}
+
+/*
+*   Stops the writer thread once it has written every record recorded.
+*   @throws mem_exception : if a write to the trace file failed
+*/
+void mmio_trace::close(){
+
+    if(this->fd == -1){
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> guard(this->lock);
+        this->stopping = true;
+    }
+    this->wake.notify_one();
+    this->writer.join();
+    ::close(this->fd);
+    this->fd = -1;
+    if(this->failed){
+        throw mem_exception("Failed to Write Trace File " + this->filename, QSPI_ERROR_IO);
+    }
+}
+
+/*
+*   @returns the number of register accesses recorded, dropped ones included.
+*/
+unsigned long long mmio_trace::records() const{
+    return this->head.load() + this->dropped.load();
+}
+
+/*
+*   @returns the number of register accesses dropped with the ring full.
+*/
+unsigned long long mmio_trace::records_dropped() const{
+    return this->dropped.load();
+}
+
+/*
+*   @returns the name of the trace file.
+*/
+const std::string& mmio_trace::file() const{
+    return this->filename;
+}
+
+/*
+*   Drains the ring every TRACE_FLUSH_MS until stopped, on the writer thread.
+*/
+void mmio_trace::run(){
+
+    enter_background();
+    std::unique_lock<std::mutex> guard(this->lock);
+    while(!this->stopping){
+        guard.unlock();
+        drain();
+        guard.lock();
+        this->wake.wait_for(guard, std::chrono::milliseconds(TRACE_FLUSH_MS));
+    }
+    guard.unlock();
+    drain();
+}
+
+/*
+*   Writes the records in the ring to the file, freeing their slots.
+*   After a failed write records are still drained but discarded, so ..
+*   recording never stalls.
+*/
+void mmio_trace::drain(){
+
+    unsigned long long head = this->head.load(std::memory_order_acquire);
+    unsigned long long tail = this->tail.load(std::memory_order_relaxed);
+    while(tail < head){
+        // write up to the end of the ring in one go
+        unsigned long first = tail & (this->ring.size() - 1);
+        unsigned long count = std::min((unsigned long long)(this->ring.size() - first), head - tail);
+        const char* data = (const char*)&this->ring[first];
+        unsigned long num_bytes = count * sizeof(trace_record);
+        unsigned long written = 0;
+        while(!this->failed && written < num_bytes){
+            ssize_t bytes = ::write(this->fd, data + written, num_bytes - written);
+            if(bytes < 0){
+                if(errno == EINTR){
+                    continue;
+                }
+                this->failed = true;
+                break;
+            }
+            written += bytes;
+        }
+        tail += count;
+        this->tail.store(tail, std::memory_order_release);
+    }
+}
+
+/*
+*   Reads every record of a trace file.
+*   @param filename : the trace file to read
+*   @throws mem_exception : if the file fails to open or is not a trace of this version
+*   @returns the records, in the order they were recorded.
+*/
+std::vector<trace_record> read_trace(const std::string& filename){
+
+    std::ifstream file(filename.c_str(), std::ios::binary);
+    if(!file){
+        throw mem_exception("Failed to Open Trace File " + filename, QSPI_ERROR_IO);
+    }
+    trace_file_header header;
+    if(!file.read((char*)&header, sizeof(header)) || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0){
+        throw mem_exception(filename + " Is Not A Register Trace", QSPI_ERROR_INVALID_ARGUMENT);
+    }
+    if(header.version != TRACE_VERSION || header.record_size != sizeof(trace_record)){
+        throw mem_exception(filename + " Is A Trace Of An Unsupported Version", QSPI_ERROR_INVALID_ARGUMENT);
+    }
+    std::vector<trace_record> records;
+    trace_record entry;
+    while(file.read((char*)&entry, sizeof(entry))){
+        records.push_back(entry);
+    }
+    return records;
+}
@@ -0,0 +1,114 @@
+/*
+*   mmio_trace.h
+*   @Author Sophie Kirkham STFC, 2018
+*   Header file for the mmio_trace class and the trace file format
+*   Records every register access made through memory_mapped_device to a ..
+*   compact binary trace, so a slow or failing run from the field can be ..
+*   replayed into the qspi_simulator with qspi_replay. Accesses are stored ..
+*   in a preallocated ring, written to the file by a writer thread, so ..
+*   tracing adds a few stores to each access rather than a write(2). If ..
+*   the writer falls a whole ring behind, accesses are dropped and counted, ..
+*   never waited for.
+*   The trace file is a trace_file_header followed by trace_records, in ..
+*   the byte order of the machine that recorded it.
+*/
+
+#ifndef MMIO_TRACE_H_
+#define MMIO_TRACE_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+
+#include "mem_exception.h"
+
+#define TRACE_MAGIC "QSPITRC1"      // First 8 bytes of a trace file
+#define TRACE_VERSION 1             // Incremented when the record layout changes
+#define TRACE_RING_RECORDS 1048576  // Records the ring holds, a power of 2 (24MB)
+#define TRACE_FLUSH_MS 10           // Longest the writer thread sleeps between drains
+
+enum trace_direction{
+    TRACE_READ = 0,     // a register read, value is the value read
+    TRACE_WRITE = 1     // a register write, value is the value written
+};
+
+struct trace_file_header{
+    char magic[8];          // TRACE_MAGIC
+    uint32_t version;       // TRACE_VERSION
+    uint32_t record_size;   // sizeof(trace_record)
+};
+
+struct trace_record{
+    uint64_t time_ns;       // time since the trace started
+    uint32_t base;          // base address of the device e.g. QSPI_BASE
+    uint32_t value;         // the value read or written
+    uint16_t offset;        // the offset of the register from base
+    uint8_t width;          // the data width in bits (8, 16, 32)
+    uint8_t direction;      // a trace_direction
+    uint32_t reserved;      // 0, pads the record to 24 bytes
+};
+
+class mmio_trace{
+
+    public:
+
+        mmio_trace(const std::string& filename, unsigned long capacity = TRACE_RING_RECORDS);
+        ~mmio_trace();
+
+        /*  Records one register access, called by one thread at a time.
+        *   @param direction : TRACE_READ or TRACE_WRITE
+        *   @param base : the base address of the device
+        *   @param offset : the offset of the register from base
+        *   @param width : the data width in bits
+        *   @param value : the value read or written
+        */
+        void record(trace_direction direction, uint32_t base, uint32_t offset, uint8_t width, unsigned long value){
+            unsigned long long head = this->head.load(std::memory_order_relaxed);
+            if(head - this->tail.load(std::memory_order_acquire) >= this->ring.size()){
+                this->dropped++;
+                return;
+            }
+            trace_record& entry = this->ring[head & (this->ring.size() - 1)];
+            entry.time_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            std::chrono::steady_clock::now() - this->start).count();
+            entry.base = base;
+            entry.value = value;
+            entry.offset = offset;
+            entry.width = width;
+            entry.direction = direction;
+            entry.reserved = 0;
+            this->head.store(head + 1, std::memory_order_release);
+        };
+
+        void close();
+        unsigned long long records() const;
+        unsigned long long records_dropped() const;
+        const std::string& file() const;
+
+    private:
+
+        std::string filename;       // the trace file
+        int fd;                     // the open trace file, -1 once closed
+        std::vector<trace_record> ring;     // accesses waiting to be written
+        std::atomic<unsigned long long> head;   // records added, written by the recording thread
+        std::atomic<unsigned long long> tail;   // records written, written by the writer thread
+        std::atomic<unsigned long long> dropped;    // records dropped with the ring full
+        std::chrono::steady_clock::time_point start;    // time 0 of the trace
+        std::mutex lock;            // guards stopping
+        std::condition_variable wake;   // wakes the writer thread to stop
+        bool stopping;              // set to drain the ring and stop the writer
+        bool failed;                // set if a write to the file failed
+        std::thread writer;         // writes the ring to the file
+
+        void run();
+        void drain();
+};
+
+std::vector<trace_record> read_trace(const std::string& filename);
+
+#endif
@@ -0,0 +1,174 @@
+/*
+*   mtd_backend.cpp
+*   @Author Sophie Kirkham STFC, 2018
+*   Implementation of the mtd_backend class
+*/
+
+#include <string.h>
+#include <errno.h>
+#include <vector>
+
+#include "mtd_backend.h"
+
+/*
+*   Constructor for mtd_backend objects, opens the device.
+*   @param device_file : the MTD character device e.g. /dev/mtd0, or a plain file
+*   @throws mem_exception : if the device fails to open or is neither an MTD device nor a file
+*/
+mtd_backend::mtd_backend(const std::string& device_file) :
+    device_file(device_file),
+    is_mtd(false),
+    block_size(SECTOR_SIZE),
+    device_size(0)
+{
+    if((this->file_descriptor = open(device_file.c_str(), O_RDWR | O_CLOEXEC)) == -1){
+        throw mem_exception("Failed to Open MTD Device " + device_file + " : " + strerror(errno), QSPI_ERROR_MAP);
+    }
+
+    struct mtd_info_user info;
+    struct stat file_stat;
+    if(ioctl(this->file_descriptor, MEMGETINFO, &info) == 0){
+        if(info.type != MTD_NORFLASH){
+            close(this->file_descriptor);
+            throw mem_exception(device_file + " Is Not A NOR Flash MTD Device", QSPI_ERROR_INVALID_ARGUMENT);
+        }
+        this->is_mtd = true;
+        this->block_size = info.erasesize;
+        this->device_size = info.size;
+    }
+    else if(fstat(this->file_descriptor, &file_stat) == 0 && S_ISREG(file_stat.st_mode)){
+        // a plain file stands in for the flash, the 256KB sectors of the chip
+        this->device_size = file_stat.st_size;
+    }
+    else{
+        close(this->file_descriptor);
+        throw mem_exception(device_file + " Is Neither An MTD Device Nor A File", QSPI_ERROR_INVALID_ARGUMENT);
+    }
+}
+
+/*
+*   Destructor for mtd_backend objects, closes the device.
+*/
+mtd_backend::~mtd_backend(){
+    close(this->file_descriptor);
+}
+
+/*
+*   @returns the name of the backend for messages.
+*/
+std::string mtd_backend::name() const{
+    return (this->is_mtd ? "MTD " : "file ") + this->device_file;
+}
+
+/*
+*   Checks a range lies within the device.
+*   @throws mem_exception : if the range passes the end of the device
+*/
+void mtd_backend::check_range(uint32_t address, unsigned long num_bytes) const{
+
+    if((unsigned long long)address + num_bytes > this->device_size){
+        throw mem_exception("Address Range Passes The End Of " + this->device_file, QSPI_ERROR_INVALID_ARGUMENT);
+    }
+}
+
+/*
+*   Reads bytes from the device.
+*   @throws mem_exception : if the read fails or passes the end of the device
+*/
+void mtd_backend::read(uint32_t address, uint8_t* buffer, unsigned long num_bytes){
+
+    check_range(address, num_bytes);
+    unsigned long bytes_read = 0;
+    while(bytes_read < num_bytes){
+        ssize_t result = pread(this->file_descriptor, buffer + bytes_read, num_bytes - bytes_read, address + bytes_read);
+        if(result < 0 && errno == EINTR){
+            continue;
+        }
+        if(result <= 0){
+            throw mem_exception("Failed to Read " + this->device_file, QSPI_ERROR_IO);
+        }
+        bytes_read += result;
+    }
+}
+
+/*
+*   Programs bytes into the device.
+*   An MTD device is written directly, the driver programs the pages. A ..
+*   plain file has the bytes AND-ed with its contents, as programming ..
+*   can only clear bits of a NOR flash.
+*   @throws mem_exception : if the write fails or passes the end of the device
+*/
+void mtd_backend::program(uint32_t address, const uint8_t* data, unsigned long num_bytes){
+
+    check_range(address, num_bytes);
+    const uint8_t* bytes = data;
+    std::vector<uint8_t> merged;
+    if(!this->is_mtd){
+        merged.resize(num_bytes);
+        read(address, merged.data(), num_bytes);
+        for(unsigned long i = 0; i < num_bytes; i++){
+            merged[i] &= data[i];
+        }
+        bytes = merged.data();
+    }
+    unsigned long bytes_written = 0;
+    while(bytes_written < num_bytes){
+        ssize_t result = pwrite(this->file_descriptor, bytes + bytes_written, num_bytes - bytes_written, address + bytes_written);
+        if(result < 0 && errno == EINTR){
+            continue;
+        }
+        if(result <= 0){
+            throw mem_exception("Program Error : Failed to Write " + this->device_file, QSPI_ERROR_PROGRAM);
+        }
+        bytes_written += result;
+    }
+}
+
+/*
+*   Erases whole erase blocks, the erase has finished when this returns.
+*   MEMERASE blocks in the driver, which sleeps while the chip erases.
+*   @throws mem_exception : if the range is not whole blocks or the erase fails
+*/
+void mtd_backend::start_erase(uint32_t address, unsigned long num_bytes){
+
+    check_range(address, num_bytes);
+    if(address % this->block_size != 0 || num_bytes % this->block_size != 0){
+        throw mem_exception("Erase Range Is Not Whole Erase Blocks", QSPI_ERROR_INVALID_ARGUMENT);
+    }
+    if(this->is_mtd){
+        struct erase_info_user erase;
+        erase.start = address;
+        erase.length = num_bytes;
+        if(ioctl(this->file_descriptor, MEMERASE, &erase) != 0){
+            throw mem_exception("Erase Error Has Occured : " + std::string(strerror(errno)), QSPI_ERROR_ERASE);
+        }
+        return;
+    }
+    std::vector<uint8_t> erased(this->block_size, 0xFF);
+    for(unsigned long offset = 0; offset < num_bytes; offset += this->block_size){
+        if(pwrite(this->file_descriptor, erased.data(), this->block_size, address + offset) != (ssize_t)this->block_size){
+            throw mem_exception("Erase Error Has Occured : Failed to Write " + this->device_file, QSPI_ERROR_ERASE);
+        }
+    }
+}
+
+/*
+*   @returns true, start_erase() finishes the erase before returning.
+*/
+bool mtd_backend::erase_complete(){
+    return true;
+}
+
+/*
+*   @returns the size of an erase block.
+*/
+unsigned long mtd_backend::erase_size() const{
+    return this->block_size;
+}
+
+/*
+*   @returns the size of the device.
+*/
+unsigned long long mtd_backend::flash_size() const{
+    return this->device_size;
+}
@@ -0,0 +1,54 @@
+/*
+*   mtd_backend.h
+*   @Author Sophie Kirkham STFC, 2018
+*   Header file for the mtd_backend class
+*   Moves flash data through a Linux MTD character device (/dev/mtdN) when ..
+*   the kernel's SPI-NOR driver is bound to the QSPI controller. The driver ..
+*   handles the controller, program and erase timing (sleeping rather than ..
+*   spinning) and DMA where the controller supports it.
+*/
+
+#ifndef MTD_BACKEND_H_
+#define MTD_BACKEND_H_
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <mtd/mtd-user.h>
+
+#include "flash_backend.h"
+#include "qspi_flash_defines.h"
+
+/*
+*   Flash backend over an MTD device, or a plain file standing in for one.
+*   A plain file is erased by writing 0xFF and programmed by AND-ing the ..
+*   bytes in, as a NOR flash would.
+*/
+class mtd_backend : public flash_backend{
+
+    public:
+
+        mtd_backend(const std::string& device_file);
+        ~mtd_backend();
+
+        std::string name() const;
+        void read(uint32_t address, uint8_t* buffer, unsigned long num_bytes);
+        void program(uint32_t address, const uint8_t* data, unsigned long num_bytes);
+        void start_erase(uint32_t address, unsigned long num_bytes);
+        bool erase_complete();
+        unsigned long erase_size() const;
+        unsigned long long flash_size() const;
+
+    private:
+
+        std::string device_file;    // the MTD device or plain file
+        int file_descriptor;        // the open device
+        bool is_mtd;                // true for an MTD device, false for a plain file
+        unsigned long block_size;   // the size of an erase block
+        unsigned long long device_size; // the size of the device
+
+        void check_range(uint32_t address, unsigned long num_bytes) const;
+};
+
+#endif
@@ -0,0 +1,151 @@
+/*
+*   mtd_backend_test.cpp
+*   @Author Sophie Kirkham STFC, 2018
+*   Main application entry point for the mtd_backend_test .elf executable
+*   Drives the mtd_backend through a plain file standing in for the MTD ..
+*   device, with the QSPI simulator taking the multiplexer's register ..
+*   accesses, so the backend is tested on any Linux box without hardware.
+*   Checks the erase and program semantics of the file, that reads come ..
+*   back through the device and that the device takes its geometry from ..
+*   the file rather than the 64MB chips.
+*   Prints each check and exits non-zero if any of them failed.
+*/
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <unistd.h>
+#include "qspi_device.h"
+#include "mtd_backend.h"
+#include "qspi_simulator.h"
+
+#define TEST_SECTORS 4                              // Erase sectors in the stand-in file
+#define TEST_FILE_SIZE (TEST_SECTORS * SECTOR_SIZE) // Bytes in the stand-in file, 1MB
+
+int failures = 0;   // number of failed checks
+
+/*
+*   Prints the result of a check, counting the failures.
+*   @param passed : true if the check passed
+*   @param description : what was checked
+*/
+void check(bool passed, const std::string& description){
+    std::cout << (passed ? "PASS : " : "FAIL : ") << description << std::endl;
+    if(!passed){
+        failures++;
+    }
+}
+
+/*
+*   Checks every byte of a buffer holds the same value.
+*   @param buffer : the bytes to check
+*   @param num_bytes : the number of bytes to check
+*   @param value : the value expected in each byte
+*   @returns true if every byte holds value
+*/
+bool all_bytes(const std::vector<uint8_t>& buffer, unsigned long num_bytes, uint8_t value){
+    for(unsigned long i = 0; i < num_bytes; i++){
+        if(buffer[i] != value){
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+*   Reads bytes from the stand-in file directly, behind the backend.
+*   @param filename : the stand-in file
+*   @param address : the offset to read from
+*   @param num_bytes : the number of bytes to read
+*   @returns the bytes read
+*/
+std::vector<uint8_t> file_bytes(const std::string& filename, uint32_t address, unsigned long num_bytes){
+    std::vector<uint8_t> bytes(num_bytes);
+    std::ifstream file(filename.c_str(), std::ios::binary);
+    file.seekg(address);
+    file.read(reinterpret_cast<char*>(&bytes[0]), num_bytes);
+    return bytes;
+}
+
+int main(int argc, char* argv[]){
+
+    char filename[] = "/tmp/mtd_backend_test.XXXXXX";
+    int descriptor = mkstemp(filename);
+    if(descriptor == -1 || ftruncate(descriptor, TEST_FILE_SIZE) != 0){
+        std::cout << "Failed to create the stand-in file " << filename << std::endl;
+        return 1;
+    }
+    close(descriptor);
+
+    // the model takes the multiplexer's register accesses, the file the flash data
+    qspi_simulator simulator(SIM_FLASH_SIZE, SIM_FIFO_DEPTH);
+    memory_mapped_device::set_register_bus(&simulator);
+
+    try{
+        qspi_device qspi;
+        qspi.map_qspi_mux();
+        qspi.set_backend(new mtd_backend(filename));
+        int flash_num = 2;
+        qspi.select_flash(flash_num);
+
+        // the geometry follows the file, not the 64MB chips
+        const flash_geometry& geometry = qspi.get_geometry();
+        check(geometry.size == TEST_FILE_SIZE, "geometry size is the size of the file");
+        check(geometry.sector_size == SECTOR_SIZE, "geometry sector size is the backend's erase size");
+        bool rejected = false;
+        try{
+            qspi.check_range(TEST_FILE_SIZE - 16, 32);
+        }
+        catch(mem_exception& err){
+            rejected = true;
+        }
+        check(rejected, "range running past the end of the file is rejected");
+        rejected = false;
+        try{
+            qspi.check_range(0, TEST_FILE_SIZE);
+        }
+        catch(mem_exception& err){
+            rejected = true;
+        }
+        check(!rejected, "range covering the whole file is accepted");
+
+        // a whole erase leaves the file at 0xFF
+        qspi.erase_flash_memory(flash_num);
+        check(all_bytes(file_bytes(filename, 0, TEST_FILE_SIZE), TEST_FILE_SIZE, 0xFF), "erase leaves every byte at 0xFF");
+
+        // programming ANDs the bytes in, as a NOR flash would
+        std::vector<uint8_t> page(PAGE_SIZE, 0xF0);
+        uint8_t crc = 0;
+        uint32_t address = SECTOR_SIZE + PAGE_SIZE;
+        qspi.program_page(address, &page[0], PAGE_SIZE, crc);
+        check(all_bytes(file_bytes(filename, address, PAGE_SIZE), PAGE_SIZE, 0xF0), "program writes the page to the file");
+        std::fill(page.begin(), page.end(), 0x3C);
+        qspi.program_page(address, &page[0], PAGE_SIZE, crc);
+        check(all_bytes(file_bytes(filename, address, PAGE_SIZE), PAGE_SIZE, 0x30), "program over programmed bytes ANDs them in");
+
+        // reads come back through the device
+        std::vector<uint8_t> read_back(PAGE_SIZE);
+        unsigned long num_bytes = PAGE_SIZE;
+        qspi.read_flash_buffer(address, num_bytes, &read_back[0]);
+        check(all_bytes(read_back, PAGE_SIZE, 0x30), "read through the device returns the programmed bytes");
+
+        // a range erase clears its sector and leaves the others
+        uint32_t erase_address = SECTOR_SIZE;
+        unsigned long erase_bytes = PAGE_SIZE;
+        page.assign(PAGE_SIZE, 0x00);
+        qspi.program_page(0, &page[0], PAGE_SIZE, crc);
+        qspi.erase_range(flash_num, erase_address, erase_bytes);
+        check(all_bytes(file_bytes(filename, SECTOR_SIZE, SECTOR_SIZE), SECTOR_SIZE, 0xFF), "range erase clears the whole sector");
+        check(all_bytes(file_bytes(filename, 0, PAGE_SIZE), PAGE_SIZE, 0x00), "range erase leaves the other sectors");
+
+        qspi.un_map_qspi_mux();
+    }
+    catch(mem_exception& err){
+        check(false, std::string("no exception was thrown : ") + err.what());
+    }
+
+    memory_mapped_device::set_register_bus(NULL);
+    unlink(filename);
+    std::cout << (failures == 0 ? "All checks passed" : "Some checks failed") << std::endl;
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,199 @@
+/*
+*   progress_reporter.cpp
+*   @Author Sophie Kirkham STFC, 2018
+*   Implementation of the progress_reporter class
+*   Samples the device's progress counters on its own thread and writes ..
+*   the phase, throughput and ETA straight to a file descriptor.
+*/
+
+#include <errno.h>
+#include <stdio.h>
+#include <sstream>
+#include <iomanip>
+
+#include "progress_reporter.h"
+#include "realtime.h"
+
+/*
+*   Starts the reporter thread.
+*   @param counters : the counters to sample, must outlive the reporter
+*   @param format : PROGRESS_TTY or PROGRESS_JSON
+*   @param fd : the file descriptor to write samples to
+*   @param interval_ms : the time between samples, at least 1
+*   @throws mem_exception : if interval_ms is 0.
+*/
+progress_reporter::progress_reporter(const progress_counters& counters, progress_format format,
+                                    int fd, unsigned interval_ms) :
+    counters(counters),
+    format(format),
+    fd(fd),
+    tty(isatty(fd) == 1),
+    interval(interval_ms),
+    start(std::chrono::steady_clock::now()),
+    phase_start(start),
+    last_time(start),
+    last_phase(PROGRESS_IDLE),
+    last_done(0),
+    rate(0),
+    stopping(false)
+{
+    if(interval_ms == 0){
+        throw mem_exception("Invalid Progress Interval 0 ms, must be at least 1", QSPI_ERROR_INVALID_ARGUMENT);
+    }
+    this->reporter = std::thread(&progress_reporter::run, this);
+}
+
+/*
+*   Stops the reporter thread.
+*/
+progress_reporter::~progress_reporter(){
+    stop();
+}
+
+/*
+*   Stops the reporter thread, writing a final sample.
+*/
+void progress_reporter::stop(){
+
+    {
+        std::lock_guard<std::mutex> guard(this->lock);
+        if(this->stopping){
+            return;
+        }
+        this->stopping = true;
+    }
+    this->wake.notify_one();
+    this->reporter.join();
+}
+
+/*
+*   Samples the counters every interval until stopped, on the reporter thread.
+*/
+void progress_reporter::run(){
+
+    enter_background();
+    std::unique_lock<std::mutex> guard(this->lock);
+    while(!this->wake.wait_for(guard, this->interval, [this]{ return this->stopping; })){
+        guard.unlock();
+        sample(false);
+        guard.lock();
+    }
+    guard.unlock();
+    sample(true);
+}
+
+/*
+*   Reads the counters and renders them.
+*   The throughput is averaged over the samples of the phase, restarting ..
+*   when the phase changes or a new operation starts.
+*   @param final : true for the sample taken on stopping
+*/
+void progress_reporter::sample(bool final){
+
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    int phase = this->counters.phase.load(std::memory_order_relaxed);
+    unsigned long long done = this->counters.bytes_done.load(std::memory_order_relaxed);
+    unsigned long long total = this->counters.bytes_total.load(std::memory_order_relaxed);
+    unsigned long long pages = this->counters.pages.load(std::memory_order_relaxed);
+    unsigned long long sectors = this->counters.sectors.load(std::memory_order_relaxed);
+
+    // a new phase, or a new operation in the same phase, starts a new average ..
+    // from this sample, the time since the last spans both phases
+    if(phase != this->last_phase || done < this->last_done){
+        this->phase_start = now;
+        this->last_phase = phase;
+        this->last_done = done;
+        this->rate = 0;
+    }
+    double seconds = std::chrono::duration_cast<std::chrono::duration<double> >(now - this->last_time).count();
+    if(seconds > 0 && done > this->last_done){
+        double sampled = (done - this->last_done) / seconds;
+        this->rate = (this->rate == 0) ? sampled : this->rate + PROGRESS_SMOOTHING * (sampled - this->rate);
+    }
+    this->last_time = now;
+    this->last_done = done;
+
+    double elapsed = std::chrono::duration_cast<std::chrono::duration<double> >(now - this->start).count();
+    double phase_elapsed = std::chrono::duration_cast<std::chrono::duration<double> >(now - this->phase_start).count();
+    double eta = (this->rate > 0 && total > done) ? (total - done) / this->rate : 0;
+
+    std::ostringstream line;
+    line << std::fixed;
+    if(this->format == PROGRESS_JSON){
+        line << std::setprecision(3) << "{\"time\": " << elapsed << ", \"phase\": \"" << progress_phase_name(phase)
+        << "\", \"bytes_done\": " << done << ", \"bytes_total\": " << total << ", \"pages\": " << pages
+        << ", \"sectors\": " << sectors << ", \"bytes_per_second\": " << (unsigned long long)this->rate
+        << ", \"eta_seconds\": " << eta << ", \"final\": " << (final ? "true" : "false") << "}\n";
+    }
+    else{
+        line << std::setprecision(1) << std::left << std::setw(8) << progress_phase_name(phase) << std::right;
+        if(total > 0){
+            line << " " << done / 1e6 << "/" << total / 1e6 << " MB " << std::setw(5) << 100.0 * done / total << "%  "
+            << std::setprecision(2) << this->rate / 1e6 << " MB/s  ETA " << (unsigned long)eta << " s";
+        }
+        else{
+            line << " " << phase_elapsed << " s";
+        }
+        line << "  pages " << pages << "  sectors " << sectors;
+        if(this->tty){
+            // redraw the one line in place, clearing what is left of the last
+            std::string text = "\r" + line.str() + "\033[K";
+            if(final){
+                text += "\n";
+            }
+            emit(text);
+            return;
+        }
+        line << "\n";
+    }
+    emit(line.str());
+}
+
+/*
+*   Writes a rendered sample, retrying short writes and dropping it on error.
+*   @param text : the sample
+*/
+void progress_reporter::emit(const std::string& text){
+
+    unsigned long written = 0;
+    while(written < text.size()){
+        ssize_t count = ::write(this->fd, text.data() + written, text.size() - written);
+        if(count < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            return;
+        }
+        written += count;
+    }
+}
+
+/*
+*   @returns the name of a progress_phase.
+*/
+const char* progress_phase_name(int phase){
+
+    switch(phase){
+        case PROGRESS_ERASE: return "erase";
+        case PROGRESS_PROGRAM: return "program";
+        case PROGRESS_READ: return "read";
+        case PROGRESS_VERIFY: return "verify";
+        default: return "idle";
+    }
+}
+
+/*
+*   Converts a format name to a progress_format.
+*   @param name : tty or json
+*   @throws mem_exception : if the name is unknown
+*/
+progress_format progress_format_from_name(const std::string& name){
+
+    if(name.compare("tty") == 0){
+        return PROGRESS_TTY;
+    }
+    if(name.compare("json") == 0){
+        return PROGRESS_JSON;
+    }
+    throw mem_exception("Unknown Progress Format " + name + ", Use tty or json", QSPI_ERROR_INVALID_ARGUMENT);
+}
@@ -0,0 +1,92 @@
+/*
+*   progress_reporter.h
+*   @Author Sophie Kirkham STFC, 2018
+*   Header file for the progress_counters and progress_reporter classes
+*   The qspi_device publishes the phase, bytes, pages and sectors of the ..
+*   operation running to progress_counters with relaxed atomic stores, ..
+*   nothing more, so the SPI loops never touch stdio. A reporter thread ..
+*   samples the counters at a fixed interval and renders the phase, ..
+*   throughput and ETA to a terminal, or as JSON lines for a supervisor.
+*/
+
+#ifndef PROGRESS_REPORTER_H_
+#define PROGRESS_REPORTER_H_
+
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <unistd.h>
+
+#include "mem_exception.h"
+
+#define PROGRESS_SAMPLE_MS 500      // Default interval between progress samples
+#define PROGRESS_SMOOTHING 0.3      // Weight of the newest sample in the throughput average
+
+enum progress_phase{
+    PROGRESS_IDLE,      // no operation running
+    PROGRESS_ERASE,     // erasing sectors or the whole chip
+    PROGRESS_PROGRAM,   // programming pages
+    PROGRESS_READ,      // reading the flash
+    PROGRESS_VERIFY     // reading the flash back to compare
+};
+
+enum progress_format{
+    PROGRESS_TTY,       // one line redrawn in place on a terminal, a line per sample otherwise
+    PROGRESS_JSON       // one JSON object per sample
+};
+
+/*
+*   Progress of the operation running, written by the device's thread and ..
+*   read by the reporter's, both with relaxed ordering. A bulk erase has ..
+*   no bytes total, it reports only its phase.
+*/
+struct progress_counters{
+    std::atomic<int> phase;                 // a progress_phase
+    std::atomic<unsigned long long> bytes_done;     // bytes done in the phase
+    std::atomic<unsigned long long> bytes_total;    // bytes in the phase, 0 if unknown
+    std::atomic<unsigned long long> pages;          // pages programmed or skipped
+    std::atomic<unsigned long long> sectors;        // sectors erased
+
+    progress_counters() : phase(PROGRESS_IDLE), bytes_done(0), bytes_total(0), pages(0), sectors(0){};
+};
+
+class progress_reporter{
+
+    public:
+
+        progress_reporter(const progress_counters& counters, progress_format format,
+                        int fd = STDERR_FILENO, unsigned interval_ms = PROGRESS_SAMPLE_MS);
+        ~progress_reporter();
+
+        void stop();
+
+    private:
+
+        const progress_counters& counters;  // the counters sampled
+        progress_format format;     // how samples are rendered
+        int fd;                     // where samples are written
+        bool tty;                   // true if fd is a terminal, lines are redrawn in place
+        std::chrono::milliseconds interval;     // time between samples
+        std::chrono::steady_clock::time_point start;        // when reporting started
+        std::chrono::steady_clock::time_point phase_start;  // when the phase sampled last started
+        std::chrono::steady_clock::time_point last_time;    // time of the last sample
+        int last_phase;             // the phase at the last sample
+        unsigned long long last_done;   // bytes done at the last sample
+        double rate;                // smoothed bytes per second of the phase
+        std::mutex lock;            // guards stopping
+        std::condition_variable wake;   // wakes the reporter to stop
+        bool stopping;              // set to stop the reporter thread
+        std::thread reporter;       // samples and renders the counters
+
+        void run();
+        void sample(bool final);
+        void emit(const std::string& text);
+};
+
+const char* progress_phase_name(int phase);
+progress_format progress_format_from_name(const std::string& name);
+
+#endif
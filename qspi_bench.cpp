@@ -0,0 +1,501 @@
+/*
+*   qspi_bench.cpp
+*   @Author Sophie Kirkham STFC, 2018
+*   Main application entry point for the qspi_bench .elf executable
+*   Benchmarks reads, programs, erases and verifies of the flash memory ..
+*   devices, on the FEM-II or against the QSPI simulator, reporting the ..
+*   throughput, register accesses per byte, status polls and latencies of ..
+*   each scenario as JSON. Results can be compared against a stored ..
+*   baseline run to flag regressions.
+*   Throughput is in simulated time on the simulator, latencies are always ..
+*   wall clock, as recorded by the device.
+*   Scenarios, run on each chip in this order :
+*       program : erase then program the whole region with the pattern
+*       verify  : read back and compare the whole region
+*       dump    : read the whole region
+*       update  : read-modify-write of a sub-region at the given alignment
+*       random  : small reads at random addresses within the region
+*   Chip 1 holds the FEM-II's own image, it is only benchmarked by the ..
+*   read-only scenarios.
+*/
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <random>
+#include <boost/program_options.hpp>
+#include "qspi_device.h"
+#include "qspi_simulator.h"
+
+namespace po = boost::program_options;
+
+#define BENCH_VERSION 1             // Incremented when the JSON output changes incompatibly
+#define BENCH_SIZE 4194304          // Default bytes in the benchmarked region
+#define BENCH_UPDATE_SIZE 65536     // Default bytes in the partial update
+#define BENCH_READS 1000            // Default number of random reads
+#define BENCH_READ_SIZE 256         // Default bytes in a random read
+#define BENCH_THRESHOLD 10.0        // Default percentage a result may worsen before it is a regression
+#define BENCH_SEED 0x5EED           // Seed of the random pattern and addresses, fixed for repeatable runs
+#define BENCH_FF_PERCENT 90         // Percentage of 0xFF bytes in the ff pattern
+
+/*
+*   The measurements of one scenario on one chip.
+*/
+struct bench_result{
+    std::string scenario;       // the scenario name
+    int chip;                   // the flash chip
+    unsigned long long bytes;   // bytes moved to or from the flash
+    double seconds;             // time taken, simulated when running on the simulator
+    unsigned long long mmio_ops;    // register reads and writes
+    unsigned long long polls;   // controller status register reads
+    uint64_t p50;               // wall clock latency percentiles in ns, per page, FIFO or read
+    uint64_t p99;
+    uint64_t max;
+    std::string latency_of;     // what the latencies time
+};
+
+/*
+*   Times scenarios in simulated time on the simulator, wall time otherwise, ..
+*   and counts the register accesses with the engine's hot path counters.
+*/
+class bench_clock{
+
+    public:
+
+        bench_clock(qspi_simulator* simulator) : simulator(simulator){};
+
+        /*  @returns the time now in ns.
+        */
+        uint64_t now(){
+            if(this->simulator != NULL){
+                return this->simulator->now();
+            }
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+        };
+
+        /*  Starts timing a scenario.
+        */
+        void start(){
+            this->start_time = now();
+            this->start_counts = collect_metrics();
+        };
+
+        /*  Stops timing a scenario, filling in its time and counts.
+        */
+        void stop(bench_result& result){
+            result.seconds = (now() - this->start_time) / 1e9;
+            qspi_metrics counts = collect_metrics();
+            result.mmio_ops = counts.values[METRIC_MMIO_READS] + counts.values[METRIC_MMIO_WRITES]
+                            - this->start_counts.values[METRIC_MMIO_READS] - this->start_counts.values[METRIC_MMIO_WRITES];
+            result.polls = counts.values[METRIC_TX_POLLS] - this->start_counts.values[METRIC_TX_POLLS];
+        };
+
+    private:
+
+        qspi_simulator* simulator;      // the simulator, NULL on the FEM-II
+        uint64_t start_time;            // the time the scenario started
+        qspi_metrics start_counts;      // the hot path counters when the scenario started
+};
+
+/*
+*   Fills a buffer with a benchmark pattern.
+*   @param pattern : random, ff (mostly 0xFF as in a sparse bitstream) or file
+*   @param image : the bitstream file for the file pattern, repeated to fill
+*   @throws mem_exception : if the pattern is unknown or the image fails to read
+*/
+void fill_pattern(std::vector<uint8_t>& data, const std::string& pattern, const std::string& image){
+
+    std::mt19937 random(BENCH_SEED);
+    if(pattern == "random"){
+        for(unsigned long i = 0; i < data.size(); i++){
+            data[i] = random() & 0xFF;
+        }
+    }
+    else if(pattern == "ff"){
+        for(unsigned long i = 0; i < data.size(); i++){
+            data[i] = (random() % 100 < BENCH_FF_PERCENT) ? 0xFF : (random() & 0xFF);
+        }
+    }
+    else if(pattern == "file"){
+        std::ifstream file(image.c_str(), std::ios::binary);
+        std::vector<char> bytes((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        if(bytes.empty()){
+            throw mem_exception("Failed to Read Bitstream " + image, QSPI_ERROR_IO);
+        }
+        for(unsigned long i = 0; i < data.size(); i++){
+            data[i] = bytes[i % bytes.size()];
+        }
+    }
+    else{
+        throw mem_exception("Unknown Pattern " + pattern, QSPI_ERROR_INVALID_ARGUMENT);
+    }
+}
+
+/*
+*   Copies the percentiles of a latency recorder into a result and clears it.
+*/
+void take_latency(bench_result& result, latency_recorder& recorder, const std::string& latency_of){
+
+    result.p50 = recorder.percentile(0.50);
+    result.p99 = recorder.percentile(0.99);
+    result.max = recorder.max();
+    result.latency_of = (recorder.count() > 0) ? latency_of : "";
+    recorder.clear();
+}
+
+/*
+*   Formats one result as a single line JSON object.
+*/
+std::string result_json(const bench_result& result){
+
+    std::ostringstream json;
+    json << std::fixed << std::setprecision(3);
+    double mb_per_s = (result.seconds > 0) ? result.bytes / result.seconds / 1e6 : 0;
+    json << "{\"scenario\": \"" << result.scenario << "\", \"chip\": " << result.chip
+    << ", \"bytes\": " << result.bytes << ", \"seconds\": " << result.seconds
+    << ", \"mb_per_s\": " << mb_per_s;
+    json << ", \"mmio_ops\": " << result.mmio_ops << ", \"mmio_per_byte\": "
+    << (result.bytes > 0 ? (double)result.mmio_ops / result.bytes : 0)
+    << ", \"polls\": " << result.polls;
+    if(!result.latency_of.empty()){
+        json << ", \"latency_of\": \"" << result.latency_of << "\", \"p50_us\": " << result.p50 / 1000.0
+        << ", \"p99_us\": " << result.p99 / 1000.0 << ", \"max_us\": " << result.max / 1000.0;
+    }
+    json << "}";
+    return json.str();
+}
+
+/*
+*   Finds the number following "key": in a line of JSON.
+*   @returns true if the key was found with a number.
+*/
+bool json_number(const std::string& line, const std::string& key, double& value){
+
+    size_t found = line.find("\"" + key + "\":");
+    if(found == std::string::npos){
+        return false;
+    }
+    const char* start = line.c_str() + found + key.size() + 3;
+    char* end = NULL;
+    value = strtod(start, &end);
+    return end != start;
+}
+
+/*
+*   Finds the string following "key": in a line of JSON.
+*/
+std::string json_string(const std::string& line, const std::string& key){
+
+    size_t found = line.find("\"" + key + "\": \"");
+    if(found == std::string::npos){
+        return "";
+    }
+    size_t start = found + key.size() + 5;
+    return line.substr(start, line.find('"', start) - start);
+}
+
+/*
+*   Compares the results against a baseline run's JSON.
+*   A result regresses if its throughput falls, or its register accesses ..
+*   per byte rise, by more than the threshold percentage.
+*   @returns the number of regressions, each printed to stderr.
+*   @throws mem_exception : if the baseline fails to open
+*/
+int compare_baseline(const std::vector<bench_result>& results, const std::string& filename, double threshold){
+
+    std::ifstream baseline(filename.c_str());
+    if(!baseline){
+        throw mem_exception("Failed to Open Baseline " + filename, QSPI_ERROR_IO);
+    }
+    int regressions = 0;
+    std::string line;
+    while(std::getline(baseline, line)){
+        std::string scenario = json_string(line, "scenario");
+        double chip;
+        if(scenario.empty() || !json_number(line, "chip", chip)){
+            continue;
+        }
+        for(unsigned i = 0; i < results.size(); i++){
+            if(results[i].scenario != scenario || results[i].chip != (int)chip){
+                continue;
+            }
+            std::string current = result_json(results[i]);
+            double was, now;
+            if(json_number(line, "mb_per_s", was) && json_number(current, "mb_per_s", now) &&
+               was > 0 && now < was * (1 - threshold / 100)){
+                std::cerr << "REGRESSION " << scenario << " chip " << chip << " : " << now
+                << " MB/s against " << was << " MB/s" << std::endl;
+                regressions++;
+            }
+            if(json_number(line, "mmio_per_byte", was) && json_number(current, "mmio_per_byte", now) &&
+               now > was * (1 + threshold / 100)){
+                std::cerr << "REGRESSION " << scenario << " chip " << chip << " : " << now
+                << " register accesses per byte against " << was << std::endl;
+                regressions++;
+            }
+        }
+    }
+    return regressions;
+}
+
+/*
+*   Runs every scenario asked for on one chip.
+*   @throws mem_exception : if an operation fails
+*/
+void bench_chip(qspi_device& qspi, bench_clock& clock, int chip, const std::vector<std::string>& scenarios,
+                const std::vector<uint8_t>& data, uint32_t address, unsigned long update_size,
+                unsigned long align, unsigned long reads, unsigned long read_size,
+                latency_recorder& page_latency, latency_recorder& fifo_latency,
+                std::vector<bench_result>& results)
+{
+    std::vector<uint8_t> buffer(data.size());
+    unsigned long size = data.size();
+    bool verify = false;
+    qspi.select_flash(chip);
+    // enable quad mode before timing, so the first scenario does not pay for it
+    uint32_t warm_address = address;
+    unsigned long warm_size = 1;
+    qspi.read_flash_buffer(warm_address, warm_size, buffer.data());
+
+    for(unsigned s = 0; s < scenarios.size(); s++){
+        const std::string& scenario = scenarios[s];
+        bench_result result = bench_result();
+        result.scenario = scenario;
+        result.chip = chip;
+        // chip 1 holds the FEM-II's own image, leave it untouched
+        if(chip == 1 && (scenario == "program" || scenario == "update")){
+            continue;
+        }
+        page_latency.clear();
+        fifo_latency.clear();
+        clock.start();
+
+        if(scenario == "program"){
+            uint32_t erase_address = address;
+            unsigned long erase_size = size;
+            qspi.erase_range(chip, erase_address, erase_size);
+            uint32_t program_address = address;
+            unsigned long program_size = size;
+            qspi.program_flash_buffer(program_address, data.data(), program_size, verify);
+            result.bytes = size;
+            clock.stop(result);
+            take_latency(result, page_latency, "page");
+        }
+        else if(scenario == "verify"){
+            uint32_t verify_address = address;
+            unsigned long verify_size = size;
+            qspi.verify_flash_buffer(verify_address, data.data(), verify_size);
+            result.bytes = size;
+            clock.stop(result);
+            take_latency(result, fifo_latency, "fifo");
+        }
+        else if(scenario == "dump"){
+            uint32_t read_address = address;
+            unsigned long read_size_all = size;
+            qspi.read_flash_buffer(read_address, read_size_all, buffer.data());
+            result.bytes = size;
+            clock.stop(result);
+            take_latency(result, fifo_latency, "fifo");
+        }
+        else if(scenario == "update"){
+            // read the sectors holding the sub-region, patch them, erase and reprogram
+            uint32_t first = address + align;
+            uint32_t sector_start = first - (first % SECTOR_SIZE);
+            uint32_t sector_end = first + update_size;
+            sector_end += (SECTOR_SIZE - sector_end % SECTOR_SIZE) % SECTOR_SIZE;
+            unsigned long span = sector_end - sector_start;
+            std::vector<uint8_t> sectors(span);
+            uint32_t read_address = sector_start;
+            qspi.read_flash_buffer(read_address, span, sectors.data());
+            for(unsigned long i = 0; i < update_size; i++){
+                sectors[first - sector_start + i] = ~data[(first - address + i) % size];
+            }
+            uint32_t erase_address = sector_start;
+            unsigned long erase_size = span;
+            qspi.erase_range(chip, erase_address, erase_size);
+            uint32_t program_address = sector_start;
+            unsigned long program_size = span;
+            qspi.program_flash_buffer(program_address, sectors.data(), program_size, verify);
+            result.bytes = update_size;
+            clock.stop(result);
+            take_latency(result, page_latency, "page");
+        }
+        else if(scenario == "random"){
+            std::mt19937 random(BENCH_SEED);
+            latency_recorder read_latency(reads);
+            std::vector<uint8_t> small(read_size);
+            for(unsigned long r = 0; r < reads; r++){
+                uint32_t read_address = address + random() % (size - read_size + 1);
+                unsigned long bytes = read_size;
+                std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+                qspi.read_flash_buffer(read_address, bytes, small.data());
+                read_latency.record(std::chrono::steady_clock::now() - started);
+            }
+            result.bytes = reads * read_size;
+            clock.stop(result);
+            take_latency(result, read_latency, "read");
+        }
+        else{
+            throw mem_exception("Unknown Scenario " + scenario, QSPI_ERROR_INVALID_ARGUMENT);
+        }
+        results.push_back(result);
+        std::cerr << result_json(result) << std::endl;
+    }
+    qspi.deselect_flash();
+}
+
+/*
+*   Splits a comma separated list.
+*/
+std::vector<std::string> split_list(const std::string& list){
+
+    std::vector<std::string> items;
+    std::istringstream stream(list);
+    std::string item;
+    while(std::getline(stream, item, ',')){
+        if(!item.empty()){
+            items.push_back(item);
+        }
+    }
+    return items;
+}
+
+/*
+*   Main entry point for qspi_bench
+*   @param argc : number of command line arguments provided
+*   @param argv : array of command line arguments
+*   @returns 0 on success, 1 on failure, 2 if a result regressed against the baseline
+*/
+int main(int argc, char* argv[]){
+
+    po::options_description options("Options");
+    po::variables_map vm;
+    try{
+        options.add_options()
+            ("help,h", "Prints the help menu")
+            ("scenarios", po::value<std::string>()->default_value("program,verify,dump,update,random"),
+                "Comma separated scenarios to run : program, verify, dump, update, random.")
+            ("chips", po::value<std::string>()->default_value("2"),
+                "Comma separated flash chips to benchmark, chip 1 only runs the read-only scenarios.")
+            ("address,a", po::value<uint32_t>()->default_value(0),
+                "Flash address the benchmarked region starts at, sector aligned.")
+            ("size,s", po::value<unsigned long>()->default_value(BENCH_SIZE),
+                "Bytes in the benchmarked region, 64000000 for the whole chip.")
+            ("pattern", po::value<std::string>()->default_value("random"),
+                "Data programmed : random, ff (90% 0xFF, like a sparse bitstream) or file.")
+            ("image,i", po::value<std::string>(),
+                "Bitstream file for --pattern file, repeated to fill the region.")
+            ("update-size", po::value<unsigned long>()->default_value(BENCH_UPDATE_SIZE),
+                "Bytes in the partial update.")
+            ("align", po::value<unsigned long>()->default_value(0),
+                "Offset of the partial update from a sector boundary, e.g. 1 for a misaligned update.")
+            ("reads", po::value<unsigned long>()->default_value(BENCH_READS),
+                "Number of random reads.")
+            ("read-size", po::value<unsigned long>()->default_value(BENCH_READ_SIZE),
+                "Bytes in each random read.")
+            ("output,o", po::value<std::string>(),
+                "File to write the JSON results to (Default: stdout).")
+            ("baseline", po::value<std::string>(),
+                "JSON results of an earlier run to compare against, exiting 2 if any result regressed.")
+            ("threshold", po::value<double>()->default_value(BENCH_THRESHOLD),
+                "Percentage a result may worsen against the baseline before it is a regression.")
+            ("simulate", po::value<std::string>()->implicit_value(""),
+                "Benchmark the QSPI simulator instead of the board, flash chip n backed by <arg>n.bin if given.")
+            ("sim-timing", po::value<std::string>()->default_value(""),
+                "Timing of the simulator as name=ns pairs, see qspi_driver --help.")
+            ("sim-fifo", po::value<unsigned>()->default_value(SIM_FIFO_DEPTH),
+                "Depth of the simulator's controller FIFOs.");
+        po::store(po::parse_command_line(argc, argv, options), vm);
+        po::notify(vm);
+    }
+    catch(const po::error &ex){
+        std::cerr << ex.what() << std::endl;
+        return 1;
+    }
+    if(vm.count("help")){
+        std::cout << "Usage: qspi_bench [options]" << std::endl;
+        std::cout << options << std::endl;
+        return 1;
+    }
+
+    // the core prints progress to stdout, keep it clear for the JSON
+    std::streambuf* json_buffer = std::cout.rdbuf();
+    std::cout.rdbuf(std::cerr.rdbuf());
+    std::ostream json_out(json_buffer);
+
+    std::vector<std::string> scenarios = split_list(vm["scenarios"].as<std::string>());
+    std::vector<std::string> chip_list = split_list(vm["chips"].as<std::string>());
+    uint32_t address = vm["address"].as<uint32_t>();
+    unsigned long size = vm["size"].as<unsigned long>();
+    std::string pattern = vm["pattern"].as<std::string>();
+    unsigned long update_size = vm["update-size"].as<unsigned long>();
+    unsigned long align = vm["align"].as<unsigned long>();
+    unsigned long reads = vm["reads"].as<unsigned long>();
+    unsigned long read_size = vm["read-size"].as<unsigned long>();
+
+    if(size == 0 || read_size > size || align + update_size > size || (unsigned long long)address + size > SIXTY_FOUR_MB){
+        std::cerr << "The region, update and reads must fit within the flash" << std::endl;
+        return 1;
+    }
+
+    std::unique_ptr<qspi_simulator> simulator;
+    std::vector<bench_result> results;
+    int regressions = 0;
+    try{
+        std::vector<uint8_t> data(size);
+        fill_pattern(data, pattern, vm.count("image") ? vm["image"].as<std::string>() : "");
+
+        if(vm.count("simulate")){
+            simulator.reset(new qspi_simulator(SIM_FLASH_SIZE, vm["sim-fifo"].as<unsigned>()));
+            simulator->timing.parse(vm["sim-timing"].as<std::string>());
+            if(!vm["simulate"].as<std::string>().empty()){
+                simulator->back_with_files(vm["simulate"].as<std::string>());
+            }
+            memory_mapped_device::set_register_bus(simulator.get());
+        }
+        bench_clock clock(simulator.get());
+
+        qspi_device qspi;
+        qspi.map_qspi_mux();
+        latency_recorder page_latency;
+        latency_recorder fifo_latency;
+        qspi.set_latency_recorders(&page_latency, &fifo_latency);
+        try{
+            for(unsigned c = 0; c < chip_list.size(); c++){
+                bench_chip(qspi, clock, atoi(chip_list[c].c_str()), scenarios, data, address, update_size,
+                            align, reads, read_size, page_latency, fifo_latency, results);
+            }
+        }
+        catch(mem_exception& err){
+            qspi.un_map_qspi_mux();
+            throw;
+        }
+        qspi.un_map_qspi_mux();
+
+        if(vm.count("baseline")){
+            regressions = compare_baseline(results, vm["baseline"].as<std::string>(), vm["threshold"].as<double>());
+        }
+    }
+    catch(mem_exception& err){
+        std::cerr << "An error occured during the benchmark : " << err.what() << std::endl;
+        return 1;
+    }
+
+    // one result per line, so baselines compare line by line
+    std::ofstream json_file;
+    std::ostream* out = &json_out;
+    if(vm.count("output")){
+        json_file.open(vm["output"].as<std::string>().c_str());
+        out = &json_file;
+    }
+    *out << "{\"version\": " << BENCH_VERSION << ", \"target\": \"" << (simulator ? "simulator" : "fem-ii")
+    << "\", \"latency_clock\": \"wall\", \"pattern\": \"" << pattern << "\", \"size\": " << size << ", \"align\": " << align
+    << ", \"regressions\": " << regressions << ", \"results\": [" << std::endl;
+    for(unsigned i = 0; i < results.size(); i++){
+        *out << "  " << result_json(results[i]) << (i + 1 < results.size() ? "," : "") << std::endl;
+    }
+    *out << "]}" << std::endl;
+    return (regressions > 0) ? 2 : 0;
+}
@@ -0,0 +1,569 @@
+/*
+*   qspi_daemon.cpp
+*   @Author Sophie Kirkham STFC, 2018
+*   Implementation of the qspi_daemon class and its job protocol
+*/
+
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sstream>
+#include <map>
+#include <vector>
+
+#include "qspi_daemon.h"
+
+// set by SIGINT / SIGTERM to stop the daemon after the running job
+static volatile sig_atomic_t stop_requested = 0;
+
+static void request_stop(int){
+    stop_requested = 1;
+}
+
+/*
+*   Parses a number in decimal, or hexadecimal with a 0x prefix.
+*   @param key : the key the value belongs to, for the error message
+*   @param value : the text to parse
+*   @throws mem_exception : if the value is not a number
+*/
+static unsigned long parse_number(const std::string& key, const std::string& value){
+
+    char* end = NULL;
+    errno = 0;
+    unsigned long number = strtoul(value.c_str(), &end, 0);
+    if(value.empty() || *end != '\0' || errno != 0){
+        throw mem_exception("Invalid Job : " + key + " is not a number");
+    }
+    return number;
+}
+
+/*
+*   Parses a job from a line of key=value pairs.
+*   @param line : the job line
+*   @throws mem_exception : if the line is not a valid job
+*   @returns the job.
+*/
+daemon_job parse_job(const std::string& line){
+
+    std::map<std::string, std::string> values;
+    std::istringstream tokens(line);
+    std::string token;
+    while(tokens >> token){
+        size_t equals = token.find('=');
+        if(equals == std::string::npos){
+            throw mem_exception("Invalid Job : expected key=value, got " + token);
+        }
+        values[token.substr(0, equals)] = token.substr(equals + 1);
+    }
+
+    daemon_job job;
+    job.operation = values["op"];
+    job.flash_chip = 0;
+    job.address = 0;
+    job.size = 0;
+    job.filename = values["file"];
+    job.verify = values["verify"] == "1";
+    job.sparse = values["sparse"] == "1";
+    job.compress = values.count("compress") ? values["compress"] : "none";
+    job.level = 0;
+
+    if(job.operation != "read" && job.operation != "erase" && job.operation != "program" &&
+        job.operation != "verify" && job.operation != "status"){
+        throw mem_exception("Invalid Job : unsupported op " + job.operation);
+    }
+    if(!values.count("chip")){
+        throw mem_exception("Invalid Job : chip is required");
+    }
+    unsigned long chip = parse_number("chip", values["chip"]);
+    if(chip < 1 || chip > FLASH_CHIPS){
+        throw mem_exception("Invalid Job : chip must be 1-4");
+    }
+    job.flash_chip = chip;
+    if(values.count("address")){
+        job.address = parse_number("address", values["address"]);
+    }
+
+    if(job.operation == "read" || job.operation == "program" || job.operation == "verify"){
+        if(!values.count("size") || job.filename.empty()){
+            throw mem_exception("Invalid Job : size and file are required for " + job.operation);
+        }
+        // the daemon's own stdin and stdout are not the client's
+        if(job.filename.compare(STREAM_NAME) == 0){
+            throw mem_exception("Invalid Job : files can not be streamed through the daemon");
+        }
+        job.size = parse_number("size", values["size"]);
+    }
+    // an erase with an address or size erases only the sectors of its range
+    if(job.operation == "erase" && values.count("size")){
+        job.size = parse_number("size", values["size"]);
+    }
+
+    compression_codec codec = codec_from_name(job.compress);
+    if(!codec_supported(codec)){
+        throw mem_exception("Invalid Job : driver built without " + codec_name(codec) + " support");
+    }
+    job.level = default_level(codec);
+    if(values.count("level")){
+        const std::string& value = values["level"];
+        char* end = NULL;
+        errno = 0;
+        long level = strtol(value.c_str(), &end, 0);
+        if(value.empty() || *end != '\0' || errno != 0 || level < INT_MIN || level > INT_MAX){
+            throw mem_exception("Invalid Job : level is not a number");
+        }
+        try{
+            check_level(codec, level);
+        }
+        catch(mem_exception& err){
+            throw mem_exception(std::string("Invalid Job : ") + err.what());
+        }
+        job.level = level;
+    }
+    return job;
+}
+
+/*
+*   Trims a job's size to the probed flash chip to prevent memory over runs.
+*   Called once the job's chip is selected and its geometry is known.
+*   @param job : the job to trim
+*   @param geometry : the geometry of the job's flash chip
+*   @throws mem_exception : if the job starts beyond the flash memory
+*/
+void clamp_job(daemon_job& job, const flash_geometry& geometry){
+
+    if(job.operation != "read" && job.operation != "program" && job.operation != "verify" && !range_erase(job)){
+        return;
+    }
+    if(job.address >= geometry.size){
+        throw mem_exception("Invalid Job : address is beyond the flash memory");
+    }
+    // a range erase without a size runs to the end of the flash
+    if(job.size + job.address > geometry.size || (range_erase(job) && job.size == 0)){
+        job.size = geometry.size - job.address;
+    }
+}
+
+/*
+*   @returns true if the job erases a range rather than the whole chip, ..
+*   given by an address or size.
+*/
+bool range_erase(const daemon_job& job){
+    return job.operation == "erase" && (job.address != 0 || job.size != 0);
+}
+
+/*
+*   Sends a job to a running daemon and prints the replies.
+*   @param socket_path : the path of the daemon's socket
+*   @param line : the job line
+*   @returns 0 if the job succeeded, 1 otherwise.
+*/
+int submit_job(const std::string& socket_path, const std::string& line){
+
+    int connection = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, socket_path.c_str(), sizeof(address.sun_path) - 1);
+    if(connection == -1 || connect(connection, (struct sockaddr*)&address, sizeof(address)) == -1){
+        std::cout << "Failed to Connect to the Daemon at " << socket_path << std::endl;
+        if(connection != -1){
+            close(connection);
+        }
+        return 1;
+    }
+
+    std::string request = line + "\n";
+    if(send(connection, request.c_str(), request.size(), MSG_NOSIGNAL) != (ssize_t)request.size()){
+        std::cout << "Failed to Send the Job to the Daemon" << std::endl;
+        close(connection);
+        return 1;
+    }
+    shutdown(connection, SHUT_WR);
+
+    // print the replies until the job's result
+    int result = 1;
+    std::string pending;
+    char buffer[4096];
+    ssize_t count;
+    while((count = recv(connection, buffer, sizeof(buffer), 0)) > 0 || (count < 0 && errno == EINTR)){
+        if(count < 0){
+            continue;
+        }
+        pending.append(buffer, count);
+        size_t end;
+        while((end = pending.find('\n')) != std::string::npos){
+            std::string reply = pending.substr(0, end);
+            pending.erase(0, end + 1);
+            unsigned long long done;
+            unsigned long long total;
+            if(sscanf(reply.c_str(), "progress %llu %llu", &done, &total) == 2){
+                std::cout << "Progress : " << done << " / " << total << " bytes" << std::endl;
+                continue;
+            }
+            std::cout << reply << std::endl;
+            result = reply.compare(0, 2, "ok") == 0 ? 0 : 1;
+        }
+    }
+    close(connection);
+    return result;
+}
+
+/*
+*   Closes a client's socket once neither its thread nor the worker holds it.
+*/
+qspi_daemon::client::~client(){
+    close(this->socket);
+}
+
+/*
+*   Constructor for qspi_daemon objects.
+*   @param device : the qspi device, already mapped with map_qspi_mux()
+*   @param socket_path : the path to listen for jobs on
+*/
+qspi_daemon::qspi_daemon(qspi_device& device, const std::string& socket_path) :
+    device(device),
+    socket_path(socket_path),
+    listen_socket(-1),
+    socket_inode(0),
+    client_threads(0),
+    stopping(false)
+{}
+
+/*
+*   Destructor for qspi_daemon objects, removes the socket if it is still ..
+*   the one this daemon bound.
+*/
+qspi_daemon::~qspi_daemon(){
+
+    if(this->listen_socket != -1){
+        close(this->listen_socket);
+    }
+    struct stat info;
+    if(this->socket_inode != 0 && lstat(this->socket_path.c_str(), &info) == 0 && 
+        S_ISSOCK(info.st_mode) && info.st_ino == this->socket_inode){
+        unlink(this->socket_path.c_str());
+    }
+}
+
+/*
+*   Removes a socket left behind by a daemon that did not exit cleanly.
+*   @param address : the address of the socket
+*   @throws mem_exception : if the path is not a socket, or a daemon still listens on it
+*/
+void qspi_daemon::remove_stale_socket(const struct sockaddr_un& address){
+
+    struct stat info;
+    if(lstat(this->socket_path.c_str(), &info) == -1){
+        return;
+    }
+    if(!S_ISSOCK(info.st_mode)){
+        throw mem_exception("Daemon Socket Path " + this->socket_path + " Exists And Is Not A Socket");
+    }
+    // a socket nobody accepts on is stale
+    int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(probe == -1){
+        throw mem_exception("Failed to Create the Daemon Socket");
+    }
+    bool listening = connect(probe, (const struct sockaddr*)&address, sizeof(address)) == 0;
+    close(probe);
+    if(listening){
+        throw mem_exception("A Daemon Is Already Listening on " + this->socket_path);
+    }
+    unlink(this->socket_path.c_str());
+}
+
+/*
+*   Sends one reply line to a client, a client that has gone is ignored.
+*   @param connection : the client to reply to
+*   @param line : the reply, without the newline
+*   @param block : false to drop the line rather than wait for a client ..
+*   that is not reading, used while the daemon stops
+*/
+void qspi_daemon::send_line(client& connection, const std::string& line, bool block){
+
+    std::string reply = line + "\n";
+    size_t sent = 0;
+    int flags = MSG_NOSIGNAL | (block ? 0 : MSG_DONTWAIT);
+    while(sent < reply.size()){
+        ssize_t count = send(connection.socket, reply.c_str() + sent, reply.size() - sent, flags);
+        if(count < 0 && errno == EINTR){
+            continue;
+        }
+        if(count <= 0){
+            return;
+        }
+        sent += count;
+    }
+}
+
+/*
+*   Listens for clients until SIGINT or SIGTERM, then finishes the running ..
+*   job, fails the jobs still queued, deselects the flash and removes the socket.
+*   @throws mem_exception : if the socket fails to be created
+*   @throws mem_exception : if the path is not a stale socket or a daemon listens on it
+*/
+void qspi_daemon::run(){
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if(this->socket_path.size() >= sizeof(address.sun_path)){
+        throw mem_exception("Daemon Socket Path Is Too Long");
+    }
+    strncpy(address.sun_path, this->socket_path.c_str(), sizeof(address.sun_path) - 1);
+
+    remove_stale_socket(address);
+    this->listen_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(this->listen_socket == -1 ||
+        bind(this->listen_socket, (struct sockaddr*)&address, sizeof(address)) == -1){
+        throw mem_exception("Failed to Create the Daemon Socket");
+    }
+    struct stat info;
+    if(lstat(this->socket_path.c_str(), &info) == 0){
+        this->socket_inode = info.st_ino;
+    }
+    if(listen(this->listen_socket, 16) == -1){
+        throw mem_exception("Failed to Create the Daemon Socket");
+    }
+
+    signal(SIGINT, request_stop);
+    signal(SIGTERM, request_stop);
+    signal(SIGPIPE, SIG_IGN);
+
+    // a crashed run may have left a chip selected
+    this->device.deselect_flash();
+    std::cout << "Daemon listening on " << this->socket_path << std::endl;
+
+    std::thread worker(&qspi_daemon::work_loop, this);
+
+    while(!stop_requested){
+        struct pollfd waiting = {this->listen_socket, POLLIN, 0};
+        if(poll(&waiting, 1, 250) <= 0){
+            continue;
+        }
+        int connection = accept(this->listen_socket, NULL, NULL);
+        if(connection == -1){
+            continue;
+        }
+        std::shared_ptr<client> new_client(new client());
+        new_client->socket = connection;
+        new_client->connected = true;
+
+        std::lock_guard<std::mutex> guard(this->lock);
+        this->clients.push_back(new_client);
+        this->client_threads++;
+        std::thread(&qspi_daemon::client_loop, this, new_client).detach();
+    }
+
+    // stop taking jobs and take the jobs still queued
+    std::unique_lock<std::mutex> guard(this->lock);
+    this->stopping = true;
+    std::vector< std::pair<std::shared_ptr<client>, std::string> > dropped;
+    for(std::list< std::shared_ptr<client> >::iterator it = this->clients.begin(); it != this->clients.end(); it++){
+        for(unsigned long i = 0; i < (*it)->jobs.size(); i++){
+            dropped.push_back(std::make_pair(*it, (*it)->jobs[i].operation));
+        }
+        (*it)->jobs.clear();
+    }
+    guard.unlock();
+
+    // fail them without the lock, a client that is not reading is skipped
+    for(unsigned long i = 0; i < dropped.size(); i++){
+        send_line(*dropped[i].first, "error Daemon Stopped Before The Job Ran : op=" + dropped[i].second, false);
+    }
+    if(!dropped.empty()){
+        std::cout << dropped.size() << " queued jobs were not run" << std::endl;
+    }
+
+    // unblock the client threads and wait for them
+    guard.lock();
+    for(std::list< std::shared_ptr<client> >::iterator it = this->clients.begin(); it != this->clients.end(); it++){
+        shutdown((*it)->socket, SHUT_RDWR);
+    }
+    this->changed.notify_all();
+    while(this->client_threads > 0){
+        this->changed.wait(guard);
+    }
+    guard.unlock();
+    worker.join();
+    this->clients.clear();
+    std::cout << "Daemon stopped" << std::endl;
+}
+
+/*
+*   Client thread body, queues the jobs a client sends until it hangs up.
+*   Jobs queued before a clean hang up still run.
+*   @param connection : the client
+*/
+void qspi_daemon::client_loop(std::shared_ptr<client> connection){
+
+    std::string pending;
+    char buffer[4096];
+    while(true){
+        ssize_t count = recv(connection->socket, buffer, sizeof(buffer), 0);
+        if(count < 0 && errno == EINTR){
+            continue;
+        }
+        if(count <= 0){
+            std::lock_guard<std::mutex> guard(this->lock);
+            connection->connected = false;
+            if(count < 0){
+                // the client is gone, nobody is waiting for its jobs
+                connection->jobs.clear();
+            }
+            break;
+        }
+        pending.append(buffer, count);
+
+        size_t end;
+        while((end = pending.find('\n')) != std::string::npos){
+            std::string line = pending.substr(0, end);
+            pending.erase(0, end + 1);
+            if(line.find_first_not_of(" \t\r") == std::string::npos){
+                continue;
+            }
+            try{
+                daemon_job job = parse_job(line);
+                std::unique_lock<std::mutex> guard(this->lock);
+                if(this->stopping){
+                    guard.unlock();
+                    send_line(*connection, "error Daemon Stopped Before The Job Ran : op=" + job.operation, false);
+                    continue;
+                }
+                connection->jobs.push_back(job);
+                this->changed.notify_all();
+            }
+            catch(mem_exception& err){
+                send_line(*connection, std::string("error ") + err.what());
+            }
+        }
+    }
+
+    std::lock_guard<std::mutex> guard(this->lock);
+    this->client_threads--;
+    this->changed.notify_all();
+}
+
+/*
+*   Takes the next job, one job from each client in turn.
+*   @param connection : set to the client the job belongs to
+*   @param job : set to the job
+*   @returns false once the daemon is stopping.
+*/
+bool qspi_daemon::next_job(std::shared_ptr<client>& connection, daemon_job& job){
+
+    std::unique_lock<std::mutex> guard(this->lock);
+    while(!this->stopping){
+
+        std::list< std::shared_ptr<client> >::iterator it = this->clients.begin();
+        while(it != this->clients.end()){
+            if((*it)->jobs.empty()){
+                // forget clients that have hung up with nothing left to run
+                if(!(*it)->connected){
+                    it = this->clients.erase(it);
+                }
+                else{
+                    it++;
+                }
+                continue;
+            }
+            connection = *it;
+            job = connection->jobs.front();
+            connection->jobs.pop_front();
+            // move the client to the back so every other client goes first
+            this->clients.splice(this->clients.end(), this->clients, it);
+            return true;
+        }
+        this->changed.wait(guard);
+    }
+    return false;
+}
+
+/*
+*   Worker thread body, runs one job at a time on the shared qspi device.
+*/
+void qspi_daemon::work_loop(){
+
+    std::shared_ptr<client> connection;
+    daemon_job job;
+    while(next_job(connection, job)){
+        run_job(*connection, job);
+        connection.reset();
+    }
+}
+
+/*
+*   Runs a job on the qspi device, streaming progress to the client.
+*   The chip is always deselected afterwards, even if the job failed.
+*   @param connection : the client that sent the job
+*   @param job : the job to run
+*/
+void qspi_daemon::run_job(client& connection, daemon_job& job){
+
+    std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+    std::ostringstream result;
+
+    try{
+        this->device.select_flash(job.flash_chip);
+        clamp_job(job, this->device.get_geometry());
+        this->device.set_progress_callback([&connection](unsigned long long done, unsigned long long total){
+            std::ostringstream progress;
+            progress << "progress " << done << " " << total;
+            send_line(connection, progress.str());
+        });
+        this->device.set_sparse_images(job.sparse);
+
+        if(job.operation == "read"){
+            this->device.set_output_compression(codec_from_name(job.compress), job.level);
+            uint8_t crc = this->device.read_flash_memory(job.address, job.size, job.filename, true);
+            result << "ok read " << job.size << " bytes crc=0x" << std::hex << (int)crc << std::dec;
+        }
+        else if(range_erase(job)){
+            this->device.erase_range(job.flash_chip, job.address, job.size);
+            result << "ok erased " << job.size << " bytes";
+        }
+        else if(job.operation == "erase"){
+            this->device.erase_flash_memory(job.flash_chip);
+            result << "ok erased";
+        }
+        else if(job.operation == "program"){
+            this->device.write_flash_memory(job.flash_chip, job.address, job.size, job.filename, job.verify);
+            result << "ok programmed " << job.size << " bytes" << (job.verify ? ", verified" : "");
+        }
+        else if(job.operation == "verify"){
+            this->device.verify_flash_memory(job.address, job.size, job.filename);
+            result << "ok verified " << job.size << " bytes";
+        }
+        else{
+            uint8_t status = this->device.read_flash_status_reg();
+            uint8_t config = this->device.read_flash_config_reg();
+            result << "ok status=0x" << std::hex << (int)status << " config=0x" << (int)config << std::dec;
+        }
+        std::chrono::high_resolution_clock::time_point finish = std::chrono::high_resolution_clock::now();
+        result << " in " << std::chrono::duration_cast<std::chrono::milliseconds>(finish - start).count() << " ms";
+    }
+    catch(mem_exception& err){
+        result.str("");
+        result << "error " << err.what();
+    }
+
+    this->device.set_progress_callback(progress_callback());
+    this->device.set_output_compression(CODEC_NONE, 0);
+    this->device.set_sparse_images(false);
+    try{
+        this->device.deselect_flash();
+    }
+    catch(mem_exception& err){
+        result.str("");
+        result << "error failed to deselect the flash chip : " << err.what();
+    }
+    send_line(connection, result.str());
+}
@@ -0,0 +1,91 @@
+/*
+*   qspi_daemon.h
+*   @Author Sophie Kirkham STFC, 2018
+*   Header file for the qspi_daemon class
+*   Keeps the qspi controller and multiplexer mapped and runs read, erase, ..
+*   program, verify and status jobs received over a local UNIX socket.
+*/
+
+#ifndef QSPI_DAEMON_H_
+#define QSPI_DAEMON_H_
+
+#include <string>
+#include <deque>
+#include <list>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <sys/types.h>
+#include <sys/un.h>
+
+#include "qspi_device.h"
+
+/*
+*   A job for the daemon, parsed from one line of key=value pairs :
+*   op=<read|erase|program|verify|status> chip=<1-4> [address=<n>] [size=<n>]
+*   [file=<path>] [verify=1] [sparse=1] [compress=<codec>] [level=<n>]
+*/
+struct daemon_job{
+    std::string operation;  // the operation to perform
+    int flash_chip;         // the flash chip to use
+    uint32_t address;       // the flash address to start from
+    unsigned long size;     // the number of bytes to read, program or verify
+    std::string filename;   // the image or dump file
+    bool verify;            // true to verify a program
+    bool sparse;            // true to read or program a sparse image
+    std::string compress;   // the codec to compress a read with
+    int level;              // the level to compress a read at
+};
+
+daemon_job parse_job(const std::string& line);
+void clamp_job(daemon_job& job, const flash_geometry& geometry);
+bool range_erase(const daemon_job& job);
+int submit_job(const std::string& socket_path, const std::string& line);
+
+/*
+*   Daemon serving flash jobs over a UNIX socket
+*   Each client connection has its own queue of jobs, a single worker runs ..
+*   one job at a time from each client in turn so the shared controller is ..
+*   never driven by two jobs at once and no client can starve another.
+*   Every job answers with "progress <done> <total>" lines and then one ..
+*   "ok <message>" or "error <message>" line. The flash chip is deselected ..
+*   after every job. Jobs still queued when the daemon stops are answered ..
+*   with an error line rather than dropped.
+*/
+class qspi_daemon{
+
+    public:
+
+        qspi_daemon(qspi_device& device, const std::string& socket_path);
+        ~qspi_daemon();
+        void run();
+
+    private:
+
+        struct client{
+            int socket;                 // the connected client socket
+            std::deque<daemon_job> jobs;// jobs waiting to run
+            bool connected;             // false once the client has hung up
+            ~client();
+        };
+
+        qspi_device& device;            // the mapped qspi device shared by every job
+        std::string socket_path;        // the path of the listening socket
+        int listen_socket;              // the listening socket
+        ino_t socket_inode;             // inode of the socket bound, 0 if none
+        std::mutex lock;                // protects the clients and their queues
+        std::condition_variable changed;// signals a queued job or a stop
+        std::list< std::shared_ptr<client> > clients;   // clients in round robin order
+        int client_threads;             // number of running client threads
+        bool stopping;                  // true once the daemon is stopping
+
+        void remove_stale_socket(const struct sockaddr_un& address);
+        void client_loop(std::shared_ptr<client> connection);
+        void work_loop();
+        void run_job(client& connection, daemon_job& job);
+        bool next_job(std::shared_ptr<client>& connection, daemon_job& job);
+        static void send_line(client& connection, const std::string& line, bool block = true);
+};
+
+#endif
@@ -15,7 +15,29 @@
 *   base address definitions from qspi_flash_defines.h
 *   Calculates the crc8 table for future use.
 */
-qspi_device::qspi_device() : qspi(QSPI_BASE), mux(MUX_BASE){
+qspi_device::qspi_device() : 
+    out_codec(CODEC_NONE),
+    out_level(0),
+    sparse_images(false),
+    compare_data(NULL), 
+    compare_offset(0), 
+    first_mismatch(-1), 
+    progress_done(0),
+    progress_total(0),
+    progress_reported(0),
+    progress_muted(false),
+    counters(NULL),
+    cancel_flag(NULL),
+    page_latency(NULL),
+    fifo_latency(NULL),
+    selected_flash(0),
+    quad_checked(false),
+    geometry(default_geometry()),
+    fifo_depth(0),
+    fifo_detected(false),
+    qspi(QSPI_BASE), 
+    mux(MUX_BASE)
+{
      this->calc_CRC8_table();
 }
 
@@ -43,6 +65,7 @@ void qspi_device::calc_CRC8_table(){
 *   @returns True if the Status Reg Bit 2 is High.
 */
 bool qspi_device::tx_empty(){
+    count_metric(METRIC_TX_POLLS);
     std::bitset<8> qspi_status(this->qspi.read_mem(QSPI_STATUS_R, QSPI_STD_WIDTH));
     return ((qspi_status[2] == 1) ? true : false);
 }
@@ -60,6 +83,8 @@ bool qspi_device::rx_empty(){
 */
 uint8_t qspi_device::read_flash_status_reg(){  
 
+    check_registers();
+
     // reset the fifo, enable master configuration
     this->qspi.write_mem(QSPI_CONFIG_R, RESET_FIFO_MSTR_CONFIG_ENABLE, QSPI_CR_WIDTH);
     // issue flash read status instruction code onto the data transmit reg
@@ -94,6 +119,8 @@ uint8_t qspi_device::read_flash_status_reg(){
 */
 uint8_t qspi_device::read_flash_config_reg(){
 
+    check_registers();
+
     // reset the fifo, enable master configuration
     this->qspi.write_mem(QSPI_CONFIG_R, RESET_FIFO_MSTR_CONFIG_ENABLE, QSPI_CR_WIDTH);
     // issue flash read config instruction code onto the data transmit reg
@@ -127,6 +154,7 @@ uint8_t qspi_device::read_flash_config_reg(){
 *   @returns True if the Status Reg Bit 0 is High.
 */
 bool qspi_device::write_in_progress(){
+    count_metric(METRIC_WIP_POLLS);
     std::bitset<8> status(read_flash_status_reg());
     return ((status[0] == 1) ? true : false);
 }
@@ -190,7 +218,7 @@ void qspi_device::write_enable(){
         
         // check whether write enabled, throw exception if failed.
         if(!is_write_enabled()){
-            throw mem_exception("Write Failed to Enable");
+            throw mem_exception("Write Failed to Enable", QSPI_ERROR_WRITE_ENABLE);
         }
     }
 }
@@ -203,6 +231,7 @@ void qspi_device::write_enable(){
 */
 void qspi_device::write_flash_registers(uint8_t& status_reg, uint8_t& config_reg){
 
+    this->quad_checked = false;
     write_enable(); // enable write
 
     // reset the fifo, enable master configuration
@@ -263,11 +292,158 @@ void qspi_device::read_spansion_id(){
     for(int i = 0; i < 4; i++){
         this->qspi.read_mem(QSPI_DRR, QSPI_STD_WIDTH);
     }
-    // print the two hex ID bytes using std::cout
+    // log the two hex ID bytes
     for(int i = 0; i < 2; i++){
-        std::cout << std::hex << "Device ID : 0x" << \
-        this->qspi.read_mem(QSPI_DRR, QSPI_STD_WIDTH) << std::dec << std::endl;
+        log_event(EVENT_DEVICE_ID, this->qspi.read_mem(QSPI_DRR, QSPI_STD_WIDTH));
+    }
+}
+
+/*
+*   Issues a command and reads back the bytes the flash returns, in one transaction
+*   @param command : the opcode, address and dummy bytes to send
+*   @param command_bytes : the number of command bytes
+*   @param buffer : the buffer to read the returned bytes into
+*   @param num_bytes : the number of bytes to read, with the command at most a FIFO
+*/
+void qspi_device::read_command(const uint8_t* command, unsigned long command_bytes, uint8_t* buffer, unsigned long num_bytes){
+
+    // reset the fifo, enable master configuration
+    this->qspi.write_mem(QSPI_CONFIG_R, RESET_FIFO_MSTR_CONFIG_ENABLE, QSPI_CR_WIDTH);
+    // push the command, then a dummy byte for each byte to clock back
+    fifo_write(command, command_bytes);
+    fifo_write(NULL, num_bytes);
+    // issue chip select instruction onto the slave select register
+    this->qspi.write_mem(QSPI_SSR, CHIP_SELECT, QSPI_STD_WIDTH);
+    // issue enable master transaction on the config reg to start the QSPI clock
+    this->qspi.write_mem(QSPI_CONFIG_R, ENABLE_MASTER_TRAN, QSPI_CR_WIDTH);
+
+    // wait for the tx buffer to be empty
+    bool tx_state = tx_empty();
+    while (tx_state == false){
+        tx_state = tx_empty();
+    }
+    // issue chip deselect instruction onto the slave select register
+    this->qspi.write_mem(QSPI_SSR, CHIP_DESELECT, QSPI_STD_WIDTH);
+    // issue disable master transaction on the config reg to stop the QSPI clock
+    this->qspi.write_mem(QSPI_CONFIG_R, DISABLE_MASTER_TRAN, QSPI_CR_WIDTH);
+
+    // discard the bytes received while the command was sent
+    fifo_read(NULL, command_bytes);
+    fifo_read(buffer, num_bytes);
+}
+
+/*
+*   Reads the JEDEC manufacturer and device ID of the selected flash.
+*   @param id : set to the JEDEC_ID_SIZE ID bytes
+*/
+void qspi_device::read_jedec_id(uint8_t* id){
+
+    const uint8_t command[1] = {FL_READ_JEDEC_ID};
+    read_command(command, sizeof(command), id, JEDEC_ID_SIZE);
+}
+
+/*
+*   Reads bytes of the serial flash discoverable parameters of the selected flash
+*   @param address : the SFDP address to read from
+*   @param buffer : the buffer to read into
+*   @param num_bytes : the number of bytes to read, split into FIFO sized transactions
+*/
+void qspi_device::read_sfdp(uint32_t address, uint8_t* buffer, unsigned long num_bytes){
+
+    unsigned long bytes_read = 0;
+    while(bytes_read < num_bytes){
+        // three address bytes and a dummy byte follow the opcode
+        uint32_t next = address + bytes_read;
+        const uint8_t command[5] = {FL_READ_SFDP, (uint8_t)(next >> 16), (uint8_t)(next >> 8), (uint8_t)next, DUMMY_DATA};
+        unsigned long chunk = std::min(num_bytes - bytes_read, fifo_chunk(sizeof(command)));
+        read_command(command, sizeof(command), buffer + bytes_read, chunk);
+        bytes_read += chunk;
+    }
+}
+
+/*
+*   Probes the geometry and opcodes of the selected flash from its JEDEC ID ..
+*   and the basic flash parameter table of its SFDP. A device without a ..
+*   usable table keeps the defaults, only its JEDEC ID is filled in.
+*   @returns the geometry of the selected flash.
+*/
+flash_geometry qspi_device::probe_flash(){
+
+    flash_geometry probe = default_geometry();
+    read_jedec_id(probe.jedec_id);
+
+    uint8_t header[SFDP_HEADER_SIZE];
+    read_sfdp(0, header, sizeof(header));
+    try{
+        unsigned count = sfdp_parameter_headers(header);
+        std::vector<uint8_t> headers(count * SFDP_HEADER_SIZE);
+        read_sfdp(SFDP_HEADER_SIZE, &headers[0], headers.size());
+        uint32_t table_address = 0;
+        unsigned num_dwords = 0;
+        if(!find_basic_table(&headers[0], count, table_address, num_dwords)){
+            return probe;
+        }
+        std::vector<uint8_t> table(num_dwords * 4);
+        read_sfdp(table_address, &table[0], table.size());
+        std::vector<uint32_t> dwords(num_dwords);
+        for(unsigned i = 0; i < num_dwords; i++){
+            dwords[i] = table[i * 4] | (table[i * 4 + 1] << 8) | (table[i * 4 + 2] << 16) | ((uint32_t)table[i * 4 + 3] << 24);
+        }
+        flash_geometry parsed = probe;
+        parse_basic_table(dwords, parsed);
+        return parsed;
+    }
+    catch(mem_exception& err){
+        // no SFDP, or a table the engines can not use, the defaults stand
+        return probe;
+    }
+}
+
+/*
+*   Detects the depth the controller's FIFOs were built with
+*   With the master transaction inhibited nothing is shifted out, dummy ..
+*   bytes are pushed until the status register flags the TX FIFO full and ..
+*   the count is checked against the TX occupancy register. The FIFOs are ..
+*   reset afterwards.
+*   @returns the depth, 0 if it could not be detected or is below FIFO_MIN_DEPTH.
+*/
+unsigned long qspi_device::detect_fifo_depth(){
+
+    // reset the fifo, enable master configuration, the transaction stays inhibited
+    this->qspi.write_mem(QSPI_CONFIG_R, RESET_FIFO_MSTR_CONFIG_ENABLE, QSPI_CR_WIDTH);
+    unsigned long depth = 0;
+    while(depth < FIFO_MAX_DEPTH && !(this->qspi.read_mem(QSPI_STATUS_R, QSPI_STD_WIDTH) & QSPI_SR_TX_FULL)){
+        this->qspi.write_mem(QSPI_DTR, DUMMY_DATA, QSPI_STD_WIDTH);
+        depth++;
+    }
+    // the occupancy register holds one less than the bytes queued
+    unsigned long occupancy = this->qspi.read_mem(QSPI_TX_OCCUPANCY, QSPI_CR_WIDTH) + 1;
+
+    // drop the dummy bytes, leaving the controller as a transaction does
+    this->qspi.write_mem(QSPI_CONFIG_R, RESET_FIFO_MSTR_CONFIG_ENABLE, QSPI_CR_WIDTH);
+    this->qspi.write_mem(QSPI_CONFIG_R, DISABLE_MASTER_TRAN, QSPI_CR_WIDTH);
+
+    if(depth >= FIFO_MAX_DEPTH || depth < FIFO_MIN_DEPTH || occupancy != depth){
+        return 0;
+    }
+    return depth;
+}
+
+/*
+*   @param header : the instruction, address and dummy bytes sharing the FIFO
+*   @throws mem_exception : if the header fills the detected FIFO
+*   @returns the data bytes one FIFO transfer carries, FIFO_DEPTH if the ..
+*   depth was not detected.
+*/
+unsigned long qspi_device::fifo_chunk(unsigned long header){
+
+    if(this->fifo_depth == 0){
+        return FIFO_DEPTH;
+    }
+    if(this->fifo_depth <= header){
+        throw mem_exception("Controller FIFO Too Shallow For The Instruction, Address And Dummy Bytes");
     }
+    return this->fifo_depth - header;
 }
 
 
@@ -281,18 +457,22 @@ void qspi_device::read_spansion_id(){
 *   with the fifo depth. Constantly refills the tx buffer to complete the ..
 *   read operation in minimal transactions.
 *   Calcualtes the crc code for the read operation on the fly.
-*   Writes the byte data to the binary file, in binary format, if to_file is true.
+*   Writes the byte data to the output sink, in binary format, if to_file is true.
+*   Byte-compares the data against compare_data if it is set.
+*   A cancel ends the transaction at the next increment.
+*   @throws mem_exception : if the operation was cancelled
 *   @returns the next address to read from 
 */
 uint32_t qspi_device::read_n_bytes(uint32_t& address, unsigned long& num_bytes, unsigned long& increment, uint8_t& crc, bool to_file){
 
-    //initialise an empty buffer to hold @increment numbers of bytes for writing
-    uint8_t write_buffer[increment]; 
+    //initialise an empty buffer to hold up to a FIFO of bytes for writing
+    uint8_t write_buffer[FIFO_MAX_DEPTH]; 
+    std::chrono::steady_clock::time_point fifo_start = std::chrono::steady_clock::now();
 
     // reset the fifo, enable master configuration
     this->qspi.write_mem(QSPI_CONFIG_R, RESET_FIFO_MSTR_CONFIG_ENABLE, QSPI_CR_WIDTH);
-    // issue flash read quad out instruction code onto the data transmit reg
-    this->qspi.write_mem(QSPI_DTR, FL_READ_QUAD_OUT, QSPI_STD_WIDTH);
+    // issue the chip's quad out read instruction code onto the data transmit reg
+    this->qspi.write_mem(QSPI_DTR, this->geometry.read_opcode, QSPI_STD_WIDTH);
 
     // bit shift the four byte address into 4 bytes
     uint8_t msb = (address & 0xFF000000) >> 24;
@@ -308,9 +488,7 @@ uint32_t qspi_device::read_n_bytes(uint32_t& address, unsigned long& num_bytes,
 
     // write the number of bytes we want to read + the preamble size to the ..
     // data transmit register
-    for(int j =0; j < increment + PREAMBLE_SIZE; j++){
-        this->qspi.write_mem(QSPI_DTR, DUMMY_DATA, QSPI_STD_WIDTH);
-    }
+    fifo_write(NULL, increment + this->geometry.read_preamble());
 
     // issue chip select instruction onto the slave select registe
     this->qspi.write_mem(QSPI_SSR, CHIP_SELECT, QSPI_STD_WIDTH);
@@ -325,23 +503,32 @@ uint32_t qspi_device::read_n_bytes(uint32_t& address, unsigned long& num_bytes,
 
     // read out and discard the preamble produced by a read transaction from .. 
     // the data receive register
-    for(int k = 0; k < PREAMBLE_SIZE; k++){
-        this->qspi.read_mem(QSPI_DRR, QSPI_STD_WIDTH);
-    }
+    fifo_read(NULL, this->geometry.read_preamble());
 
     // read the actual data bytes from the data transmit register in @increments
+    fifo_read(write_buffer, increment);
+    if(this->fifo_latency != NULL){
+        this->fifo_latency->record(std::chrono::steady_clock::now() - fifo_start);
+    }
+    if(log_detail()){
+        log_event(EVENT_FIFO_READ, address, increment, std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - fifo_start).count());
+    }
     for(int d =0; d < increment; d++){
-        uint8_t byte = this->qspi.read_mem(QSPI_DRR, QSPI_STD_WIDTH);
-        write_buffer[d] = byte;   // fill the buffer with the data byte
         // calculate the crc code
-        uint8_t crc_byte = (uint8_t) (byte ^ crc); // XOR the byte
+        uint8_t crc_byte = (uint8_t) (write_buffer[d] ^ crc); // XOR the byte
         crc = this->crc_table[crc_byte]; // look up the crc code for byte value
     }
+    // if we are verifying, compare the bytes against the image
+    if(this->compare_data != NULL){
+        compare_bytes(write_buffer, increment);
+    }
     // if we are writing data to a bin file, write the write_buffer to out_file
     if(to_file){
-        this->out_file.write((char*)&write_buffer, sizeof (write_buffer));
-        memset(&write_buffer[0], 0, sizeof(write_buffer));
+        metrics_timer writing(METRIC_IO_NS);
+        this->out_sink->write(write_buffer, increment);
     }
+    report_progress(increment);
 
     unsigned long bytes_read = increment;   //bytes read == increment
 
@@ -350,9 +537,12 @@ uint32_t qspi_device::read_n_bytes(uint32_t& address, unsigned long& num_bytes,
     *   buffer, without starting a new transaction. 
     */
     while(bytes_read < num_bytes){
-        for(int j =0; j < increment; j++){
-            this->qspi.write_mem(QSPI_DTR, DUMMY_DATA, QSPI_STD_WIDTH);
+        // the FIFOs are empty between increments, a cancel can end the transaction here
+        if(cancel_requested()){
+            break;
         }
+        fifo_start = std::chrono::steady_clock::now();
+        fifo_write(NULL, increment);
 
         //check the tx buffer is empty
         bool tx_state = tx_empty();
@@ -361,17 +551,28 @@ uint32_t qspi_device::read_n_bytes(uint32_t& address, unsigned long& num_bytes,
         }
 
         // read the data bytes, fill the write_buffer and calculate the crc code  
+        fifo_read(write_buffer, increment);
+        if(this->fifo_latency != NULL){
+            this->fifo_latency->record(std::chrono::steady_clock::now() - fifo_start);
+        }
+        if(log_detail()){
+            log_event(EVENT_FIFO_READ, address + bytes_read, increment, std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now() - fifo_start).count());
+        }
         for(int d =0; d < increment; d++){
-            uint8_t byte = this->qspi.read_mem(QSPI_DRR, QSPI_STD_WIDTH);
-            write_buffer[d] = byte;
-            uint8_t crc_byte = (uint8_t) (byte ^ crc);
+            uint8_t crc_byte = (uint8_t) (write_buffer[d] ^ crc);
             crc = this->crc_table[crc_byte];
         }
+        // if verifying, compare the bytes against the image
+        if(this->compare_data != NULL){
+            compare_bytes(write_buffer, increment);
+        }
         // if to_file, write the write_buffer to out_file
         if(to_file){
-            this->out_file.write((char*)&write_buffer, sizeof (write_buffer));
-            memset(&write_buffer[0], 0, sizeof(write_buffer));
+            metrics_timer writing(METRIC_IO_NS);
+            this->out_sink->write(write_buffer, increment);
         }
+        report_progress(increment);
         // increment bytes read by increment
         bytes_read +=increment;
     }
@@ -379,16 +580,52 @@ uint32_t qspi_device::read_n_bytes(uint32_t& address, unsigned long& num_bytes,
     this->qspi.write_mem(QSPI_SSR, CHIP_DESELECT, QSPI_STD_WIDTH);
     // issue disable master transaction on the config reg to stop the QSPI clock
     this->qspi.write_mem(QSPI_CONFIG_R, DISABLE_MASTER_TRAN, QSPI_CR_WIDTH);
+    check_cancel();
 
-    return bytes_read;
+    return address + bytes_read;
+}
+
+/*
+*   Byte-compares a buffer of bytes read from the flash against compare_data
+*   Records the image offset of the first mismatching byte in first_mismatch.
+*   @param buffer : the bytes read from the flash memory
+*   @param num_bytes : the number of bytes in the buffer
+*/
+void qspi_device::compare_bytes(const uint8_t* buffer, unsigned long num_bytes){
+
+    if(num_bytes > FIFO_DEPTH && this->image_erased.intersects(this->compare_offset, num_bytes)){
+        // fill the erased ranges a FIFO at a time
+        for(unsigned long offset = 0; offset < num_bytes; offset += FIFO_DEPTH){
+            compare_bytes(buffer + offset, std::min(num_bytes - offset, (unsigned long)FIFO_DEPTH));
+        }
+        return;
+    }
+    const uint8_t* expected = this->compare_data + this->compare_offset;
+    uint8_t erased_buffer[FIFO_DEPTH];
+    if(this->image_erased.intersects(this->compare_offset, num_bytes)){
+        // erased ranges are holes in a sparse image, the flash holds 0xFF there
+        memcpy(erased_buffer, expected, num_bytes);
+        this->image_erased.fill(this->compare_offset, erased_buffer, num_bytes);
+        expected = erased_buffer;
+    }
+    if(this->first_mismatch < 0 && memcmp(buffer, expected, num_bytes) != 0){
+        for(unsigned long i = 0; i < num_bytes; i++){
+            if(buffer[i] != expected[i]){
+                this->first_mismatch = this->compare_offset + i;
+                break;
+            }
+        }
+    }
+    this->compare_offset += num_bytes;
 }
 
 /*  Reads out a specified number of bytes from a flash memory device
 *   @param mem_address : the memory address to start the read from
 *   @param num_bytes : the number of bytes to read from the flash
-*   @param filename : string value for the .bin file name to print to
+*   @param filename : string value for the .bin file name to print to, "-" for stdout
 *   @param to_file : boolean value, when true the mwemory content is printed to a .bin file
 *   @throws mem_exception : if the .bin file fails to open
+*   @throws mem_exception : if the bytes fail to be written to the output
 *   @throws mem_exception : if quad mode failed to enable
 *   If to_file is true - writes to file. 
 *   Calls read_loop with the FIFO aligned num_bytes and then with the overflow num_bytes
@@ -398,318 +635,660 @@ uint32_t qspi_device::read_n_bytes(uint32_t& address, unsigned long& num_bytes,
 uint8_t qspi_device::read_flash_memory(uint32_t& mem_address, unsigned long& num_bytes, std::string& filename, bool to_file){
 
     std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
-    
-    unsigned long increment = FIFO_DEPTH; // max safe data in FIFO = 128
-    /*  Calculate how many times 128 goes into num_bytes, round down to nearest.. 
-        integer. i.e. calculate how many bytes can be read evenly on the 
-        FIFO boundary
-    */
-    unsigned long int FIFO_aligned_num_bytes = (floor(num_bytes/FIFO_DEPTH)) * FIFO_DEPTH;
-    // find the overflow between even bytes and requested bytes.    
-    unsigned long int overflow_bytes = num_bytes - FIFO_aligned_num_bytes; 
    
-    // if we are writing to a file open the out_file in binary mode
+    // if we are writing to a file open the output sink, written on its own thread
+    compress_sink* compressor = NULL;
+    sparse_sink* sparse = NULL;
     if(to_file){
-        this->out_file.open(filename, std::ios::out | std::ios::binary);
-        // if the file fails to open throw exception
-        if(!this->out_file.is_open()){
-            throw mem_exception("Failed to Open .bin File");
+        if(this->sparse_images && (filename.compare(STREAM_NAME) == 0 || this->out_codec != CODEC_NONE)){
+            throw mem_exception("Sparse Output Must Be An Uncompressed File, Not stdout", QSPI_ERROR_INVALID_ARGUMENT);
         }
-    }
-    
-    // initialise the CRC code for future calculations.
-    uint8_t crc = 0;
-
-    // if quad mode is not enabled, enable quad mode 
-    if(!is_quad_enabled()){
-        uint8_t status = 0x00;
-        uint8_t config = 0x02;
-        try{
-            write_flash_registers(status, config);
+        int fd = stream_sink::open_output(filename);
+        if(this->sparse_images){
+            // erased blocks are seeked over and listed in the sidecar
+            sparse = new sparse_sink(fd, filename + ERASED_EXT);
+            this->out_sink.reset(sparse);
         }
-        catch(mem_exception& err){
-            throw;
+        else if(this->out_codec != CODEC_NONE){
+            // compression runs on the sink's writer thread, off the SPI path
+            compressor = new compress_sink(fd, fd != STDOUT_FILENO, this->out_codec, this->out_level);
+            this->out_sink.reset(compressor);
         }
-    }
-    if(is_quad_enabled()){
-        
-        // read the first block of fifo aligned bytes from the memory
-        uint32_t next_addr = read_n_bytes(mem_address, 
-                                        FIFO_aligned_num_bytes, 
-                                        increment, 
-                                        crc, 
-                                        to_file
-                                        );
-        // read the overflow byts from the memory device starting next_addr
-        read_n_bytes(next_addr, overflow_bytes, overflow_bytes, crc, to_file);
-        // print out the CRC code
-        std::cout << std::hex << "CRC code for read : 0x" << crc << std::dec 
-        << std::endl;
-        // if we were writing to a file, close the file now we have finished
-        if(to_file){
-            this->out_file.close();
+        else{
+            this->out_sink.reset(new stream_sink(fd, fd != STDOUT_FILENO));
         }
-        // calculate performance and print the time in ms to complete read
-        std::chrono::high_resolution_clock::time_point finish = std::chrono::high_resolution_clock::now();
-        std::cout << std::chrono::duration_cast<std::chrono::milliseconds>(finish - start).count() << " ms to read" << std::endl;
     }
-    else{
-        // throw mem exception if quad mode did not enable.
-        throw mem_exception("Quad Mode Did Not Enable, Read Operation In-valid");
+
+    uint8_t crc;
+    try{
+        crc = read_to_sink(mem_address, num_bytes, to_file);
+    }
+    catch(mem_exception& err){
+        this->out_sink.reset();
+        throw;
+    }
+
+    // if we were writing to a file, flush and close it now we have finished
+    if(to_file){
+        this->out_sink->close();
+        if(sparse != NULL){
+            log_event(EVENT_SPARSE_HOLES, sparse->ranges().erased_bytes());
+        }
+        if(compressor != NULL){
+            log_event(EVENT_COMPRESSED, compressor->uncompressed_bytes(), compressor->compressed_bytes(), 
+                    this->out_codec, compressor->level());
+            if(compressor->level() != this->out_level){
+                log_event(EVENT_LEVEL_LOWERED, this->out_level);
+            }
+        }
+        this->out_sink.reset();
     }
+    // calculate performance and print the time in ms to complete read
+    std::chrono::high_resolution_clock::time_point finish = std::chrono::high_resolution_clock::now();
+    log_event(EVENT_READ_DONE, std::chrono::duration_cast<std::chrono::milliseconds>(finish - start).count());
     return crc;
 }
 
 /*
-*   Erase the entire (64MB) flash memory by setting all bytes to 0xFF.
-*   @param flash_num, int currently used to protect the flash memory 1 from being erased.
-*   @throws mem_exception : if we erase flash number 1.
-*   @throws mem_exception : if an erase error occured.
+*   Reads a specified number of bytes from the flash memory into a buffer
+*   @param mem_address : the address to start reading from
+*   @param num_bytes : the number of bytes to read
+*   @param buffer : the buffer to read into, at least num_bytes long
+*   @throws mem_exception : if quad mode failed to enable
+*   @returns crc : a byte value of the CRC code.
 */
-void qspi_device::erase_flash_memory(int& flash_num){
+uint8_t qspi_device::read_flash_buffer(uint32_t& mem_address, unsigned long& num_bytes, uint8_t* buffer){
 
-    //temporay hack to ensure we dont erase flash 1..
-    if(flash_num == 1){
-        throw mem_exception("FATAL : COMMAND SET TO ERASE FLASH MEMORY CHIP 1");
+    this->out_sink.reset(new buffer_sink(buffer, num_bytes));
+    uint8_t crc;
+    try{
+        crc = read_to_sink(mem_address, num_bytes, true);
     }
-    else{
-    
-        std::chrono::high_resolution_clock::time_point start_erase = std::chrono::high_resolution_clock::now();
-        write_enable(); // enable write
-        // reset the fifo, enable master configuration
-        this->qspi.write_mem(QSPI_CONFIG_R, RESET_FIFO_MSTR_CONFIG_ENABLE, QSPI_CR_WIDTH);
-        // issue flash bulk erase instruction code onto the data transmit reg
-        this->qspi.write_mem(QSPI_DTR, FL_BULK_ERASE, QSPI_STD_WIDTH);
-        // issue chip select instruction onto the slave select register
-        this->qspi.write_mem(QSPI_SSR, CHIP_SELECT, QSPI_STD_WIDTH);
-        // issue enable master transaction on the config reg to start the QSPI clock
-        this->qspi.write_mem(QSPI_CONFIG_R, ENABLE_MASTER_TRAN, QSPI_CR_WIDTH);
-        // issue chip deselect instruction onto the slave select register
-        this->qspi.write_mem(QSPI_SSR, CHIP_DESELECT, QSPI_STD_WIDTH);
-        // issue disable master transaction on the config reg to stop the QSPI clock
-        this->qspi.write_mem(QSPI_CONFIG_R, DISABLE_MASTER_TRAN, QSPI_CR_WIDTH);
-
-        // wait for write to not be in progress i.e. to finish
-        bool wip = write_in_progress();
-        while(wip == true){
-            wip = write_in_progress();
-        }
-        // check for an erase error.
-        if(erase_error()){
-            throw mem_exception("Erase Error Has Occured, Perform a Clear Status Register Operation to Reset the Device");
-        }
-        else{
-            // print out performance stats on time to erase.
-            std::chrono::high_resolution_clock::time_point finish_erase = std::chrono::high_resolution_clock::now();
-            std::cout << std::chrono::duration_cast<std::chrono::milliseconds>(finish_erase - start_erase).count() << " ms to erase." << std::endl;
-            std::cout << "Erase Operation Complete" << std::endl;
-        }
-
+    catch(mem_exception& err){
+        this->out_sink.reset();
+        throw;
     }
+    this->out_sink.reset();
+    return crc;
 }
 
-
 /*
-*   Write a specified number of fifo aligned bytes from in_file to a flash memory device.
-*   @param mem_address : memory addres to start writing to.
-*   @param num_bytes : nubmer of bytes to write to the flash memory
-*   @param crc : cyclic redundancy check value
-*   Writes byte data to a binary file in blocks of 512 bytes (page boundaries)
-*   Calcualtes the crc code on the fly for the write
-*   @throws mem_exception : if there is a program error
-*   @return bytes_written : the next address to write to 
+*   Reads a specified number of bytes from the flash memory
+*   @param mem_address : the address to start reading from
+*   @param num_bytes : the number of bytes to read
+*   @param to_sink : boolean value, when true the bytes are written to out_sink
+*   Enables quad mode if required, then reads the array.
+*   @throws mem_exception : if quad mode failed to enable
+*   @throws mem_exception : if the bytes fail to be written to the output
+*   @returns crc : a byte value of the CRC code.
 */
-uint32_t qspi_device::write_n_fifo_aligned_bytes_from_file(uint32_t& mem_address, unsigned long& num_bytes, uint8_t& crc){
-
-    // initialise a buffer to hold 128 bytes
-    uint8_t buffer[FIFO_DEPTH];
+uint8_t qspi_device::read_to_sink(uint32_t& mem_address, unsigned long& num_bytes, bool to_sink){
 
-    // read 128 bytes from in_file into the buffer.
-    this->in_file.read((char*)(&buffer[0]), FIFO_DEPTH);  
-
-    // check the file read succeeded.
-    if(!this->in_file){
-        throw mem_exception("Failed to Read Bytes from File.");
+    // the read back of a verify stays in the verify phase
+    if(this->counters != NULL && this->counters->phase.load(std::memory_order_relaxed) != PROGRESS_VERIFY){
+        set_phase(PROGRESS_READ);
     }
+    start_progress(num_bytes);
+    enable_quad_read();
+    uint8_t crc = read_array(mem_address, num_bytes, to_sink);
+    // log the CRC code
+    log_event(EVENT_READ_CRC, crc);
+    return crc;
+}
 
-    uint32_t fbyte_address = mem_address;
+/*
+*   Enables quad mode on the selected flash if it is not already, needed ..
+*   before the array is read with the quad output read instruction.
+*   @throws mem_exception : if quad mode failed to enable
+*/
+void qspi_device::enable_quad_read(){
 
-    // check that write is enabled, if not - enable it.
-    if(!is_write_enabled()){
-        write_enable();
+    // a backend configures the flash itself
+    if(this->backend){
+        this->quad_checked = true;
+        return;
     }
+    // if quad mode is not enabled, enable quad mode 
+    if(!is_quad_enabled()){
+        uint8_t status = 0x00;
+        uint8_t config = 0x02;
+        write_flash_registers(status, config);
+        // the registers must finish writing before the array is read
+        wait_for_write();
+    }
+    if(!is_quad_enabled()){
+        // throw mem exception if quad mode did not enable.
+        throw mem_exception("Quad Mode Did Not Enable, Read Operation In-valid", QSPI_ERROR_QUAD_MODE);
+    }
+    this->quad_checked = true;
+}
 
-    // reset the fifo, enable master configuration
-    this->qspi.write_mem(QSPI_CONFIG_R, RESET_FIFO_MSTR_CONFIG_ENABLE, QSPI_CR_WIDTH);
-    // issue flash quad page program instruction code onto the data transmit reg
-    this->qspi.write_mem(QSPI_DTR, FL_QUAD_PP, QSPI_STD_WIDTH);
-
-    // bit shift the memory address inot 4 bytes
-    uint8_t msb = (fbyte_address & 0xFF000000) >> 24;
-    uint8_t mid1 = (fbyte_address & 0x00FF0000) >> 16;
-    uint8_t mid2 = (fbyte_address & 0x0000FF00) >> 8;
-    uint8_t lsb = (fbyte_address & 0x000000FF);
+/*
+*   Reads bytes from the flash array, quad mode must already be enabled
+*   Reads through the backend if one is set, or copies the bytes out of ..
+*   the XIP window if it is mapped, otherwise ..
+*   calls read_n_bytes with the FIFO aligned num_bytes and then with the ..
+*   overflow num_bytes.
+*   @param mem_address : the address to start reading from
+*   @param num_bytes : the number of bytes to read
+*   @param to_sink : boolean value, when true the bytes are written to out_sink
+*   @throws mem_exception : if the bytes fail to be written to the output
+*   @returns crc : a byte value of the CRC code.
+*/
+uint8_t qspi_device::read_array(uint32_t mem_address, unsigned long num_bytes, bool to_sink){
 
-    // push the address onto the data transmit reigster
-    this->qspi.write_mem(QSPI_DTR, msb, QSPI_STD_WIDTH);
-    this->qspi.write_mem(QSPI_DTR, mid1, QSPI_STD_WIDTH);
-    this->qspi.write_mem(QSPI_DTR, mid2, QSPI_STD_WIDTH);
-    this->qspi.write_mem(QSPI_DTR, lsb, QSPI_STD_WIDTH);
+    // the data bytes a FIFO holds beside the instruction, address and preamble
+    unsigned long increment = fifo_chunk(5 + this->geometry.read_preamble());
+    /*  Calculate how many times the increment goes into num_bytes, round down .. 
+        to nearest integer. i.e. calculate how many bytes can be read evenly on the 
+        FIFO boundary
+    */
+    unsigned long int FIFO_aligned_num_bytes = (num_bytes / increment) * increment;
+    // find the overflow between even bytes and requested bytes.    
+    unsigned long int overflow_bytes = num_bytes - FIFO_aligned_num_bytes; 
+    
+    // initialise the CRC code for future calculations.
+    uint8_t crc = 0;
+    metrics_timer reading(METRIC_READ_NS);
+    count_metric(METRIC_BYTES_READ, num_bytes);
 
-    // write the buffer of 128 bytes into memory 
-    for(int i =0; i < FIFO_DEPTH; i++){
-        this->qspi.write_mem(QSPI_DTR, buffer[i], QSPI_STD_WIDTH);
-        // calculate the crc as we go
-        uint8_t byte = (uint8_t) (buffer[i] ^ crc); //XOR the byte
-        crc = this->crc_table[byte];
+    // read through the backend, or straight out of the XIP window when it holds the bytes
+    if(this->backend || (this->xip && this->xip->contains(mem_address, num_bytes))){
+        return read_buffered(mem_address, num_bytes, to_sink);
     }
-
-    // issue chip select instruction onto the slave select register
-    this->qspi.write_mem(QSPI_SSR, CHIP_SELECT, QSPI_STD_WIDTH);
-    // issue enable master transaction on the config reg to start the QSPI clock
-    this->qspi.write_mem(QSPI_CONFIG_R, ENABLE_MASTER_TRAN, QSPI_CR_WIDTH);
-    
-    // wait for the tx buffer to be empty
-    bool tx__state = tx_empty();
-    while (tx__state == false){
-        tx__state = tx_empty();
+        
+    uint32_t next_addr = mem_address;
+    // read the first block of fifo aligned bytes from the memory
+    if(FIFO_aligned_num_bytes > 0){
+        next_addr = read_n_bytes(mem_address, 
+                                FIFO_aligned_num_bytes, 
+                                increment, 
+                                crc, 
+                                to_sink
+                                );
     }
+    // read the overflow byts from the memory device starting next_addr
+    if(overflow_bytes > 0){
+        read_n_bytes(next_addr, overflow_bytes, overflow_bytes, crc, to_sink);
+    }
+    return crc;
+}
 
-    // reset the buffer to 0 to read in the next 128 bytes.
-    unsigned long bytes_written = FIFO_DEPTH;
-    memset(&buffer[0], 0, sizeof(buffer));
-    this->in_file.seekg(FIFO_DEPTH);
-
-    // process the remaining bytes needed to write in one transaction
-    while(bytes_written < num_bytes){
-
-        // read 128 bytes from the file into buffer
-        this->in_file.read((char*)(&buffer[0]), FIFO_DEPTH);
+/*
+*   Reads bytes from the flash array through the backend or XIP window
+*   Fetches XIP_CHUNK bytes at a time into a buffer, then calculates the ..
+*   CRC, compares against compare_data and writes to the sink from it ..
+*   just as read_n_bytes does per FIFO.
+*   @param mem_address : the address to start reading from
+*   @param num_bytes : the number of bytes to read
+*   @param to_sink : boolean value, when true the bytes are written to out_sink
+*   @throws mem_exception : if the bytes fail to be written to the output
+*   @throws mem_exception : if the operation was cancelled
+*   @returns crc : a byte value of the CRC code.
+*/
+uint8_t qspi_device::read_buffered(uint32_t mem_address, unsigned long num_bytes, bool to_sink){
 
-        // check the read operation is ok 
-        if(!this->in_file){
-            throw mem_exception("Failed to Read Bytes from File.");
+    uint8_t crc = 0;
+    this->read_buffer.resize(XIP_CHUNK);
+    unsigned long bytes_read = 0;
+    while(bytes_read < num_bytes){
+        check_cancel();
+        unsigned long chunk = std::min(num_bytes - bytes_read, (unsigned long)XIP_CHUNK);
+        uint8_t* bytes = this->read_buffer.data();
+        if(this->backend){
+            this->backend->read(mem_address + bytes_read, bytes, chunk);
         }
-
-        // write the 128 bytes to memory
-        for(int i =0; i < FIFO_DEPTH; i++){
-            this->qspi.write_mem(QSPI_DTR, buffer[i], QSPI_STD_WIDTH);
-            // calculate the crc code as we go
-            uint8_t byte = (uint8_t) (buffer[i] ^ crc); //XOR the byte
-            crc = this->crc_table[byte];
+        else{
+            this->xip->copy(bytes, mem_address + bytes_read, chunk);
         }
-
-        // if we have written a page (512 bytes), enable the transaction
-        // we can only write in blocks of 512 bytes
-        if(bytes_written % PAGE_SIZE == 0){
-             // issue chip select instruction onto the slave select register
-            this->qspi.write_mem(QSPI_SSR, CHIP_SELECT, QSPI_STD_WIDTH);
-            // issue enable master transaction on the config reg to start the QSPI clock
-            this->qspi.write_mem(QSPI_CONFIG_R, ENABLE_MASTER_TRAN, QSPI_CR_WIDTH);
+        for(unsigned long i = 0; i < chunk; i++){
+            crc = this->crc_table[(uint8_t)(bytes[i] ^ crc)];
         }
-
-        // wait for the tx buffer to be empty
-        bool tx_state_ = tx_empty();
-        while (tx_state_ == false){
-            tx_state_ = tx_empty();
+        // if verifying, compare the bytes against the image
+        if(this->compare_data != NULL){
+            compare_bytes(bytes, chunk);
         }
-
-        //reset the buffer ready for the next 128 bytes
-        bytes_written += FIFO_DEPTH;
-        memset(&buffer[0], 0, sizeof(buffer));
-        this->in_file.seekg(bytes_written);
-        
-        // if we've written a page we need to set up and start a new transaction
-        if(bytes_written % PAGE_SIZE == 0){
-
-            // issue chip deselect instruction onto the slave select register
-            this->qspi.write_mem(QSPI_SSR, CHIP_DESELECT, QSPI_STD_WIDTH);
-            // issue disable master transaction on the config reg to stop the QSPI clock
-            this->qspi.write_mem(QSPI_CONFIG_R, DISABLE_MASTER_TRAN, QSPI_CR_WIDTH);
-    
-            // wait for the page write to complete
-            bool wip = write_in_progress();
-            while(wip == true){
-                wip = write_in_progress();
-            }
-
-            // re-enable write
-            write_enable();
-            // reset the fifo, enable master configuration
-            this->qspi.write_mem(QSPI_CONFIG_R, RESET_FIFO_MSTR_CONFIG_ENABLE, QSPI_CR_WIDTH);
-            // issue flash quad page program instruction code onto the data transmit reg
-            this->qspi.write_mem(QSPI_DTR, FL_QUAD_PP, QSPI_STD_WIDTH);
-
-            // bit shift the address into 4 bytes
-            uint8_t msb = (bytes_written & 0xFF000000) >> 24;
-            uint8_t mid1 = (bytes_written & 0x00FF0000) >> 16;
-            uint8_t mid2 = (bytes_written & 0x0000FF00) >> 8;
-            uint8_t lsb = (bytes_written & 0x000000FF);
-            // push the address onto the data transmit register
-            this->qspi.write_mem(QSPI_DTR, msb, QSPI_STD_WIDTH);
-            this->qspi.write_mem(QSPI_DTR, mid1, QSPI_STD_WIDTH);
-            this->qspi.write_mem(QSPI_DTR, mid2, QSPI_STD_WIDTH);
-            this->qspi.write_mem(QSPI_DTR, lsb, QSPI_STD_WIDTH);
+        if(to_sink){
+            metrics_timer writing(METRIC_IO_NS);
+            this->out_sink->write(bytes, chunk);
         }
+        report_progress(chunk);
+        bytes_read += chunk;
     }
+    return crc;
+}
 
-    // once we have written all of the bytes..
-    // issue chip deselect instruction onto the slave select register
-    this->qspi.write_mem(QSPI_SSR, CHIP_DESELECT, QSPI_STD_WIDTH);
-    // issue disable master transaction on the config reg to stop the QSPI clock
-    this->qspi.write_mem(QSPI_CONFIG_R, DISABLE_MASTER_TRAN, QSPI_CR_WIDTH);
-    
-    // make sure all write operations have completed
-    bool wip = write_in_progress();
-    while(wip == true){
-        wip = write_in_progress();
-    }
-
-    // check for a program error
-    if(program_error()){
-        throw mem_exception ("Program Error : Write Operation Failed.");
-    }
+/*
+*   Maps the QSPI controller's XIP read port, reads then copy out of it ..
+*   instead of driving the FIFOs. Call after map_qspi_mux().
+*   @param file : MEM_DEVICE for the port, or a flash image file standing in for it
+*   @throws mem_exception : if the window fails to map
+*/
+void qspi_device::map_xip(const std::string& file){
 
-    return bytes_written;
+    std::unique_ptr<xip_window> window(new xip_window(file));
+    window->map();
+    this->xip.reset(window.release());
+    this->cache.clear();
 }
 
 /*
-*   Write a specified number of un-fifo aligned bytes from in_file to a flash memory device.
-*   @param mem_address : memory addres to start writing to.
-*   @param num_bytes : nubmer of bytes to write to the flash memory
-*   @param crc : cyclic redundancy check value
-*   Writes byte data to a binary file in one transaction
-*   @throws mem_exception : if there is a program error
-*   Calcualtes the crc code on the fly for the write
+*   @returns true if reads go through the XIP window.
 */
-void qspi_device::write_n_unaligned_bytes_from_file(uint32_t& mem_address, unsigned long& num_bytes, uint8_t& crc){
+bool qspi_device::xip_mapped(){
+    return (bool)this->xip;
+}
 
-     // initialise a buffer to hold 128 bytes
-    uint8_t buffer[num_bytes];
-    //set the read pointer in the file to be the memory address.
-    this->in_file.seekg(mem_address);
-    // read 128 bytes
-    this->in_file.read((char*)(&buffer[0]), num_bytes);
+/*
+*   Moves FIFO transfers through a DMA engine instead of the CPU, transfers ..
+*   shorter than DMA_MIN_BYTES stay on the CPU. Call after map_qspi_mux().
+*   @param engine : DMA_CDMA for the AXI CDMA, DMA_EMULATED for the stand-in
+*   @throws mem_exception : if the engine is unknown or fails to open
+*/
+void qspi_device::enable_dma(const std::string& engine){
 
-    // check the file read succeeded.
-    if(!this->in_file){
-        throw mem_exception("Failed to Read Bytes from File.");
+    if(engine == DMA_CDMA){
+        this->dma.reset(new axi_cdma(DMA_UIO_DEVICE, DMA_BUFFER_DEVICE));
     }
-
-    // check that write is enabled, if not - enable it.
-    if(!is_write_enabled()){
-        write_enable();
+    else if(engine == DMA_EMULATED){
+        this->dma.reset(new emulated_dma(this->qspi));
     }
-    // reset the fifo, enable master configuration
-    this->qspi.write_mem(QSPI_CONFIG_R, RESET_FIFO_MSTR_CONFIG_ENABLE, QSPI_CR_WIDTH);
-    // issue flash quad page program instruction code onto the data transmit reg
-    this->qspi.write_mem(QSPI_DTR, FL_QUAD_PP, QSPI_STD_WIDTH);
-
-    // bit shift the memory address inot 4 bytes
-    uint8_t msb = (mem_address & 0xFF000000) >> 24;
-    uint8_t mid1 = (mem_address & 0x00FF0000) >> 16;
-    uint8_t mid2 = (mem_address & 0x0000FF00) >> 8;
-    uint8_t lsb = (mem_address & 0x000000FF);
+    else{
+        throw mem_exception("Unknown DMA Engine " + engine, QSPI_ERROR_INVALID_ARGUMENT);
+    }
+}
+
+/*
+*   @returns the DMA engine moving FIFO transfers, NULL if the CPU moves them.
+*/
+fifo_dma* qspi_device::get_dma(){
+    return this->dma.get();
+}
+
+/*
+*   @returns the geometry and opcodes of the selected chip, probed when it was selected.
+*/
+const flash_geometry& qspi_device::get_geometry(){
+    return this->geometry;
+}
+
+/*
+*   Checks a range of addresses lies within the selected chip.
+*   @param mem_address : the first address of the range
+*   @param num_bytes : the number of bytes in the range
+*   @throws mem_exception : if the range runs past the end of the flash
+*/
+void qspi_device::check_range(uint32_t mem_address, unsigned long long num_bytes){
+    if(mem_address + num_bytes > this->geometry.size){
+        throw mem_exception("Address Range Runs Past The End Of The Flash", QSPI_ERROR_INVALID_ARGUMENT);
+    }
+}
+
+/*
+*   @returns the depth of the controller's FIFOs, 0 if it was not detected.
+*/
+unsigned long qspi_device::get_fifo_depth(){
+    return this->fifo_depth;
+}
+
+/*
+*   Pushes bytes onto the data transmit register, through the DMA engine if set.
+*   @param data : the bytes to push, NULL to push DUMMY_DATA
+*   @param num_bytes : the number of bytes, at most a FIFO
+*/
+void qspi_device::fifo_write(const uint8_t* data, unsigned long num_bytes){
+
+    if(this->dma && num_bytes >= DMA_MIN_BYTES){
+        // a FIFO can be deeper than the DMA buffer, move it a buffer at a time
+        uint32_t* words = this->dma->words();
+        for(unsigned long done = 0; done < num_bytes;){
+            unsigned long chunk = std::min(num_bytes - done, this->dma->capacity());
+            for(unsigned long i = 0; i < chunk; i++){
+                words[i] = (data == NULL) ? DUMMY_DATA : data[done + i];
+            }
+            this->dma->start_to_fifo(chunk);
+            this->dma->wait();
+            done += chunk;
+        }
+        return;
+    }
+    for(unsigned long i = 0; i < num_bytes; i++){
+        this->qspi.write_mem(QSPI_DTR, (data == NULL) ? DUMMY_DATA : data[i], QSPI_STD_WIDTH);
+    }
+}
+
+/*
+*   Pops bytes off the data receive register, through the DMA engine if set.
+*   @param buffer : the buffer to read into, NULL to discard the bytes
+*   @param num_bytes : the number of bytes, at most a FIFO
+*/
+void qspi_device::fifo_read(uint8_t* buffer, unsigned long num_bytes){
+
+    if(this->dma && num_bytes >= DMA_MIN_BYTES){
+        // a FIFO can be deeper than the DMA buffer, move it a buffer at a time
+        const uint32_t* words = this->dma->words();
+        for(unsigned long done = 0; done < num_bytes;){
+            unsigned long chunk = std::min(num_bytes - done, this->dma->capacity());
+            this->dma->start_from_fifo(chunk);
+            this->dma->wait();
+            for(unsigned long i = 0; buffer != NULL && i < chunk; i++){
+                buffer[done + i] = (uint8_t)words[i];
+            }
+            done += chunk;
+        }
+        return;
+    }
+    for(unsigned long i = 0; i < num_bytes; i++){
+        uint8_t byte = this->qspi.read_mem(QSPI_DRR, QSPI_STD_WIDTH);
+        if(buffer != NULL){
+            buffer[i] = byte;
+        }
+    }
+}
+
+/*
+*   Reads bytes from the flash at an address, like pread(2)
+*   Served from the read cache, blocks that miss are read in whole and kept. ..
+*   No CRC is printed or calculated for the caller, quad mode is only ..
+*   checked on the first miss after the flash is selected. Cache fills ..
+*   report no progress, so a caller's progress window is left as it was.
+*   @param buffer : the buffer to read into, at least num_bytes long
+*   @param num_bytes : the number of bytes to read
+*   @param mem_address : the flash address to read from
+*   @throws mem_exception : if no flash chip is selected
+*   @throws mem_exception : if quad mode failed to enable
+*   @returns the number of bytes read, short if the read passes the end of the flash.
+*/
+unsigned long qspi_device::pread(uint8_t* buffer, unsigned long num_bytes, uint32_t mem_address){
+
+    if(this->selected_flash == 0){
+        throw mem_exception("No Flash Chip Selected", QSPI_ERROR_FLASH_SELECT);
+    }
+    if(mem_address >= this->geometry.size){
+        return 0;
+    }
+    num_bytes = std::min(num_bytes, (unsigned long)(this->geometry.size - mem_address));
+
+    this->progress_muted = true;
+    unsigned long bytes_read;
+    try{
+        bytes_read = read_cached(buffer, num_bytes, mem_address);
+    }
+    catch(mem_exception& err){
+        this->progress_muted = false;
+        throw;
+    }
+    this->progress_muted = false;
+    return bytes_read;
+}
+
+/*
+*   Copies bytes out of the read cache, reading the blocks that miss in whole.
+*   @param buffer : the buffer to read into, at least num_bytes long
+*   @param num_bytes : the number of bytes to read, within the flash
+*   @param mem_address : the flash address to read from
+*   @throws mem_exception : if quad mode failed to enable
+*   @returns the number of bytes read.
+*/
+unsigned long qspi_device::read_cached(uint8_t* buffer, unsigned long num_bytes, uint32_t mem_address){
+
+    unsigned long bytes_read = 0;
+    while(bytes_read < num_bytes){
+
+        uint32_t address = mem_address + bytes_read;
+        uint32_t block_address = address - (address % CACHE_BLOCK_SIZE);
+        unsigned long offset = address - block_address;
+        unsigned long chunk = std::min(num_bytes - bytes_read, CACHE_BLOCK_SIZE - offset);
+
+        const uint8_t* block = this->cache.find(this->selected_flash, block_address);
+        if(block == NULL){
+            if(!this->quad_checked){
+                enable_quad_read();
+            }
+            uint8_t* fill = this->cache.insert(this->selected_flash, block_address);
+            if(fill == NULL){
+                // the cache is disabled, read just the bytes asked for
+                this->out_sink.reset(new buffer_sink(buffer + bytes_read, chunk));
+                try{
+                    read_array(address, chunk, true);
+                }
+                catch(mem_exception& err){
+                    this->out_sink.reset();
+                    throw;
+                }
+                this->out_sink.reset();
+                bytes_read += chunk;
+                continue;
+            }
+            // the last block stops at the end of the flash
+            unsigned long block_bytes = std::min((unsigned long)CACHE_BLOCK_SIZE, (unsigned long)(this->geometry.size - block_address));
+            this->out_sink.reset(new buffer_sink(fill, block_bytes));
+            try{
+                read_array(block_address, block_bytes, true);
+            }
+            catch(mem_exception& err){
+                this->out_sink.reset();
+                this->cache.invalidate(this->selected_flash, block_address, CACHE_BLOCK_SIZE);
+                throw;
+            }
+            this->out_sink.reset();
+            block = fill;
+        }
+        memcpy(buffer + bytes_read, block + offset, chunk);
+        bytes_read += chunk;
+    }
+    return bytes_read;
+}
+
+/*
+*   @returns the cache serving pread(), to size it and read its statistics.
+*/
+sector_cache& qspi_device::read_cache(){
+    return this->cache;
+}
+
+/*
+*   Starts a bulk erase of the entire flash memory, setting all bytes to 0xFF.
+*   Returns as soon as the erase is issued, the chip can be deselected and ..
+*   others used while it erases. Poll erase_complete() with it selected.
+*   @param flash_num, int currently used to protect the flash memory 1 from being erased.
+*   @throws mem_exception : if the range runs past the end of the flash
+*   @throws mem_exception : if we erase flash number 1.
+*/
+void qspi_device::start_erase(int& flash_num){
+
+    //temporay hack to ensure we dont erase flash 1..
+    if(flash_num == 1){
+        throw mem_exception("FATAL : COMMAND SET TO ERASE FLASH MEMORY CHIP 1", QSPI_ERROR_PROTECTED);
+    }
+    this->cache.invalidate(this->selected_flash);
+    if(this->backend){
+        unsigned long long size = this->backend->flash_size();
+        this->backend->start_erase(0, size - (size % this->backend->erase_size()));
+        return;
+    }
+    write_enable(); // enable write
+    // reset the fifo, enable master configuration
+    this->qspi.write_mem(QSPI_CONFIG_R, RESET_FIFO_MSTR_CONFIG_ENABLE, QSPI_CR_WIDTH);
+    // issue flash bulk erase instruction code onto the data transmit reg
+    this->qspi.write_mem(QSPI_DTR, this->geometry.bulk_erase_opcode, QSPI_STD_WIDTH);
+    // issue chip select instruction onto the slave select register
+    this->qspi.write_mem(QSPI_SSR, CHIP_SELECT, QSPI_STD_WIDTH);
+    // issue enable master transaction on the config reg to start the QSPI clock
+    this->qspi.write_mem(QSPI_CONFIG_R, ENABLE_MASTER_TRAN, QSPI_CR_WIDTH);
+    // issue chip deselect instruction onto the slave select register
+    this->qspi.write_mem(QSPI_SSR, CHIP_DESELECT, QSPI_STD_WIDTH);
+    // issue disable master transaction on the config reg to stop the QSPI clock
+    this->qspi.write_mem(QSPI_CONFIG_R, DISABLE_MASTER_TRAN, QSPI_CR_WIDTH);
+}
+
+/*
+*   Checks whether the erase started by start_erase() has finished.
+*   @throws mem_exception : if an erase error occured.
+*   @returns true once the erase has finished.
+*/
+bool qspi_device::erase_complete(){
+
+    if(this->backend){
+        return this->backend->erase_complete();
+    }
+    if(write_in_progress()){
+        return false;
+    }
+    // check for an erase error.
+    if(erase_error()){
+        throw mem_exception("Erase Error Has Occured, Perform a Clear Status Register Operation to Reset the Device", QSPI_ERROR_ERASE);
+    }
+    return true;
+}
+
+/*
+*   Erase the entire (64MB) flash memory by setting all bytes to 0xFF.
+*   @param flash_num, int currently used to protect the flash memory 1 from being erased.
+*   @throws mem_exception : if we erase flash number 1.
+*   @throws mem_exception : if an erase error occured.
+*   @throws mem_exception : if the operation was cancelled before the erase started
+*/
+void qspi_device::erase_flash_memory(int& flash_num){
+
+    metrics_timer erasing(METRIC_ERASE_NS);
+    set_phase(PROGRESS_ERASE);
+    start_progress(0);
+    std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+    // a bulk erase can not be stopped once issued, only cancelled before
+    check_cancel();
+    start_erase(flash_num);
+
+    // wait for write to not be in progress i.e. to finish
+    wait_for_erase();
+    // log the performance stats on time to erase.
+    std::chrono::high_resolution_clock::time_point finish_erase = std::chrono::high_resolution_clock::now();
+    log_event(EVENT_ERASE_DONE, std::chrono::duration_cast<std::chrono::milliseconds>(finish_erase - start).count());
+}
+
+
+/*
+*   Waits for a program, erase or register write to complete on the flash.
+*   Issues one status register read and holds chip select, the flash ..
+*   streams the status register for as long as it is held. Each poll clocks ..
+*   STATUS_POLL_BYTES more samples through the FIFOs, topping the TX FIFO ..
+*   up without ending the transaction, until the write in progress bit clears.
+*   @throws mem_exception : if a backend is in use
+*   @returns status : the final value of the status register.
+*/
+uint8_t qspi_device::wait_for_write(){
+
+    check_registers();
+    metrics_timer waiting(METRIC_WAIT_NS);
+    uint8_t samples[STATUS_POLL_BYTES];
+    unsigned long burst = std::min(fifo_chunk(1), (unsigned long)STATUS_POLL_BYTES);
+
+    // reset the fifo, enable master configuration
+    this->qspi.write_mem(QSPI_CONFIG_R, RESET_FIFO_MSTR_CONFIG_ENABLE, QSPI_CR_WIDTH);
+    // issue flash read status instruction code and the first dummy bytes
+    this->qspi.write_mem(QSPI_DTR, FL_READ_STATUS, QSPI_STD_WIDTH);
+    fifo_write(NULL, burst);
+    // issue chip select instruction onto the slave select register
+    this->qspi.write_mem(QSPI_SSR, CHIP_SELECT, QSPI_STD_WIDTH);
+    // issue enable master transaction on the config reg to start the QSPI clock
+    this->qspi.write_mem(QSPI_CONFIG_R, ENABLE_MASTER_TRAN, QSPI_CR_WIDTH);
+
+    // wait for the instruction and the first samples, discarding the byte ..
+    // received while the instruction was sent
+    while(!tx_empty()){
+    }
+    this->qspi.read_mem(QSPI_DRR, QSPI_STD_WIDTH);
+    fifo_read(samples, burst);
+    count_metric(METRIC_WIP_POLLS);
+
+    // the newest sample is the status now, keep clocking until it is clear
+    while(samples[burst - 1] & 0x01){
+        fifo_write(NULL, burst);
+        while(!tx_empty()){
+        }
+        fifo_read(samples, burst);
+        count_metric(METRIC_WIP_POLLS);
+    }
+
+    // issue chip deselect instruction onto the slave select register
+    this->qspi.write_mem(QSPI_SSR, CHIP_DESELECT, QSPI_STD_WIDTH);
+    // issue disable master transaction on the config reg to stop the QSPI clock
+    this->qspi.write_mem(QSPI_CONFIG_R, DISABLE_MASTER_TRAN, QSPI_CR_WIDTH);
+    return samples[burst - 1];
+}
+
+/*
+*   Waits for an erase started by start_erase() or start_sector_erase() to complete.
+*   @throws mem_exception : if an erase error occured.
+*/
+void qspi_device::wait_for_erase(){
+
+    if(this->backend){
+        while(!this->backend->erase_complete()){
+        }
+        return;
+    }
+    // check for an erase error.
+    if(wait_for_write() & 0x20){
+        throw mem_exception("Erase Error Has Occured, Perform a Clear Status Register Operation to Reset the Device", QSPI_ERROR_ERASE);
+    }
+}
+
+/*
+*   Checks whether a block of image data is blank (every byte 0xFF).
+*   Blank data matches the erased flash, so it does not need programming.
+*   Uses the vectorized erased block scan.
+*   @param data : the image data to check
+*   @param num_bytes : the number of bytes to check
+*   @returns True if every byte is 0xFF.
+*/
+bool qspi_device::is_blank(const uint8_t* data, unsigned long num_bytes){
+    return is_erased(data, num_bytes);
+}
+
+/*
+*   Programs up to one page of bytes into the flash memory in one transaction.
+*   @param address : the flash memory address to program from
+*   @param data : the bytes to program, read directly from the image mapping
+*   @param num_bytes : the number of bytes, must not cross a page boundary
+*   @param crc : cyclic redundancy check value
+*   Pushes the bytes into the FIFO in FIFO sized chunks, refilling the TX ..
+*   buffer as it empties without ending the transaction.
+*   @throws mem_exception : if there is a program error
+*/
+void qspi_device::program_page(uint32_t address, const uint8_t* data, unsigned long num_bytes, uint8_t& crc){
+
+    std::chrono::steady_clock::time_point page_start = std::chrono::steady_clock::now();
+    count_metric(METRIC_PAGES_PROGRAMMED);
+    // the cached copy of the page is stale once programming starts
+    this->cache.invalidate(this->selected_flash, address, num_bytes);
+    if(this->backend){
+        for(unsigned long i = 0; i < num_bytes; i++){
+            crc = this->crc_table[(uint8_t)(data[i] ^ crc)];
+        }
+        this->backend->program(address, data, num_bytes);
+        if(this->page_latency != NULL){
+            this->page_latency->record(std::chrono::steady_clock::now() - page_start);
+        }
+        if(log_detail()){
+            log_event(EVENT_PAGE_PROGRAM, address, num_bytes, std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now() - page_start).count());
+        }
+        return;
+    }
+    // check that write is enabled, if not - enable it.
+    write_enable();
+
+    // reset the fifo, enable master configuration
+    this->qspi.write_mem(QSPI_CONFIG_R, RESET_FIFO_MSTR_CONFIG_ENABLE, QSPI_CR_WIDTH);
+    // issue the chip's quad page program instruction code onto the data transmit reg
+    this->qspi.write_mem(QSPI_DTR, this->geometry.program_opcode, QSPI_STD_WIDTH);
+
+    // bit shift the memory address into 4 bytes
+    uint8_t msb = (address & 0xFF000000) >> 24;
+    uint8_t mid1 = (address & 0x00FF0000) >> 16;
+    uint8_t mid2 = (address & 0x0000FF00) >> 8;
+    uint8_t lsb = (address & 0x000000FF);
 
     // push the address onto the data transmit reigster
     this->qspi.write_mem(QSPI_DTR, msb, QSPI_STD_WIDTH);
@@ -717,143 +1296,691 @@ void qspi_device::write_n_unaligned_bytes_from_file(uint32_t& mem_address, unsig
     this->qspi.write_mem(QSPI_DTR, mid2, QSPI_STD_WIDTH);
     this->qspi.write_mem(QSPI_DTR, lsb, QSPI_STD_WIDTH);
 
-    // write the buffer of 128 bytes into memory 
-    for(int i =0; i < num_bytes; i++){
-        this->qspi.write_mem(QSPI_DTR, buffer[i], QSPI_STD_WIDTH);
-        // calculate the crc as we go
-        uint8_t byte = (uint8_t) (buffer[i] ^ crc); //XOR the byte
-        crc = this->crc_table[byte];
-    }
+    unsigned long bytes_written = 0;
+    while(bytes_written < num_bytes){
 
-    // issue chip select instruction onto the slave select register
-    this->qspi.write_mem(QSPI_SSR, CHIP_SELECT, QSPI_STD_WIDTH);
-     // issue enable master transaction on the config reg to start the QSPI clock
-    this->qspi.write_mem(QSPI_CONFIG_R, ENABLE_MASTER_TRAN, QSPI_CR_WIDTH);
+        // the first chunk shares the FIFO with the instruction and address
+        unsigned long chunk = std::min(num_bytes - bytes_written, fifo_chunk((bytes_written == 0) ? 5 : 0));
+
+        // push up to a FIFO of bytes straight from the image
+        fifo_write(data + bytes_written, chunk);
+        for(unsigned long i = 0; i < chunk; i++){
+            crc = this->crc_table[(uint8_t)(data[bytes_written + i] ^ crc)];
+        }
 
-    //wait for the tx buffer to be empty
-    bool tx_state_ = tx_empty();
-    while (tx_state_ == false){
-        tx_state_ = tx_empty();
+        // start the transaction once the first chunk is queued
+        if(bytes_written == 0){
+            // issue chip select instruction onto the slave select register
+            this->qspi.write_mem(QSPI_SSR, CHIP_SELECT, QSPI_STD_WIDTH);
+            // issue enable master transaction on the config reg to start the QSPI clock
+            this->qspi.write_mem(QSPI_CONFIG_R, ENABLE_MASTER_TRAN, QSPI_CR_WIDTH);
+        }
+
+        // wait for the tx buffer to be empty
+        bool tx_state = tx_empty();
+        while (tx_state == false){
+            tx_state = tx_empty();
+        }
+        bytes_written += chunk;
     }
 
     // issue chip deselect instruction onto the slave select register
     this->qspi.write_mem(QSPI_SSR, CHIP_DESELECT, QSPI_STD_WIDTH);
-    // issue disable master transaction on the config reg to stop the QSPI clo
+    // issue disable master transaction on the config reg to stop the QSPI clock
     this->qspi.write_mem(QSPI_CONFIG_R, DISABLE_MASTER_TRAN, QSPI_CR_WIDTH);
 
-    // wait for the write to complete  
-    bool wip = write_in_progress();
-    while(wip == true){
-        wip = write_in_progress();
+    // wait for the page write to complete, checking for a program error
+    if(wait_for_write() & 0x40){
+        throw mem_exception("Program Error : Write Operation Failed.", QSPI_ERROR_PROGRAM);
+    }
+    if(this->page_latency != NULL){
+        this->page_latency->record(std::chrono::steady_clock::now() - page_start);
+    }
+    if(log_detail()){
+        log_event(EVENT_PAGE_PROGRAM, address, num_bytes, std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - page_start).count());
+    }
+}
+
+/*
+*   Write a specified number of bytes from the image to a flash memory device.
+*   @param mem_address : memory addres to start writing to.
+*   @param source : the image source to take the bytes to write from
+*   @param num_bytes : nubmer of bytes to write to the flash memory
+*   @param crc : cyclic redundancy check value
+*   Splits the bytes on page boundaries and programs each page in one ..
+*   transaction. Pages that are entirely blank (0xFF) already match the ..
+*   erased flash and are skipped, their bytes are still added to the crc.
+*   @throws mem_exception : if there is a program error
+*   @throws mem_exception : if the operation was cancelled between pages
+*   @return the next address to write to
+*/
+uint32_t qspi_device::write_n_bytes(uint32_t& mem_address, image_source& source, unsigned long& num_bytes, uint8_t& crc){
+
+    uint32_t address = mem_address;
+    unsigned long bytes_written = 0;
+    metrics_timer programming(METRIC_PROGRAM_NS);
+    count_metric(METRIC_BYTES_PROGRAMMED, num_bytes);
+    set_phase(PROGRESS_PROGRAM);
+    start_progress(num_bytes);
+
+    try{
+        while(bytes_written < num_bytes){
+
+            // the previous page has finished programming, stop here if cancelled
+            check_cancel();
+
+            // program up to the end of the current page
+            unsigned long page_left = this->geometry.page_size - (address % this->geometry.page_size);
+            unsigned long chunk = std::min(num_bytes - bytes_written, page_left);
+            const uint8_t* page;
+            {
+                metrics_timer reading(METRIC_IO_NS);
+                page = source.next(chunk);
+            }
+
+            // bytes in the erased ranges of a sparse image are blank, not holes
+            uint8_t page_buffer[MAX_PAGE_SIZE];
+            bool erased = this->image_erased.covers(bytes_written, chunk);
+            if(!erased && this->image_erased.intersects(bytes_written, chunk)){
+                memcpy(page_buffer, page, chunk);
+                this->image_erased.fill(bytes_written, page_buffer, chunk);
+                page = page_buffer;
+            }
+
+            if(erased || is_blank(page, chunk)){
+                // nothing to program, just accumulate the crc
+                count_metric(METRIC_PAGES_SKIPPED);
+                for(unsigned long i = 0; i < chunk; i++){
+                    crc = this->crc_table[(uint8_t)(0xFF ^ crc)];
+                }
+            }
+            else{
+                program_page(address, page, chunk, crc);
+            }
+            address += chunk;
+            bytes_written += chunk;
+            if(this->counters != NULL){
+                this->counters->pages.store(this->counters->pages.load(std::memory_order_relaxed) + 1, 
+                                            std::memory_order_relaxed);
+            }
+            report_progress(chunk);
+        }
+    }
+    catch(mem_exception& err){
+        set_phase(PROGRESS_IDLE);
+        throw;
+    }
+    set_phase(PROGRESS_IDLE);
+    return address;
+}
+
+/*
+*   Opens an image to program or verify the flash memory against
+*   Maps an image file, decompressing it on a reader thread if compressed, ..
+*   or streams it from stdin when the filename is "-". Loads the erased ..
+*   ranges sidecar of a sparse image.
+*   @param filename : the name of the image file, "-" for stdin
+*   @param num_bytes : the number of bytes that will be read from the image
+*   @throws mem_exception : if the file or sidecar fails to open
+*   @throws mem_exception : if the image is smaller than num_bytes
+*   @returns the image source, owned by the caller.
+*/
+image_source* qspi_device::open_image(std::string& filename, unsigned long& num_bytes){
+
+    // a sparse image lists its erased ranges, left as holes, in a sidecar file
+    this->image_erased.clear();
+    if(this->sparse_images){
+        if(filename.compare(STREAM_NAME) == 0){
+            throw mem_exception("Sparse Images Can Not Be Streamed From stdin", QSPI_ERROR_INVALID_ARGUMENT);
+        }
+        this->image_erased.load(filename + ERASED_EXT);
+        log_event(EVENT_IMAGE_ERASED, this->image_erased.erased_bytes());
+    }
+
+    if(filename.compare(STREAM_NAME) == 0){
+        // stream the image from stdin, decompressing it on the reader thread
+        return new decompress_source(STDIN_FILENO);
+    }
+
+    // map the image file with the filename provided.
+    this->in_image.open(filename);
+
+    compression_codec codec = detect_codec(this->in_image.data(), this->in_image.size());
+    if(codec != CODEC_NONE){
+        // decompress the mapped image on the reader thread
+        log_event(EVENT_DECOMPRESSING, codec);
+        return new decompress_source(this->in_image.data(), this->in_image.size());
+    }
+    // check the image holds enough bytes to program
+    if(this->in_image.size() < num_bytes){
+        this->in_image.close();
+        this->image_erased.clear();
+        throw mem_exception("File Is Smaller Than The Number Of Bytes To Write", QSPI_ERROR_IO);
+    }
+    return new mapped_source(this->in_image);
+}
+
+/*
+*   Calculates the CRC of the bytes the flash should hold for an image
+*   The erased ranges of a sparse image count as 0xFF.
+*   @param source : the image to calculate the CRC of
+*   @param num_bytes : the number of image bytes
+*   @throws mem_exception : if the image ends before num_bytes
+*   @returns crc : the CRC-8 of the image bytes.
+*/
+uint8_t qspi_device::image_crc(image_source& source, unsigned long& num_bytes){
+
+    uint8_t crc = 0;
+    uint8_t page_buffer[PAGE_SIZE];
+    unsigned long offset = 0;
+
+    while(offset < num_bytes){
+        unsigned long chunk = std::min(num_bytes - offset, (unsigned long)PAGE_SIZE);
+        const uint8_t* page = source.next(chunk);
+        if(this->image_erased.intersects(offset, chunk)){
+            memcpy(page_buffer, page, chunk);
+            this->image_erased.fill(offset, page_buffer, chunk);
+            page = page_buffer;
+        }
+        for(unsigned long i = 0; i < chunk; i++){
+            crc = this->crc_table[(uint8_t)(page[i] ^ crc)];
+        }
+        offset += chunk;
+    }
+    return crc;
+}
+
+/*
+*   Verifies the flash memory holds an image
+*   Reads the flash back without writing to file, calculating the CRC and ..
+*   comparing every byte against the image when it is mapped.
+*   @param mem_address : the flash address the image starts at
+*   @param num_bytes : the number of bytes to verify
+*   @param filename : the name of the image file
+*   @param source : the open image
+*   @param crc : the CRC of the image bytes
+*   @throws mem_exception : if a byte or the CRC does not match
+*/
+void qspi_device::verify_image(uint32_t& mem_address, unsigned long& num_bytes, std::string& filename, image_source& source, uint8_t crc){
+
+    metrics_timer verifying(METRIC_VERIFY_NS);
+    count_metric(METRIC_BYTES_VERIFIED, num_bytes);
+    set_phase(PROGRESS_VERIFY);
+    this->compare_data = source.image();
+    this->compare_offset = 0;
+    this->first_mismatch = -1;
+    uint8_t read_crc;
+    try{
+        read_crc = read_flash_memory(mem_address, num_bytes, filename, false);
+    }
+    catch(mem_exception& err){
+        set_phase(PROGRESS_IDLE);
+        throw;
     }
+    set_phase(PROGRESS_IDLE);
+    this->compare_data = NULL;
 
-    // check for program errors
-    if(program_error()){
-        throw mem_exception ("Program Error : Write Operation Failed");
+    if(this->first_mismatch >= 0){
+        log_event(EVENT_VERIFY_MISMATCH, mem_address + this->first_mismatch);
+        throw mem_exception("Flash Program Verification Failed", QSPI_ERROR_VERIFY);
+    }
+    else if(crc == read_crc){
+        log_event(EVENT_VERIFY_OK);
+    }
+    else{
+        throw mem_exception("Flash Program Verification Failed", QSPI_ERROR_VERIFY);
     }
+}
+
+/*
+*   Verifies the flash memory against an image without programming it
+*   The image may be a raw, compressed or sparse file, an image container, ..
+*   or stdin. Bytes are compared one by one for a raw file or a stored ..
+*   container segment, otherwise only the CRC is.
+*   @param mem_address : the flash address the image starts at
+*   @param num_bytes : the number of bytes to verify, set to the bytes held by a container
+*   @param filename : the name of the image file, "-" for stdin
+*   @throws mem_exception : if the image fails to open
+*   @throws mem_exception : if the flash does not match the image
+*/
+void qspi_device::verify_flash_memory(uint32_t& mem_address, unsigned long& num_bytes, std::string& filename){
 
-    // clear the buffer
-    memset(&buffer[0], 0, sizeof(buffer));
+    if(is_image_container(filename)){
+        verify_container(mem_address, num_bytes, filename);
+        return;
+    }
+    std::unique_ptr<image_source> source(open_image(filename, num_bytes));
+    try{
+        // a compressed or streamed image is only checked against its CRC
+        uint8_t crc = image_crc(*source, num_bytes);
+        log_event(EVENT_IMAGE_CRC, crc);
+        verify_image(mem_address, num_bytes, filename, *source, crc);
+    }
+    catch(mem_exception& err){
+        source.reset();
+        close_image();
+        throw;
+    }
+    source.reset();
+    close_image();
 }
 
+/*
+*   Verifies the flash memory against a buffer without programming it
+*   @param mem_address : the flash address the data starts at
+*   @param data : the bytes the flash should hold
+*   @param num_bytes : the number of bytes to verify
+*   @throws mem_exception : if the flash does not match the data
+*/
+void qspi_device::verify_flash_buffer(uint32_t& mem_address, const uint8_t* data, unsigned long& num_bytes){
+
+    memory_source source(data, num_bytes);
+    std::string no_file;
+    try{
+        uint8_t crc = image_crc(source, num_bytes);
+        verify_image(mem_address, num_bytes, no_file, source, crc);
+    }
+    catch(mem_exception& err){
+        this->compare_data = NULL;
+        throw;
+    }
+}
 
 /*
 *   Writes a specificed number of bytes to a flash memory device
 *   @param flash_num :  the flash number to erase
 *   @param mem_address : memory address to start the write to
 *   @param num_bytes : number of bytes to write to the memory
-*   @param filename : string name of the file to program the flash from
-*   @param verify :   boolean value, if true the program operation CRC is verified
-*   Programs a flash memory by calculating fifo aligned bytes and overflow bytes
-*   erases the flash memory and ensures both write and quad mode is enabled on the flash
+*   @param filename : string name of the file to program the flash from, "-" for stdin
+*   @param verify :   boolean value, if true the program operation is verified
+*   Maps the image file and programs it straight from the mapping, or streams ..
+*   it from stdin with bounded memory so the transfer overlaps with programming.
+*   gzip, zstd and lz4 images are decompressed on a worker thread while ..
+*   pages program, without a temporary decompressed file.
+*   Erases the flash memory and ensures both write and quad mode is enabled on the flash
+*   An image container has every sector of its layout erased, its segments ..
+*   and any fill other than 0xFF programmed, num_bytes is set to the bytes ..
+*   its segments hold.
+*   Verification compares the CRC, and every byte read back against the ..
+*   mapping when the image is a file.
 *   @throws mem_exception : if the file fails to open i.e. does not exist
+*   @throws mem_exception : if the image is smaller than num_bytes
 *   @throws mem_exception : if there is a a program error.
 *   @throws mem_exception : if there is a verification error.
 */
 void qspi_device::write_flash_memory(int& flash_num, uint32_t& mem_address, unsigned long& num_bytes, std::string& filename, bool& verify){
 
-    // open the in_file with the filename provided.
-    this->in_file.open(filename, std::ios::in | std::ios::binary);
-
-    // check that the file opens ok 
-    if(!this->in_file){
-        throw mem_exception ("File Failed to Open");
+    if(is_image_container(filename)){
+        write_container(&flash_num, mem_address, num_bytes, filename, verify);
+        return;
     }
+    std::unique_ptr<image_source> source(open_image(filename, num_bytes));
+
     try{
         // erase the flash to enable programming
         erase_flash_memory(flash_num);  
+        program_image(mem_address, num_bytes, filename, *source, verify);
     }
     catch(mem_exception& err){
+        source.reset();
+        close_image();
         throw;
-    }  
+    }
+    source.reset();
+    close_image();
+}
+
+/*
+*   Programs a flash memory device that has already been erased
+*   Used once an erase started with start_erase() has completed, so the ..
+*   erase of one chip can overlap work on another.
+*   @param mem_address : memory address to start the write to
+*   @param num_bytes : number of bytes to write to the memory
+*   @param filename : string name of the file to program the flash from, "-" for stdin
+*   @param verify :   boolean value, if true the program operation is verified
+*   @throws mem_exception : if the file fails to open i.e. does not exist
+*   @throws mem_exception : if there is a a program error.
+*   @throws mem_exception : if there is a verification error.
+*/
+void qspi_device::program_flash_memory(uint32_t& mem_address, unsigned long& num_bytes, std::string& filename, bool& verify){
+
+    if(is_image_container(filename)){
+        write_container(NULL, mem_address, num_bytes, filename, verify);
+        return;
+    }
+    std::unique_ptr<image_source> source(open_image(filename, num_bytes));
+
+    try{
+        program_image(mem_address, num_bytes, filename, *source, verify);
+    }
+    catch(mem_exception& err){
+        source.reset();
+        close_image();
+        throw;
+    }
+    source.reset();
+    close_image();
+}
+
+/*
+*   Programs an open image to the erased flash memory
+*   Ensures quad mode is enabled, programs the image and verifies it if requested.
+*   @param mem_address : memory address to start the write to
+*   @param num_bytes : number of bytes to write to the memory
+*   @param filename : string name of the image file
+*   @param source : the open image
+*   @param verify :   boolean value, if true the program operation is verified
+*   @throws mem_exception : if there is a a program error.
+*   @throws mem_exception : if there is a verification error.
+*   @returns crc : the CRC code of the bytes programmed.
+*/
+uint8_t qspi_device::program_image(uint32_t& mem_address, unsigned long& num_bytes, std::string& filename, image_source& source, bool& verify){
+
     std::chrono::high_resolution_clock::time_point start_write = std::chrono::high_resolution_clock::now();
-    // calculate how many bytes can be read evenly on the FIFO boundary
-    unsigned long int FIFO_aligned_num_bytes = (floor(num_bytes/FIFO_DEPTH)) * FIFO_DEPTH;
-    // find the overflow between even bytes and requested bytes.    
-    unsigned long int overflow_bytes = num_bytes - FIFO_aligned_num_bytes; 
 
-    // enable write
-    write_enable();
     uint8_t crc = 0;
 
-    // check that quad is enabled, if not - enable it.
-    if(!is_quad_enabled()){
+    // check that quad is enabled, if not - enable it. A backend configures the flash itself.
+    if(!this->backend && !is_quad_enabled()){
         uint8_t status = 0x00;
         uint8_t config = 0x02;
-        try{
-            write_flash_registers(status, config);
-        }
-        catch(mem_exception& err){
-            throw;
+        write_flash_registers(status, config);
+        wait_for_write();
+        if(!is_quad_enabled()){
+            throw mem_exception("Quad Mode Did Not Enable, Write Operation In-valid", QSPI_ERROR_QUAD_MODE);
         }
     }
-    else{
-        // write the fifo aligned number of bytes
-        uint32_t next_address;
-        try{
-            next_address = write_n_fifo_aligned_bytes_from_file(mem_address, FIFO_aligned_num_bytes, crc);
+
+    // program the image from the source
+    write_n_bytes(mem_address, source, num_bytes, crc);
+
+    // log the crc code and timing stats
+    log_event(EVENT_WRITE_CRC, crc);
+    std::chrono::high_resolution_clock::time_point finish_write = std::chrono::high_resolution_clock::now();
+    log_event(EVENT_WRITE_DONE, std::chrono::duration_cast<std::chrono::milliseconds>(finish_write - start_write).count());
+
+    if(verify){
+        verify_image(mem_address, num_bytes, filename, source, crc);
+    }
+    return crc;
+}
+
+/*
+*   Opens an image container, checking every segment against its CRC-32 ..
+*   so a damaged container is rejected before the flash is touched.
+*   @param container : the container to open
+*   @param filename : the name of the container file
+*   @param mem_address : the flash address the layout starts at
+*   @param num_bytes : set to the bytes held by the segments
+*   @throws mem_exception : if the container fails to open or a segment fails its CRC-32
+*   @throws mem_exception : if the layout does not fit in the flash
+*/
+void qspi_device::open_container(image_container& container, std::string& filename, uint32_t& mem_address, unsigned long& num_bytes){
+
+    container.open(filename);
+    check_range(mem_address, container.image_size());
+    for(unsigned long i = 0; i < container.segments().size(); i++){
+        container.check_segment(i);
+    }
+    num_bytes = container.populated_bytes();
+    log_event(EVENT_IMAGE_SEGMENTS, container.segments().size(), num_bytes, container.image_size(), container.fill());
+}
+
+/*
+*   Programs the segments of an image container in one pass
+*   Every sector of the layout is erased first, so no old data survives ..
+*   in the gaps, then each segment is programmed and verified if requested. ..
+*   Gaps are programmed with the fill value unless it is the erased value ..
+*   0xFF, and are checked to hold it when verifying.
+*   @param flash_num : the flash chip to erase, NULL if it is already erased
+*   @param mem_address : the flash address the layout starts at
+*   @param num_bytes : set to the bytes held by the segments
+*   @param filename : the name of the container file
+*   @param verify : boolean value, if true each segment is verified once programmed
+*   @throws mem_exception : if the container fails to open or does not fit in the flash
+*   @throws mem_exception : if there is an erase, program or verification error
+*/
+void qspi_device::write_container(int* flash_num, uint32_t& mem_address, unsigned long& num_bytes, std::string& filename, bool& verify){
+
+    image_container container;
+    this->image_erased.clear();
+    try{
+        open_container(container, filename, mem_address, num_bytes);
+        const std::vector<image_segment>& segments = container.segments();
+
+        if(flash_num != NULL && container.image_size() > 0){
+            unsigned long length = container.image_size();
+            erase_range(*flash_num, mem_address, length);
         }
-        catch(mem_exception& err){
-            throw;
+
+        for(unsigned long i = 0; i < segments.size(); i++){
+            uint32_t address = mem_address + segments[i].offset;
+            unsigned long length = segments[i].length;
+            log_event(EVENT_SEGMENT, i, address, length, segments[i].codec);
+            std::unique_ptr<image_source> source(container.segment_source(i));
+            program_image(address, length, filename, *source, verify);
         }
-        try{
-            // write the left over overflow bytes
-            write_n_unaligned_bytes_from_file(next_address, overflow_bytes, crc);
+
+        std::vector<image_gap> gaps = container.gaps();
+        for(unsigned long i = 0; i < gaps.size(); i++){
+            uint32_t address = mem_address + gaps[i].offset;
+            unsigned long length = gaps[i].length;
+            if(container.fill() != PACK_DEFAULT_FILL){
+                // the gap is byte checked below, not against the CRC of its fill
+                bool crc_only = false;
+                fill_source source(container.fill(), length);
+                program_image(address, length, filename, source, crc_only);
+            }
+            if(verify){
+                verify_fill(address, length, container.fill());
+            }
         }
-        catch(mem_exception& err){
-            throw;
+    }
+    catch(mem_exception& err){
+        close_image();
+        throw;
+    }
+    close_image();
+}
+
+/*
+*   Verifies the flash memory against the segments of an image container
+*   The segments are read back against their bytes, the gaps between ..
+*   them against the fill value.
+*   @param mem_address : the flash address the layout starts at
+*   @param num_bytes : set to the bytes held by the segments
+*   @param filename : the name of the container file
+*   @throws mem_exception : if the container fails to open or does not fit in the flash
+*   @throws mem_exception : if the flash does not match a segment
+*/
+void qspi_device::verify_container(uint32_t& mem_address, unsigned long& num_bytes, std::string& filename){
+
+    image_container container;
+    this->image_erased.clear();
+    try{
+        open_container(container, filename, mem_address, num_bytes);
+        const std::vector<image_segment>& segments = container.segments();
+        for(unsigned long i = 0; i < segments.size(); i++){
+            uint32_t address = mem_address + segments[i].offset;
+            unsigned long length = segments[i].length;
+            log_event(EVENT_SEGMENT, i, address, length, segments[i].codec);
+            std::unique_ptr<image_source> source(container.segment_source(i));
+            uint8_t crc = image_crc(*source, length);
+            log_event(EVENT_IMAGE_CRC, crc);
+            verify_image(address, length, filename, *source, crc);
         }
-       
-        // check for a program error
-        if(program_error()){
-            throw mem_exception("Program Error : Write Operation Failed");
+        std::vector<image_gap> gaps = container.gaps();
+        for(unsigned long i = 0; i < gaps.size(); i++){
+            verify_fill(mem_address + gaps[i].offset, gaps[i].length, container.fill());
         }
-        else{
-            // print out crc code and timing stats
-            std::cout << "CRC code for write : 0x" << std::hex << crc << std::endl << std::dec;
-            std::chrono::high_resolution_clock::time_point finish_write = std::chrono::high_resolution_clock::now();
-            std::cout << std::chrono::duration_cast<std::chrono::milliseconds>(finish_write - start_write).count() << " ms to write." << std::endl;
-            std::cout << "Write Successfull" << std::endl;
+    }
+    catch(mem_exception& err){
+        close_image();
+        throw;
+    }
+    close_image();
+}
+
+/*
+*   Checks every byte of a range of the flash holds one value
+*   Used for the gaps of an image container, which have no image bytes ..
+*   to compare against.
+*   @param mem_address : the first address of the range
+*   @param num_bytes : the number of bytes in the range
+*   @param fill : the value every byte must hold
+*   @throws mem_exception : if a byte does not hold the value
+*   @throws mem_exception : if the operation was cancelled
+*/
+void qspi_device::verify_fill(uint32_t mem_address, unsigned long num_bytes, uint8_t fill){
+
+    metrics_timer verifying(METRIC_VERIFY_NS);
+    count_metric(METRIC_BYTES_VERIFIED, num_bytes);
+    set_phase(PROGRESS_VERIFY);
+    start_progress(num_bytes);
+    std::vector<uint8_t> buffer(STREAM_BLOCK_SIZE);
+    unsigned long offset = 0;
+    try{
+        while(offset < num_bytes){
+            check_cancel();
+            unsigned long chunk = std::min(num_bytes - offset, (unsigned long)buffer.size());
+            if(pread(buffer.data(), chunk, mem_address + offset) != chunk){
+                throw mem_exception("Flash Program Verification Failed", QSPI_ERROR_VERIFY);
+            }
+            for(unsigned long i = 0; i < chunk; i++){
+                if(buffer[i] != fill){
+                    log_event(EVENT_VERIFY_MISMATCH, mem_address + offset + i);
+                    throw mem_exception("Flash Program Verification Failed", QSPI_ERROR_VERIFY);
+                }
+            }
+            offset += chunk;
+            report_progress(chunk);
         }
     }
-   
-    if(verify){
-        //read the flash memory using the parameters provided and not writing to file
-        //calculating the CRC.
-        uint8_t read_crc = read_flash_memory(mem_address, num_bytes,filename, false);
-        
-        if(crc == read_crc){
-            std::cout << "Flash Program Verified Successfully" << std::endl;
+    catch(mem_exception& err){
+        set_phase(PROGRESS_IDLE);
+        throw;
+    }
+    set_phase(PROGRESS_IDLE);
+}
+
+/*
+*   Releases the image opened by open_image(), once its source is destroyed.
+*/
+void qspi_device::close_image(){
+    this->compare_data = NULL;
+    this->image_erased.clear();
+    this->in_image.close();
+}
+
+/*
+*   Programs a buffer to a flash memory device that has already been erased
+*   @param mem_address : memory address to start the write to
+*   @param data : the bytes to program
+*   @param num_bytes : number of bytes to write to the memory
+*   @param verify :   boolean value, if true every byte is read back and compared
+*   @throws mem_exception : if there is a a program error.
+*   @throws mem_exception : if there is a verification error.
+*   @returns crc : the CRC code of the bytes programmed.
+*/
+uint8_t qspi_device::program_flash_buffer(uint32_t& mem_address, const uint8_t* data, unsigned long& num_bytes, bool& verify){
+
+    memory_source source(data, num_bytes);
+    std::string no_file;
+    uint8_t crc;
+    try{
+        crc = program_image(mem_address, num_bytes, no_file, source, verify);
+    }
+    catch(mem_exception& err){
+        this->compare_data = NULL;
+        throw;
+    }
+    return crc;
+}
+
+/*
+*   Starts the erase of the sector holding an address, setting its bytes to 0xFF.
+*   Poll erase_complete() for the end of the erase.
+*   @param flash_num : the selected flash chip, chip 1 is protected from erasing
+*   @param address : an address within the sector to erase
+*   @throws mem_exception : if we erase flash number 1.
+*/
+void qspi_device::start_sector_erase(int& flash_num, uint32_t address){
+
+    //temporay hack to ensure we dont erase flash 1..
+    if(flash_num == 1){
+        throw mem_exception("FATAL : COMMAND SET TO ERASE FLASH MEMORY CHIP 1", QSPI_ERROR_PROTECTED);
+    }
+    unsigned long sector_size = erase_unit();
+    this->cache.invalidate(this->selected_flash, address - (address % sector_size), sector_size);
+    if(this->backend){
+        this->backend->start_erase(address - (address % sector_size), sector_size);
+        return;
+    }
+    write_enable(); // enable write
+    // reset the fifo, enable master configuration
+    this->qspi.write_mem(QSPI_CONFIG_R, RESET_FIFO_MSTR_CONFIG_ENABLE, QSPI_CR_WIDTH);
+    // issue the sector erase instruction code and the four byte address
+    this->qspi.write_mem(QSPI_DTR, this->geometry.sector_erase_opcode, QSPI_STD_WIDTH);
+    this->qspi.write_mem(QSPI_DTR, (address & 0xFF000000) >> 24, QSPI_STD_WIDTH);
+    this->qspi.write_mem(QSPI_DTR, (address & 0x00FF0000) >> 16, QSPI_STD_WIDTH);
+    this->qspi.write_mem(QSPI_DTR, (address & 0x0000FF00) >> 8, QSPI_STD_WIDTH);
+    this->qspi.write_mem(QSPI_DTR, (address & 0x000000FF), QSPI_STD_WIDTH);
+    // issue chip select instruction onto the slave select register
+    this->qspi.write_mem(QSPI_SSR, CHIP_SELECT, QSPI_STD_WIDTH);
+    // issue enable master transaction on the config reg to start the QSPI clock
+    this->qspi.write_mem(QSPI_CONFIG_R, ENABLE_MASTER_TRAN, QSPI_CR_WIDTH);
+    // wait for the instruction to be sent before deselecting
+    while(!tx_empty()){
+    }
+    // issue chip deselect instruction onto the slave select register
+    this->qspi.write_mem(QSPI_SSR, CHIP_DESELECT, QSPI_STD_WIDTH);
+    // issue disable master transaction on the config reg to stop the QSPI clock
+    this->qspi.write_mem(QSPI_CONFIG_R, DISABLE_MASTER_TRAN, QSPI_CR_WIDTH);
+}
+
+/*
+*   Erases the sectors holding a range of addresses
+*   A range covering the whole flash memory uses a bulk erase instead.
+*   @param flash_num : the selected flash chip, chip 1 is protected from erasing
+*   @param mem_address : the first address to erase
+*   @param num_bytes : the number of bytes to erase, rounded out to whole sectors
+*   @throws mem_exception : if we erase flash number 1.
+*   @throws mem_exception : if an erase error occured.
+*   @throws mem_exception : if the operation was cancelled between sectors
+*/
+void qspi_device::erase_range(int& flash_num, uint32_t& mem_address, unsigned long& num_bytes){
+
+    check_range(mem_address, num_bytes);
+    if(mem_address == 0 && num_bytes >= this->geometry.size){
+        erase_flash_memory(flash_num);
+        return;
+    }
+    metrics_timer erasing(METRIC_ERASE_NS);
+    set_phase(PROGRESS_ERASE);
+    uint32_t sector_size = erase_unit();
+    uint32_t first = mem_address - (mem_address % sector_size);
+    uint32_t end = mem_address + num_bytes;
+    start_progress(end - first);
+    for(uint32_t sector = first; sector < end; sector += sector_size){
+        check_cancel();
+        start_sector_erase(flash_num, sector);
+        wait_for_erase();
+        if(log_detail()){
+            log_event(EVENT_SECTOR_ERASE, sector);
         }
-        else{
-            throw mem_exception("Flash Program Verification Failed");
+        if(this->counters != NULL){
+            this->counters->sectors.store(this->counters->sectors.load(std::memory_order_relaxed) + 1, 
+                                        std::memory_order_relaxed);
         }
+        report_progress(std::min(sector_size, end - sector));
     }
-
 }
 
 /*
 *   Selects the flash chip to use through the multiplexer memory device
+*   The first time a chip is selected its geometry and opcodes are probed ..
+*   from its JEDEC ID and SFDP, the read, program and erase engines use them.
 *   @param flash_num : integer value for the flash chip to select 
 *   @throws mem_exception : if write_mem fails due to incorrect data width
 *   @throws mem_exception : if a flash number outside 1-4 is provided
@@ -880,13 +2007,36 @@ void qspi_device::select_flash(int& flash_num){
                     break;
     
             default:
-                throw mem_exception("Invalid flash number provided, flash 1-4 only accepted");
+                throw mem_exception("Invalid flash number provided, flash 1-4 only accepted", QSPI_ERROR_FLASH_SELECT);
                 break;
         }
+        this->selected_flash = flash_num;
+        this->quad_checked = false;
     }
     catch(mem_exception& err){
         throw;
     }
+
+    // a backend drives the flash itself, the registers can not probe it
+    if(this->backend){
+        this->geometry = backend_geometry();
+        return;
+    }
+    // the controller's FIFOs are sized once, before the probe transfers use them
+    if(!this->fifo_detected){
+        this->fifo_depth = detect_fifo_depth();
+        this->fifo_detected = true;
+        log_event(EVENT_FIFO_DEPTH, this->fifo_depth);
+    }
+    // each chip is probed once, boards mix chip revisions
+    std::map<int, flash_geometry>::iterator known = this->probed.find(flash_num);
+    if(known == this->probed.end()){
+        known = this->probed.insert(std::make_pair(flash_num, probe_flash())).first;
+        const flash_geometry& found = known->second;
+        log_event(EVENT_FLASH_GEOMETRY, (flash_num << 24) | (found.jedec_id[0] << 16) | (found.jedec_id[1] << 8) | found.jedec_id[2],
+                found.size, found.page_size, found.sector_size);
+    }
+    this->geometry = known->second;
 }
 
 /*
@@ -896,6 +2046,7 @@ void qspi_device::select_flash(int& flash_num){
 void qspi_device::deselect_flash(){
     try{
         this->mux.write_mem(MUX_OFFSET, MUX_DESET, MUX_WIDTH);
+        this->selected_flash = 0;
     }
     catch(mem_exception& err){
         throw;
@@ -927,13 +2078,17 @@ void qspi_device::map_qspi_mux(){
 /*
 *   Un-Maps the memory areas used for the qspi controller and multiplexer
 *   Deselects the flash chip to be used through the multiplexer
-*   Calls unmap() for both qspi and mux and deselect_flash()
+*   Calls unmap() for both qspi and mux and deselect_flash(), and the XIP window if mapped
 *   @throws mem_exception : if qspi controller memory map fails to unmap
 *   @throws mem_exception : if multiplexer fails to deselect the flash chip.
 *   @throws mem_exception : if multiplexer memory map fails to unmap
 */
 void qspi_device::un_map_qspi_mux(){
      try{
+        if(this->xip){
+            this->xip->unmap();
+            this->xip.reset();
+        }
         this->qspi.unmap();
     }
     catch(mem_exception& err){
@@ -942,9 +2097,181 @@ void qspi_device::un_map_qspi_mux(){
     try{
         this->deselect_flash();
         this->mux.unmap();
+        this->probed.clear();
+        this->fifo_detected = false;
     }
     catch(mem_exception& err){
         throw;
     }
 }
-       
\ No newline at end of file
+       
+
+/*
+*   Sets the codec and level used to compress dumps written by read_flash_memory
+*   @param codec : the codec to compress with, CODEC_NONE writes raw bytes
+*   @param level : the level to start at, lowered automatically if the ..
+*   compression can not keep up with the read.
+*/
+void qspi_device::set_output_compression(compression_codec codec, int level){
+    this->out_codec = codec;
+    this->out_level = level;
+}
+
+/*
+*   Selects sparse images, read_flash_memory leaves erased blocks as holes ..
+*   listed in a sidecar file and write_flash_memory treats them as blank.
+*   @param sparse : true to read and program sparse images
+*/
+void qspi_device::set_sparse_images(bool sparse){
+    this->sparse_images = sparse;
+}
+
+/*
+*   Sets the callback reporting the progress of reads and programs
+*   @param callback : called every PROGRESS_INTERVAL bytes and at the end, ..
+*   an empty callback disables reporting.
+*/
+void qspi_device::set_progress_callback(progress_callback callback){
+    this->progress = callback;
+}
+
+/*
+*   Sets the counters the phase, bytes, pages and sectors of each ..
+*   operation are published to, for a progress_reporter to sample.
+*   @param counters : the counters, NULL to stop publishing
+*/
+void qspi_device::set_progress_counters(progress_counters* counters){
+    this->counters = counters;
+}
+
+/*
+*   Starts progress reporting for an operation
+*   @param total : the number of bytes in the operation
+*/
+void qspi_device::start_progress(unsigned long long total){
+    this->progress_done = 0;
+    this->progress_total = total;
+    this->progress_reported = 0;
+    if(this->counters != NULL){
+        this->counters->bytes_done.store(0, std::memory_order_relaxed);
+        this->counters->bytes_total.store(total, std::memory_order_relaxed);
+    }
+}
+
+/*
+*   Publishes the phase of the current operation to the progress counters.
+*   @param phase : the phase starting
+*/
+void qspi_device::set_phase(progress_phase phase){
+    if(this->counters != NULL){
+        this->counters->phase.store(phase, std::memory_order_relaxed);
+    }
+}
+
+/*
+*   Adds bytes to the progress of the current operation, reporting it ..
+*   every PROGRESS_INTERVAL bytes and when the operation completes.
+*   @param num_bytes : the number of bytes just completed
+*/
+void qspi_device::report_progress(unsigned long num_bytes){
+
+    if(this->progress_muted){
+        return;
+    }
+    this->progress_done += num_bytes;
+    if(this->counters != NULL){
+        this->counters->bytes_done.store(this->progress_done, std::memory_order_relaxed);
+    }
+    if(this->progress && (this->progress_done - this->progress_reported >= PROGRESS_INTERVAL || 
+        this->progress_done == this->progress_total)){
+        this->progress_reported = this->progress_done;
+        this->progress(this->progress_done, this->progress_total);
+    }
+}
+
+/*
+*   Sets the flag that cancels the current operation
+*   Reads stop at the next FIFO increment, programs at the next page and ..
+*   erases at the next sector, each leaving the chip deselected.
+*   @param flag : cancels when set true, NULL disables cancelling
+*/
+void qspi_device::set_cancel_flag(const std::atomic<bool>* flag){
+    this->cancel_flag = flag;
+}
+
+/*
+*   Sets the recorders timing each page program and each FIFO of a read
+*   @param page : records page programs, NULL stops recording them
+*   @param fifo : records FIFO reads, NULL stops recording them
+*/
+void qspi_device::set_latency_recorders(latency_recorder* page, latency_recorder* fifo){
+    this->page_latency = page;
+    this->fifo_latency = fifo;
+}
+
+/*
+*   @returns true if the cancel flag has been set.
+*/
+bool qspi_device::cancel_requested(){
+    return this->cancel_flag != NULL && this->cancel_flag->load(std::memory_order_relaxed);
+}
+
+/*
+*   Stops the current operation if the cancel flag has been set.
+*   @throws mem_exception : if the operation was cancelled
+*/
+void qspi_device::check_cancel(){
+    if(cancel_requested()){
+        throw mem_exception("Operation Cancelled", QSPI_ERROR_CANCELLED);
+    }
+}
+
+/*
+*   Moves flash data through a backend instead of the controller's registers
+*   The multiplexer is still driven directly to select the chip.
+*   @param flash : the backend, owned by the device from now on, NULL ..
+*   to go back to the registers
+*/
+void qspi_device::set_backend(flash_backend* flash){
+    this->backend.reset(flash);
+    this->cache.clear();
+    this->quad_checked = false;
+    this->geometry = this->backend ? backend_geometry() : default_geometry();
+}
+
+/*
+*   Builds the geometry of the flash behind the backend
+*   The size and erase unit come from the backend, the page size and ..
+*   opcodes, unused through it, keep their defaults.
+*   @returns the geometry.
+*/
+flash_geometry qspi_device::backend_geometry(){
+    flash_geometry geometry = default_geometry();
+    geometry.size = this->backend->flash_size();
+    geometry.sector_size = this->backend->erase_size();
+    return geometry;
+}
+
+/*
+*   @returns the backend in use, NULL when driving the registers.
+*/
+flash_backend* qspi_device::get_backend(){
+    return this->backend.get();
+}
+
+/*
+*   @returns the size of the blocks a sector erase clears.
+*/
+unsigned long qspi_device::erase_unit(){
+    return this->backend ? this->backend->erase_size() : this->geometry.sector_size;
+}
+
+/*
+*   Checks the flash registers can be reached, they can not through a backend.
+*   @throws mem_exception : if a backend is in use
+*/
+void qspi_device::check_registers(){
+    if(this->backend){
+        throw mem_exception("Flash Registers Can Not Be Read Through The " + this->backend->name() + " Backend", QSPI_ERROR_INVALID_ARGUMENT);
+    }
+}
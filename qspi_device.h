@@ -12,22 +12,107 @@
 #include <bitset>
 #include <fstream>
 #include <math.h>
+#include <algorithm>
 #include "qspi_controller.h"
 #include "multiplexer.h"
+#include "xip_window.h"
+#include "flash_backend.h"
+#include "fifo_dma.h"
 #include "qspi_flash_defines.h"
+#include "mapped_file.h"
+#include "image_source.h"
+#include "image_sink.h"
+#include "compression.h"
+#include "erased_ranges.h"
+#include "sector_cache.h"
+#include "realtime.h"
+#include "qspi_metrics.h"
+#include "progress_reporter.h"
+#include "event_log.h"
+#include "flash_geometry.h"
+#include "image_container.h"
 #include <chrono>
+#include <map>
+#include <memory>
+#include <functional>
+#include <atomic>
+
+// Called with the bytes done and the total bytes of a read or program
+typedef std::function<void(unsigned long long done, unsigned long long total)> progress_callback;
 
 class qspi_device{
 
     private:
 
-        std::ofstream out_file; // file to read bytes too from memory
-        std::ifstream in_file;  // file to write bytes to memory from
+        std::unique_ptr<image_sink> out_sink;   // sink to read bytes too from memory
+        compression_codec out_codec;    // codec to compress dumps with
+        int out_level;          // level to start compressing dumps at
+        bool sparse_images;     // true to read and program sparse images
+        mapped_file in_image;   // memory mapped image to write bytes to memory from
+        erased_ranges image_erased;     // erased ranges of the sparse image being programmed
+        const uint8_t* compare_data;    // image to byte-compare reads against
+        unsigned long compare_offset;   // offset of the next byte to compare
+        long first_mismatch;    // offset of the first byte that failed to compare
+        progress_callback progress;     // called as reads and programs advance
+        unsigned long long progress_done;       // bytes done by the current operation
+        unsigned long long progress_total;      // bytes in the current operation
+        unsigned long long progress_reported;   // bytes done at the last report
+        bool progress_muted;    // true while pread() fills the cache, which reports no progress
+        progress_counters* counters;    // published for a progress_reporter, NULL if none
+        const std::atomic<bool>* cancel_flag;   // set to cancel the current operation, NULL if none
+        latency_recorder* page_latency; // records each page program, NULL if none
+        latency_recorder* fifo_latency; // records each FIFO read, NULL if none
+        sector_cache cache;     // recently read blocks, serving pread()
+        int selected_flash;     // the flash chip selected, 0 if none
+        bool quad_checked;      // true once quad mode is known enabled on the selected chip
+        flash_geometry geometry;    // geometry and opcodes of the selected chip
+        std::map<int, flash_geometry> probed;   // geometry of each chip probed since mapping
+        unsigned long fifo_depth;   // depth of the controller's FIFOs, 0 if not detected
+        bool fifo_detected;     // true once the FIFO depth was probed since mapping
         uint8_t crc_table[256]; // cyclic refundancy check (CRC) table
         uint8_t polynominal = 0x1D;     // fixed 8 bit polynominal for CRC
 
         qspi_controller qspi;   // memory mapped qspi_controller
         multiplexer mux;        // memory mapped multiplexer
+        std::unique_ptr<xip_window> xip;    // memory mapped XIP read port, reads use it if set
+        std::unique_ptr<flash_backend> backend; // moves the flash data if set, instead of the registers
+        std::vector<uint8_t> read_buffer;   // bytes fetched from the backend or XIP window
+        std::unique_ptr<fifo_dma> dma;      // moves FIFO transfers if set, instead of the CPU
+
+        void start_progress(unsigned long long total);
+        void set_phase(progress_phase phase);
+        void report_progress(unsigned long num_bytes);
+        bool cancel_requested();
+        void check_cancel();
+        image_source* open_image(std::string& filename, unsigned long& num_bytes);
+        uint8_t image_crc(image_source& source, unsigned long& num_bytes);
+        void verify_image(uint32_t& mem_address, unsigned long& num_bytes, std::string& filename, 
+                        image_source& source, uint8_t crc);
+        uint8_t program_image(uint32_t& mem_address, unsigned long& num_bytes, std::string& filename, 
+                        image_source& source, bool& verify);
+        void close_image();
+        void open_container(image_container& container, std::string& filename, uint32_t& mem_address, 
+                        unsigned long& num_bytes);
+        void write_container(int* flash_num, uint32_t& mem_address, unsigned long& num_bytes, 
+                        std::string& filename, bool& verify);
+        void verify_container(uint32_t& mem_address, unsigned long& num_bytes, std::string& filename);
+        void verify_fill(uint32_t mem_address, unsigned long num_bytes, uint8_t fill);
+        uint8_t read_to_sink(uint32_t& mem_address, unsigned long& num_bytes, bool to_sink);
+        void enable_quad_read();
+        uint8_t read_array(uint32_t mem_address, unsigned long num_bytes, bool to_sink);
+        unsigned long read_cached(uint8_t* buffer, unsigned long num_bytes, uint32_t mem_address);
+        flash_geometry backend_geometry();
+        uint8_t read_buffered(uint32_t mem_address, unsigned long num_bytes, bool to_sink);
+        unsigned long erase_unit();
+        void check_registers();
+        void read_command(const uint8_t* command, unsigned long command_bytes, uint8_t* buffer, unsigned long num_bytes);
+        void read_sfdp(uint32_t address, uint8_t* buffer, unsigned long num_bytes);
+        flash_geometry probe_flash();
+        unsigned long detect_fifo_depth();
+        unsigned long fifo_chunk(unsigned long header);
+        void fifo_write(const uint8_t* data, unsigned long num_bytes);
+        void fifo_read(uint8_t* buffer, unsigned long num_bytes);
+        void wait_for_erase();
 
     public: 
 
@@ -46,13 +131,33 @@ class qspi_device{
         bool program_error();
         void write_enable();
         void read_spansion_id();
+        void read_jedec_id(uint8_t* id);
         void calc_CRC8_table();
         void erase_flash_memory(int& flash_num);
+        void start_erase(int& flash_num);
+        bool erase_complete();
+        void start_sector_erase(int& flash_num, uint32_t address);
+        void erase_range(int& flash_num, uint32_t& mem_address, unsigned long& num_bytes);
         void write_flash_registers(uint8_t& status_reg, uint8_t& config_reg);
         void select_flash(int& flash_num);
         void deselect_flash();
         void map_qspi_mux();
         void un_map_qspi_mux();
+        void map_xip(const std::string& file);
+        bool xip_mapped();
+        void set_backend(flash_backend* flash);
+        flash_backend* get_backend();
+        void enable_dma(const std::string& engine);
+        fifo_dma* get_dma();
+        const flash_geometry& get_geometry();
+        void check_range(uint32_t mem_address, unsigned long long num_bytes);
+        unsigned long get_fifo_depth();
+        void set_output_compression(compression_codec codec, int level);
+        void set_sparse_images(bool sparse);
+        void set_progress_callback(progress_callback callback);
+        void set_progress_counters(progress_counters* counters);
+        void set_cancel_flag(const std::atomic<bool>* flag);
+        void set_latency_recorders(latency_recorder* page, latency_recorder* fifo);
        
         
         uint32_t read_n_bytes(uint32_t& address, 
@@ -67,16 +172,34 @@ class qspi_device{
                                     std::string& filename, 
                                     bool to_file
                                     );
-        
-        uint32_t write_n_fifo_aligned_bytes_from_file(uint32_t& mem_address, 
+
+        uint8_t read_flash_buffer(uint32_t& mem_address, 
                                 unsigned long& num_bytes, 
-                                uint8_t& crc
-                                );  
+                                uint8_t* buffer
+                                );
+        
+        unsigned long pread(uint8_t* buffer, 
+                            unsigned long num_bytes, 
+                            uint32_t mem_address
+                            );
 
-        void write_n_unaligned_bytes_from_file(uint32_t& mem_address, 
-                                    unsigned long& num_bytes, 
-                                    uint8_t& crc
-                                    );
+        sector_cache& read_cache();
+
+        void compare_bytes(const uint8_t* buffer, unsigned long num_bytes);
+        uint8_t wait_for_write();
+        bool is_blank(const uint8_t* data, unsigned long num_bytes);
+
+        void program_page(uint32_t address, 
+                        const uint8_t* data, 
+                        unsigned long num_bytes, 
+                        uint8_t& crc
+                        );
+
+        uint32_t write_n_bytes(uint32_t& mem_address, 
+                            image_source& source, 
+                            unsigned long& num_bytes, 
+                            uint8_t& crc
+                            );
                                     
         void write_flash_memory(int& flash_num, 
                                 uint32_t& mem_address, 
@@ -85,6 +208,28 @@ class qspi_device{
                                 bool& verify
                                 );
 
+        void program_flash_memory(uint32_t& mem_address, 
+                                unsigned long& num_bytes, 
+                                std::string& filename, 
+                                bool& verify
+                                );
+
+        uint8_t program_flash_buffer(uint32_t& mem_address, 
+                                const uint8_t* data, 
+                                unsigned long& num_bytes, 
+                                bool& verify
+                                );
+
+        void verify_flash_memory(uint32_t& mem_address, 
+                                unsigned long& num_bytes, 
+                                std::string& filename
+                                );
+
+        void verify_flash_buffer(uint32_t& mem_address, 
+                                const uint8_t* data, 
+                                unsigned long& num_bytes
+                                );
+
 };
 
 #endif
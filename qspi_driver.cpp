@@ -9,12 +9,89 @@
 */
 
 #include <iostream>
+#include <sstream>
+#include <fstream>
+#include <cstdlib>
+#include <memory>
 #include <boost/program_options.hpp>
 #include "boost/date_time/posix_time/posix_time.hpp"
 #include "qspi_device.h"
+#include "qspi_daemon.h"
+#include "job_scheduler.h"
+#include "mtd_backend.h"
+#include "qspi_simulator.h"
 
 namespace po = boost::program_options;
 
+std::string metrics_file;       // --metrics destination, empty if not exporting
+std::string prometheus_file;    // --prometheus textfile, empty if not exporting
+std::unique_ptr<mmio_trace> trace;  // records the register accesses with --trace, empty if not tracing
+progress_counters progress;     // the progress the device publishes
+std::unique_ptr<progress_reporter> reporter;    // renders the progress with --progress, empty if not reporting
+std::unique_ptr<event_log> events;  // the core's events, printed and written to --event-log
+
+/*
+*   Prints the events left in the log and closes it, registered with ..
+*   atexit() so no event is lost on any exit path.
+*/
+void close_events(){
+
+    if(!events){
+        return;
+    }
+    event_log::set_active(NULL);
+    try{
+        events->close();
+        if(events->events_dropped() > 0){
+            std::cerr << events->events_dropped() << " events dropped with the event log full" << std::endl;
+        }
+    }
+    catch(mem_exception& err){
+        std::cerr << err.what() << std::endl;
+    }
+    events.reset();
+}
+
+/*
+*   Stops the progress reporter after its final sample, registered with ..
+*   atexit() so the last line is finished on every exit path.
+*/
+void stop_progress(){
+    if(reporter){
+        reporter->stop();
+        reporter.reset();
+    }
+}
+
+/*
+*   Exports the hot path counters on exit, registered with atexit() so ..
+*   every exit path, failed operations included, reports them.
+*/
+void export_metrics(){
+
+    qspi_metrics metrics = collect_metrics();
+    if(!metrics_file.empty()){
+        if(metrics_file.compare(METRICS_STDOUT) == 0){
+            std::cout << metrics_json(metrics) << std::endl;
+        }
+        else{
+            std::ofstream json(metrics_file.c_str(), std::ios::trunc);
+            json << metrics_json(metrics) << std::endl;
+            if(!json){
+                std::cerr << "Failed to write the metrics to " << metrics_file << std::endl;
+            }
+        }
+    }
+    if(!prometheus_file.empty()){
+        try{
+            write_prometheus(prometheus_file, metrics);
+        }
+        catch(mem_exception& err){
+            std::cerr << err.what() << std::endl;
+        }
+    }
+}
+
 
 /*
 *   Unmaps the qspi and multiplexer memory maps and exits the program
@@ -22,6 +99,7 @@ namespace po = boost::program_options;
 */
 void clean_exit(qspi_device& qspi){
 
+    flush_events();
     try{
         qspi.un_map_qspi_mux();
         exit(1);
@@ -33,6 +111,44 @@ void clean_exit(qspi_device& qspi){
     }
 }
 
+/*
+*   Stops recording register accesses and writes out the rest of the trace, ..
+*   registered with atexit() so every exit path closes the trace.
+*/
+void close_trace(){
+
+    if(!trace){
+        return;
+    }
+    memory_mapped_device::set_mmio_trace(NULL);
+    try{
+        trace->close();
+        std::cout << "Recorded " << trace->records() << " register accesses to " << trace->file();
+        if(trace->records_dropped() > 0){
+            std::cout << ", " << trace->records_dropped() << " dropped with the trace ring full";
+        }
+        std::cout << std::endl;
+    }
+    catch(mem_exception& err){
+        std::cerr << err.what() << std::endl;
+    }
+    trace.reset();
+}
+
+/*
+*   Makes a relative filename absolute, the daemon runs in its own directory
+*   @param filename : the filename to make absolute
+*   @returns the absolute filename.
+*/
+std::string absolute_path(const std::string& filename){
+
+    char directory[4096];
+    if(filename.empty() || filename[0] == '/' || getcwd(directory, sizeof(directory)) == NULL){
+        return filename;
+    }
+    return std::string(directory) + "/" + filename;
+}
+
 /*
 *   Main entry point for the qspi_driver
 *   Passess command line arguments and calls the appropriate qspi_device methods
@@ -44,31 +160,98 @@ int main(int argc, char* argv[]){
     std::string timestamp = boost::posix_time::to_iso_extended_string(boost::posix_time::microsec_clock::local_time());
     std::string operation;
     bool verify = false;
-    int flash_chip;
-    uint32_t address;
+    bool sparse = false;
+    int flash_chip = 0;
+    uint32_t address = 0;
     std::string input_file;
+    std::vector<std::string> pack_segments;
+    std::string fill_value;
     std::string output_file;
-    unsigned long size;
+    std::string socket_path;
+    std::string jobs_file;
+    std::string xip_file;
+    std::string mtd_file;
+    std::string dma_engine;
+    std::string trace_file;
+    std::string event_file;
+    bool log_details = false;
+    std::string progress_format_name;
+    unsigned progress_interval = PROGRESS_SAMPLE_MS;
+    bool simulate = false;
+    std::string sim_files;
+    std::string sim_timing_settings;
+    unsigned sim_fifo_depth = SIM_FIFO_DEPTH;
+    bool realtime = false;
+    realtime_config rt_config = {RT_DEFAULT_CPU, RT_DEFAULT_PRIORITY};
+    unsigned long size = 0;
+    std::string compress;
+    int level = 0;
+    bool level_set = false;
+    compression_codec out_codec = CODEC_NONE;
     po::options_description options("Options");
 
     try{
         // set up options for command line arguments
         options.add_options()
-            ("help, h", "Prints the help menu")
+            ("help,h", "Prints the help menu")
             ("operation, op", po::value<std::string>()->required(), 
-                "Operation to perform (read, erase, program), mandatory argument.")
-            ("flash_chip, f", po::value<int>()->required(),  
+                "Operation to perform (read, erase, program, verify, status, daemon, pack), mandatory argument.")
+            ("flash_chip,f", po::value<int>()->required(),  
                 "The flash chip to use (1: Chip 1, 2: Chip 2, 3: Chip 3, 4: Chip 4), mandatory argument.")
-            ("verify, v", 
+            ("verify,v", 
                 "Perform a CRC-8 verification of the flash memory contents and the .bin file provided.")
-            ("address, a", po::value<uint32_t>()->default_value(0x00000000), 
+            ("address,a", po::value<uint32_t>()->default_value(0x00000000), 
                 "Hexidecimal Flash memory address to start the operation from (Default: 0x00000000.")
-            ("input_file, i", po::value<std::string>(), 
-                "Binary input filename to program the Flash with, file must pre-exist, required when op = write.")
-            ("output_file, o", po::value<std::string>()->default_value(timestamp + "_flash_dump"), 
-                "Binary output filename to store Flash memory contents in (Default: <timestamp> + _flash_dump)")
-            ("size, s", po::value<unsigned long>()->required(), 
-                "Integer-decimal value for the number of bytes to program, read or erase."); 
+            ("input_file,i", po::value<std::string>(), 
+                "Binary input filename to program or verify the Flash with, file must pre-exist, required when op = program or verify. Use - to stream from stdin. An image container made with op = pack programs and verifies only its segments, and needs no size.")
+            ("output_file,o", po::value<std::string>()->default_value(timestamp + "_flash_dump"), 
+                "Binary output filename to store Flash memory contents in (Default: <timestamp> + _flash_dump). Use - to stream to stdout.")
+            ("size,s", po::value<unsigned long>()->required(), 
+                "Integer-decimal value for the number of bytes to program, read or erase. An erase with a size or address erases only the sectors of the range, otherwise the whole chip.")
+            ("compress,c", po::value<std::string>(), 
+                "Compress the read output (gzip, zstd, lz4, none) (Default: from the output file extension .gz, .zst, .lz4).")
+            ("level,l", po::value<int>(), 
+                "Compression level to start the read output at, lowered automatically if compression falls behind the read.")
+            ("socket", po::value<std::string>(), 
+                "UNIX socket of a qspi_driver daemon. With op = daemon, listen for jobs on it (Default: /tmp/qspi_driver.sock), otherwise send the operation to the daemon.")
+            ("jobs", po::value<std::string>(), 
+                "File of jobs to run in one invocation, one per line as op=<operation> chip=<n> [address=<n>] [size=<n>] [file=<name>] [verify=1] [sparse=1] [compress=<codec>] [level=<n>], or as flat JSON objects with the same keys. An erase job with an address or size erases only the sectors from address to address + size, or to the end of the chip without a size, otherwise the whole chip.")
+            ("xip", po::value<std::string>()->implicit_value(MEM_DEVICE), 
+                "Read and verify through the QSPI controller's XIP read port, falling back to the FIFOs if it fails to map. A flash image file may be given to stand in for the port.")
+            ("dma", po::value<std::string>()->implicit_value(DMA_CDMA), 
+                "Move FIFO transfers with a DMA engine instead of the CPU, falling back to the CPU if it fails to open. cdma for the AXI CDMA (default), emulated for a stand-in engine.")
+            ("realtime", po::value<int>()->implicit_value(RT_DEFAULT_CPU), 
+                "Run the transfers pinned to a core (Default: 1) at SCHED_FIFO priority with memory locked, and print the p50/p99/max latency of each page program and FIFO read.")
+            ("priority", po::value<int>()->default_value(RT_DEFAULT_PRIORITY), 
+                "SCHED_FIFO priority of --realtime, 1-99 on Linux.")
+            ("simulate", po::value<std::string>()->implicit_value(""), 
+                "Run against a software model of the QSPI controller, multiplexer and flash chips instead of the board. Flash chip n is backed by the file <arg>n.bin if given (e.g. /tmp/flash), held in memory otherwise.")
+            ("sim-timing", po::value<std::string>(), 
+                "Timing of the model as name=ns pairs, e.g. sck=20,mmio=150,tpp=340000,tse=520000000,tbe=103000000000,tw=140000000.")
+            ("sim-fifo", po::value<unsigned>()->default_value(SIM_FIFO_DEPTH), 
+                "Depth of the model's controller FIFOs, as the core would be synthesized with.")
+            ("metrics", po::value<std::string>()->implicit_value(METRICS_STDOUT), 
+                "Print the hot path counters (register accesses, polls, pages programmed or skipped, time per phase, bytes per second) as JSON on exit, or write them to the file given.")
+            ("prometheus", po::value<std::string>(), 
+                "Write the hot path counters on exit to a Prometheus node_exporter textfile, e.g. /var/lib/node_exporter/qspi.prom.")
+            ("progress", po::value<std::string>()->implicit_value("tty"), 
+                "Report the phase, throughput and ETA of the operation to stderr from a separate thread, as a line redrawn in place (tty, default) or JSON lines (json).")
+            ("progress-interval", po::value<unsigned>()->default_value(PROGRESS_SAMPLE_MS), 
+                "Milliseconds between --progress reports, at least 1.")
+            ("event-log", po::value<std::string>(), 
+                "Also write the driver's events (CRCs, timings, device ID) to a binary log file, decoded with qspi_logdump.")
+            ("log-detail", 
+                "Log an event for every page programmed, FIFO read and sector erased.")
+            ("trace", po::value<std::string>(), 
+                "Record every register access to a binary trace file, to replay into the simulator with qspi_replay.")
+            ("mtd", po::value<std::string>(), 
+                "Read, program and erase through a Linux MTD device (e.g. /dev/mtd0) of the kernel's SPI-NOR driver instead of the controller's registers. The chip is still selected through the multiplexer. A plain file may stand in for the device.")
+            ("segment", po::value<std::vector<std::string> >()->composing(), 
+                "With op = pack, a raw .bin file to pack into the image container given with -o, as FILE@ADDRESS (Default address: 0). May be repeated, -i at -a packs one more.")
+            ("fill", po::value<std::string>()->default_value("0xFF"), 
+                "With op = pack, the value of the bytes left out of the container between segments, programmed into the gaps unless it is 0xFF (Default: 0xFF, erased flash).")
+            ("sparse", 
+                "Read: leave erased blocks as holes in the output file, listed in <output_file>.erased. Program: treat the ranges listed in <input_file>.erased as blank."); 
         
         //generate variables map and parse command line arguments 
         po::variables_map vm;
@@ -88,13 +271,22 @@ int main(int argc, char* argv[]){
 
             operation = vm["operation"].as<std::string>();
 
-            // check an input file was provided for a read operation
-            if(operation.compare("write") == 0){
+            // check an input file was provided for a program or verify operation
+            if(operation.compare("pack") == 0){
+                if(vm.count("input_file")){
+                    input_file = vm["input_file"].as<std::string>();
+                }
+                if(vm.count("segment")){
+                    pack_segments = vm["segment"].as<std::vector<std::string> >();
+                }
+                fill_value = vm["fill"].as<std::string>();
+            }
+            else if(operation.compare("program") == 0 || operation.compare("verify") == 0){
                 if(vm.count("input_file")){
                     input_file = vm["input_file"].as<std::string>();
                 }
                 else{
-                    std::cout << "Input file is required when performing a write operation" << std::endl;
+                    std::cout << "Input file is required when performing a " << operation << " operation" << std::endl;
                     exit(1);
                 }
             }
@@ -106,6 +298,9 @@ int main(int argc, char* argv[]){
         if(vm.count("verify")){
             verify = true;
         }
+        if(vm.count("sparse")){
+            sparse = true;
+        }
         if(vm.count("address")){
             char* end;
             // need to check whether address is being populated properly in hex.
@@ -118,21 +313,221 @@ int main(int argc, char* argv[]){
         if(vm.count("output_file")){
             output_file = vm["output_file"].as<std::string>();
         }
+        if(vm.count("compress")){
+            compress = vm["compress"].as<std::string>();
+        }
+        else if(output_file.find_last_of('.') != std::string::npos){
+            // pick the codec from a compressed file extension
+            std::string extension = output_file.substr(output_file.find_last_of('.') + 1);
+            if(extension == "gz" || extension == "zst" || extension == "lz4"){
+                compress = extension;
+            }
+        }
+        if(vm.count("level")){
+            level = vm["level"].as<int>();
+            level_set = true;
+        }
+        if(vm.count("socket")){
+            socket_path = vm["socket"].as<std::string>();
+        }
+        if(vm.count("jobs")){
+            jobs_file = vm["jobs"].as<std::string>();
+        }
+        if(vm.count("mtd")){
+            mtd_file = vm["mtd"].as<std::string>();
+        }
+        if(vm.count("xip")){
+            xip_file = vm["xip"].as<std::string>();
+        }
+        if(vm.count("dma")){
+            dma_engine = vm["dma"].as<std::string>();
+        }
+        if(vm.count("simulate")){
+            simulate = true;
+            sim_files = vm["simulate"].as<std::string>();
+        }
+        if(vm.count("sim-timing")){
+            sim_timing_settings = vm["sim-timing"].as<std::string>();
+        }
+        if(vm.count("sim-fifo")){
+            sim_fifo_depth = vm["sim-fifo"].as<unsigned>();
+        }
+        if(vm.count("progress")){
+            progress_format_name = vm["progress"].as<std::string>();
+            progress_interval = vm["progress-interval"].as<unsigned>();
+        }
+        if(vm.count("event-log")){
+            event_file = vm["event-log"].as<std::string>();
+        }
+        if(vm.count("log-detail")){
+            log_details = true;
+        }
+        if(vm.count("trace")){
+            trace_file = vm["trace"].as<std::string>();
+        }
+        if(vm.count("metrics")){
+            metrics_file = vm["metrics"].as<std::string>();
+        }
+        if(vm.count("prometheus")){
+            prometheus_file = vm["prometheus"].as<std::string>();
+        }
+        if(vm.count("realtime")){
+            realtime = true;
+            rt_config.cpu = vm["realtime"].as<int>();
+            rt_config.priority = vm["priority"].as<int>();
+        }
 
-        po::notify(vm);
+        // the daemon and a jobs file take the chip and size from each job, status needs no size, ..
+        // an image container holds its own layout and pack runs on the host
+        if(operation.compare("daemon") != 0 && operation.compare("status") != 0 && operation.compare("pack") != 0 
+            && !is_image_container(input_file) && jobs_file.empty()){
+            po::notify(vm);
+        }
     }
     catch(const po::error &ex){
         std::cerr << ex.what() << std::endl;
     }
 
-    // check and trim the size parameter to prevent memory over runs
-    if((size + address) > SIXTY_FOUR_MB){
-        std::cout << "Starting memory addres + size is greater than"
-        << "flash memory size (64MB), clipping size to prevent overrun" << std::endl;
-        size -= (size + address) - SIXTY_FOUR_MB;
+    // when streaming a dump to stdout, print all messages to stderr instead
+    if(operation.compare("read") == 0 && output_file.compare(STREAM_NAME) == 0){
+        std::cout.rdbuf(std::cerr.rdbuf());
+    }
+
+    // the core's events are printed by the event log's flusher, to stderr ..
+    // when stdout carries the dump
+    try{
+        bool to_stdout = operation.compare("read") == 0 && output_file.compare(STREAM_NAME) == 0;
+        events.reset(new event_log(to_stdout ? stderr : stdout, event_file));
+        events->set_detail(log_details);
+        event_log::set_active(events.get());
+        std::atexit(close_events);
+    }
+    catch(mem_exception& err){
+        std::cout << "An error occured opening the event log : " << err.what() << std::endl;
+        exit(1);
+    }
+
+    // check the read output compression is available in this build
+    if(!compress.empty()){
+        try{
+            out_codec = codec_from_name(compress);
+            if(!codec_supported(out_codec)){
+                throw mem_exception("Driver Built Without " + codec_name(out_codec) + " Support");
+            }
+            if(!level_set){
+                level = default_level(out_codec);
+            }
+            check_level(out_codec, level);
+        }
+        catch(mem_exception& err){
+            std::cout << "Invalid compression argument : " << err.what() << std::endl;
+            exit(1);
+        }
+    }
+
+    // a priority SCHED_FIFO would refuse is rejected up front, not on entering real-time mode
+    if(realtime){
+        try{
+            check_priority(rt_config.priority);
+        }
+        catch(mem_exception& err){
+            std::cout << "Invalid --priority argument : " << err.what() << std::endl;
+            exit(1);
+        }
+    }
+
+    // pack raw images into an image container, on the host without the controller
+    if(operation.compare("pack") == 0){
+        try{
+            char* end;
+            unsigned long fill = strtoul(fill_value.c_str(), &end, 0);
+            if(fill_value.empty() || *end != '\0' || fill > 0xFF){
+                throw mem_exception("Invalid Fill Value " + fill_value, QSPI_ERROR_INVALID_ARGUMENT);
+            }
+            std::vector<pack_input> inputs;
+            if(!input_file.empty()){
+                pack_input input = {input_file, address};
+                inputs.push_back(input);
+            }
+            for(unsigned long i = 0; i < pack_segments.size(); i++){
+                pack_input input = {pack_segments[i], 0};
+                std::string::size_type at = pack_segments[i].find_last_of('@');
+                if(at != std::string::npos){
+                    input.filename = pack_segments[i].substr(0, at);
+                    input.offset = strtoull(pack_segments[i].c_str() + at + 1, &end, 0);
+                    if(at + 1 == pack_segments[i].size() || *end != '\0'){
+                        throw mem_exception("Invalid Segment " + pack_segments[i], QSPI_ERROR_INVALID_ARGUMENT);
+                    }
+                }
+                inputs.push_back(input);
+            }
+            if(inputs.empty()){
+                throw mem_exception("No Images Given To Pack, use -i or --segment", QSPI_ERROR_INVALID_ARGUMENT);
+            }
+            pack_image(output_file, inputs, fill, out_codec, level);
+            image_container container;
+            container.open(output_file);
+            std::cout << "Packed " << container.segments().size() << " segments holding " << container.populated_bytes()
+            << " of " << container.image_size() << " bytes into " << output_file << std::endl;
+        }
+        catch(mem_exception& err){
+            std::cout << "An error occured during pack operation : " << err.what() << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    // send the operation to a running daemon rather than mapping the controller
+    if(!socket_path.empty() && operation.compare("daemon") != 0){
+        std::ostringstream job;
+        job << "op=" << operation << " chip=" << flash_chip << " address=" << address << " size=" << size;
+        if(operation.compare("read") == 0){
+            job << " file=" << absolute_path(output_file) << " compress=" << codec_name(out_codec) << " level=" << level;
+        }
+        else if(operation.compare("program") == 0 || operation.compare("verify") == 0){
+            job << " file=" << absolute_path(input_file);
+        }
+        job << (verify ? " verify=1" : "") << (sparse ? " sparse=1" : "");
+        return submit_job(socket_path, job.str());
+    }
+
+    if(!metrics_file.empty() || !prometheus_file.empty()){
+        std::atexit(export_metrics);
+    }
+
+    // the model takes the register accesses of the controller and multiplexer
+    std::unique_ptr<qspi_simulator> simulator;
+    if(simulate){
+        try{
+            simulator.reset(new qspi_simulator(SIM_FLASH_SIZE, sim_fifo_depth));
+            simulator->timing.parse(sim_timing_settings);
+            if(!sim_files.empty()){
+                simulator->back_with_files(sim_files);
+            }
+            memory_mapped_device::set_register_bus(simulator.get());
+            std::cout << "Running against the " << simulator->name() << std::endl;
+        }
+        catch(mem_exception& err){
+            std::cout << "An error occured setting up the simulator : " << err.what() << std::endl;
+            exit(1);
+        }
+    }
+
+    // record the register accesses from the first, made mapping the devices
+    if(!trace_file.empty()){
+        try{
+            trace.reset(new mmio_trace(trace_file));
+            memory_mapped_device::set_mmio_trace(trace.get());
+            std::atexit(close_trace);
+        }
+        catch(mem_exception& err){
+            std::cout << "An error occured opening the trace : " << err.what() << std::endl;
+            exit(1);
+        }
     }
 
     qspi_device qspi; // initialised qspi_device
+    qspi.set_sparse_images(sparse);
 
     // set up the memory mapped areas for qspi and mux
     try{
@@ -143,6 +538,107 @@ int main(int argc, char* argv[]){
         err.what() << std::endl;
         exit(1);
     }
+    // the kernel's driver moves the data when an MTD device is given
+    if(!mtd_file.empty()){
+        try{
+            qspi.set_backend(new mtd_backend(mtd_file));
+            std::cout << "Using the " << qspi.get_backend()->name() << " backend" << std::endl;
+        }
+        catch(mem_exception& err){
+            std::cout << "An error occured opening the MTD device : " << err.what() << std::endl;
+            clean_exit(qspi);
+            return 1;
+        }
+    }
+    // reads use the XIP window when it maps, the FIFOs otherwise
+    if(!xip_file.empty()){
+        try{
+            qspi.map_xip(xip_file);
+            std::cout << "Reading through the XIP window of " << xip_file << std::endl;
+        }
+        catch(mem_exception& err){
+            std::cout << "XIP window failed to map, reading through the FIFOs : " << err.what() << std::endl;
+        }
+    }
+    // FIFO transfers go through the DMA engine when it opens, the CPU otherwise
+    if(!dma_engine.empty()){
+        try{
+            qspi.enable_dma(dma_engine);
+            std::cout << "Moving FIFO transfers with the " << qspi.get_dma()->name() << std::endl;
+        }
+        catch(mem_exception& err){
+            std::cout << "DMA engine failed to open, moving FIFO transfers with the CPU : " << err.what() << std::endl;
+        }
+    }
+    // pin this thread, which runs the transfers, and time every page and FIFO
+    std::unique_ptr<latency_recorder> page_latency;
+    std::unique_ptr<latency_recorder> fifo_latency;
+    if(realtime){
+        page_latency.reset(new latency_recorder());
+        fifo_latency.reset(new latency_recorder());
+        try{
+            enter_realtime(pthread_self(), rt_config);
+            std::cout << "Running in real-time on core " << rt_config.cpu << " at SCHED_FIFO priority " 
+            << rt_config.priority << std::endl;
+        }
+        catch(mem_exception& err){
+            std::cout << "Real-time mode failed to start, timing transfers without it : " << err.what() << std::endl;
+        }
+        qspi.set_latency_recorders(page_latency.get(), fifo_latency.get());
+    }
+    // the device only stores to the counters, the reporter thread renders them
+    if(!progress_format_name.empty()){
+        try{
+            progress_format format = progress_format_from_name(progress_format_name);
+            qspi.set_progress_counters(&progress);
+            reporter.reset(new progress_reporter(progress, format, STDERR_FILENO, progress_interval));
+            std::atexit(stop_progress);
+        }
+        catch(mem_exception& err){
+            std::cout << "Invalid progress argument : " << err.what() << std::endl;
+            clean_exit(qspi);
+            return 1;
+        }
+    }
+
+    // run every job in the jobs file, overlapping the erases across chips
+    if(!jobs_file.empty()){
+        bool succeeded = false;
+        try{
+            job_scheduler scheduler(qspi);
+            scheduler.load(jobs_file);
+            succeeded = scheduler.run();
+            scheduler.print_summary();
+        }
+        catch(mem_exception& err){
+            std::cout << "An error occured running the jobs file : " << err.what() << std::endl;
+        }
+        if(succeeded){
+            try{
+                qspi.un_map_qspi_mux();
+                return 0;
+            }
+            catch(mem_exception& err){
+                std::cout << "An error occured during memory map tear-down : " <<
+                err.what() << std::endl;
+            }
+        }
+        clean_exit(qspi);
+        return 1;
+    }
+
+    // serve jobs over the socket until stopped, keeping the controller mapped
+    if(operation.compare("daemon") == 0){
+        try{
+            qspi_daemon daemon(qspi, socket_path.empty() ? DAEMON_SOCKET : socket_path);
+            daemon.run();
+        }
+        catch(mem_exception& err){
+            std::cout << "An error occured running the daemon : " << err.what() << std::endl;
+        }
+        clean_exit(qspi);
+        return 1;
+    }
 
     //select the flash chip 
     try{
@@ -155,6 +651,20 @@ int main(int argc, char* argv[]){
         return 1;
     }
 
+    // check and trim the size parameter against the probed chip to prevent memory over runs
+    unsigned long long flash_size = qspi.get_geometry().size;
+    if(address >= flash_size){
+        std::cout << "Starting memory address is beyond the flash memory size ("
+        << flash_size << " bytes)" << std::endl;
+        clean_exit(qspi);
+        return 1;
+    }
+    if((size + address) > flash_size){
+        std::cout << "Starting memory addres + size is greater than "
+        << "flash memory size (" << flash_size << " bytes), clipping size to prevent overrun" << std::endl;
+        size = flash_size - address;
+    }
+
     // handle a read operation 
     if(operation.compare("read") == 0){
 
@@ -163,9 +673,14 @@ int main(int argc, char* argv[]){
         << std::dec << "printing to a file called " << output_file.c_str();
 
         try{
+            if(out_codec != CODEC_NONE){
+                std::cout << std::endl << "Compressing the output with " << codec_name(out_codec) << std::endl;
+            }
+            qspi.set_output_compression(out_codec, level);
             qspi.read_flash_memory(address, size, output_file, true);  
         }
         catch(mem_exception& err){
+            flush_events();
             std::cout << "An error occured during read operation : " 
             << err.what() << std::endl;
             clean_exit(qspi);
@@ -176,11 +691,23 @@ int main(int argc, char* argv[]){
     // handle an erase operation
     else if(operation.compare("erase") == 0){
 
-        std::cout << "Erasing flash chip " << flash_chip << std::endl;
         try{
-            qspi.erase_flash_memory(flash_chip);
+            if(address != 0 || size > 0){
+                // a range erases only its sectors, from the address to the end without a size
+                if(size == 0){
+                    size = flash_size - address;
+                }
+                std::cout << "Erasing " << size << " bytes of flash chip " << flash_chip
+                << " starting at address " << std::hex << address << std::dec << std::endl;
+                qspi.erase_range(flash_chip, address, size);
+            }
+            else{
+                std::cout << "Erasing flash chip " << flash_chip << std::endl;
+                qspi.erase_flash_memory(flash_chip);
+            }
         }
         catch(mem_exception& err){
+            flush_events();
             std::cout << "An error occured during erase operation : " 
             << err.what() << std::endl;
             clean_exit(qspi);
@@ -199,6 +726,7 @@ int main(int argc, char* argv[]){
             qspi.write_flash_memory(flash_chip, address, size, input_file, verify);
         }
         catch(mem_exception& err){
+            flush_events();
             std::cout << "An error occured during write operation : " 
             << err.what() << std::endl;
             clean_exit(qspi);
@@ -206,6 +734,44 @@ int main(int argc, char* argv[]){
         }
 
     }
+    // handle a verify operation
+    else if(operation.compare("verify") == 0){
+
+        std::cout << "Verifying " << size << " bytes of flash chip " 
+        << flash_chip  << " starting at address " << std::hex << address
+        << std::dec << " against a file called " << input_file.c_str() << std::endl;
+
+        try{
+            qspi.verify_flash_memory(address, size, input_file);
+        }
+        catch(mem_exception& err){
+            flush_events();
+            std::cout << "An error occured during verify operation : " 
+            << err.what() << std::endl;
+            clean_exit(qspi);
+            return 1;
+        }
+    }
+
+    // handle a status operation
+    else if(operation.compare("status") == 0){
+
+        try{
+            uint8_t status = qspi.read_flash_status_reg();
+            uint8_t config = qspi.read_flash_config_reg();
+            std::cout << "Flash chip " << flash_chip << " status register : 0x" << std::hex 
+            << (int)status << " config register : 0x" 
+            << (int)config << std::dec << std::endl;
+            std::cout << describe_geometry(qspi.get_geometry()) << std::endl;
+            std::cout << "Controller FIFO depth : " << qspi.get_fifo_depth() << " bytes" << std::endl;
+        }
+        catch(mem_exception& err){
+            std::cout << "An error occured during status operation : " 
+            << err.what() << std::endl;
+            clean_exit(qspi);
+            return 1;
+        }
+    }
     else if(operation.compare("") == 0 ){
        
     }
@@ -218,6 +784,21 @@ int main(int argc, char* argv[]){
         exit(1);
     }
 
+    flush_events();
+    if(realtime){
+        if(page_latency->count() > 0){
+            page_latency->print_summary("Page program");
+        }
+        if(fifo_latency->count() > 0){
+            fifo_latency->print_summary("FIFO read");
+        }
+    }
+    if(simulator){
+        std::cout << "Simulated time : " << simulator->now() / 1000000.0 << " ms, " 
+        << simulator->mmio_reads << " register reads, " << simulator->mmio_writes << " register writes, "
+        << simulator->status_polls << " status polls, " << simulator->spi_bytes << " bytes on the bus" << std::endl;
+    }
+
     clean_exit(qspi);
     return 0;
 
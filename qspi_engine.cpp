@@ -0,0 +1,433 @@
+/*
+*   qspi_engine.cpp
+*   @Author Sophie Kirkham STFC, 2018
+*   Implementation of the qspi_engine and qspi_operation classes
+*/
+
+#include "qspi_engine.h"
+
+/*
+*   Constructor for qspi_operation objects, made by qspi_engine::submit().
+*   @param request : what the operation does
+*   @param signal : the lock and condition of the engine running it
+*/
+qspi_operation::qspi_operation(const operation_request& request, std::shared_ptr<engine_signal> signal) :
+    op_request(request),
+    signal(signal),
+    op_state(OP_QUEUED),
+    op_error_code(QSPI_OK),
+    op_crc(0),
+    cancel_flag(false),
+    done(0),
+    total(request.size)
+{}
+
+/*
+*   @returns true if an operation in the state has finished.
+*/
+bool qspi_operation::is_finished(operation_state state){
+    return state == OP_DONE || state == OP_FAILED || state == OP_CANCELLED;
+}
+
+/*
+*   @returns the state of the operation.
+*/
+operation_state qspi_operation::state(){
+    std::lock_guard<std::mutex> guard(this->signal->lock);
+    return this->op_state;
+}
+
+/*
+*   @returns true once the operation has finished, successfully or not.
+*/
+bool qspi_operation::finished(){
+    return is_finished(state());
+}
+
+/*
+*   Asks the operation to stop, a queued operation never starts.
+*   Returns straight away, wait() for the operation to stop.
+*/
+void qspi_operation::cancel(){
+    this->cancel_flag.store(true, std::memory_order_relaxed);
+}
+
+/*
+*   Waits for the operation to finish.
+*   @returns the final state of the operation.
+*/
+operation_state qspi_operation::wait(){
+
+    std::unique_lock<std::mutex> guard(this->signal->lock);
+    while(!is_finished(this->op_state)){
+        this->signal->changed.wait(guard);
+    }
+    return this->op_state;
+}
+
+/*
+*   Waits for the operation to finish, up to a timeout.
+*   @param timeout : the longest to wait
+*   @returns true if the operation has finished.
+*/
+bool qspi_operation::wait_for(std::chrono::milliseconds timeout){
+
+    std::unique_lock<std::mutex> guard(this->signal->lock);
+    return this->signal->changed.wait_for(guard, timeout, [this]{ return is_finished(this->op_state); });
+}
+
+/*
+*   @returns the bytes read, programmed, erased or verified so far.
+*/
+unsigned long long qspi_operation::bytes_done(){
+    return this->done.load(std::memory_order_relaxed);
+}
+
+/*
+*   @returns the bytes in the operation, the sectors covered for an erase.
+*/
+unsigned long long qspi_operation::bytes_total(){
+    return this->total.load(std::memory_order_relaxed);
+}
+
+/*
+*   @returns the qspi_error code of a failed or cancelled operation, QSPI_OK otherwise.
+*/
+int qspi_operation::error_code(){
+    std::lock_guard<std::mutex> guard(this->signal->lock);
+    return this->op_error_code;
+}
+
+/*
+*   @returns the error message of a failed or cancelled operation, "" otherwise.
+*/
+std::string qspi_operation::error(){
+    std::lock_guard<std::mutex> guard(this->signal->lock);
+    return this->op_error;
+}
+
+/*
+*   @returns the CRC of the bytes read, programmed or verified once done.
+*/
+uint8_t qspi_operation::crc(){
+    std::lock_guard<std::mutex> guard(this->signal->lock);
+    return this->op_crc;
+}
+
+/*
+*   @returns what the operation does.
+*/
+const operation_request& qspi_operation::request(){
+    return this->op_request;
+}
+
+/*
+*   Constructor for qspi_engine objects, starts the engine thread.
+*   @param device : the qspi device, already mapped with map_qspi_mux()
+*   @param device_lock : held while an operation runs, callers using the ..
+*   device directly must hold it too
+*/
+qspi_engine::qspi_engine(qspi_device& device, std::mutex& device_lock) :
+    device(device),
+    device_lock(device_lock),
+    signal(new qspi_operation::engine_signal()),
+    stopping(false)
+{
+    this->worker = std::thread(&qspi_engine::run, this);
+}
+
+/*
+*   Destructor for qspi_engine objects
+*   Cancels every queued and running operation and joins the engine thread.
+*/
+qspi_engine::~qspi_engine(){
+
+    cancel_all();
+    {
+        std::lock_guard<std::mutex> guard(this->signal->lock);
+        this->stopping = true;
+    }
+    this->signal->changed.notify_all();
+    this->worker.join();
+}
+
+/*
+*   Queues an operation to run on the engine thread.
+*   @param request : what the operation does
+*   @param progress : called on the engine thread as the operation advances
+*   @param on_complete : called on the engine thread once it has finished
+*   @returns the handle of the operation.
+*/
+operation_handle qspi_engine::submit(const operation_request& request, progress_callback progress, completion_callback on_complete){
+
+    operation_handle operation(new qspi_operation(request, this->signal));
+    operation->progress = progress;
+    operation->on_complete = on_complete;
+    {
+        std::lock_guard<std::mutex> guard(this->signal->lock);
+        this->queue.push_back(operation);
+    }
+    this->signal->changed.notify_all();
+    return operation;
+}
+
+/*
+*   Queues a read of the flash into a buffer.
+*   @param buffer : at least size bytes, valid until the read has finished
+*/
+operation_handle qspi_engine::read(int flash_chip, uint32_t address, unsigned long size, uint8_t* buffer){
+
+    operation_request request = {OP_READ, flash_chip, address, size, "", buffer, NULL, false, false};
+    return submit(request);
+}
+
+/*
+*   Queues a program of the flash from a buffer.
+*   @param data : the bytes to program, valid until the program has finished
+*   @param erase : true to erase the sectors being programmed first
+*   @param verify : true to read back and compare every byte
+*/
+operation_handle qspi_engine::program(int flash_chip, uint32_t address, unsigned long size, const uint8_t* data, bool erase, bool verify){
+
+    operation_request request = {OP_PROGRAM, flash_chip, address, size, "", NULL, data, erase, verify};
+    return submit(request);
+}
+
+/*
+*   Queues an erase of the sectors holding a range of the flash.
+*/
+operation_handle qspi_engine::erase(int flash_chip, uint32_t address, unsigned long size){
+
+    operation_request request = {OP_ERASE, flash_chip, address, size, "", NULL, NULL, false, false};
+    return submit(request);
+}
+
+/*
+*   Queues a comparison of the flash against a buffer.
+*   @param data : the bytes the flash should hold, valid until the verify has finished
+*/
+operation_handle qspi_engine::verify(int flash_chip, uint32_t address, unsigned long size, const uint8_t* data){
+
+    operation_request request = {OP_VERIFY, flash_chip, address, size, "", NULL, data, false, false};
+    return submit(request);
+}
+
+/*
+*   Waits for any one of several operations to finish.
+*   The operations must come from the same engine.
+*   @param operations : the operations to wait on
+*   @param timeout : the longest to wait, negative to wait forever
+*   @throws mem_exception : if the operations come from different engines
+*   @returns the index of the first finished operation, -1 on timeout.
+*/
+long qspi_engine::wait_any(const std::vector<operation_handle>& operations, std::chrono::milliseconds timeout){
+
+    if(operations.empty()){
+        return -1;
+    }
+    std::shared_ptr<qspi_operation::engine_signal> signal = operations[0]->signal;
+    for(unsigned long i = 1; i < operations.size(); i++){
+        if(operations[i]->signal != signal){
+            throw mem_exception("Operations Waited On Together Must Come From One Engine", QSPI_ERROR_INVALID_ARGUMENT);
+        }
+    }
+
+    long first = -1;
+    std::function<bool()> any_finished = [&]{
+        for(unsigned long i = 0; i < operations.size(); i++){
+            if(operations[i]->is_finished(operations[i]->op_state)){
+                first = i;
+                return true;
+            }
+        }
+        return false;
+    };
+    std::unique_lock<std::mutex> guard(signal->lock);
+    if(timeout.count() < 0){
+        signal->changed.wait(guard, any_finished);
+    }
+    else{
+        signal->changed.wait_for(guard, timeout, any_finished);
+    }
+    return first;
+}
+
+/*
+*   Waits for every one of several operations to finish.
+*   @param operations : the operations to wait on
+*   @param timeout : the longest to wait, negative to wait forever
+*   @returns true if every operation has finished.
+*/
+bool qspi_engine::wait_all(const std::vector<operation_handle>& operations, std::chrono::milliseconds timeout){
+
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + timeout;
+    for(unsigned long i = 0; i < operations.size(); i++){
+        if(timeout.count() < 0){
+            operations[i]->wait();
+            continue;
+        }
+        std::chrono::steady_clock::duration left = deadline - std::chrono::steady_clock::now();
+        if(!operations[i]->wait_for(std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::max(left, std::chrono::steady_clock::duration::zero())))){
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+*   Pins the engine thread to a core at SCHED_FIFO priority, locking the ..
+*   process's memory, see enter_realtime().
+*   @throws mem_exception : if real-time mode fails to start
+*/
+void qspi_engine::set_realtime(const realtime_config& config){
+    enter_realtime(this->worker.native_handle(), config);
+}
+
+/*
+*   Cancels every queued operation and the one running.
+*/
+void qspi_engine::cancel_all(){
+
+    std::lock_guard<std::mutex> guard(this->signal->lock);
+    for(unsigned long i = 0; i < this->queue.size(); i++){
+        this->queue[i]->cancel();
+    }
+    if(this->running){
+        this->running->cancel();
+    }
+}
+
+/*
+*   The engine thread, runs the queued operations in order until stopped.
+*/
+void qspi_engine::run(){
+
+    std::unique_lock<std::mutex> guard(this->signal->lock);
+    while(true){
+        while(this->queue.empty() && !this->stopping){
+            this->signal->changed.wait(guard);
+        }
+        if(this->queue.empty()){
+            return;
+        }
+        this->running = this->queue.front();
+        this->queue.pop_front();
+        qspi_operation& operation = *this->running;
+
+        if(operation.cancel_flag.load(std::memory_order_relaxed)){
+            // cancelled while queued, the flash is never touched
+            operation.op_state = OP_CANCELLED;
+            operation.op_error_code = QSPI_ERROR_CANCELLED;
+            operation.op_error = "Operation Cancelled";
+        }
+        else{
+            operation.op_state = OP_RUNNING;
+            guard.unlock();
+            execute(operation);
+            guard.lock();
+        }
+        operation_handle finished = this->running;
+        this->running.reset();
+        this->signal->changed.notify_all();
+
+        if(finished->on_complete){
+            guard.unlock();
+            finished->on_complete(*finished);
+            guard.lock();
+        }
+    }
+}
+
+/*
+*   Runs an operation on the device, then deselects the flash.
+*   Records the result in the operation under the engine's lock.
+*   @param operation : the operation to run
+*/
+void qspi_engine::execute(qspi_operation& operation){
+
+    operation_request& request = operation.op_request;
+    operation_state state = OP_DONE;
+    int code = QSPI_OK;
+    std::string message;
+    uint8_t crc = 0;
+
+    std::lock_guard<std::mutex> device_guard(this->device_lock);
+    this->device.set_cancel_flag(&operation.cancel_flag);
+    this->device.set_progress_callback([&operation](unsigned long long done, unsigned long long total){
+        operation.done.store(done, std::memory_order_relaxed);
+        operation.total.store(total, std::memory_order_relaxed);
+        if(operation.progress){
+            operation.progress(done, total);
+        }
+    });
+
+    try{
+        this->device.select_flash(request.flash_chip);
+        this->device.check_range(request.address, request.size);
+        switch(request.type){
+            case OP_READ:
+                if(request.filename.empty()){
+                    crc = this->device.read_flash_buffer(request.address, request.size, request.buffer);
+                }
+                else{
+                    crc = this->device.read_flash_memory(request.address, request.size, request.filename, true);
+                }
+                break;
+            case OP_PROGRAM:
+                if(request.erase){
+                    uint32_t erase_address = request.address;
+                    unsigned long erase_size = request.size;
+                    this->device.erase_range(request.flash_chip, erase_address, erase_size);
+                }
+                if(request.filename.empty()){
+                    crc = this->device.program_flash_buffer(request.address, request.data, request.size, request.verify);
+                }
+                else{
+                    this->device.program_flash_memory(request.address, request.size, request.filename, request.verify);
+                }
+                break;
+            case OP_ERASE:
+                this->device.erase_range(request.flash_chip, request.address, request.size);
+                break;
+            case OP_VERIFY:
+                if(request.filename.empty()){
+                    this->device.verify_flash_buffer(request.address, request.data, request.size);
+                }
+                else{
+                    this->device.verify_flash_memory(request.address, request.size, request.filename);
+                }
+                break;
+        }
+    }
+    catch(mem_exception& err){
+        code = err.code();
+        message = err.what();
+        state = (code == QSPI_ERROR_CANCELLED) ? OP_CANCELLED : OP_FAILED;
+    }
+    catch(std::exception& err){
+        code = QSPI_ERROR_FAILED;
+        message = err.what();
+        state = OP_FAILED;
+    }
+
+    // a cancelled operation stops between transactions, the chip can be let go
+    try{
+        this->device.deselect_flash();
+    }
+    catch(mem_exception& err){
+        if(state == OP_DONE){
+            code = err.code();
+            message = err.what();
+            state = OP_FAILED;
+        }
+    }
+    this->device.set_cancel_flag(NULL);
+    this->device.set_progress_callback(progress_callback());
+
+    std::lock_guard<std::mutex> guard(this->signal->lock);
+    operation.op_state = state;
+    operation.op_error_code = code;
+    operation.op_error = message;
+    operation.op_crc = crc;
+}
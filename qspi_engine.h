@@ -0,0 +1,144 @@
+/*
+*   qspi_engine.h
+*   @Author Sophie Kirkham STFC, 2018
+*   Header file for the qspi_engine and qspi_operation classes
+*   Runs reads, programs, erases and verifies on an engine thread, returning ..
+*   an operation handle straight away so the caller (e.g. a GUI) stays responsive.
+*   Operations run one at a time in submission order. Each can be watched ..
+*   through its progress, waited on alone or with others, and cancelled. A ..
+*   cancel takes effect at the next FIFO increment of a read, page of a ..
+*   program or sector of an erase, a bulk erase once issued runs to completion.
+*   The flash is deselected after every operation, whether or not it finished.
+*/
+
+#ifndef QSPI_ENGINE_H_
+#define QSPI_ENGINE_H_
+
+#include <string>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+
+#include "qspi_device.h"
+
+enum operation_type{
+    OP_READ,        // read the flash into a buffer or file
+    OP_PROGRAM,     // program the flash from a buffer or file
+    OP_ERASE,       // erase a range of the flash
+    OP_VERIFY       // compare the flash against a buffer or file
+};
+
+enum operation_state{
+    OP_QUEUED,      // waiting for the engine thread
+    OP_RUNNING,     // running on the engine thread
+    OP_DONE,        // finished successfully
+    OP_FAILED,      // finished with an error
+    OP_CANCELLED    // cancelled before it finished
+};
+
+/*
+*   What an operation does, a buffer is used when filename is empty.
+*   Buffers must stay valid until the operation has finished.
+*/
+struct operation_request{
+    operation_type type;    // what to do
+    int flash_chip;         // the flash chip, 1-4
+    uint32_t address;       // the flash address to start at
+    unsigned long size;     // the number of bytes
+    std::string filename;   // the image or dump file, empty to use buffer
+    uint8_t* buffer;        // the buffer to read into
+    const uint8_t* data;    // the buffer to program or verify from
+    bool erase;             // erase the sectors before programming
+    bool verify;            // verify after programming
+};
+
+class qspi_operation;
+typedef std::shared_ptr<qspi_operation> operation_handle;
+
+// Called on the engine thread once an operation has finished
+typedef std::function<void(qspi_operation& operation)> completion_callback;
+
+class qspi_operation{
+
+    public:
+
+        operation_state state();
+        bool finished();
+        void cancel();
+        operation_state wait();
+        bool wait_for(std::chrono::milliseconds timeout);
+        unsigned long long bytes_done();
+        unsigned long long bytes_total();
+        int error_code();
+        std::string error();
+        uint8_t crc();
+        const operation_request& request();
+
+    private:
+
+        friend class qspi_engine;
+
+        // the engine's lock and condition, shared so handles outlive the engine
+        struct engine_signal{
+            std::mutex lock;                    // guards the state of every operation
+            std::condition_variable changed;    // notified when an operation finishes
+        };
+
+        operation_request op_request;       // what the operation does
+        std::shared_ptr<engine_signal> signal;  // the engine's lock and condition
+        operation_state op_state;           // guarded by signal->lock
+        int op_error_code;                  // the qspi_error code on failure
+        std::string op_error;               // the error message on failure
+        uint8_t op_crc;                     // the CRC of the bytes read or programmed
+        std::atomic<bool> cancel_flag;      // set to cancel, polled by the device
+        std::atomic<unsigned long long> done;   // bytes done
+        std::atomic<unsigned long long> total;  // bytes in the operation
+        progress_callback progress;         // called on the engine thread as it advances
+        completion_callback on_complete;    // called on the engine thread once finished
+
+        qspi_operation(const operation_request& request, std::shared_ptr<engine_signal> signal);
+        bool is_finished(operation_state state);
+};
+
+class qspi_engine{
+
+    public:
+
+        qspi_engine(qspi_device& device, std::mutex& device_lock);
+        ~qspi_engine();
+
+        operation_handle submit(const operation_request& request,
+                                progress_callback progress = progress_callback(),
+                                completion_callback on_complete = completion_callback()
+                                );
+        operation_handle read(int flash_chip, uint32_t address, unsigned long size, uint8_t* buffer);
+        operation_handle program(int flash_chip, uint32_t address, unsigned long size, const uint8_t* data,
+                                bool erase, bool verify);
+        operation_handle erase(int flash_chip, uint32_t address, unsigned long size);
+        operation_handle verify(int flash_chip, uint32_t address, unsigned long size, const uint8_t* data);
+
+        static long wait_any(const std::vector<operation_handle>& operations, std::chrono::milliseconds timeout);
+        static bool wait_all(const std::vector<operation_handle>& operations, std::chrono::milliseconds timeout);
+        void cancel_all();
+        void set_realtime(const realtime_config& config);
+
+    private:
+
+        qspi_device& device;            // the mapped qspi device
+        std::mutex& device_lock;        // serialises the device with its other users
+        std::shared_ptr<qspi_operation::engine_signal> signal;  // shared with every operation
+        std::deque<operation_handle> queue;     // operations waiting to run
+        operation_handle running;       // the operation running, empty if none
+        bool stopping;                  // set to stop the engine thread
+        std::thread worker;             // the engine thread
+
+        void run();
+        void execute(qspi_operation& operation);
+};
+
+#endif
@@ -0,0 +1,28 @@
+/*
+*   qspi_errors.h
+*   @Author Sophie Kirkham STFC, 2018
+*   Error codes carried by mem_exception and returned by the libqspi C API
+*   Plain C so it can be included from C and C++.
+*/
+
+#ifndef QSPI_ERRORS_H_
+#define QSPI_ERRORS_H_
+
+enum qspi_error{
+    QSPI_OK = 0,                    // success
+    QSPI_ERROR_FAILED = -1,         // any failure without a more specific code
+    QSPI_ERROR_INVALID_ARGUMENT = -2,   // an argument is out of range
+    QSPI_ERROR_MAP = -3,            // /dev/mem failed to open, map or un-map
+    QSPI_ERROR_FLASH_SELECT = -4,   // the flash chip failed to be selected
+    QSPI_ERROR_PROTECTED = -5,      // the operation would erase the protected flash chip 1
+    QSPI_ERROR_WRITE_ENABLE = -6,   // the flash write enable latch failed to set
+    QSPI_ERROR_QUAD_MODE = -7,      // quad mode failed to enable
+    QSPI_ERROR_ERASE = -8,          // the flash reported an erase error
+    QSPI_ERROR_PROGRAM = -9,        // the flash reported a program error
+    QSPI_ERROR_VERIFY = -10,        // the flash contents did not match the image
+    QSPI_ERROR_IO = -11,            // an image, dump or stream failed to be read or written
+    QSPI_ERROR_CANCELLED = -12,     // the operation was cancelled before it finished
+    QSPI_ERROR_TIMEOUT = -13        // the wait for an operation timed out
+};
+
+#endif
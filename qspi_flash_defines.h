@@ -17,6 +17,7 @@
 #define MUX_SET_FL2 0x105   // Data value sent to MUX to select flash chip 2
 #define MUX_SET_FL3 0x106   // Data value sent to MUX to select flash chip 3
 #define MUX_SET_FL4 0x107   // Data value sent to MUX to select flash chip 4
+#define FLASH_CHIPS 4       // Flash chips behind the MUX, numbered from 1
 #define MUX_DESET 0x100     // Data value sent to MUX to deselect any flash chip
 #define MUX_WIDTH 32        // The data width used in transactions with the MUX
 
@@ -29,6 +30,11 @@
 #define QSPI_DTR 0x68       // The offset address of the QSPI data transmit Reg
 #define QSPI_DRR 0x6C       // The offset address of the QSPI data receive reg
 #define QSPI_SSR 0x70       // The offset address of the QSPI Slave Select reg
+#define QSPI_TX_OCCUPANCY 0x74  // The offset address of the QSPI TX FIFO occupancy reg
+#define QSPI_SR_TX_FULL 0x08    // Status reg bit set when the TX FIFO is full
+#define XIP_BASE 0xA4000000 // The base address of the QSPI controller's XIP read port
+#define XIP_SIZE 0x4000000  // The size of the XIP read port, the whole 64MB flash
+#define XIP_CHUNK 65536     // Number of bytes copied out of the XIP window at a time
 
 #define RESET_FIFO_MSTR_CONFIG_ENABLE 0x000001E6    // Value sent to reset FIFO and enable master transaction.    
 #define ENABLE_MASTER_TRAN 0x00000086   // Value sent to enable master transaction
@@ -47,17 +53,26 @@
 #define FL_READ_QUAD_IO 0xEB// Instruction code to read flash memory array in QUADO I/O mode.
 #define FL_QUAD_PP 0x34     // Instruction code to program the flash memory array in QUAD mode
 #define FL_BULK_ERASE 0x60  // Instruction code to erase the entire flash memory array.
+#define FL_SECTOR_ERASE 0xDC// Instruction code to erase one sector, with a four byte address.
 
 //Helper Definitions
 #define DUMMY_DATA 0xDD     // Dummy data byte value.
 #define FL_MEM_START 0x00000000 // Start address of the flash memory array
 #define FL_MEM_SIZE 28734812// Current configuration bin file size.
-#define FIFO_DEPTH 128      // Max number of bytes to issue into the FIFO
+#define FIFO_DEPTH 128      // Bytes issued into the FIFO per transfer when its depth is not detected
+#define FIFO_MIN_DEPTH 16   // Smallest FIFO depth the controller is synthesized with
+#define FIFO_MAX_DEPTH 4096 // Most bytes pushed when detecting the FIFO depth
+#define STATUS_POLL_BYTES 1 // Status samples clocked per poll of a streamed status read, more trade detection latency for fewer polls
 #define PREAMBLE_SIZE 9     // Size of the preamble generated using single transaction reads.
 #define DEFAULT_FLASH 1     // Default flash to select.
 #define SIXTY_FOUR_MB 64000000  // 64MB 
 #define PAGE_SIZE 512
+#define SECTOR_SIZE 262144  // Size of an erase sector, 256KB
+#define PROGRESS_INTERVAL 65536 // Number of bytes between progress reports
 #define MAX_FLASH_ADDRESS (SIXTY_FOUR_MB - 16) // Maximum safe flash address to begin a read from.
 const std::string BIN_EXT = ".bin";
+const std::string STREAM_NAME = "-";    // File name used to stream through stdin/stdout
+const std::string DAEMON_SOCKET = "/tmp/qspi_driver.sock";   // Default socket of the daemon
+const std::string ERASED_EXT = ".erased";   // Extension of a sparse dump's erased ranges sidecar
 
 #endif
\ No newline at end of file
@@ -0,0 +1,69 @@
+/*
+*   qspi_logdump.cpp
+*   @Author Sophie Kirkham STFC, 2018
+*   Main application entry point for the qspi_logdump .elf executable
+*   Decodes binary event logs written with qspi_driver --event-log, ..
+*   printing each event as the line the driver printed for it, prefixed ..
+*   with its time and thread, or as one JSON object per line.
+*/
+
+#include <iostream>
+#include <iomanip>
+#include <boost/program_options.hpp>
+#include "event_log.h"
+
+namespace po = boost::program_options;
+
+/*
+*   Main entry point for qspi_logdump
+*   @param argc : number of command line arguments provided
+*   @param argv : array of command line arguments
+*   @returns 0 on success, 1 on error.
+*/
+int main(int argc, char* argv[]){
+
+    po::options_description options("Options");
+    po::positional_options_description positional;
+    po::variables_map vm;
+    try{
+        options.add_options()
+            ("help,h", "Prints the help menu")
+            ("log", po::value<std::string>()->required(),
+                "Event log written with qspi_driver --event-log.")
+            ("json", "Print each event as a JSON object, one per line.");
+        positional.add("log", 1);
+        po::store(po::command_line_parser(argc, argv).options(options).positional(positional).run(), vm);
+        if(vm.count("help")){
+            std::cout << "Usage: qspi_logdump [options] log" << std::endl;
+            std::cout << options << std::endl;
+            return 1;
+        }
+        po::notify(vm);
+    }
+    catch(const po::error &ex){
+        std::cerr << ex.what() << std::endl;
+        return 1;
+    }
+
+    std::vector<event_record> records;
+    try{
+        records = read_event_log(vm["log"].as<std::string>());
+    }
+    catch(mem_exception& err){
+        std::cerr << "An error occured reading the event log : " << err.what() << std::endl;
+        return 1;
+    }
+
+    bool json = vm.count("json") > 0;
+    for(unsigned long i = 0; i < records.size(); i++){
+        if(json){
+            std::cout << event_json(records[i]) << "\n";
+            continue;
+        }
+        // a multi-line message keeps the prefix on its first line only
+        std::cout << std::fixed << std::setprecision(6) << std::setw(12) << records[i].time_ns / 1e9
+        << " [" << records[i].thread << "] " << event_text(records[i]) << "\n";
+    }
+    std::cout.flush();
+    return 0;
+}
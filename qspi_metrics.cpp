@@ -0,0 +1,194 @@
+/*
+*   qspi_metrics.cpp
+*   @Author Sophie Kirkham STFC, 2018
+*   Source file for the hot path counters of the qspi_device engine
+*   The per-thread slots, their aggregation and the JSON and Prometheus ..
+*   textfile exports.
+*/
+
+#include "qspi_metrics.h"
+
+#include <stdio.h>
+#include <mutex>
+#include <vector>
+#include <sstream>
+#include <fstream>
+#include <algorithm>
+
+namespace{
+
+/*
+*   The live slots and the totals of the threads that have exited.
+*   Never destroyed, so threads exiting and atexit handlers after main ..
+*   returns can still use it.
+*/
+struct metrics_registry{
+    std::mutex lock;                        // guards the slots and retired totals
+    std::vector<const metrics_slot*> slots; // the slots of the live threads
+    uint64_t retired[METRIC_COUNT];         // the sums of the exited threads' slots
+    std::chrono::steady_clock::time_point start;    // when counting started
+
+    metrics_registry() : start(std::chrono::steady_clock::now()){
+        std::fill(this->retired, this->retired + METRIC_COUNT, 0);
+    }
+};
+
+metrics_registry& registry(){
+    static metrics_registry* totals = new metrics_registry();
+    return *totals;
+}
+
+const char* const METRIC_NAMES[METRIC_COUNT] = {
+    "mmio_reads", "mmio_writes", "tx_polls", "wip_polls", "pages_programmed", "pages_skipped",
+    "bytes_read", "bytes_programmed", "bytes_verified", "erase_ns", "program_ns", "wait_ns",
+    "io_ns", "verify_ns", "read_ns"
+};
+
+/*
+*   Bytes moved per second of a phase, 0 if the phase never ran.
+*/
+double bytes_per_second(const qspi_metrics& metrics, qspi_metric bytes, qspi_metric phase){
+    if(metrics.values[phase] == 0){
+        return 0;
+    }
+    return metrics.values[bytes] * 1e9 / metrics.values[phase];
+}
+
+}
+
+thread_local metrics_slot metrics_local;
+
+/*
+*   Registers the slot of a new thread with the process totals.
+*/
+metrics_slot::metrics_slot(){
+    for(int i = 0; i < METRIC_COUNT; i++){
+        this->values[i].store(0, std::memory_order_relaxed);
+    }
+    metrics_registry& totals = registry();
+    std::lock_guard<std::mutex> guard(totals.lock);
+    totals.slots.push_back(this);
+}
+
+/*
+*   Folds the counts of an exiting thread into the retired totals.
+*/
+metrics_slot::~metrics_slot(){
+    metrics_registry& totals = registry();
+    std::lock_guard<std::mutex> guard(totals.lock);
+    for(int i = 0; i < METRIC_COUNT; i++){
+        totals.retired[i] += get((qspi_metric)i);
+    }
+    totals.slots.erase(std::remove(totals.slots.begin(), totals.slots.end(), this), totals.slots.end());
+}
+
+/*
+*   @param metric : the counter to read
+*   @returns the count, safe to read from any thread.
+*/
+uint64_t metrics_slot::get(qspi_metric metric) const{
+    return this->values[metric].load(std::memory_order_relaxed);
+}
+
+/*
+*   Starts timing a phase.
+*   @param phase : the METRIC_*_NS counter to add the time to
+*/
+metrics_timer::metrics_timer(qspi_metric phase) : phase(phase), start(std::chrono::steady_clock::now()){
+}
+
+/*
+*   Adds the time since construction to the phase.
+*/
+metrics_timer::~metrics_timer(){
+    std::chrono::steady_clock::duration elapsed = std::chrono::steady_clock::now() - this->start;
+    count_metric(this->phase, std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+}
+
+/*
+*   @param metric : the counter
+*   @returns the name of the counter in the JSON and Prometheus exports.
+*/
+const char* metric_name(qspi_metric metric){
+    return METRIC_NAMES[metric];
+}
+
+/*
+*   Sums the counters of every thread, live and exited.
+*   Counts still being added on other threads may be missed, not torn.
+*   @returns the summed counters.
+*/
+qspi_metrics collect_metrics(){
+
+    qspi_metrics metrics;
+    metrics_registry& totals = registry();
+    std::lock_guard<std::mutex> guard(totals.lock);
+    for(int i = 0; i < METRIC_COUNT; i++){
+        metrics.values[i] = totals.retired[i];
+        for(unsigned long s = 0; s < totals.slots.size(); s++){
+            metrics.values[i] += totals.slots[s]->get((qspi_metric)i);
+        }
+    }
+    std::chrono::steady_clock::duration elapsed = std::chrono::steady_clock::now() - totals.start;
+    metrics.seconds = std::chrono::duration_cast<std::chrono::duration<double> >(elapsed).count();
+    return metrics;
+}
+
+/*
+*   Formats the counters as one JSON object, with the bytes per second of ..
+*   the read, program and verify phases.
+*   @param metrics : the collected counters
+*   @returns the JSON object, without a trailing newline.
+*/
+std::string metrics_json(const qspi_metrics& metrics){
+
+    std::ostringstream json;
+    json << "{\"seconds\": " << metrics.seconds;
+    for(int i = 0; i < METRIC_COUNT; i++){
+        json << ", \"" << METRIC_NAMES[i] << "\": " << metrics.values[i];
+    }
+    json << ", \"read_bytes_per_second\": " << (uint64_t)bytes_per_second(metrics, METRIC_BYTES_READ, METRIC_READ_NS)
+    << ", \"program_bytes_per_second\": " << (uint64_t)bytes_per_second(metrics, METRIC_BYTES_PROGRAMMED, METRIC_PROGRAM_NS)
+    << ", \"verify_bytes_per_second\": " << (uint64_t)bytes_per_second(metrics, METRIC_BYTES_VERIFIED, METRIC_VERIFY_NS)
+    << "}";
+    return json.str();
+}
+
+/*
+*   Writes the counters as a Prometheus node_exporter textfile.
+*   The file is written beside the path then renamed over it, so the ..
+*   exporter never scrapes a half written file.
+*   @param path : the .prom file to write
+*   @param metrics : the collected counters
+*   @throws mem_exception : if the file fails to be written
+*/
+void write_prometheus(const std::string& path, const qspi_metrics& metrics){
+
+    std::string temp = path + METRICS_TEMP_EXT;
+    {
+        std::ofstream prom(temp.c_str(), std::ios::trunc);
+        for(int i = 0; i < METRIC_ERASE_NS; i++){
+            prom << "# TYPE qspi_" << METRIC_NAMES[i] << "_total counter" << std::endl;
+            prom << "qspi_" << METRIC_NAMES[i] << "_total " << metrics.values[i] << std::endl;
+        }
+        // the phase times share one metric, labelled by phase
+        prom << "# TYPE qspi_phase_seconds_total counter" << std::endl;
+        for(int i = METRIC_ERASE_NS; i < METRIC_COUNT; i++){
+            std::string phase(METRIC_NAMES[i]);
+            prom << "qspi_phase_seconds_total{phase=\"" << phase.substr(0, phase.size() - 3) << "\"} "
+            << metrics.values[i] / 1e9 << std::endl;
+        }
+        prom << "# TYPE qspi_bytes_per_second gauge" << std::endl;
+        prom << "qspi_bytes_per_second{phase=\"read\"} " << bytes_per_second(metrics, METRIC_BYTES_READ, METRIC_READ_NS) << std::endl;
+        prom << "qspi_bytes_per_second{phase=\"program\"} " << bytes_per_second(metrics, METRIC_BYTES_PROGRAMMED, METRIC_PROGRAM_NS) << std::endl;
+        prom << "qspi_bytes_per_second{phase=\"verify\"} " << bytes_per_second(metrics, METRIC_BYTES_VERIFIED, METRIC_VERIFY_NS) << std::endl;
+        prom.flush();
+        if(!prom){
+            throw mem_exception("Failed To Write The Metrics File " + temp, QSPI_ERROR_IO);
+        }
+    }
+    if(rename(temp.c_str(), path.c_str()) != 0){
+        remove(temp.c_str());
+        throw mem_exception("Failed To Rename The Metrics File To " + path, QSPI_ERROR_IO);
+    }
+}
@@ -0,0 +1,110 @@
+/*
+*   qspi_metrics.h
+*   @Author Sophie Kirkham STFC, 2018
+*   Header file for the hot path counters of the qspi_device engine
+*   Counts the register reads and writes, TX empty and write in progress ..
+*   polls, pages programmed or skipped and bytes moved, and times each phase ..
+*   of an operation. Every thread counts into its own slot with relaxed ..
+*   atomics, so the MMIO loops never share a cache line or take a lock. The ..
+*   slots are only summed when the metrics are collected, e.g. at exit.
+*   Phases nest: the wait phase overlaps the erase and program phases, and ..
+*   the read back of a verify is counted under both verify and read.
+*/
+
+#ifndef QSPI_METRICS_H_
+#define QSPI_METRICS_H_
+
+#include <stdint.h>
+#include <string>
+#include <atomic>
+#include <chrono>
+
+#include "mem_exception.h"
+
+#define METRICS_STDOUT "-"      // --metrics file name printing the summary to stdout
+#define METRICS_TEMP_EXT ".tmp" // Suffix of the textfile written before it is renamed into place
+
+enum qspi_metric{
+    METRIC_MMIO_READS,          // controller and multiplexer register reads
+    METRIC_MMIO_WRITES,         // controller and multiplexer register writes
+    METRIC_TX_POLLS,            // reads of the TX empty status bit
+    METRIC_WIP_POLLS,           // reads of the flash write in progress bit
+    METRIC_PAGES_PROGRAMMED,    // pages sent to the flash
+    METRIC_PAGES_SKIPPED,       // blank pages left erased
+    METRIC_BYTES_READ,          // bytes read from the flash
+    METRIC_BYTES_PROGRAMMED,    // bytes programmed, skipped pages included
+    METRIC_BYTES_VERIFIED,      // bytes verified
+    METRIC_ERASE_NS,            // time erasing
+    METRIC_PROGRAM_NS,          // time programming, waits included
+    METRIC_WAIT_NS,             // time polling for a write to complete
+    METRIC_IO_NS,               // time reading the image and writing the output
+    METRIC_VERIFY_NS,           // time verifying, its read back included
+    METRIC_READ_NS,             // time reading the flash
+    METRIC_COUNT
+};
+
+/*
+*   One thread's counters, registered with the process totals while the thread lives
+*/
+class metrics_slot{
+
+    public:
+
+        metrics_slot();
+        ~metrics_slot();
+
+        /*  Adds to a counter, only ever written by the owning thread.
+        *   @param metric : the counter to add to
+        *   @param amount : the amount to add
+        */
+        void add(qspi_metric metric, uint64_t amount){
+            std::atomic<uint64_t>& value = this->values[metric];
+            value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+        }
+        uint64_t get(qspi_metric metric) const;
+
+    private:
+
+        std::atomic<uint64_t> values[METRIC_COUNT];     // read by the collecting thread
+};
+
+extern thread_local metrics_slot metrics_local;
+
+/*  Counts an event on the calling thread.
+*   @param metric : the counter to add to
+*   @param amount : the amount to add
+*/
+inline void count_metric(qspi_metric metric, uint64_t amount = 1){
+    metrics_local.add(metric, amount);
+}
+
+/*
+*   The counters of every thread summed at one point in time
+*/
+struct qspi_metrics{
+    uint64_t values[METRIC_COUNT];  // indexed by qspi_metric
+    double seconds;                 // time since the process started counting
+};
+
+/*
+*   Adds the time from construction to destruction to a phase of the calling thread
+*/
+class metrics_timer{
+
+    public:
+
+        metrics_timer(qspi_metric phase);
+        ~metrics_timer();
+
+    private:
+
+        qspi_metric phase;      // the METRIC_*_NS counter to add to
+        std::chrono::steady_clock::time_point start;    // when the phase started
+};
+
+const char* metric_name(qspi_metric metric);
+qspi_metrics collect_metrics();
+std::string metrics_json(const qspi_metrics& metrics);
+void write_prometheus(const std::string& path, const qspi_metrics& metrics);
+
+#endif
@@ -0,0 +1,209 @@
+/*
+*   qspi_replay.cpp
+*   @Author Sophie Kirkham STFC, 2018
+*   Main application entry point for the qspi_replay .elf executable
+*   Replays register traces recorded with qspi_driver --trace into the QSPI ..
+*   simulator, issuing every access in the recorded order. Reports the ..
+*   accesses per register, the recorded and simulated time, and any read ..
+*   that returned a different value in the model than on the board, where ..
+*   the replay diverged from the run.
+*   Given two traces, e.g. the same operation recorded by two driver ..
+*   versions, prints how many register accesses and how much simulated ..
+*   time the second saves over the first.
+*/
+
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <map>
+#include <boost/program_options.hpp>
+#include "mmio_trace.h"
+#include "qspi_simulator.h"
+#include "qspi_flash_defines.h"
+
+namespace po = boost::program_options;
+
+/*
+*   The totals of one replayed trace.
+*/
+struct replay_result{
+    std::string file;                   // the trace file
+    unsigned long long reads;           // register reads replayed
+    unsigned long long writes;          // register writes replayed
+    unsigned long long mismatches;      // reads returning a different value in the model
+    long long first_mismatch;           // index of the first mismatched read, -1 if none
+    uint64_t recorded_ns;               // time from the first to the last access as recorded
+    uint64_t simulated_ns;              // time the model took over the accesses
+    unsigned long status_polls;         // controller status register reads
+    unsigned long spi_bytes;            // bytes shifted on the SPI bus
+    std::map<std::pair<uint32_t, uint32_t>, std::pair<unsigned long long, unsigned long long> > registers;
+                                        // (reads, writes) of each (base, offset)
+};
+
+/*
+*   @returns the name of a register of the controller or multiplexer, its address otherwise.
+*/
+std::string register_name(uint32_t base, uint32_t offset){
+
+    if(base == QSPI_BASE){
+        switch(offset){
+            case QSPI_CONFIG_R: return "QSPI CR";
+            case QSPI_STATUS_R: return "QSPI SR";
+            case QSPI_DTR: return "QSPI DTR";
+            case QSPI_DRR: return "QSPI DRR";
+            case QSPI_SSR: return "QSPI SSR";
+            case QSPI_TX_OCCUPANCY: return "QSPI TX OCCUPANCY";
+        }
+    }
+    if(base == MUX_BASE && offset == MUX_OFFSET){
+        return "MUX SELECT";
+    }
+    std::ostringstream address;
+    address << "0x" << std::hex << base << "+0x" << offset;
+    return address.str();
+}
+
+/*
+*   Replays one trace into a new simulator.
+*   @param file : the trace file
+*   @param timing : the timing of the model, as name=ns pairs
+*   @param flash_files : the prefix of the files backing the flash chips, empty to hold them in memory
+*   @throws mem_exception : if the trace fails to read or the model to set up
+*   @returns the totals of the replay.
+*/
+replay_result replay(const std::string& file, const std::string& timing, const std::string& flash_files){
+
+    std::vector<trace_record> records = read_trace(file);
+    qspi_simulator simulator(SIM_FLASH_SIZE, SIM_FIFO_DEPTH);
+    simulator.timing.parse(timing);
+    if(!flash_files.empty()){
+        simulator.back_with_files(flash_files);
+    }
+
+    replay_result result;
+    result.file = file;
+    result.reads = 0;
+    result.writes = 0;
+    result.mismatches = 0;
+    result.first_mismatch = -1;
+    result.recorded_ns = records.empty() ? 0 : records.back().time_ns - records.front().time_ns;
+
+    for(unsigned long i = 0; i < records.size(); i++){
+        const trace_record& entry = records[i];
+        std::pair<unsigned long long, unsigned long long>& counts = result.registers[std::make_pair(entry.base, entry.offset)];
+        if(entry.direction == TRACE_WRITE){
+            simulator.write(entry.base, entry.offset, entry.value, entry.width);
+            result.writes++;
+            counts.second++;
+            continue;
+        }
+        unsigned long value = simulator.read(entry.base, entry.offset, entry.width);
+        unsigned long mask = (entry.width >= 32) ? 0xFFFFFFFFUL : ((1UL << entry.width) - 1);
+        if((value & mask) != (entry.value & mask)){
+            if(result.first_mismatch < 0){
+                result.first_mismatch = i;
+            }
+            result.mismatches++;
+        }
+        result.reads++;
+        counts.first++;
+    }
+    result.simulated_ns = simulator.now();
+    result.status_polls = simulator.status_polls;
+    result.spi_bytes = simulator.spi_bytes;
+    return result;
+}
+
+/*
+*   Prints the totals and per register accesses of a replay.
+*/
+void print_result(const replay_result& result){
+
+    std::cout << result.file << " : " << result.reads + result.writes << " register accesses, "
+    << result.reads << " reads, " << result.writes << " writes, " << result.status_polls << " status polls, "
+    << result.spi_bytes << " bytes on the bus" << std::endl;
+    std::cout << "  Recorded time : " << result.recorded_ns / 1e6 << " ms, simulated time : "
+    << result.simulated_ns / 1e6 << " ms" << std::endl;
+    std::map<std::pair<uint32_t, uint32_t>, std::pair<unsigned long long, unsigned long long> >::const_iterator reg;
+    for(reg = result.registers.begin(); reg != result.registers.end(); reg++){
+        std::cout << "  " << std::left << std::setw(12) << register_name(reg->first.first, reg->first.second)
+        << std::right << std::setw(12) << reg->second.first << " reads" << std::setw(12) << reg->second.second
+        << " writes" << std::endl;
+    }
+    if(result.mismatches > 0){
+        std::cout << "  " << result.mismatches << " reads differed in the model, the first at access "
+        << result.first_mismatch << std::endl;
+    }
+}
+
+/*
+*   Prints what the second replay saves over the first.
+*/
+void print_comparison(const replay_result& before, const replay_result& after){
+
+    long long accesses = (long long)(before.reads + before.writes) - (long long)(after.reads + after.writes);
+    double time_saved = ((double)before.simulated_ns - (double)after.simulated_ns) / 1e6;
+    std::cout << after.file << " against " << before.file << " : " << accesses << " register accesses removed";
+    if(before.reads + before.writes > 0){
+        std::cout << " (" << std::fixed << std::setprecision(1)
+        << 100.0 * accesses / (before.reads + before.writes) << "%)";
+    }
+    std::cout << ", " << std::setprecision(3) << time_saved << " ms of simulated time saved" << std::endl;
+}
+
+/*
+*   Main entry point for qspi_replay
+*   @param argc : number of command line arguments provided
+*   @param argv : array of command line arguments
+*   @returns 0 on success, 1 on error, 2 if a replay diverged from its recording.
+*/
+int main(int argc, char* argv[]){
+
+    po::options_description options("Options");
+    po::positional_options_description positional;
+    po::variables_map vm;
+    try{
+        options.add_options()
+            ("help,h", "Prints the help menu")
+            ("trace", po::value<std::vector<std::string> >()->required(),
+                "Trace files recorded with qspi_driver --trace, the second is compared against the first.")
+            ("simulate", po::value<std::string>()->default_value(""),
+                "Back flash chip n of the model with the file <arg>n.bin, e.g. a copy of the flash the trace was recorded on.")
+            ("sim-timing", po::value<std::string>()->default_value(""),
+                "Timing of the model as name=ns pairs, see qspi_driver --help.");
+        positional.add("trace", 2);
+        po::store(po::command_line_parser(argc, argv).options(options).positional(positional).run(), vm);
+        if(vm.count("help")){
+            std::cout << "Usage: qspi_replay [options] trace [trace]" << std::endl;
+            std::cout << options << std::endl;
+            return 1;
+        }
+        po::notify(vm);
+    }
+    catch(const po::error &ex){
+        std::cerr << ex.what() << std::endl;
+        return 1;
+    }
+
+    std::vector<std::string> traces = vm["trace"].as<std::vector<std::string> >();
+    std::vector<replay_result> results;
+    try{
+        for(unsigned i = 0; i < traces.size(); i++){
+            results.push_back(replay(traces[i], vm["sim-timing"].as<std::string>(), vm["simulate"].as<std::string>()));
+            print_result(results.back());
+        }
+    }
+    catch(mem_exception& err){
+        std::cerr << "An error occured during the replay : " << err.what() << std::endl;
+        return 1;
+    }
+    if(results.size() == 2){
+        print_comparison(results[0], results[1]);
+    }
+    for(unsigned i = 0; i < results.size(); i++){
+        if(results[i].mismatches > 0){
+            return 2;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,580 @@
+/*
+*   qspi_simulator.cpp
+*   @Author Sophie Kirkham STFC, 2018
+*   Implementation of the qspi_simulator and s25fl_model classes
+*   Models the AXI Quad SPI register interface, the FEM-II multiplexer and ..
+*   four Spansion S25FL flash memory devices for host-side development.
+*/
+
+#include <string.h>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sstream>
+
+#include "qspi_simulator.h"
+#include "qspi_flash_defines.h"
+
+#define SIM_CR_SPE 0x002        // Control reg SPI system enable bit
+#define SIM_CR_MASTER 0x004     // Control reg master mode bit
+#define SIM_CR_TX_RESET 0x020   // Control reg TX FIFO reset bit
+#define SIM_CR_RX_RESET 0x040   // Control reg RX FIFO reset bit
+#define SIM_CR_INHIBIT 0x100    // Control reg master transaction inhibit bit
+#define SIM_SR_RX_EMPTY 0x01    // Status reg RX FIFO empty bit
+#define SIM_SR_RX_FULL 0x02     // Status reg RX FIFO full bit
+#define SIM_SR_TX_EMPTY 0x04    // Status reg TX FIFO empty bit
+#define SIM_SR_TX_FULL 0x08     // Status reg TX FIFO full bit
+#define SIM_RX_OCCUPANCY 0x78   // Offset of the RX FIFO occupancy register
+#define SIM_SECTOR_SIZE 0x40000 // Uniform 256KB sector size of the S25FL512S
+
+/*
+*   Sets timing parameters from a comma separated list of name=ns pairs
+*   Names are sck, mmio, tpp, tse, tbe and tw, e.g. "sck=10,tbe=2000000000".
+*   @param settings : the parameters to set, the rest are left as they are
+*   @throws mem_exception : if a name is unknown or a value is not a number
+*/
+void sim_timing::parse(const std::string& settings){
+
+    std::istringstream list(settings);
+    std::string setting;
+    while(std::getline(list, setting, ',')){
+        if(setting.empty()){
+            continue;
+        }
+        size_t equals = setting.find('=');
+        std::string name = setting.substr(0, equals);
+        char* end = NULL;
+        const char* value = (equals == std::string::npos) ? "" : setting.c_str() + equals + 1;
+        uint64_t ns = strtoull(value, &end, 0);
+        if(*value == '\0' || *end != '\0'){
+            throw mem_exception("Invalid Simulator Timing " + setting, QSPI_ERROR_INVALID_ARGUMENT);
+        }
+        if(name == "sck"){ this->sck_period = ns; }
+        else if(name == "mmio"){ this->mmio_access = ns; }
+        else if(name == "tpp"){ this->t_pp = ns; }
+        else if(name == "tse"){ this->t_se = ns; }
+        else if(name == "tbe"){ this->t_be = ns; }
+        else if(name == "tw"){ this->t_w = ns; }
+        else{
+            throw mem_exception("Unknown Simulator Timing " + name, QSPI_ERROR_INVALID_ARGUMENT);
+        }
+    }
+}
+
+/*
+*   Constructor for s25fl_model objects, the array starts fully erased.
+*   @param size : the size of the flash memory array in bytes.
+*/
+s25fl_model::s25fl_model(unsigned long size) :
+    size(size),
+    config(0x00),
+    timing(NULL),
+    owns_array(true),
+    status_reg(0x00),
+    busy_until(0)
+{
+    this->array = new uint8_t[size];
+    memset(this->array, 0xFF, size);
+    this->build_sfdp();
+}
+
+/*
+*   Destructor for s25fl_model objects, releases or un-maps the array.
+*/
+s25fl_model::~s25fl_model(){
+
+    if(this->owns_array){
+        delete[] this->array;
+    }
+    else{
+        munmap(this->array, this->size);
+    }
+}
+
+/*
+*   Backs the flash memory array with a file so contents persist between runs
+*   The file is created and filled with 0xFF if it does not exist.
+*   @param filename : the file to back the array with.
+*   @throws mem_exception : if the file fails to open, size or map.
+*/
+void s25fl_model::back_with_file(const std::string& filename){
+
+    int fd = open(filename.c_str(), O_RDWR | O_CREAT, 0644);
+    if(fd == -1){
+        throw mem_exception("Simulator failed to open flash backing file.");
+    }
+    struct stat info;
+    fstat(fd, &info);
+    bool fresh = ((unsigned long)info.st_size != this->size);
+    if(fresh && ftruncate(fd, this->size) == -1){
+        close(fd);
+        throw mem_exception("Simulator failed to size flash backing file.");
+    }
+    void* mapped = mmap(0, this->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(mapped == MAP_FAILED){
+        throw mem_exception("Simulator failed to map flash backing file.");
+    }
+    if(this->owns_array){
+        delete[] this->array;
+    }
+    this->array = (uint8_t*)mapped;
+    this->owns_array = false;
+    if(fresh){
+        memset(this->array, 0xFF, this->size);
+    }
+}
+
+/*
+*   Builds a JESD216B SFDP table describing the modelled device.
+*   One basic flash parameter table of 16 DWORDs follows the headers.
+*/
+void s25fl_model::build_sfdp(){
+
+    uint32_t bfpt[16];
+    memset(bfpt, 0xFF, sizeof(bfpt));
+    // 4KB erase unsupported, 3 or 4 byte addressing, 1-1-4 and 1-4-4 reads
+    bfpt[0] = 0xFF800000 | (0x1 << 22) | (0x1 << 21) | (0x1 << 17) | (0xFF << 8) | 0x07;
+    // density in bits - 1
+    bfpt[1] = (uint32_t)((unsigned long long)this->size * 8 - 1);
+    // 1-4-4 (0xEB, 2 mode + 4 dummy) and 1-1-4 (0x6B, 8 dummy) fast reads
+    bfpt[2] = (0x6B << 24) | (0 << 21) | (8 << 16) | (0xEB << 8) | (2 << 5) | 4;
+    // 1-2-2 and 1-1-2 fast reads (unused by the driver)
+    bfpt[3] = (0x3B << 24) | (8 << 16) | (0xBB << 8) | (4 << 5);
+    bfpt[4] = 0xFFFFFFEE;   // no 2-2-2 or 4-4-4 reads
+    bfpt[5] = 0x0000FFFF;
+    bfpt[6] = 0x0000FFFF;
+    // erase type 1 : 256KB with 0xD8, no further erase types
+    bfpt[7] = (0xD8 << 8) | 18;
+    bfpt[8] = 0x00000000;
+    // erase type 1 typical time 4 x 128ms
+    bfpt[9] = (0x2 << 9) | (3 << 4) | 0x1;
+    // page size 512, page program typical 6 x 64us, chip erase 26 x 4s
+    bfpt[10] = (0x2 << 29) | (25 << 24) | (0x1 << 13) | (5 << 8) | (9 << 4) | 0x1;
+    for(int i = 11; i < 16; i++){
+        bfpt[i] = 0x00000000;
+    }
+
+    this->sfdp.assign(0x80 + sizeof(bfpt), 0xFF);
+    // SFDP header : signature, revision 1.6, one parameter header
+    const uint8_t header[16] = {'S', 'F', 'D', 'P', 0x06, 0x01, 0x00, 0xFF,
+                                0x00, 0x06, 0x01, 16, 0x80, 0x00, 0x00, 0xFF};
+    memcpy(&this->sfdp[0], header, sizeof(header));
+    for(int i = 0; i < 16; i++){
+        for(int b = 0; b < 4; b++){
+            this->sfdp[0x80 + i * 4 + b] = (bfpt[i] >> (8 * b)) & 0xFF;
+        }
+    }
+}
+
+/*
+*   Starts a new command, called when chip select is asserted.
+*/
+void s25fl_model::select(){
+    this->command.clear();
+}
+
+/*
+*   Returns the status register including the write in progress bit.
+*   @param now : the current simulated time.
+*/
+uint8_t s25fl_model::status(uint64_t now){
+    return this->status_reg | (this->busy(now) ? 0x01 : 0x00);
+}
+
+/*
+*   Checks whether a program, erase or register write is still running.
+*   @param now : the current simulated time.
+*/
+bool s25fl_model::busy(uint64_t now){
+    return now < this->busy_until;
+}
+
+/*
+*   Assembles a big endian address from the command bytes received so far.
+*   @param first : index of the first address byte
+*   @param width : number of address bytes
+*/
+uint32_t s25fl_model::command_address(unsigned first, unsigned width){
+
+    uint32_t address = 0;
+    for(unsigned i = 0; i < width; i++){
+        address = (address << 8) | this->command[first + i];
+    }
+    return address;
+}
+
+/*
+*   Exchanges one byte with the device while chip select is held.
+*   @param mosi : the byte shifted into the device
+*   @param now : the current simulated time
+*   @param cycles : set to the number of SCK cycles the byte occupied
+*   @returns the byte shifted out of the device
+*/
+uint8_t s25fl_model::transfer(uint8_t mosi, uint64_t now, unsigned& cycles){
+
+    this->command.push_back(mosi);
+    unsigned index = this->command.size() - 1;
+    uint8_t opcode = this->command[0];
+    cycles = 8;
+
+    switch(opcode){
+        case FL_READ_STATUS:
+            // the status register streams for as long as chip select is held
+            return (index >= 1) ? this->status(now) : 0xFF;
+        case FL_READ_CONFIG:
+            return (index >= 1) ? this->config : 0xFF;
+        case FL_READ_ID:
+            if(index == 4){ return 0x01; }
+            if(index == 5){ return 0x19; }
+            return 0xFF;
+        case 0x9F: {
+            const uint8_t id[6] = {0x01, 0x02, 0x20, 0x4D, 0x00, 0x80};
+            return (index >= 1 && index <= 6) ? id[index - 1] : 0xFF;
+        }
+        case 0x5A:
+            // three address bytes and eight dummy cycles precede the table
+            if(index >= 5){
+                uint32_t offset = this->command_address(1, 3) + (index - 5);
+                return (offset < this->sfdp.size()) ? this->sfdp[offset] : 0xFF;
+            }
+            return 0xFF;
+        case FL_READ_QUAD_OUT:
+            if(index >= PREAMBLE_SIZE && !this->busy(now)){
+                // data bytes are clocked out on four lanes
+                cycles = 2;
+                uint32_t address = this->command_address(1, 4);
+                return this->array[(address + index - PREAMBLE_SIZE) % this->size];
+            }
+            return 0xFF;
+        case FL_QUAD_PP:
+            if(index >= 5){
+                cycles = 2;
+            }
+            return 0xFF;
+        default:
+            return 0xFF;
+    }
+}
+
+/*
+*   Commits the command shifted in, called when chip select is released.
+*   Program, erase and register writes require the write enable latch ..
+*   and set the device busy for the modelled typical time.
+*   @param now : the current simulated time.
+*/
+void s25fl_model::deselect(uint64_t now){
+
+    if(this->command.empty()){
+        return;
+    }
+    uint8_t opcode = this->command[0];
+    bool write_enabled = (this->status_reg & 0x02) != 0;
+
+    // only status and config reads are accepted while busy
+    if(this->busy(now)){
+        return;
+    }
+    switch(opcode){
+        case FL_WRITE_ENABLE:
+            this->status_reg |= 0x02;
+            break;
+        case 0x04:
+            this->status_reg &= ~0x02;
+            break;
+        case 0x30:
+            this->status_reg &= ~0x60;
+            break;
+        case FL_WRITE_REG:
+            if(write_enabled && this->command.size() >= 2){
+                this->status_reg = (this->status_reg & 0x02) | (this->command[1] & 0x9C);
+                if(this->command.size() >= 3){
+                    this->config = this->command[2];
+                }
+                this->busy_until = now + this->timing->t_w;
+                this->status_reg &= ~0x02;
+            }
+            break;
+        case FL_QUAD_PP:
+            if(write_enabled && this->command.size() > 5){
+                uint32_t address = this->command_address(1, 4) % this->size;
+                uint32_t page = address & ~(uint32_t)(PAGE_SIZE - 1);
+                uint32_t offset = address & (PAGE_SIZE - 1);
+                // data wraps within the page, programming can only clear bits
+                for(unsigned i = 5; i < this->command.size(); i++){
+                    this->array[page + offset] &= this->command[i];
+                    offset = (offset + 1) & (PAGE_SIZE - 1);
+                }
+                this->busy_until = now + this->timing->t_pp;
+                this->status_reg &= ~0x02;
+            }
+            break;
+        case 0xDC:
+        case 0xD8:
+            if(write_enabled && this->command.size() >= 4){
+                unsigned width = (opcode == 0xDC) ? 4 : 3;
+                if(this->command.size() >= 1 + width){
+                    uint32_t address = this->command_address(1, width) % this->size;
+                    uint32_t sector = address & ~(uint32_t)(SIM_SECTOR_SIZE - 1);
+                    memset(this->array + sector, 0xFF, SIM_SECTOR_SIZE);
+                    this->busy_until = now + this->timing->t_se;
+                    this->status_reg &= ~0x02;
+                }
+            }
+            break;
+        case FL_BULK_ERASE:
+        case 0xC7:
+            if(write_enabled){
+                memset(this->array, 0xFF, this->size);
+                this->busy_until = now + this->timing->t_be;
+                this->status_reg &= ~0x02;
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+/*
+*   Constructor for qspi_simulator objects.
+*   @param flash_size : the size of each simulated flash device in bytes
+*   @param fifo_depth : the depth of the simulated TX and RX FIFOs
+*/
+qspi_simulator::qspi_simulator(unsigned long flash_size, unsigned fifo_depth) :
+    fifo_depth(fifo_depth),
+    mmio_reads(0),
+    mmio_writes(0),
+    status_polls(0),
+    spi_bytes(0),
+    control(0x180),
+    slave_select(0x01),
+    mux_select(MUX_DESET),
+    sim_time(0),
+    next_shift(0)
+{
+    for(int i = 0; i < 4; i++){
+        s25fl_model* chip = new s25fl_model(flash_size);
+        chip->timing = &this->timing;
+        this->chips.push_back(chip);
+    }
+}
+
+/*
+*   Destructor for qspi_simulator objects.
+*/
+qspi_simulator::~qspi_simulator(){
+    for(unsigned i = 0; i < this->chips.size(); i++){
+        delete this->chips[i];
+    }
+}
+
+/*
+*   @returns the name of the bus for messages.
+*/
+std::string qspi_simulator::name() const{
+    return "QSPI simulator";
+}
+
+/*
+*   Backs the four flash devices with files <prefix>1.bin to <prefix>4.bin.
+*   @param prefix : the path the flash numbers and BIN_EXT are appended to
+*   @throws mem_exception : if a file fails to open, size or map.
+*/
+void qspi_simulator::back_with_files(const std::string& prefix){
+
+    for(unsigned i = 0; i < this->chips.size(); i++){
+        std::ostringstream filename;
+        filename << prefix << (i + 1) << BIN_EXT;
+        this->chips[i]->back_with_file(filename.str());
+    }
+}
+
+/*
+*   Gets the simulated flash device for a flash number.
+*   @param flash_num : the flash number (1-4)
+*/
+s25fl_model* qspi_simulator::flash(int flash_num){
+    return this->chips.at(flash_num - 1);
+}
+
+/*
+*   @returns the current simulated time in nanoseconds.
+*/
+uint64_t qspi_simulator::now(){
+    return this->sim_time;
+}
+
+/*
+*   @returns the flash device currently routed by the multiplexer, or NULL.
+*/
+s25fl_model* qspi_simulator::selected_chip(){
+
+    if(this->mux_select >= MUX_SET_FL1 && this->mux_select <= MUX_SET_FL4){
+        return this->chips[this->mux_select - MUX_SET_FL1];
+    }
+    return NULL;
+}
+
+/*
+*   @returns true when the controller is clocking data out of the TX FIFO.
+*/
+bool qspi_simulator::transferring(){
+
+    return (this->control & SIM_CR_SPE) && (this->control & SIM_CR_MASTER) &&
+        !(this->control & SIM_CR_INHIBIT) && ((this->slave_select & 0x01) == 0);
+}
+
+/*
+*   Shifts TX FIFO bytes out to the selected flash device up to the ..
+*   current simulated time, pushing the responses into the RX FIFO.
+*/
+void qspi_simulator::advance(){
+
+    if(!this->transferring()){
+        return;
+    }
+    if(this->next_shift < this->sim_time && this->tx_fifo.empty()){
+        this->next_shift = this->sim_time;
+    }
+    while(!this->tx_fifo.empty() && this->next_shift <= this->sim_time){
+        uint8_t mosi = this->tx_fifo.front();
+        this->tx_fifo.pop_front();
+        uint8_t miso = 0xFF;
+        unsigned cycles = 8;
+        s25fl_model* chip = this->selected_chip();
+        if(chip != NULL){
+            miso = chip->transfer(mosi, this->next_shift, cycles);
+        }
+        if(this->rx_fifo.size() < this->fifo_depth){
+            this->rx_fifo.push_back(miso);
+        }
+        this->next_shift += cycles * this->timing.sck_period;
+        this->spi_bytes++;
+    }
+}
+
+/*
+*   Shifts every byte left in the TX FIFO of an active transaction.
+*   @returns the simulated time the last byte finished shifting.
+*/
+uint64_t qspi_simulator::drain(){
+
+    if(this->transferring() && !this->tx_fifo.empty()){
+        uint64_t start = this->sim_time;
+        this->sim_time = this->next_shift + this->tx_fifo.size() * 8 * this->timing.sck_period;
+        this->advance();
+        uint64_t finish = this->next_shift;
+        this->sim_time = start;
+        return finish;
+    }
+    return this->sim_time;
+}
+
+/*
+*   Reads a simulated register, advancing simulated time by one access.
+*   @param base : the base address of the device being accessed
+*   @param offset : the register offset
+*   @param width : the data width, every register is modelled as 32 bits
+*   @returns the register value
+*/
+unsigned long qspi_simulator::read(uint32_t base, uint32_t offset, uint8_t){
+
+    this->sim_time += this->timing.mmio_access;
+    this->mmio_reads++;
+    this->advance();
+
+    if(base == MUX_BASE){
+        return (offset == MUX_OFFSET) ? this->mux_select : 0;
+    }
+    switch(offset){
+        case QSPI_CONFIG_R:
+            return this->control;
+        case QSPI_STATUS_R: {
+            this->status_polls++;
+            unsigned long status = 0;
+            status |= this->rx_fifo.empty() ? SIM_SR_RX_EMPTY : 0;
+            status |= (this->rx_fifo.size() >= this->fifo_depth) ? SIM_SR_RX_FULL : 0;
+            status |= this->tx_fifo.empty() ? SIM_SR_TX_EMPTY : 0;
+            status |= (this->tx_fifo.size() >= this->fifo_depth) ? SIM_SR_TX_FULL : 0;
+            return status;
+        }
+        case QSPI_DRR: {
+            if(this->rx_fifo.empty()){
+                return 0;
+            }
+            uint8_t value = this->rx_fifo.front();
+            this->rx_fifo.pop_front();
+            return value;
+        }
+        case QSPI_SSR:
+            return this->slave_select;
+        case QSPI_TX_OCCUPANCY:
+            return this->tx_fifo.empty() ? 0 : this->tx_fifo.size() - 1;
+        case SIM_RX_OCCUPANCY:
+            return this->rx_fifo.empty() ? 0 : this->rx_fifo.size() - 1;
+        default:
+            return 0;
+    }
+}
+
+/*
+*   Writes a simulated register, advancing simulated time by one access.
+*   @param base : the base address of the device being accessed
+*   @param offset : the register offset
+*   @param value : the value to write
+*   @param width : the data width, every register is modelled as 32 bits
+*/
+void qspi_simulator::write(uint32_t base, uint32_t offset, unsigned long value, uint8_t){
+
+    this->sim_time += this->timing.mmio_access;
+    this->mmio_writes++;
+    this->advance();
+
+    if(base == MUX_BASE){
+        if(offset == MUX_OFFSET){
+            this->mux_select = value;
+        }
+        return;
+    }
+    switch(offset){
+        case QSPI_CONFIG_R:
+            if(value & SIM_CR_TX_RESET){
+                this->tx_fifo.clear();
+            }
+            if(value & SIM_CR_RX_RESET){
+                this->rx_fifo.clear();
+            }
+            this->control = value & ~(SIM_CR_TX_RESET | SIM_CR_RX_RESET);
+            this->next_shift = this->sim_time;
+            break;
+        case QSPI_DTR:
+            // writes to a full FIFO are dropped as on the hardware
+            if(this->tx_fifo.size() < this->fifo_depth){
+                this->tx_fifo.push_back(value & 0xFF);
+            }
+            break;
+        case QSPI_SSR: {
+            bool was_selected = (this->slave_select & 0x01) == 0;
+            bool selected = (value & 0x01) == 0;
+            s25fl_model* chip = this->selected_chip();
+            if(!was_selected && selected && chip != NULL){
+                chip->select();
+            }
+            if(was_selected && !selected){
+                // the modelled core finishes the bytes already queued for ..
+                // the transaction before chip select is released
+                this->sim_time = std::max(this->sim_time, this->drain());
+                if(chip != NULL){
+                    chip->deselect(this->sim_time);
+                }
+            }
+            this->slave_select = value;
+            break;
+        }
+        default:
+            break;
+    }
+    this->advance();
+}
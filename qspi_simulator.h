@@ -0,0 +1,130 @@
+/*
+*   qspi_simulator.h
+*   @Author Sophie Kirkham STFC, 2018
+*   Header file for the qspi_simulator and s25fl_model classes
+*   Cycle-approximate host-side model of the AXI Quad SPI controller, the ..
+*   FEM-II flash multiplexer and four Spansion S25FL flash memory devices.
+*   Set as the register bus, the driver runs against the model on any ..
+*   Linux box. Time in the model is simulated, each register access ..
+*   advancing it, so throughput is measured in simulated time with now().
+*/
+
+#ifndef QSPI_SIMULATOR_H_
+#define QSPI_SIMULATOR_H_
+
+#include <stdint.h>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "mem_exception.h"
+#include "register_bus.h"
+
+#define SIM_FLASH_SIZE 0x4000000    // Size of each simulated flash device, 64MB
+#define SIM_FIFO_DEPTH 256          // Depth of the modelled controller's FIFOs, as built for the FEM-II
+
+/*
+*   Timing parameters for the simulated controller and flash devices.
+*   All values are in nanoseconds of simulated time.
+*/
+struct sim_timing{
+
+    uint64_t sck_period;    // period of one QSPI clock cycle
+    uint64_t mmio_access;   // cost of one AXI register access from the CPU
+    uint64_t t_pp;          // typical page program time
+    uint64_t t_se;          // typical sector erase time
+    uint64_t t_be;          // typical bulk erase time
+    uint64_t t_w;           // typical write registers time
+
+    sim_timing() :
+        sck_period(20),
+        mmio_access(150),
+        t_pp(340000),
+        t_se(520000000ULL),
+        t_be(103000000000ULL),
+        t_w(140000000ULL)
+    {};
+
+    void parse(const std::string& settings);
+};
+
+/*
+*   Model of a single Spansion S25FL flash memory device.
+*   Bytes are exchanged one at a time while chip select is held, the ..
+*   command is committed when chip select is released.
+*/
+class s25fl_model{
+
+    public:
+
+        s25fl_model(unsigned long size);
+        ~s25fl_model();
+
+        void back_with_file(const std::string& filename);
+        void select();
+        uint8_t transfer(uint8_t mosi, uint64_t now, unsigned& cycles);
+        void deselect(uint64_t now);
+        bool busy(uint64_t now);
+        uint8_t status(uint64_t now);
+
+        uint8_t* array;             // the flash memory array
+        unsigned long size;         // size of the flash memory array in bytes
+        uint8_t config;             // the config register
+        sim_timing* timing;         // timing parameters shared with the controller
+
+    private:
+
+        bool owns_array;            // true when array was allocated (not mapped)
+        uint8_t status_reg;         // the status register (excluding WIP)
+        uint64_t busy_until;        // simulated time the current operation ends
+        std::vector<uint8_t> command;   // command bytes shifted in this select
+        std::vector<uint8_t> sfdp;  // serial flash discoverable parameters table
+
+        uint32_t command_address(unsigned first, unsigned width);
+        void build_sfdp();
+};
+
+/*
+*   Model of the AXI Quad SPI controller registers and the multiplexer.
+*   Register accesses advance simulated time, the TX FIFO is shifted out ..
+*   at the modelled SCK rate while a master transaction is enabled.
+*/
+class qspi_simulator : public register_bus{
+
+    public:
+
+        qspi_simulator(unsigned long flash_size, unsigned fifo_depth);
+        ~qspi_simulator();
+
+        std::string name() const;
+        unsigned long read(uint32_t base, uint32_t offset, uint8_t width);
+        void write(uint32_t base, uint32_t offset, unsigned long value, uint8_t width);
+        void back_with_files(const std::string& prefix);
+        s25fl_model* flash(int flash_num);
+        uint64_t now();
+
+        sim_timing timing;          // timing parameters for the model
+        unsigned fifo_depth;        // depth of both TX and RX FIFOs
+        unsigned long mmio_reads;   // number of register reads
+        unsigned long mmio_writes;  // number of register writes
+        unsigned long status_polls; // number of controller status reads
+        unsigned long spi_bytes;    // number of bytes shifted on the bus
+
+    private:
+
+        std::vector<s25fl_model*> chips;    // the four flash devices
+        std::deque<uint8_t> tx_fifo;        // the controller transmit FIFO
+        std::deque<uint8_t> rx_fifo;        // the controller receive FIFO
+        uint32_t control;           // the controller control register
+        uint32_t slave_select;      // the controller slave select register
+        uint32_t mux_select;        // the multiplexer select register
+        uint64_t sim_time;          // current simulated time
+        uint64_t next_shift;        // time the next TX byte finishes shifting
+
+        s25fl_model* selected_chip();
+        bool transferring();
+        void advance();
+        uint64_t drain();
+};
+
+#endif
@@ -0,0 +1,187 @@
+/*
+*   realtime.cpp
+*   @Author Sophie Kirkham STFC, 2018
+*   Implementation of enter_realtime and the latency_recorder class
+*/
+
+#include <errno.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <algorithm>
+#include <iostream>
+#include <atomic>
+
+#include "realtime.h"
+
+// the cores the process ran on before real-time mode, for helper threads
+static cpu_set_t background_cpus;
+static std::atomic<bool> background_saved(false);
+
+/*
+*   Faults in the stack below the caller, so deeper calls never fault.
+*/
+static void prefault_stack(){
+
+    uint8_t stack[RT_PREFAULT_STACK];
+    for(unsigned long i = 0; i < RT_PREFAULT_STACK; i += 4096){
+        stack[i] = 0;
+    }
+    // the stores are seen by the barrier, so the compiler keeps them
+    __asm__ __volatile__("" : : "r"(stack) : "memory");
+}
+
+/*
+*   Checks a priority is within the range SCHED_FIFO accepts.
+*   @param priority : the SCHED_FIFO priority
+*   @throws mem_exception : if the priority is out of range
+*/
+void check_priority(int priority){
+
+    int lowest = sched_get_priority_min(SCHED_FIFO);
+    int highest = sched_get_priority_max(SCHED_FIFO);
+    if(lowest == -1 || highest == -1){
+        throw mem_exception("Failed to Read The SCHED_FIFO Priority Range : " + std::string(strerror(errno)));
+    }
+    if(priority < lowest || priority > highest){
+        throw mem_exception("Invalid SCHED_FIFO Priority " + std::to_string(priority) + ", must be " 
+                        + std::to_string(lowest) + " to " + std::to_string(highest), QSPI_ERROR_INVALID_ARGUMENT);
+    }
+}
+
+/*
+*   Puts a thread into real-time mode
+*   Locks the process's current and future memory, pins the thread to a ..
+*   core and runs it at SCHED_FIFO priority. Call from the thread itself ..
+*   to also fault in its stack. Needs CAP_SYS_NICE and CAP_IPC_LOCK.
+*   @param thread : the thread to run in real-time, e.g. pthread_self()
+*   @param config : the core and priority
+*   @throws mem_exception : if the priority is out of range, the memory ..
+*   fails to lock, the core is not available or the priority fails to set
+*/
+void enter_realtime(pthread_t thread, const realtime_config& config){
+
+    if(config.cpu < 0 || config.cpu >= CPU_SETSIZE){
+        throw mem_exception("Invalid Core Number", QSPI_ERROR_INVALID_ARGUMENT);
+    }
+    // checked before anything changes, so a bad priority leaves the process as it was
+    check_priority(config.priority);
+    if(mlockall(MCL_CURRENT | MCL_FUTURE) == -1){
+        throw mem_exception("Failed to Lock Memory : " + std::string(strerror(errno)));
+    }
+    if(pthread_equal(thread, pthread_self())){
+        prefault_stack();
+    }
+
+    // helper threads created later go back to the cores the thread had
+    if(!background_saved.load(std::memory_order_acquire) &&
+        pthread_getaffinity_np(thread, sizeof(background_cpus), &background_cpus) == 0){
+        background_saved.store(true, std::memory_order_release);
+    }
+
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(config.cpu, &cpus);
+    int result = pthread_setaffinity_np(thread, sizeof(cpus), &cpus);
+    if(result != 0){
+        throw mem_exception("Failed to Pin To Core " + std::to_string(config.cpu) + " : " + strerror(result));
+    }
+
+    struct sched_param param;
+    param.sched_priority = config.priority;
+    result = pthread_setschedparam(thread, SCHED_FIFO, &param);
+    if(result != 0){
+        throw mem_exception("Failed to Set SCHED_FIFO Priority " + std::to_string(config.priority) + " : " + strerror(result));
+    }
+}
+
+/*
+*   Returns the calling thread to normal scheduling on the cores the ..
+*   process had before enter_realtime(), a thread it created inherits ..
+*   the real-time core and SCHED_FIFO priority otherwise. Does nothing ..
+*   if real-time mode was never entered. Best effort, a helper runs ..
+*   either way.
+*/
+void enter_background(){
+
+    if(!background_saved.load(std::memory_order_acquire)){
+        return;
+    }
+    struct sched_param param;
+    param.sched_priority = 0;
+    pthread_setschedparam(pthread_self(), SCHED_OTHER, &param);
+    pthread_setaffinity_np(pthread_self(), sizeof(background_cpus), &background_cpus);
+}
+
+/*
+*   Constructor for latency_recorder objects, faults in the storage.
+*   @param capacity : the number of samples to hold
+*/
+latency_recorder::latency_recorder(unsigned long capacity) :
+    samples(std::max(capacity, 1UL), 0),
+    recorded(0)
+{
+}
+
+/*
+*   Records the latency of one transfer.
+*/
+void latency_recorder::record(std::chrono::steady_clock::duration latency){
+
+    this->samples[this->recorded % this->samples.size()] =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(latency).count();
+    this->recorded++;
+}
+
+/*
+*   Drops every sample recorded.
+*/
+void latency_recorder::clear(){
+    this->recorded = 0;
+}
+
+/*
+*   @returns the number of samples recorded since cleared.
+*/
+unsigned long long latency_recorder::count() const{
+    return this->recorded;
+}
+
+/*
+*   @param fraction : the fraction of samples at or below the result, e.g. 0.99
+*   @returns the latency in ns at the fraction, over the samples held, 0 if none.
+*/
+uint64_t latency_recorder::percentile(double fraction) const{
+
+    unsigned long held = std::min(this->recorded, (unsigned long long)this->samples.size());
+    if(held == 0){
+        return 0;
+    }
+    std::vector<uint64_t> sorted(this->samples.begin(), this->samples.begin() + held);
+    unsigned long rank = std::min((unsigned long)(fraction * held), held - 1);
+    std::nth_element(sorted.begin(), sorted.begin() + rank, sorted.end());
+    return sorted[rank];
+}
+
+/*
+*   @returns the largest latency in ns over the samples held, 0 if none.
+*/
+uint64_t latency_recorder::max() const{
+
+    unsigned long held = std::min(this->recorded, (unsigned long long)this->samples.size());
+    if(held == 0){
+        return 0;
+    }
+    return *std::max_element(this->samples.begin(), this->samples.begin() + held);
+}
+
+/*
+*   Prints the count, p50, p99 and max latencies in us.
+*   @param label : what was timed, e.g. "Page"
+*/
+void latency_recorder::print_summary(const std::string& label) const{
+
+    std::cout << label << " latency over " << count() << " transfers : p50 " 
+    << percentile(0.50) / 1000.0 << " us, p99 " << percentile(0.99) / 1000.0
+    << " us, max " << max() / 1000.0 << " us" << std::endl;
+}
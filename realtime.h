@@ -0,0 +1,65 @@
+/*
+*   realtime.h
+*   @Author Sophie Kirkham STFC, 2018
+*   Header file for real-time execution and the latency_recorder class
+*   The MMIO loops of a read or page program slow down whenever the thread ..
+*   running them is preempted mid-transaction. In real-time mode that ..
+*   thread is pinned to one core at SCHED_FIFO priority, and the process's ..
+*   memory is locked and faulted in so no transfer waits on a page fault. ..
+*   The latency of each page or FIFO transfer is recorded to show the ..
+*   transfer times are deterministic.
+*   Threads inherit the core and priority of the thread creating them, so ..
+*   helper threads (stream readers and writers, compression, progress) ..
+*   call enter_background() first to leave the real-time core to the transfers.
+*/
+
+#ifndef REALTIME_H_
+#define REALTIME_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include <string>
+#include <vector>
+#include <chrono>
+
+#include "mem_exception.h"
+
+#define RT_DEFAULT_CPU 1        // Core the SPI thread is pinned to, leaving core 0 to the rest
+#define RT_DEFAULT_PRIORITY 80  // SCHED_FIFO priority, above the kernel's threaded interrupts
+#define RT_PREFAULT_STACK 524288    // Bytes of stack faulted in on entering real-time mode
+#define LATENCY_SAMPLES 262144  // Samples the latency_recorder holds without allocating
+
+struct realtime_config{
+    int cpu;        // the core to pin the thread to
+    int priority;   // the SCHED_FIFO priority, 1-99 on Linux, see check_priority()
+};
+
+void check_priority(int priority);
+void enter_realtime(pthread_t thread, const realtime_config& config);
+void enter_background();
+
+/*
+*   Records the latency of each page or FIFO transfer
+*   Storage is allocated and faulted in up front, so recording never ..
+*   allocates, past LATENCY_SAMPLES samples the oldest are overwritten.
+*/
+class latency_recorder{
+
+    public:
+
+        latency_recorder(unsigned long capacity = LATENCY_SAMPLES);
+
+        void record(std::chrono::steady_clock::duration latency);
+        void clear();
+        unsigned long long count() const;
+        uint64_t percentile(double fraction) const;
+        uint64_t max() const;
+        void print_summary(const std::string& label) const;
+
+    private:
+
+        std::vector<uint64_t> samples;  // latencies in ns, a ring once full
+        unsigned long long recorded;    // samples recorded since cleared
+};
+
+#endif
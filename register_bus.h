@@ -0,0 +1,43 @@
+/*
+*   register_bus.h
+*   @Author Sophie Kirkham STFC, 2018
+*   Header file for the register_bus interface
+*   The seam between memory_mapped_device and the hardware. With no bus ..
+*   set, register accesses are loads and stores to /dev/mem mappings. A ..
+*   bus set with memory_mapped_device::set_register_bus() takes every ..
+*   /dev/mem register access instead, e.g. a software model of the board.
+*/
+
+#ifndef REGISTER_BUS_H_
+#define REGISTER_BUS_H_
+
+#include <stdint.h>
+#include <string>
+
+class register_bus{
+
+    public:
+
+        virtual ~register_bus(){};
+
+        /*  @returns the name of the bus for messages.
+        */
+        virtual std::string name() const = 0;
+
+        /*  Reads a register.
+        *   @param base : the base address of the device e.g. QSPI_BASE
+        *   @param offset : the offset of the register from base
+        *   @param width : the data width in bits (8, 16, 32)
+        */
+        virtual unsigned long read(uint32_t base, uint32_t offset, uint8_t width) = 0;
+
+        /*  Writes a register.
+        *   @param base : the base address of the device e.g. QSPI_BASE
+        *   @param offset : the offset of the register from base
+        *   @param value : the value to write
+        *   @param width : the data width in bits (8, 16, 32)
+        */
+        virtual void write(uint32_t base, uint32_t offset, unsigned long value, uint8_t width) = 0;
+};
+
+#endif
@@ -0,0 +1,192 @@
+/*
+*   sector_cache.cpp
+*   @Author Sophie Kirkham STFC, 2018
+*   Implementation of the sector_cache class
+*/
+
+#include "sector_cache.h"
+
+/*
+*   Constructor for sector_cache objects.
+*   @param capacity : the most blocks to hold, 0 disables the cache
+*/
+sector_cache::sector_cache(unsigned long capacity) :
+    max_blocks(capacity),
+    hit_count(0),
+    miss_count(0),
+    eviction_count(0)
+{}
+
+/*
+*   @returns the key of a block, the chip in the upper word.
+*/
+uint64_t sector_cache::block_key(int flash_num, uint32_t block_address){
+    return ((uint64_t)flash_num << 32) | block_address;
+}
+
+/*
+*   Looks up a block, marking it most recently used.
+*   @param flash_num : the flash chip
+*   @param block_address : the address of the block, a multiple of CACHE_BLOCK_SIZE
+*   @returns the CACHE_BLOCK_SIZE bytes of the block, NULL on a miss.
+*/
+const uint8_t* sector_cache::find(int flash_num, uint32_t block_address){
+
+    std::unordered_map<uint64_t, std::list<cache_block>::iterator>::iterator found =
+        this->index.find(block_key(flash_num, block_address));
+    if(found == this->index.end()){
+        this->miss_count++;
+        return NULL;
+    }
+    this->hit_count++;
+    // move the block to the front of the list
+    this->blocks.splice(this->blocks.begin(), this->blocks, found->second);
+    return found->second->data.data();
+}
+
+/*
+*   Makes room for a block, evicting the least recently used if full.
+*   The caller fills the block, or invalidates it if the read fails.
+*   @param flash_num : the flash chip
+*   @param block_address : the address of the block, a multiple of CACHE_BLOCK_SIZE
+*   @returns the CACHE_BLOCK_SIZE bytes to fill, NULL if the cache is disabled.
+*/
+uint8_t* sector_cache::insert(int flash_num, uint32_t block_address){
+
+    if(this->max_blocks == 0){
+        return NULL;
+    }
+    uint64_t key = block_key(flash_num, block_address);
+    remove(key);
+    if(this->blocks.size() >= this->max_blocks){
+        // reuse the storage of the least recently used block
+        this->index.erase(this->blocks.back().key);
+        this->blocks.splice(this->blocks.begin(), this->blocks, --this->blocks.end());
+        this->eviction_count++;
+    }
+    else{
+        this->blocks.push_front(cache_block());
+        this->blocks.front().data.resize(CACHE_BLOCK_SIZE);
+    }
+    this->blocks.front().key = key;
+    this->index[key] = this->blocks.begin();
+    return this->blocks.front().data.data();
+}
+
+/*
+*   Drops a block if it is held.
+*/
+void sector_cache::remove(uint64_t key){
+
+    std::unordered_map<uint64_t, std::list<cache_block>::iterator>::iterator found = this->index.find(key);
+    if(found != this->index.end()){
+        this->blocks.erase(found->second);
+        this->index.erase(found);
+    }
+}
+
+/*
+*   Drops every block holding bytes of a range, after a program or erase.
+*   @param flash_num : the flash chip
+*   @param mem_address : the first address changed
+*   @param num_bytes : the number of bytes changed
+*/
+void sector_cache::invalidate(int flash_num, uint32_t mem_address, unsigned long num_bytes){
+
+    if(num_bytes == 0 || this->blocks.empty()){
+        return;
+    }
+    uint64_t first = mem_address - (mem_address % CACHE_BLOCK_SIZE);
+    uint64_t end = (uint64_t)mem_address + num_bytes;
+    if((end - first) / CACHE_BLOCK_SIZE > this->blocks.size()){
+        // the range is bigger than the cache, check each held block instead
+        std::list<cache_block>::iterator block = this->blocks.begin();
+        while(block != this->blocks.end()){
+            uint32_t address = (uint32_t)block->key;
+            if((int)(block->key >> 32) == flash_num && address + CACHE_BLOCK_SIZE > mem_address && address < end){
+                this->index.erase(block->key);
+                block = this->blocks.erase(block);
+            }
+            else{
+                ++block;
+            }
+        }
+        return;
+    }
+    for(uint64_t address = first; address < end; address += CACHE_BLOCK_SIZE){
+        remove(block_key(flash_num, (uint32_t)address));
+    }
+}
+
+/*
+*   Drops every block of a chip, after a bulk erase.
+*   @param flash_num : the flash chip
+*/
+void sector_cache::invalidate(int flash_num){
+    invalidate(flash_num, 0, 0xFFFFFFFFUL);
+}
+
+/*
+*   Drops every block.
+*/
+void sector_cache::clear(){
+    this->blocks.clear();
+    this->index.clear();
+}
+
+/*
+*   Sets the most blocks held, dropping the least recently used if over.
+*   @param capacity : the most blocks to hold, 0 disables the cache
+*/
+void sector_cache::set_capacity(unsigned long capacity){
+
+    this->max_blocks = capacity;
+    while(this->blocks.size() > this->max_blocks){
+        this->index.erase(this->blocks.back().key);
+        this->blocks.pop_back();
+    }
+}
+
+/*
+*   @returns the most blocks held.
+*/
+unsigned long sector_cache::capacity() const{
+    return this->max_blocks;
+}
+
+/*
+*   @returns the number of blocks held.
+*/
+unsigned long sector_cache::size() const{
+    return this->blocks.size();
+}
+
+/*
+*   @returns the number of finds served from the cache.
+*/
+unsigned long long sector_cache::hits() const{
+    return this->hit_count;
+}
+
+/*
+*   @returns the number of finds that missed.
+*/
+unsigned long long sector_cache::misses() const{
+    return this->miss_count;
+}
+
+/*
+*   @returns the number of blocks dropped to make room.
+*/
+unsigned long long sector_cache::evictions() const{
+    return this->eviction_count;
+}
+
+/*
+*   Zeroes the hit, miss and eviction counts.
+*/
+void sector_cache::reset_stats(){
+    this->hit_count = 0;
+    this->miss_count = 0;
+    this->eviction_count = 0;
+}
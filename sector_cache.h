@@ -0,0 +1,66 @@
+/*
+*   sector_cache.h
+*   @Author Sophie Kirkham STFC, 2018
+*   Header file for the sector_cache class
+*   Holds recently read blocks of the flash chips so small repeated reads ..
+*   (bitstream headers, version words, calibration tables) are served from ..
+*   memory instead of a new SPI transaction.
+*/
+
+#ifndef SECTOR_CACHE_H_
+#define SECTOR_CACHE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <list>
+#include <vector>
+#include <unordered_map>
+
+#define CACHE_BLOCK_SIZE 4096   // Size of the blocks held in the cache
+#define CACHE_CAPACITY 64       // Default number of blocks held, 256KB
+
+/*
+*   Least recently used cache of CACHE_BLOCK_SIZE blocks from the 4 flash chips.
+*   The blocks are 4KB, not erase sectors, which are too coarse for the ..
+*   header sized reads it serves. Erasing a sector drops each block in it.
+*   qspi_device invalidates the blocks it programs or erases, changes made ..
+*   to the flash any other way are not seen until the cache is cleared.
+*/
+class sector_cache{
+
+    public:
+
+        sector_cache(unsigned long capacity = CACHE_CAPACITY);
+
+        const uint8_t* find(int flash_num, uint32_t block_address);
+        uint8_t* insert(int flash_num, uint32_t block_address);
+        void invalidate(int flash_num, uint32_t mem_address, unsigned long num_bytes);
+        void invalidate(int flash_num);
+        void clear();
+        void set_capacity(unsigned long capacity);
+        unsigned long capacity() const;
+        unsigned long size() const;
+        unsigned long long hits() const;
+        unsigned long long misses() const;
+        unsigned long long evictions() const;
+        void reset_stats();
+
+    private:
+
+        struct cache_block{
+            uint64_t key;               // the chip and block address
+            std::vector<uint8_t> data;  // the CACHE_BLOCK_SIZE bytes of the block
+        };
+
+        unsigned long max_blocks;       // the most blocks held, 0 disables the cache
+        std::list<cache_block> blocks;  // the blocks, most recently used first
+        std::unordered_map<uint64_t, std::list<cache_block>::iterator> index;  // blocks by key
+        unsigned long long hit_count;   // finds served from the cache
+        unsigned long long miss_count;  // finds that missed
+        unsigned long long eviction_count;  // blocks dropped to make room
+
+        static uint64_t block_key(int flash_num, uint32_t block_address);
+        void remove(uint64_t key);
+};
+
+#endif
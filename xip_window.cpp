@@ -0,0 +1,59 @@
+/*
+*   xip_window.cpp
+*   @Author Sophie Kirkham STFC, 2018
+*   Implementation of the xip_window class
+*/
+
+#include <algorithm>
+
+#include "xip_window.h"
+
+/*
+*   Finds the size of the window to map for a file.
+*   @param file : MEM_DEVICE for the XIP port, or a file standing in for it
+*   @returns XIP_SIZE for the port, the size of the file up to XIP_SIZE otherwise.
+*/
+unsigned long xip_window::window_size(const std::string& file){
+
+    struct stat file_stat;
+    if(file == MEM_DEVICE || stat(file.c_str(), &file_stat) != 0 || !S_ISREG(file_stat.st_mode)){
+        return XIP_SIZE;
+    }
+    // mapping past the end of a file faults on access
+    return std::min((unsigned long)file_stat.st_size, (unsigned long)XIP_SIZE);
+}
+
+/*
+*   @returns true if the window holds every byte of [offset, offset + num_bytes).
+*/
+bool xip_window::contains(uint32_t offset, unsigned long num_bytes) const{
+    return (unsigned long long)offset + num_bytes <= this->map_size;
+}
+
+/*
+*   Copies bytes out of the window.
+*   The port is mapped uncached, where unaligned loads fault, so the bulk ..
+*   is copied as aligned words with just the edges copied by the byte.
+*   @param buffer : the buffer to copy into, at least num_bytes long
+*   @param offset : the flash address to copy from
+*   @param num_bytes : the number of bytes to copy
+*/
+void xip_window::copy(uint8_t* buffer, uint32_t offset, unsigned long num_bytes) const{
+
+    const uint8_t* source = window() + offset;
+    unsigned long i = 0;
+    // copy byte by byte up to a word boundary of the window
+    for(; i < num_bytes && ((uintptr_t)(source + i) % sizeof(uint32_t)) != 0; i++){
+        buffer[i] = source[i];
+    }
+    const uint32_t* words = (const uint32_t*)(source + i);
+    unsigned long num_words = (num_bytes - i) / sizeof(uint32_t);
+    for(unsigned long w = 0; w < num_words; w++){
+        uint32_t word = words[w];
+        memcpy(buffer + i + w * sizeof(uint32_t), &word, sizeof(uint32_t));
+    }
+    // copy the remaining tail bytes
+    for(i += num_words * sizeof(uint32_t); i < num_bytes; i++){
+        buffer[i] = source[i];
+    }
+}
@@ -0,0 +1,37 @@
+/*
+*   xip_window.h
+*   @Author Sophie Kirkham STFC, 2018
+*   Sub-class implementation of memory_mapped_device for the QSPI Controller's XIP read port
+*   Extends memory_mapped_device
+*   When the AXI Quad SPI core is built with execute-in-place (XIP), the ..
+*   selected flash is readable as plain memory, the core issuing the quad ..
+*   reads itself. A regular file holding a flash image can stand in for ..
+*   the port, mapped from its start.
+*/
+
+#ifndef XIP_WINDOW_H_
+#define XIP_WINDOW_H_
+
+#include <sys/stat.h>
+
+#include "memory_mapped_device.h"
+#include "qspi_flash_defines.h"
+
+class xip_window : public memory_mapped_device{
+
+    public:
+
+        xip_window() : memory_mapped_device(XIP_BASE, XIP_SIZE, MEM_DEVICE, false){};
+        xip_window(const std::string& file) : 
+            memory_mapped_device(file == MEM_DEVICE ? XIP_BASE : 0, window_size(file), file, false){};
+        ~xip_window(){};
+
+        void copy(uint8_t* buffer, uint32_t offset, unsigned long num_bytes) const;
+        bool contains(uint32_t offset, unsigned long num_bytes) const;
+
+    private:
+
+        static unsigned long window_size(const std::string& file);
+};
+
+#endif